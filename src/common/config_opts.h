@@ -884,6 +884,9 @@ OPTION(osd_bench_duration, OPT_U32, 30) // duration of 'osd bench', capped at 30
 OPTION(memstore_device_bytes, OPT_U64, 1024*1024*1024)
 OPTION(memstore_page_set, OPT_BOOL, true)
 OPTION(memstore_page_size, OPT_U64, 64 << 10)
+OPTION(memstore_page_slab_size, OPT_U64, 2 << 20) // carve pages from slabs of this size; 0 allocates each page from the heap
+OPTION(memstore_page_hugepages, OPT_BOOL, false) // back page slabs with hugepages when available
+OPTION(memstore_page_set_partitions, OPT_INT, 4) // independently locked partitions of each object's pages
 
 OPTION(bdev_debug_inflight_ios, OPT_BOOL, false)
 OPTION(bdev_inject_crash, OPT_INT, 0)  // if N>0, then ~ 1/N IOs will complete before we crash on flush.
@@ -891,6 +894,17 @@ OPTION(bdev_inject_crash_flush_delay, OPT_INT, 2) // wait N more seconds on flus
 OPTION(bdev_aio, OPT_BOOL, true)
 OPTION(bdev_aio_poll_ms, OPT_INT, 250)  // milliseconds
 OPTION(bdev_aio_max_queue_depth, OPT_INT, 32)
+OPTION(bdev_aio_queues, OPT_INT, 0)  // aio contexts, each w/ a completion thread; 0 = one per 8 cpus
+OPTION(bdev_aio_sched_depth, OPT_INT, 0)  // aios in flight per device before the rest wait by priority class; 0 = submit immediately
+OPTION(bdev_aio_prio_weight_kv, OPT_INT, 16)  // relative share of scheduled aios for kv/bluefs log writes
+OPTION(bdev_aio_prio_weight_client, OPT_INT, 8)
+OPTION(bdev_aio_prio_weight_wal, OPT_INT, 4)
+OPTION(bdev_aio_prio_weight_background, OPT_INT, 1)  // compaction, scrub, recovery
+OPTION(bdev_aio_ioprio, OPT_BOOL, false)  // also tag aios with a kernel ioprio per class (linux 4.18+)
+OPTION(bdev_enable_discard, OPT_BOOL, false)  // trim released extents (block devices only)
+OPTION(bdev_discard_max_chunk, OPT_U64, 64*1024*1024)  // largest single discard
+OPTION(bdev_discard_max_bytes_per_sec, OPT_U64, 256*1024*1024)  // 0 = unthrottled
+OPTION(bdev_debug_fake_discard, OPT_BOOL, false)  // with bdev_enable_discard, queue discards on any device but skip the trim
 OPTION(bdev_block_size, OPT_INT, 4096)
 
 // if yes, osd will unbind all NVMe devices from kernel driver and bind them
@@ -901,10 +915,15 @@ OPTION(bdev_nvme_retry_count, OPT_INT, -1) // -1 means by default which is 4
 
 OPTION(bluefs_alloc_size, OPT_U64, 1048576)
 OPTION(bluefs_max_prefetch, OPT_U64, 1048576)
+OPTION(bluefs_readahead, OPT_BOOL, true)   // async readahead for sequential reads
+OPTION(bluefs_readahead_trigger_requests, OPT_INT, 4)  // sequential reads before a random reader prefetches
+OPTION(bluefs_readahead_min, OPT_U64, 1048576)
+OPTION(bluefs_readahead_max, OPT_U64, 8*1048576)
 OPTION(bluefs_min_log_runway, OPT_U64, 1048576)  // alloc when we get this low
 OPTION(bluefs_max_log_runway, OPT_U64, 4194304)  // alloc this much at a time
 OPTION(bluefs_log_compact_min_ratio, OPT_FLOAT, 5.0)      // before we consider
 OPTION(bluefs_log_compact_min_size, OPT_U64, 16*1048576)  // before we consider
+OPTION(bluefs_compact_log_sync, OPT_BOOL, false)  // hold the lock while compacting the log
 OPTION(bluefs_min_flush_size, OPT_U64, 65536)  // ignore flush until its this big
 
 OPTION(bluestore_bluefs, OPT_BOOL, true)
@@ -931,12 +950,41 @@ OPTION(bluestore_block_wal_size, OPT_U64, 96 * 1024*1024) // rocksdb wal
 OPTION(bluestore_block_wal_create, OPT_BOOL, false)
 OPTION(bluestore_max_dir_size, OPT_U32, 1000000)
 OPTION(bluestore_min_alloc_size, OPT_U32, 64*1024)
-OPTION(bluestore_onode_map_size, OPT_U32, 1024)   // onodes per collection
+OPTION(bluestore_extent_map_shard_size, OPT_U32, 512*1024)  // object bytes per separately stored extent map shard; 0 = inline
+OPTION(bluestore_allocator, OPT_STR, "stupid")  // stupid | bitmap
+OPTION(bluestore_bitmapallocator_blocks_per_zone, OPT_INT, 1024) // blocks per lock stripe
+OPTION(bluestore_onode_map_size, OPT_U32, 1024)   // enode hash buckets per collection
+OPTION(bluestore_cache_size, OPT_U64, 512*1024*1024)  // onodes + data buffers, all shards
+OPTION(bluestore_cache_meta_ratio, OPT_DOUBLE, .5)  // share of cache reserved for onodes
+OPTION(bluestore_cache_shards, OPT_INT, 4)  // independently locked cache shards
+OPTION(bluestore_2q_cache_kin_ratio, OPT_DOUBLE, .5)  // warm_in share of buffer cache
+OPTION(bluestore_2q_cache_kout_ratio, OPT_DOUBLE, .5)  // ghost (warm_out) bytes, relative to buffer cache
+OPTION(bluestore_default_buffered_write, OPT_BOOL, true)  // cache written data
+OPTION(bluestore_csum_type, OPT_STR, "crc32c") // none|crc32c|crc32c_16|crc32c_8|xxhash32|xxhash64
+OPTION(bluestore_csum_min_chunk, OPT_U32, 4096)
+OPTION(bluestore_csum_max_chunk, OPT_U32, 64*1024) // for large expected_write_size
+OPTION(bluestore_compression, OPT_STR, "none")  // none|passive|aggressive|force
+OPTION(bluestore_compression_algorithm, OPT_STR, "snappy") // snappy|zlib
+OPTION(bluestore_compression_required_ratio, OPT_DOUBLE, .875) // max allocated/original
+OPTION(bluestore_compression_min_blob_size, OPT_U32, 128*1024)
+OPTION(bluestore_compression_max_blob_size, OPT_U32, 512*1024)
 OPTION(bluestore_cache_tails, OPT_BOOL, true)   // cache tail blocks in Onode
 OPTION(bluestore_kvbackend, OPT_STR, "rocksdb")
+// prefix[(options)] ... to keep in their own rocksdb column families;
+// options are rocksdb options plus bloom_bits=N and block_cache_share=F
+// (a fraction of rocksdb_cache_size), e.g. "L(write_buffer_size=8388608) O(bloom_bits=10)".
+// The set of prefixes is fixed at mkfs; their options may change later.
+OPTION(bluestore_rocksdb_cfs, OPT_STR, "")
 OPTION(bluestore_rocksdb_options, OPT_STR, "compression=kNoCompression,max_write_buffer_number=16,min_write_buffer_number_to_merge=3,recycle_log_file_num=16")
 OPTION(bluestore_fsck_on_mount, OPT_BOOL, false)
+OPTION(bluestore_fsck_on_mount_deep, OPT_BOOL, false)  // also read back all object data
 OPTION(bluestore_fsck_on_umount, OPT_BOOL, false)
+OPTION(bluestore_fsck_on_umount_deep, OPT_BOOL, false)
+OPTION(bluestore_fsck_threads, OPT_INT, 0)  // collections checked in parallel; 0 = one per cpu
+OPTION(bluestore_txc_histogram, OPT_BOOL, false)  // log2 latency histograms per txc state
+OPTION(bluestore_txc_histogram_size, OPT_BOOL, false)  // also break them down by txc bytes
+OPTION(bluestore_freelist_snapshot, OPT_BOOL, true)  // load freelist from a snapshot on mount
+OPTION(bluestore_freelist_snapshot_interval, OPT_INT, 3600)  // seconds between snapshots while mounted; 0 = only on umount
 OPTION(bluestore_fail_eio, OPT_BOOL, true)
 OPTION(bluestore_sync_io, OPT_BOOL, false)  // perform initial io synchronously
 OPTION(bluestore_sync_transaction, OPT_BOOL, false)  // perform kv txn synchronously
@@ -949,6 +997,9 @@ OPTION(bluestore_max_ops, OPT_U64, 512)
 OPTION(bluestore_max_bytes, OPT_U64, 64*1024*1024)
 OPTION(bluestore_wal_max_ops, OPT_U64, 512)
 OPTION(bluestore_wal_max_bytes, OPT_U64, 128*1024*1024)
+OPTION(bluestore_wal_batch_max_txc, OPT_U64, 64)   // wal txcs applied together; <= 1 disables batching
+OPTION(bluestore_wal_batch_max_bytes, OPT_U64, 4*1024*1024)  // also caps a merged write
+OPTION(bluestore_wal_batch_max_age, OPT_DOUBLE, .002)  // seconds to let a batch fill
 OPTION(bluestore_fid_prealloc, OPT_INT, 1024)
 OPTION(bluestore_nid_prealloc, OPT_INT, 1024)
 OPTION(bluestore_overlay_max_length, OPT_INT, 65536)
@@ -975,6 +1026,7 @@ OPTION(kstore_sync_submit_transaction, OPT_BOOL, false)
 OPTION(kstore_onode_map_size, OPT_U64, 1024)
 OPTION(kstore_cache_tails, OPT_BOOL, true)
 OPTION(kstore_default_stripe_size, OPT_INT, 65536)
+OPTION(kstore_stripe_cache_size, OPT_U64, 64*1024*1024) // bytes of committed stripes cached across all objects
 
 OPTION(filestore_omap_backend, OPT_STR, "leveldb")
 
@@ -1008,6 +1060,7 @@ OPTION(filestore_debug_inject_read_err, OPT_BOOL, false)
 
 OPTION(filestore_debug_omap_check, OPT_BOOL, 0) // Expensive debugging check on sync
 OPTION(filestore_omap_header_cache_size, OPT_INT, 1024)
+OPTION(filestore_omap_header_cache_shards, OPT_INT, 8)  // header cache is split into this many independently locked LRUs
 
 // Use omap for xattrs for attrs over
 // filestore_max_inline_xattr_size or
@@ -1036,6 +1089,7 @@ OPTION(filestore_fsync_flushes_journal_data, OPT_BOOL, false)
 OPTION(filestore_fiemap, OPT_BOOL, false)     // (try to) use fiemap
 OPTION(filestore_punch_hole, OPT_BOOL, false)
 OPTION(filestore_seek_data_hole, OPT_BOOL, false)     // (try to) use seek_data/hole
+OPTION(filestore_sparse_read, OPT_BOOL, true)  // zero-fill holes on read instead of reading them, if seek_data/hole or fiemap is usable
 OPTION(filestore_fadvise, OPT_BOOL, true)
 //collect device partition information for management application to use
 OPTION(filestore_collect_device_partition_information, OPT_BOOL, true)
@@ -1072,12 +1126,15 @@ OPTION(filestore_queue_low_threshhold, OPT_DOUBLE, 0.2)
 OPTION(filestore_queue_high_threshhold, OPT_DOUBLE, 0.8)
 
 OPTION(filestore_op_threads, OPT_INT, 2)
+OPTION(filestore_op_queue_quantum, OPT_U64, 65536)  // bytes of credit per sequencer per round when op threads pick between sequencers; 0 for plain round robin
 OPTION(filestore_op_thread_timeout, OPT_INT, 60)
 OPTION(filestore_op_thread_suicide_timeout, OPT_INT, 180)
 OPTION(filestore_commit_timeout, OPT_FLOAT, 600)
 OPTION(filestore_fiemap_threshold, OPT_INT, 4096)
 OPTION(filestore_merge_threshold, OPT_INT, 10)
 OPTION(filestore_split_multiple, OPT_INT, 2)
+OPTION(filestore_split_ahead_ratio, OPT_DOUBLE, 0)  // queue a background split once a dir reaches this fraction of the split threshold; 0 to disable
+OPTION(filestore_split_ahead_rate, OPT_DOUBLE, 10)  // max background splits per second
 OPTION(filestore_update_to, OPT_INT, 1000)
 OPTION(filestore_blackhole, OPT_BOOL, false)     // drop any new transactions on the floor
 OPTION(filestore_fd_cache_size, OPT_INT, 128)    // FD lru size
@@ -1100,6 +1157,7 @@ OPTION(journal_block_align, OPT_BOOL, true)
 OPTION(journal_write_header_frequency, OPT_U64, 0)
 OPTION(journal_max_write_bytes, OPT_INT, 10 << 20)
 OPTION(journal_max_write_entries, OPT_INT, 100)
+OPTION(journal_aio_batch_max_wait_ratio, OPT_DOUBLE, .5)  // hold a partial aio batch back for at most this fraction of the observed aio latency; 0 = until an aio completes
 
 /// Target range for journal fullness
 OPTION(journal_throttle_low_threshhold, OPT_DOUBLE, 0.5)
@@ -38,6 +38,14 @@ class SimpleLRU {
   }
 
   void _add(K key, V value) {
+    typename ceph::unordered_map<K, typename list<pair<K, V> >::iterator, H>::iterator i =
+      contents.find(key);
+    if (i != contents.end()) {
+      // replace in place; a second lru entry would later evict the new one
+      i->second->second = value;
+      lru.splice(lru.begin(), lru, i->second);
+      return;
+    }
     lru.push_front(make_pair(key, value));
     contents[key] = lru.begin();
     trim_cache();
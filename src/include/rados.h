@@ -453,6 +453,12 @@ enum {
 	CEPH_OSD_TMAP2OMAP_NULLOK = 1,
 };
 
+/* alloc hint flags */
+enum {
+	CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE = 1,   /* data compresses well */
+	CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE = 2, /* don't bother compressing */
+};
+
 enum {
 	CEPH_OSD_WATCH_OP_UNWATCH = 0,
 	CEPH_OSD_WATCH_OP_LEGACY_WATCH = 1,
@@ -537,6 +543,7 @@ struct ceph_osd_op {
 		struct {
 			__le64 expected_object_size;
 			__le64 expected_write_size;
+			__le32 flags; /* CEPH_OSD_ALLOC_HINT_FLAG_* */
 		} __attribute__ ((packed)) alloc_hint;
 	};
 	__le32 payload_len;
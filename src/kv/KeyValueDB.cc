@@ -49,3 +49,43 @@ int KeyValueDB::test_init(const string& type, const string& dir)
 #endif
   return -EINVAL;
 }
+
+int KeyValueDB::get_by_iterator(GenericIteratorImpl *it,
+				const std::set<std::string> &keys,
+				std::set<std::string> *out_keys,
+				std::map<std::string, bufferlist> *out_values)
+{
+  bool seeked = false;
+  for (std::set<std::string>::const_iterator k = keys.begin();
+       k != keys.end();
+       ++k) {
+    // once positioned, the iterator is at the first key after the last
+    // one we found, or at or after the last one we missed
+    if (seeked && !it->valid())
+      break;
+    std::string cur;
+    if (seeked)
+      cur = it->key();
+    if (!seeked || cur < *k) {
+      it->lower_bound(*k);
+      seeked = true;
+      int r = it->status();
+      if (r)
+	return r;
+      if (!it->valid())
+	break;
+      cur = it->key();
+    }
+    if (cur != *k)
+      continue;
+    if (out_keys)
+      out_keys->insert(*k);
+    if (out_values)
+      out_values->insert(make_pair(*k, it->value()));
+    it->next();
+    int r = it->status();
+    if (r)
+      return r;
+  }
+  return 0;
+}
@@ -20,6 +20,31 @@ using std::string;
  */
 class KeyValueDB {
 public:
+  /**
+   * Associative merge of a value into an existing key
+   *
+   * Registered per prefix with set_merge_operator(); see
+   * TransactionImpl::merge().  The result of merging a sequence of
+   * values must not depend on how they are grouped, so the backend may
+   * apply them lazily (e.g., during compaction).
+   */
+  class MergeOperator {
+  public:
+    /// Merge into a key that doesn't exist
+    virtual void merge_nonexistent(
+      const char *rdata, size_t rlen,
+      std::string *new_value) = 0;
+    /// Merge into a key that does exist
+    virtual void merge(
+      const char *ldata, size_t llen,
+      const char *rdata, size_t rlen,
+      std::string *new_value) = 0;
+    /// Name of the operator; must stay stable across opens of a store
+    virtual string name() const = 0;
+
+    virtual ~MergeOperator() {}
+  };
+
   class TransactionImpl {
   public:
     /// Set Keys
@@ -93,6 +118,21 @@ public:
       const std::string &prefix ///< [in] Prefix by which to remove keys
       ) = 0;
 
+    /**
+     * Merge value into key
+     *
+     * Applies the MergeOperator registered for prefix without reading
+     * the current value first.  Only valid for prefixes registered
+     * with set_merge_operator().
+     */
+    virtual void merge(
+      const std::string &prefix,   ///< [in] Prefix for the key
+      const std::string &k,	   ///< [in] Key to merge into
+      const bufferlist &bl         ///< [in] Value to merge
+      ) {
+      assert(0 == "Not implemented");
+    }
+
     virtual ~TransactionImpl() {}
   };
   typedef ceph::shared_ptr< TransactionImpl > Transaction;
@@ -108,13 +148,37 @@ public:
   virtual int open(std::ostream &out) = 0;
   virtual int create_and_open(std::ostream &out) = 0;
 
+  /// Register a merge operator for prefix; must be called before open
+  virtual int set_merge_operator(
+    const std::string& prefix,
+    std::shared_ptr<MergeOperator> mop) {
+    return -EOPNOTSUPP;
+  }
+
+  /**
+   * Keep some prefixes apart from the rest of the store; must be called
+   * before open
+   *
+   * spec is a whitespace separated list of prefix[(options)].  Only the
+   * backend knows what the options mean.  A store must always be opened
+   * with the spec it was created with.
+   */
+  virtual int set_column_families(const std::string& spec) {
+    return spec.empty() ? 0 : -EOPNOTSUPP;
+  }
+
   virtual Transaction get_transaction() = 0;
   virtual int submit_transaction(Transaction) = 0;
   virtual int submit_transaction_sync(Transaction t) {
     return submit_transaction(t);
   }
 
-  /// Retrieve Keys
+  /**
+   * Retrieve Keys
+   *
+   * Backends should do this as one batch rather than a point lookup per
+   * key; keys arrive sorted.
+   */
   virtual int get(
     const std::string &prefix,        ///< [in] Prefix for key
     const std::set<std::string> &key,      ///< [in] Key to retrieve
@@ -242,6 +306,22 @@ public:
 
   typedef ceph::shared_ptr< IteratorImpl > Iterator;
 
+  /**
+   * Look up sorted keys with a single iterator
+   *
+   * The iterator only seeks when it is behind the next key: runs of
+   * adjacent keys cost one next() each, and a missing key that sorts
+   * before the iterator's position costs nothing.
+   *
+   * @return 0 on success, the iterator's status otherwise
+   */
+  static int get_by_iterator(
+    GenericIteratorImpl *it,                     ///< [in] iterator to use
+    const std::set<std::string> &keys,           ///< [in] keys to find
+    std::set<std::string> *out_keys,             ///< [out] keys found, or NULL
+    std::map<std::string, bufferlist> *out_values ///< [out] values found, or NULL
+    );
+
   WholeSpaceIterator get_iterator() {
     return _get_iterator();
   }
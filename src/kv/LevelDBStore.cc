@@ -166,16 +166,39 @@ void LevelDBStore::close()
     cct->get_perfcounters_collection()->remove(logger);
 }
 
+int LevelDBStore::set_merge_operator(
+  const string& prefix,
+  std::shared_ptr<KeyValueDB::MergeOperator> mop)
+{
+  assert(!db);
+  merge_ops[prefix] = mop;
+  return 0;
+}
+
+int LevelDBStore::_submit(LevelDBTransactionImpl *t,
+			  const leveldb::WriteOptions &options)
+{
+  if (t->deferred.empty()) {
+    leveldb::Status s = db->Write(options, &(t->bat));
+    return s.ok() ? 0 : -1;
+  }
+  // the merge bases must not change between our read and our write
+  Mutex::Locker l(merge_lock);
+  t->_finish_merges();
+  leveldb::Status s = db->Write(options, &(t->bat));
+  return s.ok() ? 0 : -1;
+}
+
 int LevelDBStore::submit_transaction(KeyValueDB::Transaction t)
 {
   utime_t start = ceph_clock_now(g_ceph_context);
   LevelDBTransactionImpl * _t =
     static_cast<LevelDBTransactionImpl *>(t.get());
-  leveldb::Status s = db->Write(leveldb::WriteOptions(), &(_t->bat));
+  int r = _submit(_t, leveldb::WriteOptions());
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_leveldb_txns);
   logger->tinc(l_leveldb_submit_latency, lat);
-  return s.ok() ? 0 : -1;
+  return r;
 }
 
 int LevelDBStore::submit_transaction_sync(KeyValueDB::Transaction t)
@@ -185,11 +208,11 @@ int LevelDBStore::submit_transaction_sync(KeyValueDB::Transaction t)
     static_cast<LevelDBTransactionImpl *>(t.get());
   leveldb::WriteOptions options;
   options.sync = true;
-  leveldb::Status s = db->Write(options, &(_t->bat));
+  int r = _submit(_t, options);
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_leveldb_txns);
   logger->tinc(l_leveldb_submit_sync_latency, lat);
-  return s.ok() ? 0 : -1;
+  return r;
 }
 
 void LevelDBStore::LevelDBTransactionImpl::set(
@@ -221,6 +244,11 @@ void LevelDBStore::LevelDBTransactionImpl::set(
     bufferlist val = to_set_bl;
     bat.Put(leveldb::Slice(key), leveldb::Slice(val.c_str(), val.length()));
   }
+  if (!db->merge_ops.empty() && db->_get_merge_op(prefix)) {
+    string v;
+    to_set_bl.copy(0, bllen, v);
+    _write(key, true, v);
+  }
 }
 
 void LevelDBStore::LevelDBTransactionImpl::rmkey(const string &prefix,
@@ -228,17 +256,77 @@ void LevelDBStore::LevelDBTransactionImpl::rmkey(const string &prefix,
 {
   string key = combine_strings(prefix, k);
   bat.Delete(leveldb::Slice(key));
+  if (!db->merge_ops.empty() && db->_get_merge_op(prefix))
+    _write(key, false, string());
 }
 
 void LevelDBStore::LevelDBTransactionImpl::rmkeys_by_prefix(const string &prefix)
 {
+  bool track = !db->merge_ops.empty() && db->_get_merge_op(prefix);
   KeyValueDB::Iterator it = db->get_iterator(prefix);
   for (it->seek_to_first();
        it->valid();
        it->next()) {
     string key = combine_strings(prefix, it->key());
     bat.Delete(key);
+    if (track)
+      _write(key, false, string());
+  }
+}
+
+void LevelDBStore::LevelDBTransactionImpl::merge(
+  const string &prefix,
+  const string &k,
+  const bufferlist &bl)
+{
+  std::shared_ptr<KeyValueDB::MergeOperator> mop = db->_get_merge_op(prefix);
+  assert(mop);
+  string key = combine_strings(prefix, k);
+  string v;
+  bl.copy(0, bl.length(), v);
+  auto p = written.find(key);
+  if (p == written.end()) {
+    // base is whatever is in the db when we submit
+    deferred_merge_t &d = deferred[key];
+    d.mop = mop;
+    d.values.push_back(v);
+    return;
+  }
+  string out;
+  if (p->second.first) {
+    mop->merge(p->second.second.data(), p->second.second.length(),
+	       v.data(), v.length(), &out);
+  } else {
+    mop->merge_nonexistent(v.data(), v.length(), &out);
+  }
+  bat.Put(leveldb::Slice(key), leveldb::Slice(out));
+  p->second = make_pair(true, out);
+}
+
+void LevelDBStore::LevelDBTransactionImpl::_finish_merges()
+{
+  for (auto& p : deferred) {
+    string cur;
+    leveldb::Status s = db->db->Get(leveldb::ReadOptions(),
+				    leveldb::Slice(p.first), &cur);
+    bool exists = s.ok();
+    assert(exists || s.IsNotFound());
+    for (auto& v : p.second.values) {
+      string out;
+      if (exists) {
+	p.second.mop->merge(cur.data(), cur.length(), v.data(), v.length(),
+			    &out);
+      } else {
+	p.second.mop->merge_nonexistent(v.data(), v.length(), &out);
+      }
+      cur.swap(out);
+      exists = true;
+    }
+    // no other op in this txn touched the key, so ordering is preserved
+    bat.Put(leveldb::Slice(p.first), leveldb::Slice(cur));
+    written[p.first] = make_pair(true, cur);
   }
+  deferred.clear();
 }
 
 int LevelDBStore::get(
@@ -248,19 +336,11 @@ int LevelDBStore::get(
 {
   utime_t start = ceph_clock_now(g_ceph_context);
   KeyValueDB::Iterator it = get_iterator(prefix);
-  for (std::set<string>::const_iterator i = keys.begin();
-       i != keys.end();
-       ++i) {
-    it->lower_bound(*i);
-    if (it->valid() && it->key() == *i) {
-      out->insert(make_pair(*i, it->value()));
-    } else if (!it->valid())
-      break;
-  }
+  int r = get_by_iterator(it.get(), keys, NULL, out);
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_leveldb_gets);
   logger->tinc(l_leveldb_get_latency, lat);
-  return 0;
+  return r;
 }
 
 int LevelDBStore::get(const string &prefix, 
@@ -65,6 +65,18 @@ class LevelDBStore : public KeyValueDB {
 
   int do_open(ostream &out, bool create_if_missing);
 
+  // leveldb has no merge operator; we emulate it with a read at submit
+  map<string, std::shared_ptr<KeyValueDB::MergeOperator> > merge_ops;
+  Mutex merge_lock;  ///< serializes submits that read merge bases
+
+  std::shared_ptr<KeyValueDB::MergeOperator> _get_merge_op(
+    const string &prefix) {
+    auto p = merge_ops.find(prefix);
+    if (p == merge_ops.end())
+      return std::shared_ptr<KeyValueDB::MergeOperator>();
+    return p->second;
+  }
+
   // manage async compactions
   Mutex compact_queue_lock;
   Cond compact_queue_cond;
@@ -159,6 +171,7 @@ public:
 #ifdef HAVE_LEVELDB_FILTER_POLICY
     filterpolicy(NULL),
 #endif
+    merge_lock("LevelDBStore::merge_lock"),
     compact_queue_lock("LevelDBStore::compact_thread_lock"),
     compact_queue_stop(false),
     compact_thread(this),
@@ -181,10 +194,30 @@ public:
 
   void close();
 
+  int set_merge_operator(const string& prefix,
+			 std::shared_ptr<KeyValueDB::MergeOperator> mop);
+
   class LevelDBTransactionImpl : public KeyValueDB::TransactionImpl {
   public:
     leveldb::WriteBatch bat;
     LevelDBStore *db;
+
+    /// merges whose base value must be read from the db at submit
+    struct deferred_merge_t {
+      std::shared_ptr<KeyValueDB::MergeOperator> mop;
+      list<string> values;
+    };
+    map<string, deferred_merge_t> deferred;
+    /// last value this txn wrote to keys with a merge operator, if any
+    map<string, pair<bool, string> > written;
+
+    void _write(const string &key, bool exists, const string &v) {
+      deferred.erase(key);
+      written[key] = make_pair(exists, v);
+    }
+    /// apply deferred merges to bat; caller holds merge_lock
+    void _finish_merges();
+
     explicit LevelDBTransactionImpl(LevelDBStore *db) : db(db) {}
     void set(
       const string &prefix,
@@ -196,12 +229,17 @@ public:
     void rmkeys_by_prefix(
       const string &prefix
       );
+    void merge(
+      const string &prefix,
+      const string &k,
+      const bufferlist &bl);
   };
 
   KeyValueDB::Transaction get_transaction() {
     return std::make_shared<LevelDBTransactionImpl>(this);
   }
 
+  int _submit(LevelDBTransactionImpl *t, const leveldb::WriteOptions &options);
   int submit_transaction(KeyValueDB::Transaction t);
   int submit_transaction_sync(KeyValueDB::Transaction t);
   int get(
@@ -3,6 +3,7 @@
 
 #include <set>
 #include <map>
+#include <algorithm>
 #include <string>
 #include <memory>
 #include <errno.h>
@@ -18,6 +19,7 @@
 #include "rocksdb/cache.h"
 #include "rocksdb/filter_policy.h"
 #include "rocksdb/utilities/convenience.h"
+#include "rocksdb/merge_operator.h"
 using std::string;
 #include "common/perf_counters.h"
 #include "common/debug.h"
@@ -66,6 +68,100 @@ rocksdb::Logger *create_rocksdb_ceph_logger()
   return new CephRocksdbLogger(g_ceph_context);
 }
 
+/**
+ * Routes rocksdb merges to the KeyValueDB::MergeOperator registered for
+ * the prefix of the key.  rocksdb allows only one merge operator per
+ * column family, so all prefixes share this one.
+ */
+class RocksDBStore::MergeOperatorRouter
+  : public rocksdb::AssociativeMergeOperator {
+  RocksDBStore& store;
+public:
+  explicit MergeOperatorRouter(RocksDBStore &_store) : store(_store) {}
+
+  const char *Name() const override {
+    // rocksdb refuses to open a store with a differently named operator
+    // than it was written with, so build the name from every
+    // prefix/operator pair, sorted so registration order doesn't matter.
+    map<string,string> names;
+    for (auto& p : store.merge_ops)
+      names[p.first] = p.second->name();
+    store.assoc_name.clear();
+    for (auto& p : names) {
+      store.assoc_name += '.';
+      store.assoc_name += p.first;
+      store.assoc_name += ':';
+      store.assoc_name += p.second;
+    }
+    return store.assoc_name.c_str();
+  }
+
+  bool Merge(const rocksdb::Slice& key,
+	     const rocksdb::Slice* existing_value,
+	     const rocksdb::Slice& value,
+	     std::string* new_value,
+	     rocksdb::Logger* logger) const override {
+    for (auto& p : store.merge_ops) {
+      size_t plen = p.first.length();
+      if (key.size() > plen &&
+	  key.data()[plen] == 0 &&
+	  p.first.compare(0, plen, key.data(), plen) == 0) {
+	if (existing_value) {
+	  p.second->merge(existing_value->data(), existing_value->size(),
+			  value.data(), value.size(), new_value);
+	} else {
+	  p.second->merge_nonexistent(value.data(), value.size(), new_value);
+	}
+	return true;
+      }
+    }
+    // no operator for this prefix; report corruption rather than guess
+    return false;
+  }
+};
+
+/**
+ * Merge operator for a prefix kept in its own column family, where keys
+ * carry no prefix to route on.
+ */
+class RocksDBStore::MergeOperatorLinker
+  : public rocksdb::AssociativeMergeOperator {
+  std::shared_ptr<KeyValueDB::MergeOperator> mop;
+  string name;
+public:
+  explicit MergeOperatorLinker(
+    const std::shared_ptr<KeyValueDB::MergeOperator> &o)
+    : mop(o), name(o->name()) {}
+
+  const char *Name() const override {
+    return name.c_str();
+  }
+
+  bool Merge(const rocksdb::Slice& key,
+	     const rocksdb::Slice* existing_value,
+	     const rocksdb::Slice& value,
+	     std::string* new_value,
+	     rocksdb::Logger* logger) const override {
+    if (existing_value) {
+      mop->merge(existing_value->data(), existing_value->size(),
+		 value.data(), value.size(), new_value);
+    } else {
+      mop->merge_nonexistent(value.data(), value.size(), new_value);
+    }
+    return true;
+  }
+};
+
+int RocksDBStore::set_merge_operator(
+  const string& prefix,
+  std::shared_ptr<KeyValueDB::MergeOperator> mop)
+{
+  // If you fail here, it's because you can't do this on an open database
+  assert(db == nullptr);
+  merge_ops.push_back(std::make_pair(prefix, mop));
+  return 0;
+}
+
 int string2bool(string val, bool &b_val)
 {
   if (strcasecmp(val.c_str(), "false") == 0) {
@@ -153,6 +249,75 @@ int RocksDBStore::init(string _options_str)
   return 0;
 }
 
+int RocksDBStore::set_column_families(const string& spec)
+{
+  // If you fail here, it's because you can't do this on an open database
+  assert(db == nullptr);
+  cf_specs.clear();
+  list<string> items;
+  get_str_list(spec, " \t", items);
+  for (auto& i : items) {
+    string prefix = i, opts;
+    size_t pos = i.find('(');
+    if (pos != string::npos) {
+      if (i[i.length() - 1] != ')') {
+	derr << __func__ << " invalid column family " << i << " in " << spec
+	     << dendl;
+	return -EINVAL;
+      }
+      prefix = i.substr(0, pos);
+      opts = i.substr(pos + 1, i.length() - pos - 2);
+    }
+    if (prefix.empty() || prefix == rocksdb::kDefaultColumnFamilyName) {
+      derr << __func__ << " invalid column family " << i << " in " << spec
+	   << dendl;
+      return -EINVAL;
+    }
+    cf_specs[prefix] = opts;
+  }
+  return 0;
+}
+
+int RocksDBStore::parse_cf_options(const string& opts,
+				   const rocksdb::Options& base,
+				   rocksdb::ColumnFamilyOptions *cf_opt,
+				   int *bloom_bits,
+				   uint64_t *cache_size)
+{
+  map<string, string> str_map;
+  int r = get_str_map(opts, &str_map, ",\n;");
+  if (r < 0)
+    return r;
+  rocksdb::Options opt = base;
+  *bloom_bits = 0;
+  *cache_size = 0;
+  for (auto& p : str_map) {
+    std::string err;
+    if (p.first == "bloom_bits") {
+      *bloom_bits = strict_strtol(p.second.c_str(), 10, &err);
+    } else if (p.first == "block_cache_share") {
+      // fraction of rocksdb_cache_size given to a cache of our own
+      double share = strict_strtod(p.second.c_str(), &err);
+      if (share < 0 || share >= 1)
+	err = "out of range";
+      *cache_size = share * g_conf->rocksdb_cache_size;
+    } else {
+      string this_opt = p.first + "=" + p.second;
+      rocksdb::Status status = rocksdb::GetOptionsFromString(opt, this_opt,
+							     &opt);
+      if (!status.ok())
+	err = status.ToString();
+    }
+    if (!err.empty()) {
+      derr << __func__ << " " << p.first << " = " << p.second << ": " << err
+	   << dendl;
+      return -EINVAL;
+    }
+  }
+  *cf_opt = rocksdb::ColumnFamilyOptions(opt);
+  return 0;
+}
+
 int RocksDBStore::create_and_open(ostream &out)
 {
   if (env) {
@@ -183,6 +348,9 @@ int RocksDBStore::do_open(ostream &out, bool create_if_missing)
     }
   }
   opt.create_if_missing = create_if_missing;
+  if (!merge_ops.empty()) {
+    opt.merge_operator.reset(new MergeOperatorRouter(*this));
+  }
   if (g_conf->rocksdb_separate_wal_dir) {
     opt.wal_dir = path + ".wal";
   }
@@ -218,18 +386,123 @@ int RocksDBStore::do_open(ostream &out, bool create_if_missing)
     opt.env = static_cast<rocksdb::Env*>(priv);
   }
 
-  auto cache = rocksdb::NewLRUCache(g_conf->rocksdb_cache_size);
+  // prefixes in their own column family may take their share of the
+  // block cache out of the common one
+  map<string, rocksdb::ColumnFamilyOptions> cf_opts;
+  map<string, rocksdb::BlockBasedTableOptions> cf_bbt_opts;
+  map<string, uint64_t> cf_cache_sizes;
+  uint64_t cache_size = g_conf->rocksdb_cache_size;
+  for (auto& p : cf_specs) {
+    int bloom_bits;
+    uint64_t cf_cache_size;
+    int r = parse_cf_options(p.second, opt, &cf_opts[p.first], &bloom_bits,
+			     &cf_cache_size);
+    if (r < 0) {
+      derr << __func__ << " invalid options for column family " << p.first
+	   << ": " << p.second << dendl;
+      return r;
+    }
+    if (cf_cache_size >= cache_size) {
+      derr << __func__ << " column family block cache shares exceed "
+	   << "rocksdb_cache_size" << dendl;
+      return -EINVAL;
+    }
+    cache_size -= cf_cache_size;
+    cf_cache_sizes[p.first] = cf_cache_size;
+    rocksdb::BlockBasedTableOptions& bbt = cf_bbt_opts[p.first];
+    bbt.block_size = g_conf->rocksdb_block_size;
+    if (bloom_bits > 0)
+      bbt.filter_policy.reset(rocksdb::NewBloomFilterPolicy(bloom_bits));
+  }
+
+  auto cache = rocksdb::NewLRUCache(cache_size);
   rocksdb::BlockBasedTableOptions bbt_opts;
   bbt_opts.block_size = g_conf->rocksdb_block_size;
   bbt_opts.block_cache = cache;
   opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(bbt_opts));
   dout(10) << __func__ << " set block size to " << g_conf->rocksdb_block_size
-           << " cache size to " << g_conf->rocksdb_cache_size << dendl;
+           << " cache size to " << cache_size << dendl;
 
-  status = rocksdb::DB::Open(opt, path, &db);
-  if (!status.ok()) {
-    derr << status.ToString() << dendl;
-    return -EINVAL;
+  for (auto& p : cf_opts) {
+    rocksdb::BlockBasedTableOptions& bbt = cf_bbt_opts[p.first];
+    if (cf_cache_sizes[p.first])
+      bbt.block_cache = rocksdb::NewLRUCache(cf_cache_sizes[p.first]);
+    else
+      bbt.block_cache = cache;
+    p.second.table_factory.reset(rocksdb::NewBlockBasedTableFactory(bbt));
+    auto mop = std::find_if(
+      merge_ops.begin(), merge_ops.end(),
+      [&](const pair<string, std::shared_ptr<KeyValueDB::MergeOperator> >& m) {
+	return m.first == p.first;
+      });
+    if (mop != merge_ops.end())
+      p.second.merge_operator.reset(new MergeOperatorLinker(mop->second));
+    dout(10) << __func__ << " column family " << p.first << " options "
+	     << cf_specs[p.first] << dendl;
+  }
+
+  vector<string> existing;
+  status = rocksdb::DB::ListColumnFamilies(rocksdb::DBOptions(opt), path,
+					   &existing);
+  if (!status.ok())
+    existing.clear();  // no store here yet
+
+  if (cf_specs.empty() && existing.size() <= 1) {
+    status = rocksdb::DB::Open(opt, path, &db);
+    if (!status.ok()) {
+      derr << status.ToString() << dendl;
+      return -EINVAL;
+    }
+    default_cf = db->DefaultColumnFamily();
+  } else if (existing.empty()) {
+    status = rocksdb::DB::Open(opt, path, &db);
+    if (!status.ok()) {
+      derr << status.ToString() << dendl;
+      return -EINVAL;
+    }
+    default_cf = db->DefaultColumnFamily();
+    for (auto& p : cf_opts) {
+      rocksdb::ColumnFamilyHandle *cf;
+      status = db->CreateColumnFamily(p.second, p.first, &cf);
+      if (!status.ok()) {
+	derr << __func__ << " failed to create column family " << p.first
+	     << ": " << status.ToString() << dendl;
+	return -EINVAL;
+      }
+      cf_handles[p.first] = cf;
+    }
+  } else {
+    // keys cannot move between column families, so the layout is fixed
+    // when the store is created
+    set<string> have, want;
+    for (auto& n : existing)
+      if (n != rocksdb::kDefaultColumnFamilyName)
+	have.insert(n);
+    for (auto& p : cf_specs)
+      want.insert(p.first);
+    if (have != want) {
+      derr << __func__ << " store has column families " << have
+	   << " but " << want << " are configured" << dendl;
+      return -EINVAL;
+    }
+    vector<rocksdb::ColumnFamilyDescriptor> cfds;
+    cfds.push_back(rocksdb::ColumnFamilyDescriptor(
+		     rocksdb::kDefaultColumnFamilyName,
+		     rocksdb::ColumnFamilyOptions(opt)));
+    for (auto& p : cf_opts)
+      cfds.push_back(rocksdb::ColumnFamilyDescriptor(p.first, p.second));
+    vector<rocksdb::ColumnFamilyHandle*> handles;
+    status = rocksdb::DB::Open(rocksdb::DBOptions(opt), path, cfds, &handles,
+			       &db);
+    if (!status.ok()) {
+      derr << status.ToString() << dendl;
+      return -EINVAL;
+    }
+    // the db keeps its own handle to the default column family
+    delete handles[0];
+    default_cf = db->DefaultColumnFamily();
+    for (unsigned i = 1; i < cfds.size(); ++i)
+      cf_handles[cfds[i].name] = handles[i];
   }
 
   PerfCountersBuilder plb(g_ceph_context, "rocksdb", l_rocksdb_first, l_rocksdb_last);
@@ -268,6 +541,11 @@ RocksDBStore::~RocksDBStore()
   close();
   delete logger;
 
+  // column family handles must go before the db
+  for (auto& p : cf_handles)
+    delete p.second;
+  cf_handles.clear();
+
   // Ensure db is destroyed before dependent db_cache and filterpolicy
   delete db;
 
@@ -347,62 +625,119 @@ RocksDBStore::RocksDBTransactionImpl::~RocksDBTransactionImpl()
 {
   delete bat;
 }
-void RocksDBStore::RocksDBTransactionImpl::set(
-  const string &prefix,
-  const string &k,
-  const bufferlist &to_set_bl)
+void RocksDBStore::RocksDBTransactionImpl::put_bat(
+  rocksdb::ColumnFamilyHandle *cf,
+  const string &key,
+  const bufferlist &to_set_bl,
+  bool merge)
 {
-  string key = combine_strings(prefix, k);
-
   // bufferlist::c_str() is non-constant, so we can't call c_str()
   if (to_set_bl.is_contiguous() && to_set_bl.length() > 0) {
-    bat->Put(rocksdb::Slice(key),
-	     rocksdb::Slice(to_set_bl.buffers().front().c_str(),
-			    to_set_bl.length()));
+    rocksdb::Slice v(to_set_bl.buffers().front().c_str(), to_set_bl.length());
+    if (merge)
+      bat->Merge(cf, rocksdb::Slice(key), v);
+    else
+      bat->Put(cf, rocksdb::Slice(key), v);
   } else {
     // make a copy
     bufferlist val = to_set_bl;
-    bat->Put(rocksdb::Slice(key),
-	     rocksdb::Slice(val.c_str(), val.length()));
+    rocksdb::Slice v(val.c_str(), val.length());
+    if (merge)
+      bat->Merge(cf, rocksdb::Slice(key), v);
+    else
+      bat->Put(cf, rocksdb::Slice(key), v);
   }
 }
 
+void RocksDBStore::RocksDBTransactionImpl::set(
+  const string &prefix,
+  const string &k,
+  const bufferlist &to_set_bl)
+{
+  rocksdb::ColumnFamilyHandle *cf = db->get_cf_handle(prefix);
+  if (cf)
+    put_bat(cf, k, to_set_bl, false);
+  else
+    put_bat(db->default_cf, combine_strings(prefix, k), to_set_bl, false);
+}
+
 void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 					         const string &k)
 {
-  bat->Delete(combine_strings(prefix, k));
+  rocksdb::ColumnFamilyHandle *cf = db->get_cf_handle(prefix);
+  if (cf)
+    bat->Delete(cf, rocksdb::Slice(k));
+  else
+    bat->Delete(db->default_cf, combine_strings(prefix, k));
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix)
 {
+  rocksdb::ColumnFamilyHandle *cf = db->get_cf_handle(prefix);
   KeyValueDB::Iterator it = db->get_iterator(prefix);
   for (it->seek_to_first();
        it->valid();
        it->next()) {
-    bat->Delete(combine_strings(prefix, it->key()));
+    if (cf)
+      bat->Delete(cf, rocksdb::Slice(it->key()));
+    else
+      bat->Delete(db->default_cf, combine_strings(prefix, it->key()));
   }
 }
 
+void RocksDBStore::RocksDBTransactionImpl::merge(
+  const string &prefix,
+  const string &k,
+  const bufferlist &to_set_bl)
+{
+  rocksdb::ColumnFamilyHandle *cf = db->get_cf_handle(prefix);
+  if (cf)
+    put_bat(cf, k, to_set_bl, true);
+  else
+    put_bat(db->default_cf, combine_strings(prefix, k), to_set_bl, true);
+}
+
 int RocksDBStore::get(
     const string &prefix,
     const std::set<string> &keys,
     std::map<string, bufferlist> *out)
 {
   utime_t start = ceph_clock_now(g_ceph_context);
-  KeyValueDB::Iterator it = get_iterator(prefix);
-  for (std::set<string>::const_iterator i = keys.begin();
-       i != keys.end();
-       ++i) {
-    it->lower_bound(*i);
-    if (it->valid() && it->key() == *i) {
-      out->insert(make_pair(*i, it->value()));
-    } else if (!it->valid())
-      break;
+  int r = 0;
+  // MultiGet does the point lookups against a single view of the db,
+  // using bloom filters where an iterator would seek every level
+  rocksdb::ColumnFamilyHandle *cf = get_cf_handle(prefix);
+  vector<string> combined;
+  vector<rocksdb::Slice> slices;
+  slices.reserve(keys.size());
+  if (cf) {
+    for (auto& k : keys)
+      slices.push_back(rocksdb::Slice(k));
+  } else {
+    combined.reserve(keys.size());
+    for (auto& k : keys) {
+      combined.push_back(combine_strings(prefix, k));
+      slices.push_back(rocksdb::Slice(combined.back()));
+    }
+  }
+  vector<rocksdb::ColumnFamilyHandle*> cfs(keys.size(), cf ? cf : default_cf);
+  vector<string> values;
+  vector<rocksdb::Status> status = db->MultiGet(rocksdb::ReadOptions(), cfs,
+						slices, &values);
+  std::set<string>::const_iterator k = keys.begin();
+  for (unsigned i = 0; i < status.size(); ++i, ++k) {
+    if (status[i].ok()) {
+      (*out)[*k].append(values[i]);
+    } else if (!status[i].IsNotFound()) {
+      derr << __func__ << " " << prefix << " " << *k << ": "
+	   << status[i].ToString() << dendl;
+      r = -EIO;
+    }
   }
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_rocksdb_gets);
   logger->tinc(l_rocksdb_get_latency, lat);
-  return 0;
+  return r;
 }
 
 int RocksDBStore::get(
@@ -413,12 +748,23 @@ int RocksDBStore::get(
   assert(out && (out->length() == 0));
   utime_t start = ceph_clock_now(g_ceph_context);
   int r = 0;
-  KeyValueDB::Iterator it = get_iterator(prefix);
-  it->lower_bound(key);
-  if (it->valid() && it->key() == key) {
-    out->append(it->value_as_ptr());
-  } else {
+  // a point lookup can use the bloom filters; an iterator seeks every level
+  rocksdb::ColumnFamilyHandle *cf = get_cf_handle(prefix);
+  string value;
+  rocksdb::Status s;
+  if (cf)
+    s = db->Get(rocksdb::ReadOptions(), cf, rocksdb::Slice(key), &value);
+  else
+    s = db->Get(rocksdb::ReadOptions(), default_cf,
+		rocksdb::Slice(combine_strings(prefix, key)), &value);
+  if (s.ok()) {
+    out->append(value);
+  } else if (s.IsNotFound()) {
     r = -ENOENT;
+  } else {
+    derr << __func__ << " " << prefix << " " << key << ": "
+	 << s.ToString() << dendl;
+    r = -EIO;
   }
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_rocksdb_gets);
@@ -466,6 +812,8 @@ void RocksDBStore::compact()
   logger->inc(l_rocksdb_compact);
   rocksdb::CompactRangeOptions options;
   db->CompactRange(options, nullptr, nullptr);
+  for (auto& p : cf_handles)
+    db->CompactRange(options, p.second, nullptr, nullptr);
 }
 
 
@@ -539,6 +887,22 @@ bool RocksDBStore::check_omap_dir(string &omap_dir)
 void RocksDBStore::compact_range(const string& start, const string& end)
 {
   rocksdb::CompactRangeOptions options;
+  for (auto& p : cf_handles) {
+    // a range within one column family's prefix, as compact_prefix() and
+    // compact_range(prefix, ...) produce
+    string limit = past_prefix(p.first);
+    if (start < p.first || end > limit)
+      continue;
+    size_t plen = p.first.length() + 1;
+    string kstart = start.length() > plen ? start.substr(plen) : string();
+    string kend = end.length() > plen ? end.substr(plen) : string();
+    rocksdb::Slice cstart(kstart);
+    rocksdb::Slice cend(kend);
+    db->CompactRange(options, p.second,
+		     kstart.empty() ? nullptr : &cstart,
+		     end == limit ? nullptr : &cend);
+    return;
+  }
   rocksdb::Slice cstart(start);
   rocksdb::Slice cend(end);
   db->CompactRange(options, &cstart, &cend);
@@ -657,6 +1021,8 @@ string RocksDBStore::past_prefix(const string &prefix)
 
 RocksDBStore::WholeSpaceIterator RocksDBStore::_get_iterator()
 {
+  if (!cf_handles.empty())
+    return std::make_shared<RocksDBShardedIteratorImpl>(this, nullptr);
   return std::make_shared<RocksDBWholeSpaceIteratorImpl>(
         db->NewIterator(rocksdb::ReadOptions()));
 }
@@ -667,6 +1033,8 @@ RocksDBStore::WholeSpaceIterator RocksDBStore::_get_snapshot_iterator()
   rocksdb::ReadOptions options;
 
   snapshot = db->GetSnapshot();
+  if (!cf_handles.empty())
+    return std::make_shared<RocksDBShardedIteratorImpl>(this, snapshot);
   options.snapshot = snapshot;
 
   return std::make_shared<RocksDBSnapshotIteratorImpl>(
@@ -677,3 +1045,229 @@ RocksDBStore::RocksDBSnapshotIteratorImpl::~RocksDBSnapshotIteratorImpl()
 {
   db->ReleaseSnapshot(snapshot);
 }
+
+RocksDBStore::RocksDBShardedIteratorImpl::RocksDBShardedIteratorImpl(
+  RocksDBStore *store,
+  const rocksdb::Snapshot *s)
+  : db(store->db), snapshot(s), seg(-1)
+{
+  rocksdb::ReadOptions options;
+  options.snapshot = snapshot;
+  iters.push_back(db->NewIterator(options, store->default_cf));
+  for (auto& p : store->cf_handles) {
+    prefixes.push_back(p.first);
+    starts.push_back(combine_strings(p.first, string()));
+    ends.push_back(past_prefix(p.first));
+    iters.push_back(db->NewIterator(options, p.second));
+  }
+}
+
+RocksDBStore::RocksDBShardedIteratorImpl::~RocksDBShardedIteratorImpl()
+{
+  for (auto i : iters)
+    delete i;
+  if (snapshot)
+    db->ReleaseSnapshot(snapshot);
+}
+
+bool RocksDBStore::RocksDBShardedIteratorImpl::in_seg(int s)
+{
+  rocksdb::Iterator *it = seg_iter(s);
+  if (!it->Valid())
+    return false;
+  if (s & 1)
+    return true;
+  // default column family; stay between the neighbouring prefixes
+  unsigned i = s / 2;
+  rocksdb::Slice k = it->key();
+  if (i > 0 && k.compare(rocksdb::Slice(ends[i - 1])) < 0)
+    return false;
+  if (i < prefixes.size() && k.compare(rocksdb::Slice(starts[i])) >= 0)
+    return false;
+  return true;
+}
+
+void RocksDBStore::RocksDBShardedIteratorImpl::first_from(int s)
+{
+  for (; s < num_segs(); ++s) {
+    rocksdb::Iterator *it = seg_iter(s);
+    if ((s & 1) || s == 0)
+      it->SeekToFirst();
+    else
+      it->Seek(rocksdb::Slice(ends[s / 2 - 1]));
+    if (in_seg(s)) {
+      seg = s;
+      return;
+    }
+  }
+  seg = num_segs();
+}
+
+void RocksDBStore::RocksDBShardedIteratorImpl::last_from(int s)
+{
+  for (; s >= 0; --s) {
+    rocksdb::Iterator *it = seg_iter(s);
+    unsigned i = s / 2;
+    if ((s & 1) || i == prefixes.size()) {
+      it->SeekToLast();
+    } else {
+      it->Seek(rocksdb::Slice(starts[i]));
+      if (it->Valid())
+	it->Prev();
+      else
+	it->SeekToLast();
+    }
+    if (in_seg(s)) {
+      seg = s;
+      return;
+    }
+  }
+  seg = -1;
+}
+
+void RocksDBStore::RocksDBShardedIteratorImpl::seek(const string &prefix,
+						    const string &to)
+{
+  // the prefixes sorting before ours have their whole range before us
+  unsigned i = std::lower_bound(prefixes.begin(), prefixes.end(), prefix) -
+    prefixes.begin();
+  int s;
+  if (i < prefixes.size() && prefixes[i] == prefix) {
+    s = 2 * i + 1;
+    iters[i + 1]->Seek(rocksdb::Slice(to));
+  } else {
+    s = 2 * i;
+    iters[0]->Seek(rocksdb::Slice(combine_strings(prefix, to)));
+  }
+  if (in_seg(s))
+    seg = s;
+  else
+    first_from(s + 1);
+}
+
+void RocksDBStore::RocksDBShardedIteratorImpl::seek_last(const string &prefix)
+{
+  unsigned i = std::lower_bound(prefixes.begin(), prefixes.end(), prefix) -
+    prefixes.begin();
+  int s;
+  if (i < prefixes.size() && prefixes[i] == prefix) {
+    s = 2 * i + 1;
+    iters[i + 1]->SeekToLast();
+  } else {
+    s = 2 * i;
+    iters[0]->Seek(rocksdb::Slice(past_prefix(prefix)));
+    if (iters[0]->Valid())
+      iters[0]->Prev();
+    else
+      iters[0]->SeekToLast();
+  }
+  if (in_seg(s))
+    seg = s;
+  else
+    last_from(s - 1);
+}
+
+int RocksDBStore::RocksDBShardedIteratorImpl::seek_to_first()
+{
+  first_from(0);
+  return status();
+}
+int RocksDBStore::RocksDBShardedIteratorImpl::seek_to_first(const string &prefix)
+{
+  seek(prefix, string());
+  return status();
+}
+int RocksDBStore::RocksDBShardedIteratorImpl::seek_to_last()
+{
+  last_from(num_segs() - 1);
+  return status();
+}
+int RocksDBStore::RocksDBShardedIteratorImpl::seek_to_last(const string &prefix)
+{
+  seek_last(prefix);
+  return status();
+}
+int RocksDBStore::RocksDBShardedIteratorImpl::upper_bound(const string &prefix,
+							  const string &after)
+{
+  lower_bound(prefix, after);
+  if (valid()) {
+    pair<string,string> key = raw_key();
+    if (key.first == prefix && key.second == after)
+      next();
+  }
+  return status();
+}
+int RocksDBStore::RocksDBShardedIteratorImpl::lower_bound(const string &prefix,
+							  const string &to)
+{
+  seek(prefix, to);
+  return status();
+}
+bool RocksDBStore::RocksDBShardedIteratorImpl::valid()
+{
+  return seg >= 0 && seg < num_segs() && cur()->Valid();
+}
+int RocksDBStore::RocksDBShardedIteratorImpl::next()
+{
+  if (valid()) {
+    cur()->Next();
+    if (!in_seg(seg))
+      first_from(seg + 1);
+  }
+  return status();
+}
+int RocksDBStore::RocksDBShardedIteratorImpl::prev()
+{
+  if (valid()) {
+    cur()->Prev();
+    if (!in_seg(seg))
+      last_from(seg - 1);
+  }
+  return status();
+}
+string RocksDBStore::RocksDBShardedIteratorImpl::key()
+{
+  if (seg & 1)
+    return cur()->key().ToString();
+  string out_key;
+  split_key(cur()->key(), 0, &out_key);
+  return out_key;
+}
+pair<string,string> RocksDBStore::RocksDBShardedIteratorImpl::raw_key()
+{
+  if (seg & 1)
+    return make_pair(prefixes[seg / 2], cur()->key().ToString());
+  string prefix, key;
+  split_key(cur()->key(), &prefix, &key);
+  return make_pair(prefix, key);
+}
+bool RocksDBStore::RocksDBShardedIteratorImpl::raw_key_is_prefixed(
+  const string &prefix)
+{
+  if (seg & 1)
+    return prefixes[seg / 2] == prefix;
+  // Look for "prefix\0" right in rocksb::Slice
+  rocksdb::Slice key = cur()->key();
+  if ((key.size() > prefix.length()) && (key[prefix.length()] == '\0')) {
+    return memcmp(key.data(), prefix.c_str(), prefix.length()) == 0;
+  } else {
+    return false;
+  }
+}
+bufferlist RocksDBStore::RocksDBShardedIteratorImpl::value()
+{
+  return to_bufferlist(cur()->value());
+}
+bufferptr RocksDBStore::RocksDBShardedIteratorImpl::value_as_ptr()
+{
+  rocksdb::Slice val = cur()->value();
+  return bufferptr(val.data(), val.size());
+}
+int RocksDBStore::RocksDBShardedIteratorImpl::status()
+{
+  for (auto i : iters)
+    if (!i->status().ok())
+      return -1;
+  return 0;
+}
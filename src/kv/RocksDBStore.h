@@ -46,7 +46,9 @@ namespace rocksdb{
   class WriteBatch;
   class Iterator;
   class Logger;
+  class ColumnFamilyHandle;
   struct Options;
+  struct ColumnFamilyOptions;
 }
 
 extern rocksdb::Logger *create_rocksdb_ceph_logger();
@@ -64,6 +66,32 @@ class RocksDBStore : public KeyValueDB {
   string options_str;
   int do_open(ostream &out, bool create_if_missing);
 
+  // merge operators, dispatched on key prefix by MergeOperatorRouter
+  vector<pair<string, std::shared_ptr<KeyValueDB::MergeOperator> > > merge_ops;
+  string assoc_name; ///< name of the associative merge operator
+  class MergeOperatorRouter;
+  class MergeOperatorLinker;
+
+  // prefixes kept in their own column family (named after the prefix),
+  // with the options that apply to it on top of options_str
+  map<string, string> cf_specs;
+  map<string, rocksdb::ColumnFamilyHandle*> cf_handles;
+  rocksdb::ColumnFamilyHandle *default_cf;
+
+  rocksdb::ColumnFamilyHandle *get_cf_handle(const string& prefix) {
+    if (cf_handles.empty())
+      return nullptr;
+    auto p = cf_handles.find(prefix);
+    if (p == cf_handles.end())
+      return nullptr;
+    return p->second;
+  }
+  int parse_cf_options(const string& opts,
+		       const rocksdb::Options& base,
+		       rocksdb::ColumnFamilyOptions *cf_opt,
+		       int *bloom_bits,
+		       uint64_t *cache_size);
+
   // manage async compactions
   Mutex compact_queue_lock;
   Cond compact_queue_cond;
@@ -95,6 +123,7 @@ public:
   int ParseOptionsFromString(const string opt_str, rocksdb::Options &opt);
   static int _test_init(const string& dir);
   int init(string options_str);
+  int set_column_families(const string& spec);
   /// compact rocksdb for all keys with a given prefix
   void compact_prefix(const string& prefix) {
     compact_range(prefix, past_prefix(prefix));
@@ -118,6 +147,7 @@ public:
     priv(p),
     db(NULL),
     env(static_cast<rocksdb::Env*>(p)),
+    default_cf(NULL),
     compact_queue_lock("RocksDBStore::compact_thread_lock"),
     compact_queue_stop(false),
     compact_thread(this),
@@ -137,6 +167,9 @@ public:
 
   void close();
 
+  int set_merge_operator(const string& prefix,
+			 std::shared_ptr<KeyValueDB::MergeOperator> mop);
+
   class RocksDBTransactionImpl : public KeyValueDB::TransactionImpl {
   public:
     rocksdb::WriteBatch *bat;
@@ -144,6 +177,11 @@ public:
 
     explicit RocksDBTransactionImpl(RocksDBStore *_db);
     ~RocksDBTransactionImpl();
+    void put_bat(
+      rocksdb::ColumnFamilyHandle *cf,
+      const string &k,
+      const bufferlist &bl,
+      bool merge);
     void set(
       const string &prefix,
       const string &k,
@@ -154,6 +192,10 @@ public:
     void rmkeys_by_prefix(
       const string &prefix
       );
+    void merge(
+      const string &prefix,
+      const string &k,
+      const bufferlist &bl);
   };
 
   KeyValueDB::Transaction get_transaction() {
@@ -211,6 +253,62 @@ public:
     ~RocksDBSnapshotIteratorImpl();
   };
 
+  /**
+   * Iterates the whole key space when some prefixes live in their own
+   * column family.
+   *
+   * A column family holds every key of its prefix, so its keys are
+   * contiguous in the combined (prefix\0key) order.  The key space is
+   * split into segments that alternate between a range of the default
+   * column family and a whole prefix column family, and we walk them in
+   * order.
+   */
+  class RocksDBShardedIteratorImpl :
+    public KeyValueDB::WholeSpaceIteratorImpl {
+    rocksdb::DB *db;
+    const rocksdb::Snapshot *snapshot;
+    vector<string> prefixes;               ///< column family prefixes, sorted
+    vector<string> starts, ends;           ///< [i] combined key range of prefixes[i]
+    vector<rocksdb::Iterator*> iters;      ///< [0] default, [i+1] prefixes[i]
+    int seg;                               ///< current segment
+
+    int num_segs() const {
+      return prefixes.size() * 2 + 1;
+    }
+    /// iterator for segment s
+    rocksdb::Iterator *seg_iter(int s) {
+      return (s & 1) ? iters[s / 2 + 1] : iters[0];
+    }
+    bool in_seg(int s);
+    void first_from(int s);
+    void last_from(int s);
+    void seek(const string &prefix, const string &to);
+    void seek_last(const string &prefix);
+    rocksdb::Iterator *cur() {
+      return seg_iter(seg);
+    }
+  public:
+    RocksDBShardedIteratorImpl(RocksDBStore *store,
+			       const rocksdb::Snapshot *s);
+    ~RocksDBShardedIteratorImpl();
+
+    int seek_to_first();
+    int seek_to_first(const string &prefix);
+    int seek_to_last();
+    int seek_to_last(const string &prefix);
+    int upper_bound(const string &prefix, const string &after);
+    int lower_bound(const string &prefix, const string &to);
+    bool valid();
+    int next();
+    int prev();
+    string key();
+    pair<string,string> raw_key();
+    bool raw_key_is_prefixed(const string &prefix);
+    bufferlist value();
+    bufferptr value_as_ptr();
+    int status();
+  };
+
   /// Utility
   static string combine_strings(const string &prefix, const string &value);
   static int split_key(rocksdb::Slice in, string *prefix, string *key);
@@ -36,6 +36,7 @@
 #define OPS_PER_PTR 32
 
 class CephContext;
+class PerfCounters;
 
 using std::vector;
 using std::string;
@@ -55,6 +56,7 @@ enum {
   l_os_j_wr,
   l_os_j_wr_bytes,
   l_os_j_full,
+  l_os_j_aio_lat,
   l_os_committing,
   l_os_commit,
   l_os_commit_len,
@@ -67,6 +69,9 @@ enum {
   l_os_bytes,
   l_os_apply_lat,
   l_os_queue_lat,
+  l_os_read_hole_bytes,
+  l_os_split_ahead,
+  l_os_split_ahead_skipped,
   l_os_last,
 };
 
@@ -133,6 +138,13 @@ public:
    */
   virtual objectstore_perf_stat_t get_cur_stats() = 0;
 
+  /**
+   * Fetch the store's own perf counters, if it has any.
+   */
+  virtual const PerfCounters* get_perf_counters() const {
+    return nullptr;
+  }
+
   /**
    * a sequencer orders transactions
    *
@@ -404,7 +416,7 @@ public:
       OP_OMAP_RMKEYRANGE = 37,  // cid, oid, firstkey, lastkey
       OP_COLL_MOVE_RENAME = 38,   // oldcid, oldoid, newcid, newoid
 
-      OP_SETALLOCHINT = 39,  // cid, oid, object_size, write_size
+      OP_SETALLOCHINT = 39,  // cid, oid, object_size, write_size, flags
       OP_COLL_HINT = 40, // cid, type, bl
 
       OP_TRY_RENAME = 41,   // oldcid, oldoid, newoid
@@ -424,7 +436,7 @@ public:
       __le32 dest_cid;
       __le32 dest_oid;                  //OP_CLONE, OP_CLONERANGE
       __le64 dest_off;                  //OP_CLONERANGE
-      __le32 hint_type;                 //OP_COLL_HINT
+      __le32 hint_type;                 //OP_COLL_HINT, OP_SETALLOCHINT (flags)
       __le64 expected_object_size;      //OP_SETALLOCHINT
       __le64 expected_write_size;       //OP_SETALLOCHINT
       __le32 split_bits;                //OP_SPLIT_COLLECTION2
@@ -1712,9 +1724,11 @@ public:
       coll_t cid,
       const ghobject_t &oid,
       uint64_t expected_object_size,
-      uint64_t expected_write_size
+      uint64_t expected_write_size,
+      uint32_t flags
     ) {
       if (use_tbl) {
+        // the legacy encoding has no room for flags; drop them
         __u32 op = OP_SETALLOCHINT;
         ::encode(op, tbl);
         ::encode(cid, tbl);
@@ -1728,6 +1742,7 @@ public:
         _op->oid = _get_object_id(oid);
         _op->expected_object_size = expected_object_size;
         _op->expected_write_size = expected_write_size;
+        _op->hint_type = flags;
       }
       data.ops++;
     }
@@ -1915,7 +1930,7 @@ public:
   virtual bool test_mount_in_use() = 0;
   virtual int mount() = 0;
   virtual int umount() = 0;
-  virtual int fsck() {
+  virtual int fsck(bool deep) {
     return -EOPNOTSUPP;
   }
   virtual unsigned get_max_object_name_length() = 0;
@@ -1929,6 +1944,9 @@ public:
   virtual bool can_sort_nibblewise() {
     return false;   // assume a backend cannot, unless it says otherwise
   }
+  virtual bool wants_alloc_hint_flags() {
+    return false;   // CEPH_OSD_ALLOC_HINT_FLAG_* are ignored unless it says so
+  }
 
   virtual int statfs(struct statfs *buf) = 0;
 
@@ -506,7 +506,7 @@ void ObjectStore::Transaction::_build_actions_from_tbl()
 	::decode(expected_object_size, p);
 	::decode(expected_write_size, p);
 
-	set_alloc_hint(cid, oid, expected_object_size, expected_write_size);
+	set_alloc_hint(cid, oid, expected_object_size, expected_write_size, 0);
       }
       break;
 
@@ -928,11 +928,13 @@ void ObjectStore::Transaction::dump(ceph::Formatter *f)
         ghobject_t oid = i.get_oid(op->oid);
         uint64_t expected_object_size = op->expected_object_size;
         uint64_t expected_write_size = op->expected_write_size;
+        uint32_t alloc_hint_flags = op->hint_type;
         f->dump_string("op_name", "op_setallochint");
         f->dump_stream("collection") << cid;
         f->dump_stream("oid") << oid;
         f->dump_stream("expected_object_size") << expected_object_size;
         f->dump_stream("expected_write_size") << expected_write_size;
+        f->dump_unsigned("alloc_hint_flags", alloc_hint_flags);
       }
       break;
 
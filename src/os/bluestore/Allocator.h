@@ -44,7 +44,7 @@ public:
 
   virtual void shutdown() = 0;
 
-  static Allocator *create(string type);
+  static Allocator *create(string type, int64_t size, int64_t block_size);
 };
 
 #endif
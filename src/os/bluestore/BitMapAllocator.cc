@@ -0,0 +1,393 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "BitMapAllocator.h"
+#include "bluestore_types.h"
+#include "BlueStore.h"
+
+#define dout_subsys ceph_subsys_bluestore
+#undef dout_prefix
+#define dout_prefix *_dout << "bitmapalloc "
+
+BitMapAllocator::BitMapAllocator(int64_t size, int64_t bsize)
+  : block_size(bsize),
+    blocks_per_zone(ROUND_UP_TO(
+		      MAX(g_conf->bluestore_bitmapallocator_blocks_per_zone, 1),
+		      64)),
+    total_blocks(size / bsize),
+    zones((total_blocks + blocks_per_zone - 1) / blocks_per_zone),
+    num_free(0),
+    num_reserved(0),
+    last_zone(0),
+    num_uncommitted(0),
+    num_committing(0)
+{
+  assert(block_size > 0);
+  // everything starts out in use; free space is added via init_add_free
+  uint64_t words = blocks_per_zone / 64;
+  for (unsigned i = 0; i < zones.size(); ++i) {
+    Zone& z = zones[i];
+    z.start_block = i * blocks_per_zone;
+    z.num_blocks = MIN(blocks_per_zone, total_blocks - z.start_block);
+    z.bits.resize(words, ~0ull);
+    z.full_words.resize((words + 63) / 64, ~0ull);
+  }
+  dout(10) << __func__ << " " << total_blocks << " blocks of " << block_size
+	   << " in " << zones.size() << " zones of " << blocks_per_zone
+	   << dendl;
+}
+
+BitMapAllocator::~BitMapAllocator()
+{
+}
+
+void BitMapAllocator::_update_full(Zone& z, uint64_t word)
+{
+  uint64_t mask = 1ull << (word % 64);
+  if (z.bits[word] == ~0ull)
+    z.full_words[word / 64] |= mask;
+  else
+    z.full_words[word / 64] &= ~mask;
+}
+
+uint64_t BitMapAllocator::_mark_used(Zone& z, uint64_t zblock, uint64_t n)
+{
+  uint64_t changed = 0;
+  while (n > 0) {
+    uint64_t w = zblock / 64;
+    uint64_t bit = zblock % 64;
+    uint64_t count = MIN(64 - bit, n);
+    uint64_t mask = count == 64 ? ~0ull : ((1ull << count) - 1) << bit;
+    changed += __builtin_popcountll(mask & ~z.bits[w]);
+    z.bits[w] |= mask;
+    _update_full(z, w);
+    zblock += count;
+    n -= count;
+  }
+  z.num_free -= changed;
+  return changed;
+}
+
+uint64_t BitMapAllocator::_mark_free(Zone& z, uint64_t zblock, uint64_t n)
+{
+  uint64_t changed = 0;
+  while (n > 0) {
+    uint64_t w = zblock / 64;
+    uint64_t bit = zblock % 64;
+    uint64_t count = MIN(64 - bit, n);
+    uint64_t mask = count == 64 ? ~0ull : ((1ull << count) - 1) << bit;
+    changed += __builtin_popcountll(mask & z.bits[w]);
+    z.bits[w] &= ~mask;
+    _update_full(z, w);
+    zblock += count;
+    n -= count;
+  }
+  z.num_free += changed;
+  return changed;
+}
+
+uint64_t BitMapAllocator::_mark_range(uint64_t offset, uint64_t length,
+				      bool used)
+{
+  // round outward when taking space away and inward when giving it
+  // back, so that a partial block is never handed out.
+  uint64_t start, end;
+  if (used) {
+    start = offset / block_size;
+    end = ROUND_UP_TO(offset + length, block_size) / block_size;
+  } else {
+    start = ROUND_UP_TO(offset, block_size) / block_size;
+    end = (offset + length) / block_size;
+  }
+  end = MIN(end, total_blocks);
+  uint64_t changed = 0;
+  while (start < end) {
+    Zone& z = _zone_of(start);
+    uint64_t zblock = start - z.start_block;
+    uint64_t n = MIN(end - start, z.num_blocks - zblock);
+    std::lock_guard<std::mutex> l(z.lock);
+    if (used)
+      changed += _mark_used(z, zblock, n);
+    else
+      changed += _mark_free(z, zblock, n);
+    start += n;
+  }
+  return changed;
+}
+
+uint64_t BitMapAllocator::_find_free(Zone& z, uint64_t from)
+{
+  uint64_t nwords = z.bits.size();
+  uint64_t w = from / 64;
+  uint64_t mask = ~0ull << (from % 64);
+  while (w < nwords) {
+    if ((w % 64) == 0 && z.full_words[w / 64] == ~0ull) {
+      // 64 full words in a row; skip them all
+      w += 64;
+      mask = ~0ull;
+      continue;
+    }
+    uint64_t free_bits = ~z.bits[w] & mask;
+    if (free_bits) {
+      uint64_t b = w * 64 + __builtin_ctzll(free_bits);
+      return MIN(b, z.num_blocks);
+    }
+    ++w;
+    mask = ~0ull;
+  }
+  return z.num_blocks;
+}
+
+uint64_t BitMapAllocator::_count_free(Zone& z, uint64_t from, uint64_t max)
+{
+  uint64_t count = 0;
+  uint64_t b = from;
+  while (count < max && b < z.num_blocks) {
+    uint64_t bit = b % 64;
+    uint64_t used = z.bits[b / 64] >> bit;
+    if (used) {
+      count += __builtin_ctzll(used);
+      break;
+    }
+    count += 64 - bit;
+    b += 64 - bit;
+  }
+  return MIN(count, MIN(max, z.num_blocks - from));
+}
+
+bool BitMapAllocator::_zone_allocate(
+  Zone& z, uint64_t from, uint64_t want, uint64_t need, uint64_t unit,
+  uint64_t *start, uint64_t *len)
+{
+  while (from < z.num_blocks) {
+    uint64_t b = _find_free(z, from);
+    if (b >= z.num_blocks)
+      return false;
+    uint64_t skew = (z.start_block + b) % unit;
+    if (skew) {
+      b += unit - skew;
+      if (b >= z.num_blocks)
+	return false;
+      if (_is_used(z, b)) {
+	from = b + 1;
+	continue;
+      }
+    }
+    uint64_t run = _count_free(z, b, want);
+    uint64_t usable = run - run % unit;
+    if (usable >= need) {
+      *start = b;
+      *len = usable;
+      return true;
+    }
+    from = b + run;
+  }
+  return false;
+}
+
+int BitMapAllocator::reserve(uint64_t need)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " need " << need << " num_free " << num_free
+	   << " num_reserved " << num_reserved << dendl;
+  if ((int64_t)need > num_free - num_reserved)
+    return -ENOSPC;
+  num_reserved += need;
+  return 0;
+}
+
+void BitMapAllocator::unreserve(uint64_t unused)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " unused " << unused << " num_free " << num_free
+	   << " num_reserved " << num_reserved << dendl;
+  assert(num_reserved >= (int64_t)unused);
+  num_reserved -= unused;
+}
+
+int BitMapAllocator::allocate(
+  uint64_t want_size, uint64_t alloc_unit, int64_t hint,
+  uint64_t *offset, uint32_t *length)
+{
+  dout(10) << __func__ << " want_size " << want_size
+	   << " alloc_unit " << alloc_unit
+	   << " hint " << hint
+	   << dendl;
+  uint64_t unit = MAX(ROUND_UP_TO(alloc_unit, block_size) / block_size, 1);
+  uint64_t want = MAX(alloc_unit, want_size) / block_size;
+  // an extent never spans zones, and length must fit in 32 bits
+  want = MIN(want, blocks_per_zone);
+  want = MIN(want, (uint64_t)UINT32_MAX / block_size);
+  want -= want % unit;
+  if (want == 0)
+    want = unit;
+
+  uint64_t nz = zones.size();
+  if (nz == 0)
+    return -ENOSPC;
+  uint64_t first, from = 0;
+  if (hint && (uint64_t)hint / block_size < total_blocks) {
+    first = hint / block_size / blocks_per_zone;
+    from = hint / block_size - zones[first].start_block;
+  } else {
+    first = last_zone.load() % nz;
+  }
+
+  uint64_t zi = 0, b = 0, len = 0;
+  bool found = false;
+
+  // look for a full-size extent, skipping zones someone else is busy in
+  for (uint64_t i = 0; i < nz && !found; ++i) {
+    zi = (first + i) % nz;
+    Zone& z = zones[zi];
+    if (z.num_free.load() < want)
+      continue;
+    std::unique_lock<std::mutex> zl(z.lock, std::try_to_lock);
+    if (!zl.owns_lock())
+      continue;
+    if (_zone_allocate(z, i == 0 ? from : 0, want, want, unit, &b, &len)) {
+      found = true;
+      _mark_used(z, b, len);
+    }
+  }
+
+  // settle for anything that is at least one alloc_unit
+  for (uint64_t i = 0; i < nz && !found; ++i) {
+    zi = (first + i) % nz;
+    Zone& z = zones[zi];
+    if (z.num_free.load() < unit)
+      continue;
+    std::lock_guard<std::mutex> zl(z.lock);
+    if (_zone_allocate(z, 0, want, unit, unit, &b, &len)) {
+      found = true;
+      if (g_conf->bluestore_debug_small_allocations) {
+	uint64_t max =
+	  unit * (rand() % g_conf->bluestore_debug_small_allocations);
+	if (max && len > max) {
+	  dout(10) << __func__ << " shortening allocation of "
+		   << len * block_size << " -> " << max * block_size
+		   << " due to debug_small_allocations" << dendl;
+	  len = max;
+	}
+      }
+      _mark_used(z, b, len);
+    }
+  }
+
+  if (!found) {
+    assert(0 == "caller didn't reserve?");
+    return -ENOSPC;
+  }
+
+  *offset = (zones[zi].start_block + b) * block_size;
+  *length = len * block_size;
+  dout(30) << __func__ << " got " << *offset << "~" << *length
+	   << " from zone " << zi << dendl;
+  last_zone = zi;
+
+  std::lock_guard<std::mutex> l(lock);
+  num_free -= *length;
+  num_reserved -= *length;
+  assert(num_free >= 0);
+  assert(num_reserved >= 0);
+  return 0;
+}
+
+int BitMapAllocator::release(
+  uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(release_lock);
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  uncommitted.insert(offset, length);
+  num_uncommitted += length;
+  return 0;
+}
+
+uint64_t BitMapAllocator::get_free()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return num_free;
+}
+
+void BitMapAllocator::dump(ostream& out)
+{
+  for (unsigned i = 0; i < zones.size(); ++i) {
+    Zone& z = zones[i];
+    std::lock_guard<std::mutex> zl(z.lock);
+    dout(30) << __func__ << " zone " << i << ": " << z.num_free.load()
+	     << "/" << z.num_blocks << " blocks free" << dendl;
+    uint64_t b = _find_free(z, 0);
+    while (b < z.num_blocks) {
+      uint64_t run = _count_free(z, b, z.num_blocks);
+      dout(30) << __func__ << "  " << (z.start_block + b) * block_size
+	       << "~" << run * block_size << dendl;
+      b = _find_free(z, b + run);
+    }
+  }
+  std::lock_guard<std::mutex> l(release_lock);
+  dout(30) << __func__ << " committing: "
+	   << committing.num_intervals() << " extents" << dendl;
+  for (auto p = committing.begin();
+       p != committing.end();
+       ++p) {
+    dout(30) << __func__ << "  " << p.get_start() << "~" << p.get_len() << dendl;
+  }
+  dout(30) << __func__ << " uncommitted: "
+	   << uncommitted.num_intervals() << " extents" << dendl;
+  for (auto p = uncommitted.begin();
+       p != uncommitted.end();
+       ++p) {
+    dout(30) << __func__ << "  " << p.get_start() << "~" << p.get_len() << dendl;
+  }
+}
+
+void BitMapAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  uint64_t changed = _mark_range(offset, length, false);
+  std::lock_guard<std::mutex> l(lock);
+  num_free += changed * block_size;
+}
+
+void BitMapAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  uint64_t changed = _mark_range(offset, length, true);
+  std::lock_guard<std::mutex> l(lock);
+  num_free -= changed * block_size;
+  assert(num_free >= 0);
+}
+
+void BitMapAllocator::shutdown()
+{
+  dout(1) << __func__ << dendl;
+}
+
+void BitMapAllocator::commit_start()
+{
+  std::lock_guard<std::mutex> l(release_lock);
+  dout(10) << __func__ << " releasing " << num_uncommitted
+	   << " in extents " << uncommitted.num_intervals() << dendl;
+  assert(committing.empty());
+  committing.swap(uncommitted);
+  num_committing = num_uncommitted;
+  num_uncommitted = 0;
+}
+
+void BitMapAllocator::commit_finish()
+{
+  btree_interval_set<uint64_t> done;
+  {
+    std::lock_guard<std::mutex> l(release_lock);
+    dout(10) << __func__ << " released " << num_committing
+	     << " in extents " << committing.num_intervals() << dendl;
+    done.swap(committing);
+    num_committing = 0;
+  }
+  uint64_t changed = 0;
+  for (auto p = done.begin(); p != done.end(); ++p) {
+    changed += _mark_range(p.get_start(), p.get_len(), false);
+  }
+  std::lock_guard<std::mutex> l(lock);
+  num_free += changed * block_size;
+}
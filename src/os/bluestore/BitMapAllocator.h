@@ -0,0 +1,101 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_OS_BLUESTORE_BITMAPALLOCATOR_H
+#define CEPH_OS_BLUESTORE_BITMAPALLOCATOR_H
+
+#include <atomic>
+#include <mutex>
+
+#include "Allocator.h"
+#include "include/btree_interval_set.h"
+
+/**
+ * BitMapAllocator
+ *
+ * Track free space with one bit per block (block == min_alloc_size),
+ * which bounds memory at size/block_size/8 bytes regardless of how
+ * fragmented the device gets (2 MB per TB with 64 KB blocks).
+ *
+ * The device is cut into fixed-size zones, each with its own lock, so
+ * that concurrent allocations land in (and lock) different zones.
+ * Searches are hierarchical: zones track their free block count so full
+ * zones are skipped without taking the lock, and each zone keeps a
+ * summary bitmap of fully allocated words so dense regions are skipped
+ * 64 blocks at a time.
+ */
+class BitMapAllocator : public Allocator {
+  struct Zone {
+    std::mutex lock;
+    uint64_t start_block;                ///< first block in this zone
+    uint64_t num_blocks;                 ///< blocks in this zone
+    std::atomic<uint64_t> num_free;      ///< free blocks (read w/o lock)
+    std::vector<uint64_t> bits;          ///< 1 bit per block; set = in use
+    std::vector<uint64_t> full_words;    ///< 1 bit per word; set = ~0ull
+
+    Zone() : start_block(0), num_blocks(0), num_free(0) {}
+  };
+
+  uint64_t block_size;
+  uint64_t blocks_per_zone;
+  uint64_t total_blocks;
+  std::vector<Zone> zones;
+
+  std::mutex lock;        ///< protect num_free, num_reserved
+  int64_t num_free;       ///< total free bytes
+  int64_t num_reserved;   ///< reserved bytes
+
+  std::atomic<uint64_t> last_zone;   ///< where the last allocation landed
+
+  std::mutex release_lock;  ///< protect uncommitted, committing
+  int64_t num_uncommitted;
+  int64_t num_committing;
+  btree_interval_set<uint64_t> uncommitted; ///< released but not yet usable
+  btree_interval_set<uint64_t> committing;  ///< released but not yet usable
+
+  Zone& _zone_of(uint64_t block) {
+    return zones[block / blocks_per_zone];
+  }
+
+  bool _is_used(Zone& z, uint64_t zblock) {
+    return z.bits[zblock / 64] & (1ull << (zblock % 64));
+  }
+  void _update_full(Zone& z, uint64_t word);
+
+  uint64_t _mark_used(Zone& z, uint64_t zblock, uint64_t n);
+  uint64_t _mark_free(Zone& z, uint64_t zblock, uint64_t n);
+  uint64_t _mark_range(uint64_t offset, uint64_t length, bool used);
+
+  uint64_t _find_free(Zone& z, uint64_t from);
+  uint64_t _count_free(Zone& z, uint64_t from, uint64_t max);
+  bool _zone_allocate(Zone& z, uint64_t from, uint64_t want, uint64_t need,
+		      uint64_t unit, uint64_t *start, uint64_t *len);
+
+public:
+  BitMapAllocator(int64_t size, int64_t block_size);
+  ~BitMapAllocator();
+
+  int reserve(uint64_t need);
+  void unreserve(uint64_t unused);
+
+  int allocate(
+    uint64_t want_size, uint64_t alloc_unit, int64_t hint,
+    uint64_t *offset, uint32_t *length);
+
+  int release(
+    uint64_t offset, uint64_t length);
+
+  void commit_start();
+  void commit_finish();
+
+  uint64_t get_free();
+
+  void dump(std::ostream& out);
+
+  void init_add_free(uint64_t offset, uint64_t length);
+  void init_rm_free(uint64_t offset, uint64_t length);
+
+  void shutdown();
+};
+
+#endif
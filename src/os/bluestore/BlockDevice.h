@@ -22,13 +22,24 @@
 #include <mutex>
 
 #include "acconfig.h"
+#include "include/interval_set.h"
 #include "os/fs/FS.h"
 
 #define SPDK_PREFIX "spdk:"
 
+/// io priority classes, most urgent first
+enum {
+  BDEV_PRIO_KV = 0,      ///< kv commits and the bluefs log
+  BDEV_PRIO_CLIENT,      ///< client reads and writes
+  BDEV_PRIO_WAL,         ///< deferred wal apply
+  BDEV_PRIO_BACKGROUND,  ///< compaction, scrub, recovery
+  BDEV_PRIO_MAX
+};
+
 /// track in-flight io
 struct IOContext {
   void *priv;
+  int prio;  ///< BDEV_PRIO_*
 #ifdef HAVE_SPDK
   void *nvme_task_first = nullptr;
   void *nvme_task_last = nullptr;
@@ -44,8 +55,8 @@ struct IOContext {
   std::atomic_int num_reading = {0};
   std::atomic_int num_waiting = {0};
 
-  explicit IOContext(void *p)
-    : priv(p)
+  explicit IOContext(void *p, int pr = BDEV_PRIO_CLIENT)
+    : priv(p), prio(pr)
     {}
 
   // no copying
@@ -77,6 +88,14 @@ public:
   BlockDevice() = default;
   virtual ~BlockDevice() = default;
   typedef void (*aio_callback_t)(void *handle, void *aio);
+  typedef void (*discard_callback_t)(void *handle,
+				     interval_set<uint64_t>& extents);
+
+protected:
+  discard_callback_t discard_callback = nullptr;
+  void *discard_callback_priv = nullptr;
+
+public:
 
   static BlockDevice *create(
       const string& path, aio_callback_t cb, void *cbpriv);
@@ -90,13 +109,27 @@ public:
   virtual int read(uint64_t off, uint64_t len, bufferlist *pbl,
 	   IOContext *ioc, bool buffered) = 0;
   virtual int read_buffered(uint64_t off, uint64_t len, char *buf) = 0;
+  /// start pulling a range into cache for read_buffered; does not wait
+  virtual void prefetch(uint64_t off, uint64_t len) {}
 
   virtual int aio_write(uint64_t off, bufferlist& bl,
 		IOContext *ioc, bool buffered) = 0;
   virtual int aio_zero(uint64_t off, uint64_t len, IOContext *ioc) = 0;
   virtual int flush() = 0;
 
-  void queue_reap_ioc(IOContext *ioc);
+  /// extents passed to queue_discard() come back here once trimmed
+  void set_discard_callback(discard_callback_t cb, void *priv) {
+    discard_callback = cb;
+    discard_callback_priv = priv;
+  }
+  virtual bool supports_discard() const { return false; }
+  virtual void queue_discard(interval_set<uint64_t>& extents) {
+    assert(0 == "discard not supported");
+  }
+  /// wait for all queued discards to complete
+  virtual void discard_drain() {}
+
+  virtual void queue_reap_ioc(IOContext *ioc);
   void reap_ioc();
 
   // for managing buffered readers/writers
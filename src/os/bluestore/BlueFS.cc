@@ -5,6 +5,7 @@
 
 #include "common/debug.h"
 #include "common/errno.h"
+#include "common/perf_counters.h"
 #include "BlockDevice.h"
 #include "Allocator.h"
 #include "StupidAllocator.h"
@@ -15,10 +16,15 @@
 #define dout_prefix *_dout << "bluefs "
 
 BlueFS::BlueFS()
-  : ino_last(0),
+  : logger(NULL),
+    ino_last(0),
     log_seq(0),
-    log_writer(NULL)
+    log_writer(NULL),
+    new_log_writer(NULL),
+    new_log_jump_to(0),
+    old_log_jump_to(0)
 {
+  _init_logger();
 }
 
 BlueFS::~BlueFS()
@@ -30,6 +36,27 @@ BlueFS::~BlueFS()
   for (auto p : ioc) {
     delete p;
   }
+  _shutdown_logger();
+}
+
+void BlueFS::_init_logger()
+{
+  PerfCountersBuilder b(g_ceph_context, "BlueFS",
+                        l_bluefs_first, l_bluefs_last);
+  b.add_u64_counter(l_bluefs_read_bytes, "read_bytes", "Sum for bytes read sequentially");
+  b.add_u64_counter(l_bluefs_read_random_bytes, "read_random_bytes", "Sum for bytes read randomly");
+  b.add_u64_counter(l_bluefs_readahead_bytes, "readahead_bytes", "Sum for bytes prefetched by readahead");
+  b.add_u64_counter(l_bluefs_readahead_hit_bytes, "readahead_hit_bytes", "Sum for bytes read from a prefetched range");
+  b.add_u64_counter(l_bluefs_log_compactions, "log_compactions", "Log compactions");
+  b.add_time_avg(l_bluefs_log_compaction_lat, "log_compaction_lat", "Average log compaction latency");
+  logger = b.create_perf_counters();
+  g_ceph_context->get_perfcounters_collection()->add(logger);
+}
+
+void BlueFS::_shutdown_logger()
+{
+  g_ceph_context->get_perfcounters_collection()->remove(logger);
+  delete logger;
 }
 
 /*static void aio_cb(void *priv, void *priv2)
@@ -52,7 +79,7 @@ int BlueFS::add_block_device(unsigned id, string path)
   dout(1) << __func__ << " bdev " << id << " path " << path
 	  << " size " << pretty_si_t(b->get_size()) << "B" << dendl;
   bdev.push_back(b);
-  ioc.push_back(new IOContext(NULL));
+  ioc.push_back(new IOContext(NULL, BDEV_PRIO_KV));
   block_all.resize(bdev.size());
   return 0;
 }
@@ -64,7 +91,7 @@ uint64_t BlueFS::get_block_device_size(unsigned id)
 
 void BlueFS::add_block_extent(unsigned id, uint64_t offset, uint64_t length)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::unique_lock<std::mutex> l(lock);
   dout(1) << __func__ << " bdev " << id << " " << offset << "~" << length
 	  << dendl;
   assert(id < bdev.size());
@@ -73,7 +100,7 @@ void BlueFS::add_block_extent(unsigned id, uint64_t offset, uint64_t length)
 
   if (alloc.size()) {
     log_t.op_alloc_add(id, offset, length);
-    int r = _flush_log();
+    int r = _flush_log(l);
     assert(r == 0);
     alloc[id]->init_add_free(offset, length);
   }
@@ -83,7 +110,7 @@ void BlueFS::add_block_extent(unsigned id, uint64_t offset, uint64_t length)
 int BlueFS::reclaim_blocks(unsigned id, uint64_t want,
 			   uint64_t *offset, uint32_t *length)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::unique_lock<std::mutex> l(lock);
   dout(1) << __func__ << " bdev " << id << " want " << want << dendl;
   assert(id < alloc.size());
   int r = alloc[id]->reserve(want);
@@ -97,7 +124,7 @@ int BlueFS::reclaim_blocks(unsigned id, uint64_t want,
 
   block_all[id].erase(*offset, *length);
   log_t.op_alloc_rm(id, *offset, *length);
-  r = _flush_log();
+  r = _flush_log(l);
   assert(r == 0);
 
   dout(1) << __func__ << " bdev " << id << " want " << want
@@ -159,6 +186,7 @@ int BlueFS::get_block_extents(unsigned id, interval_set<uint64_t> *extents)
 
 int BlueFS::mkfs(uuid_d osd_uuid)
 {
+  std::unique_lock<std::mutex> l(lock);
   dout(1) << __func__
 	  << " osd_uuid " << osd_uuid
 	  << dendl;
@@ -192,7 +220,7 @@ int BlueFS::mkfs(uuid_d osd_uuid)
       log_t.op_alloc_add(bdev, q.get_start(), q.get_len());
     }
   }
-  _flush_log();
+  _flush_log(l);
 
   // write supers
   super.log_fnode = log_file->fnode;
@@ -310,7 +338,7 @@ int BlueFS::_write_super()
   bl.append_zero(get_super_length() - bl.length());
   bl.rebuild();
 
-  IOContext ioc(NULL);
+  IOContext ioc(NULL, BDEV_PRIO_KV);
   bdev[0]->aio_write(get_super_offset(), bl, &ioc, false);
   bdev[0]->aio_submit(&ioc);
   ioc.aio_wait();
@@ -367,6 +395,7 @@ int BlueFS::_replay()
   while (true) {
     assert((log_reader->buf.pos & ~super.block_mask()) == 0);
     uint64_t pos = log_reader->buf.pos;
+    uint64_t jump_to = 0;
     bufferlist bl;
     {
       int r = _read(log_reader, &log_reader->buf, pos, super.block_size,
@@ -448,6 +477,22 @@ int BlueFS::_replay()
 	}
 	break;
 
+      case bluefs_transaction_t::OP_JUMP:
+        {
+	  uint64_t next_seq;
+	  uint64_t offset;
+	  ::decode(next_seq, p);
+	  ::decode(offset, p);
+	  dout(20) << __func__ << " " << pos << ":  op_jump seq " << next_seq
+		   << " offset " << offset << dendl;
+	  assert(next_seq >= log_seq);
+	  assert((offset & ~super.block_mask()) == 0);
+	  assert(offset >= log_reader->buf.pos);
+	  log_seq = next_seq - 1; // we will increment it below
+	  jump_to = offset;
+	}
+	break;
+
       case bluefs_transaction_t::OP_ALLOC_ADD:
         {
 	  __u8 id;
@@ -575,6 +620,10 @@ int BlueFS::_replay()
 
     // we successfully replayed the transaction; bump the seq and log size
     ++log_seq;
+    if (jump_to) {
+      dout(10) << __func__ << " " << pos << ": jump to " << jump_to << dendl;
+      log_reader->buf.pos = jump_to;
+    }
     log_file->fnode.size = log_reader->buf.pos;
   }
 
@@ -651,6 +700,9 @@ int BlueFS::_read_random(
     dout(20) << __func__ << " reaching (or past) eof, len clipped to "
 	     << len << dendl;
   }
+  logger->inc(l_bluefs_read_random_bytes, len);
+  _note_prefetched(h, off, len);
+  _maybe_readahead(h, off, len);
 
   int ret = 0;
   while (len > 0) {
@@ -700,6 +752,8 @@ int BlueFS::_read(
   }
   if (outbl)
     outbl->clear();
+  logger->inc(l_bluefs_read_bytes, len);
+  _maybe_readahead(h, off, len);
 
   int ret = 0;
   while (len > 0) {
@@ -721,6 +775,7 @@ int BlueFS::_read(
       }
       dout(20) << __func__ << " fetching " << x_off << "~" << l << " of "
 	       << *p << dendl;
+      _note_prefetched(h, buf->bl_off, l);
       int r = bdev[p->bdev]->read(p->offset + x_off, l, &buf->bl, ioc[p->bdev],
 				  true);
       assert(r == 0);
@@ -758,6 +813,41 @@ int BlueFS::_read(
   return ret;
 }
 
+void BlueFS::_maybe_readahead(FileReader *h, uint64_t off, uint64_t len)
+{
+  if (!h->use_readahead)
+    return;
+  Readahead::extent_t ra = h->readahead.update(off, len, h->file->fnode.size);
+  if (ra.second == 0)
+    return;
+  dout(20) << __func__ << " h " << h << " " << ra.first << "~" << ra.second
+	   << dendl;
+  logger->inc(l_bluefs_readahead_bytes, ra.second);
+  if (ra.first != h->ra_end)
+    h->ra_start = ra.first;
+  h->ra_end = ra.first + ra.second;
+
+  // ask the device to pull it in; this does not wait for the io
+  uint64_t o = ra.first;
+  uint64_t left = ra.second;
+  while (left > 0) {
+    uint64_t x_off = 0;
+    vector<bluefs_extent_t>::iterator p = h->file->fnode.seek(o, &x_off);
+    if (p == h->file->fnode.extents.end())
+      break;
+    uint64_t l = MIN(p->length - x_off, left);
+    bdev[p->bdev]->prefetch(p->offset + x_off, l);
+    o += l;
+    left -= l;
+  }
+}
+
+void BlueFS::_note_prefetched(FileReader *h, uint64_t off, uint64_t len)
+{
+  if (len && off >= h->ra_start && off + len <= h->ra_end)
+    logger->inc(l_bluefs_readahead_hit_bytes, len);
+}
+
 void BlueFS::_invalidate_cache(FileRef f, uint64_t offset, uint64_t length)
 {
   dout(10) << __func__ << " file " << f->fnode
@@ -790,8 +880,12 @@ uint64_t BlueFS::_estimate_log_size()
   return ROUND_UP_TO(size, super.block_size);
 }
 
-void BlueFS::_maybe_compact_log()
+void BlueFS::_maybe_compact_log(std::unique_lock<std::mutex>& l)
 {
+  if (new_log_writer) {
+    dout(10) << __func__ << " async compaction already in progress" << dendl;
+    return;
+  }
   uint64_t current = log_writer->file->fnode.size;
   uint64_t expected = _estimate_log_size();
   float ratio = (float)current / (float)expected;
@@ -801,51 +895,59 @@ void BlueFS::_maybe_compact_log()
   if (current < g_conf->bluefs_log_compact_min_size ||
       ratio < g_conf->bluefs_log_compact_min_ratio)
     return;
-  _compact_log();
+  utime_t start = ceph_clock_now(NULL);
+  if (g_conf->bluefs_compact_log_sync) {
+    _compact_log_sync();
+  } else {
+    _compact_log_async(l);
+  }
+  logger->inc(l_bluefs_log_compactions);
+  logger->tinc(l_bluefs_log_compaction_lat, ceph_clock_now(NULL) - start);
   dout(20) << __func__ << " done, actual " << log_writer->file->fnode.size
 	   << " vs expected " << expected << dendl;
 }
 
-void BlueFS::_compact_log()
+void BlueFS::_compact_log_dump_metadata(bluefs_transaction_t *t)
 {
-  // FIXME: we currently hold the lock while writing out the compacted log,
-  // which may mean a latency spike.  we could drop the lock while writing out
-  // the big compacted log, while continuing to log at the end of the old log
-  // file, and once it's done swap out the old log extents for the new ones.
-  dout(10) << __func__ << dendl;
-  File *log_file = log_writer->file.get();
-
-  // clear out log (be careful who calls us!!!)
-  log_t.clear();
-
-  bluefs_transaction_t t;
-  t.seq = 1;
-  t.uuid = super.uuid;
+  t->seq = 1;
+  t->uuid = super.uuid;
   dout(20) << __func__ << " op_init" << dendl;
-  t.op_init();
+  t->op_init();
   for (unsigned bdev = 0; bdev < block_all.size(); ++bdev) {
     interval_set<uint64_t>& p = block_all[bdev];
     for (interval_set<uint64_t>::iterator q = p.begin(); q != p.end(); ++q) {
       dout(20) << __func__ << " op_alloc_add " << bdev << " " << q.get_start()
 	       << "~" << q.get_len() << dendl;
-      t.op_alloc_add(bdev, q.get_start(), q.get_len());
+      t->op_alloc_add(bdev, q.get_start(), q.get_len());
     }
   }
   for (auto& p : file_map) {
     if (p.first == 1)
       continue;
     dout(20) << __func__ << " op_file_update " << p.second->fnode << dendl;
-    t.op_file_update(p.second->fnode);
+    t->op_file_update(p.second->fnode);
   }
   for (auto& p : dir_map) {
     dout(20) << __func__ << " op_dir_create " << p.first << dendl;
-    t.op_dir_create(p.first);
+    t->op_dir_create(p.first);
     for (auto& q : p.second->file_map) {
       dout(20) << __func__ << " op_dir_link " << p.first << "/" << q.first
 	       << " to " << q.second->fnode.ino << dendl;
-      t.op_dir_link(p.first, q.first, q.second->fnode.ino);
+      t->op_dir_link(p.first, q.first, q.second->fnode.ino);
     }
   }
+}
+
+void BlueFS::_compact_log_sync()
+{
+  dout(10) << __func__ << dendl;
+  File *log_file = log_writer->file.get();
+
+  // clear out log (be careful who calls us!!!)
+  log_t.clear();
+
+  bluefs_transaction_t t;
+  _compact_log_dump_metadata(&t);
   dout(20) << __func__ << " op_jump_seq " << log_seq << dendl;
   t.op_jump_seq(log_seq);
 
@@ -886,6 +988,124 @@ void BlueFS::_compact_log()
   }
 }
 
+/*
+ * Compact the log without blocking other log writers for the duration.
+ *
+ *  1. Give the current log fresh runway and log a jump to its start,
+ *     at old_log_jump_to.  Everything logged from here on lands there.
+ *  2. Encode the metadata as of that jump, ending with a jump to
+ *     new_log_jump_to, and write it to newly allocated extents with the
+ *     lock dropped.  Writers keep appending to the old log meanwhile.
+ *  3. Retake the lock and build the new log file: the compacted extents,
+ *     followed by the old log's extents from old_log_jump_to on.
+ *  4. Point the super at it, and release the old log's head.
+ *
+ * The log's extents may not be extended while the compacted log is being
+ * written (we would log the old layout), so _flush_log waits if it runs
+ * low on runway.  A crash before step 4 simply replays the old log.
+ */
+void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
+{
+  dout(10) << __func__ << dendl;
+  File *log_file = log_writer->file.get();
+  assert(!new_log);
+  assert(!new_log_writer);
+
+  // 1. allocate new runway for the old log, and jump to it
+  old_log_jump_to = log_file->fnode.get_allocated();
+  uint64_t need = old_log_jump_to + g_conf->bluefs_max_log_runway;
+  dout(10) << __func__ << " old_log_jump_to " << old_log_jump_to
+	   << " need " << need << dendl;
+  while (log_file->fnode.get_allocated() < need) {
+    int r = _allocate(log_file->fnode.prefer_bdev,
+		      need - log_file->fnode.get_allocated(),
+		      &log_file->fnode.extents);
+    assert(r == 0);
+  }
+  log_t.op_file_update(log_file->fnode);
+  _flush_log(l, old_log_jump_to);
+
+  // 2. encode the compacted log, and write it out
+  bluefs_transaction_t t;
+  _compact_log_dump_metadata(&t);
+  // conservative estimate of the encoded, padded size
+  new_log_jump_to = ROUND_UP_TO(t.op_bl.length() + super.block_size * 2,
+				g_conf->bluefs_alloc_size);
+  dout(20) << __func__ << " op_jump seq " << log_seq
+	   << " offset " << new_log_jump_to << dendl;
+  t.op_jump(log_seq, new_log_jump_to);
+
+  bufferlist bl;
+  ::encode(t, bl);
+  _pad_bl(bl);
+  assert(bl.length() <= new_log_jump_to);
+
+  new_log = new File;
+  new_log->fnode.ino = 0;   // not in file_map, never logged
+  new_log->fnode.prefer_bdev = log_file->fnode.prefer_bdev;
+  int r = _allocate(new_log->fnode.prefer_bdev, new_log_jump_to,
+		    &new_log->fnode.extents);
+  assert(r == 0);
+  assert(new_log->fnode.get_allocated() == new_log_jump_to);
+  new_log->fnode.size = bl.length();
+  new_log_writer = new FileWriter(new_log, bdev.size(),
+				  BDEV_PRIO_BACKGROUND);
+  new_log_writer->append(bl);
+  r = _flush(new_log_writer, true);
+  assert(r == 0);
+
+  l.unlock();
+  _flush_wait(new_log_writer);
+  _flush_bdev();
+  l.lock();
+
+  // 3. swap the head of the old log for the compacted log
+  dout(10) << __func__ << " old log " << log_file->fnode << dendl;
+  vector<bluefs_extent_t> old_extents;
+  vector<bluefs_extent_t>& ev = log_file->fnode.extents;
+  uint64_t discarded = 0;
+  while (discarded < old_log_jump_to) {
+    assert(!ev.empty());
+    bluefs_extent_t& e = ev.front();
+    uint64_t len = MIN((uint64_t)e.length, old_log_jump_to - discarded);
+    old_extents.push_back(bluefs_extent_t(e.bdev, e.offset, len));
+    discarded += len;
+    if (len == e.length) {
+      ev.erase(ev.begin());
+    } else {
+      e.offset += len;
+      e.length -= len;
+    }
+  }
+  new_log->fnode.extents.insert(new_log->fnode.extents.end(),
+				ev.begin(), ev.end());
+  ev.swap(new_log->fnode.extents);
+  assert(log_writer->pos >= old_log_jump_to);
+  log_file->fnode.size =
+    log_file->fnode.size - old_log_jump_to + new_log_jump_to;
+  log_writer->pos = log_writer->pos - old_log_jump_to + new_log_jump_to;
+  dout(10) << __func__ << " new log " << log_file->fnode << dendl;
+
+  // 4. write the super
+  dout(10) << __func__ << " writing super" << dendl;
+  super.log_fnode = log_file->fnode;
+  ++super.version;
+  _write_super();
+  _flush_bdev();
+
+  dout(10) << __func__ << " release old log extents " << old_extents << dendl;
+  for (auto& r : old_extents) {
+    alloc[r.bdev]->release(r.offset, r.length);
+  }
+
+  _close_writer(new_log_writer);
+  new_log_writer = NULL;
+  new_log = NULL;
+  old_log_jump_to = 0;
+  new_log_jump_to = 0;
+  log_cond.notify_all();
+}
+
 void BlueFS::_pad_bl(bufferlist& bl)
 {
   uint64_t partial = bl.length() % super.block_size;
@@ -896,12 +1116,33 @@ void BlueFS::_pad_bl(bufferlist& bl)
   }
 }
 
-int BlueFS::_flush_log()
+void BlueFS::_wait_for_log_runway(std::unique_lock<std::mutex>& l)
+{
+  while (new_log_writer &&
+	 log_writer->file->fnode.get_allocated() - log_writer->pos <
+	 g_conf->bluefs_min_log_runway) {
+    dout(10) << __func__ << " waiting for async compaction" << dendl;
+    log_cond.wait(l);
+  }
+}
+
+int BlueFS::_flush_log(std::unique_lock<std::mutex>& l, uint64_t jump_to)
 {
+  // we can't extend the log while a compaction is swapping its extents
+  _wait_for_log_runway(l);
+  if (log_t.empty()) {
+    dout(10) << __func__ << " flushed while we waited" << dendl;
+    return 0;
+  }
+
   log_t.seq = ++log_seq;
   log_t.uuid = super.uuid;
+  if (jump_to) {
+    dout(10) << __func__ << " op_jump seq " << log_seq
+	     << " offset " << jump_to << dendl;
+    log_t.op_jump(log_seq, jump_to);
+  }
   dout(10) << __func__ << " " << log_t << dendl;
-  assert(!log_t.empty());
 
   // allocate some more space (before we run out)?
   uint64_t runway = log_writer->file->fnode.get_allocated() - log_writer->pos;
@@ -931,6 +1172,14 @@ int BlueFS::_flush_log()
   _flush_wait(log_writer);
   _flush_bdev();
 
+  if (jump_to) {
+    dout(10) << __func__ << " jumping log offset from " << log_writer->pos
+	     << " to " << jump_to << dendl;
+    assert(log_writer->pos <= jump_to);
+    log_writer->pos = jump_to;
+    log_writer->file->fnode.size = jump_to;
+  }
+
   // clean dirty files
   dirty_file_list_t::iterator p = dirty_files.begin();
   while (p != dirty_files.end()) {
@@ -980,10 +1229,15 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
   }
   if (must_dirty) {
     h->file->fnode.mtime = ceph_clock_now(NULL);
-    log_t.op_file_update(h->file->fnode);
-    if (!h->file->dirty) {
-      h->file->dirty = true;
-      dirty_files.push_back(*h->file);
+    // the log's own extents are logged by _flush_log, and its size is
+    // found by replay; logging them here would capture a layout that
+    // async compaction is about to replace.
+    if (h->file->fnode.ino > 1) {
+      log_t.op_file_update(h->file->fnode);
+      if (!h->file->dirty) {
+	h->file->dirty = true;
+	dirty_files.push_back(*h->file);
+      }
     }
   }
   dout(20) << __func__ << " file now " << h->file->fnode << dendl;
@@ -1118,7 +1372,7 @@ int BlueFS::_truncate(FileWriter *h, uint64_t offset)
   return 0;
 }
 
-void BlueFS::_fsync(FileWriter *h)
+void BlueFS::_fsync(FileWriter *h, std::unique_lock<std::mutex>& l)
 {
   dout(10) << __func__ << " " << h << " " << h->file->fnode << dendl;
   _flush(h, true);
@@ -1126,7 +1380,7 @@ void BlueFS::_fsync(FileWriter *h)
   if (h->file->dirty) {
     dout(20) << __func__ << " file metadata is dirty, flushing log on "
 	     << h->file->fnode << dendl;
-    _flush_log();
+    _flush_log(l);
     assert(!h->file->dirty);
   }
 }
@@ -1200,7 +1454,10 @@ int BlueFS::_preallocate(FileRef f, uint64_t off, uint64_t len)
 
 void BlueFS::sync_metadata()
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::unique_lock<std::mutex> l(lock);
+  // wait here rather than in _flush_log, between commit_start and
+  // commit_finish, where another sync could then get in
+  _wait_for_log_runway(l);
   if (log_t.empty()) {
     dout(10) << __func__ << " - no pending log events" << dendl;
     return;
@@ -1210,11 +1467,11 @@ void BlueFS::sync_metadata()
   for (auto p : alloc) {
     p->commit_start();
   }
-  _flush_log();
+  _flush_log(l);
   for (auto p : alloc) {
     p->commit_finish();
   }
-  _maybe_compact_log();
+  _maybe_compact_log(l);
   utime_t end = ceph_clock_now(NULL);
   utime_t dur = end - start;
   dout(10) << __func__ << " done in " << dur << dendl;
@@ -1298,7 +1555,13 @@ int BlueFS::open_for_write(
   if (create)
     log_t.op_dir_link(dirname, filename, file->fnode.ino);
 
-  *h = new FileWriter(file, bdev.size());
+  // sst files are written by rocksdb flushes and compactions, off the
+  // commit path
+  int prio = BDEV_PRIO_KV;
+  if (filename.length() > 4 &&
+      filename.compare(filename.length() - 4, 4, ".sst") == 0)
+    prio = BDEV_PRIO_BACKGROUND;
+  *h = new FileWriter(file, bdev.size(), prio);
   dout(10) << __func__ << " h " << *h << " on " << file->fnode << dendl;
   return 0;
 }
@@ -1341,6 +1604,14 @@ int BlueFS::open_for_read(
 
   *h = new FileReader(file, random ? 4096 : g_conf->bluefs_max_prefetch,
 		      random, false);
+  if (g_conf->bluefs_readahead) {
+    // random readers only prefetch once they have shown a sequential run
+    (*h)->use_readahead = true;
+    (*h)->readahead.set_trigger_requests(
+      random ? g_conf->bluefs_readahead_trigger_requests : 1);
+    (*h)->readahead.set_min_readahead_size(g_conf->bluefs_readahead_min);
+    (*h)->readahead.set_max_readahead_size(g_conf->bluefs_readahead_max);
+  }
   dout(10) << __func__ << " h " << *h << " on " << file->fnode << dendl;
   return 0;
 }
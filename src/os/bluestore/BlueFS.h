@@ -4,16 +4,30 @@
 #define CEPH_OS_BLUESTORE_BLUEFS_H
 
 #include <atomic>
+#include <condition_variable>
 #include <mutex>
 
 #include "bluefs_types.h"
 #include "common/RefCountedObj.h"
+#include "common/Readahead.h"
 #include "BlockDevice.h"
 
 #include "boost/intrusive/list.hpp"
 #include <boost/intrusive_ptr.hpp>
 
 class Allocator;
+class PerfCounters;
+
+enum {
+  l_bluefs_first = 732600,
+  l_bluefs_read_bytes,
+  l_bluefs_read_random_bytes,
+  l_bluefs_readahead_bytes,
+  l_bluefs_readahead_hit_bytes,
+  l_bluefs_log_compactions,
+  l_bluefs_log_compaction_lat,
+  l_bluefs_last,
+};
 
 class BlueFS {
 public:
@@ -82,13 +96,13 @@ public:
     std::mutex lock;
     vector<IOContext*> iocv;  ///< one for each bdev
 
-    FileWriter(FileRef f, unsigned num_bdev)
+    FileWriter(FileRef f, unsigned num_bdev, int prio = BDEV_PRIO_KV)
       : file(f),
 	pos(0) {
       ++file->num_writers;
       iocv.resize(num_bdev);
       for (unsigned i = 0; i < num_bdev; ++i) {
-	iocv[i] = new IOContext(NULL);
+	iocv[i] = new IOContext(NULL, prio);
       }
     }
     ~FileWriter() {
@@ -141,11 +155,18 @@ public:
     bool random;
     bool ignore_eof;        ///< used when reading our log file
 
+    Readahead readahead;    ///< spots sequential streams (even in random files)
+    bool use_readahead;     ///< false if hinted random
+    std::atomic<uint64_t> ra_start, ra_end;  ///< window we have prefetched
+
     FileReader(FileRef f, uint64_t mpf, bool rand, bool ie)
       : file(f),
 	buf(mpf),
 	random(rand),
-	ignore_eof(ie) {
+	ignore_eof(ie),
+	use_readahead(false),
+	ra_start(0),
+	ra_end(0) {
       ++file->num_readers;
     }
     ~FileReader() {
@@ -161,6 +182,8 @@ public:
 private:
   std::mutex lock;
 
+  PerfCounters *logger;
+
   // cache
   map<string, DirRef> dir_map;                    ///< dirname -> Dir
   ceph::unordered_map<uint64_t,FileRef> file_map; ///< ino -> File
@@ -172,6 +195,13 @@ private:
   FileWriter *log_writer;     ///< writer for the log
   bluefs_transaction_t log_t; ///< pending, unwritten log transaction
 
+  // async log compaction
+  std::condition_variable log_cond; ///< signaled when compaction finishes
+  FileRef new_log;                  ///< compacted log being written
+  FileWriter *new_log_writer;       ///< writer for new_log
+  uint64_t new_log_jump_to;         ///< where new_log jumps into the old log
+  uint64_t old_log_jump_to;         ///< where the old log continues
+
   /*
    * - there can be from 1 to 3 block devices.
    *
@@ -204,12 +234,15 @@ private:
   int _flush_range(FileWriter *h, uint64_t offset, uint64_t length);
   int _flush(FileWriter *h, bool force);
   void _flush_wait(FileWriter *h);
-  void _fsync(FileWriter *h);
+  void _fsync(FileWriter *h, std::unique_lock<std::mutex>& l);
 
-  int _flush_log();
+  void _wait_for_log_runway(std::unique_lock<std::mutex>& l);
+  int _flush_log(std::unique_lock<std::mutex>& l, uint64_t jump_to = 0);
   uint64_t _estimate_log_size();
-  void _maybe_compact_log();
-  void _compact_log();
+  void _maybe_compact_log(std::unique_lock<std::mutex>& l);
+  void _compact_log_dump_metadata(bluefs_transaction_t *t);
+  void _compact_log_sync();
+  void _compact_log_async(std::unique_lock<std::mutex>& l);
 
   //void _aio_finish(void *priv);
 
@@ -231,6 +264,9 @@ private:
     size_t len,      ///< [in] this many bytes
     char *out);      ///< [out] optional: or copy it here
 
+  void _maybe_readahead(FileReader *h, uint64_t offset, uint64_t len);
+  void _note_prefetched(FileReader *h, uint64_t offset, uint64_t len);
+
   void _invalidate_cache(FileRef f, uint64_t offset, uint64_t length);
 
   int _open_super();
@@ -239,6 +275,9 @@ private:
 
   void _close_writer(FileWriter *h);
 
+  void _init_logger();
+  void _shutdown_logger();
+
   // always put the super in the second 4k block.  FIXME should this be
   // block size independent?
   unsigned get_super_offset() {
@@ -263,6 +302,10 @@ public:
   uint64_t get_free(unsigned id);
   void get_usage(vector<pair<uint64_t,uint64_t>> *usage); // [<free,total> ...]
 
+  const PerfCounters *get_perf_counters() const {
+    return logger;
+  }
+
   /// get current extents that we own for given block device
   int get_block_extents(unsigned id, interval_set<uint64_t> *extents);
 
@@ -326,8 +369,8 @@ public:
     _flush_range(h, offset, length);
   }
   void fsync(FileWriter *h) {
-    std::lock_guard<std::mutex> l(lock);
-    _fsync(h);
+    std::unique_lock<std::mutex> l(lock);
+    _fsync(h, l);
   }
   int read(FileReader *h, FileReaderBuffer *buf, uint64_t offset, size_t len,
 	   bufferlist *outbl, char *out) {
@@ -130,10 +130,14 @@ class BlueRocksRandomAccessFile : public rocksdb::RandomAccessFile {
   //enum AccessPattern { NORMAL, RANDOM, SEQUENTIAL, WILLNEED, DONTNEED };
 
   void Hint(AccessPattern pattern) {
-    if (pattern == RANDOM)
+    if (pattern == RANDOM) {
       h->buf.max_prefetch = 4096;
-    else if (pattern == SEQUENTIAL)
+      h->use_readahead = false;
+    } else if (pattern == SEQUENTIAL) {
       h->buf.max_prefetch = g_conf->bluefs_max_prefetch;
+      h->use_readahead = g_conf->bluefs_readahead;
+      h->readahead.set_trigger_requests(1);
+    }
   }
 
   // Remove any kind of caching of data from the offset to offset+length
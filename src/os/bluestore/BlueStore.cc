@@ -18,6 +18,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <thread>
 
 #include "BlueStore.h"
 #include "kv.h"
@@ -25,6 +26,7 @@
 #include "include/stringify.h"
 #include "common/errno.h"
 #include "common/safe_io.h"
+#include "common/admin_socket.h"
 #include "Allocator.h"
 #include "FreelistManager.h"
 #include "BlueFS.h"
@@ -63,6 +65,8 @@ const string PREFIX_OVERLAY = "V"; // u64 + offset -> data
 const string PREFIX_OMAP = "M";    // u64 + keyname -> value
 const string PREFIX_WAL = "L";     // id -> wal_transaction_t
 const string PREFIX_ALLOC = "B";   // u64 offset -> u64 length (freelist)
+const string PREFIX_ALLOC_SNAP = "b"; // snapshot of the freelist
+const string PREFIX_EXTENT = "X";  // u64 nid + u64 offset -> extent/csum shard
 
 // write a label in the first block.  always use this size.  note that
 // bluefs makes a matching assumption about the location of its
@@ -410,6 +414,12 @@ static void get_overlay_key(uint64_t nid, uint64_t offset, string *out)
   _key_encode_u64(offset, out);
 }
 
+static void get_extent_shard_key(uint64_t nid, uint64_t offset, string *out)
+{
+  _key_encode_u64(nid, out);
+  _key_encode_u64(offset, out);
+}
+
 // '-' < '.' < '~'
 static void get_omap_header(uint64_t id, string *out)
 {
@@ -467,6 +477,17 @@ void BlueStore::Enode::put()
 #undef dout_prefix
 #define dout_prefix *_dout << "bluestore.onode(" << this << ") "
 
+BlueStore::Onode::Onode(OnodeSpace *s, const ghobject_t& o, const string& k)
+  : nref(0),
+    space(s),
+    oid(o),
+    key(k),
+    cache_bytes(sizeof(Onode)),
+    exists(false),
+    bc(s->cache)
+{
+}
+
 void BlueStore::Onode::flush()
 {
   std::unique_lock<std::mutex> l(flush_lock);
@@ -476,53 +497,438 @@ void BlueStore::Onode::flush()
   dout(20) << __func__ << " done" << dendl;
 }
 
-// OnodeHashLRU
+void BlueStore::Onode::dirty_extents(uint64_t offset, uint64_t length)
+{
+  if (!onode.extent_map_shard_size || !length)
+    return;
+  // an extent that starts in an earlier shard may be split or trimmed
+  auto p = onode.seek_extent(offset);
+  uint64_t start = offset;
+  if (p != onode.block_map.end() && p->first < start)
+    start = p->first;
+  uint64_t last = onode.get_extent_shard(offset + length - 1);
+  for (uint64_t s = onode.get_extent_shard(start); s <= last;
+       s += onode.extent_map_shard_size)
+    dirty_extent_shards.insert(s);
+}
+
+void BlueStore::Onode::dirty_all_extents()
+{
+  if (!onode.extent_map_shard_size)
+    return;
+  for (auto& p : onode.extent_map_shards)
+    dirty_extent_shards.insert(p.first);
+  for (auto& p : onode.block_map)
+    dirty_extent_shards.insert(onode.get_extent_shard(p.first));
+  unsigned count = onode.get_csum_count();
+  if (count)
+    dirty_csum(0, count * onode.get_csum_chunk_size());
+}
+
+void BlueStore::Onode::dirty_csum(uint64_t offset, uint64_t length)
+{
+  if (!onode.extent_map_shard_size || !onode.has_csum() || !length)
+    return;
+  // csum_write() also invalidates the chunks from the old eof (or the
+  // last chunk with a value) up to offset
+  uint64_t chunk = onode.get_csum_chunk_size();
+  uint64_t end = offset + length;
+  uint64_t start = MIN(offset, onode.size);
+  start = MIN(start, (uint64_t)onode.get_csum_count() * chunk);
+  start -= start % chunk;
+  uint64_t last = onode.get_extent_shard(end - 1);
+  for (uint64_t s = onode.get_extent_shard(start); s <= last;
+       s += onode.extent_map_shard_size)
+    dirty_extent_shards.insert(s);
+}
+
+// Buffer
+
+static ostream& operator<<(ostream& out, const BlueStore::Buffer& b)
+{
+  return out << "buffer(" << BlueStore::Buffer::get_level_name(b.level)
+	     << " " << b.offset << "~" << b.length << ")";
+}
+
+// BufferSpace
+
+#undef dout_prefix
+#define dout_prefix *_dout << "bluestore.BufferSpace(" << this << ") "
+
+BlueStore::BufferSpace::~BufferSpace()
+{
+  clear();
+}
+
+void BlueStore::BufferSpace::_add_buffer(Buffer *b, Buffer *near)
+{
+  cache->_add_buffer(b, near);
+  buffer_map[b->offset].reset(b);
+}
+
+void BlueStore::BufferSpace::_rm_buffer(buffer_map_t::iterator p)
+{
+  cache->_rm_buffer(p->second.get());
+  buffer_map.erase(p);
+}
+
+int BlueStore::BufferSpace::_discard(uint64_t offset, uint64_t length)
+{
+  dout(20) << __func__ << " " << offset << "~" << length << dendl;
+  int level = Buffer::LEVEL_WARM_IN;
+  uint64_t end = offset + length;
+  auto i = _data_lower_bound(offset);
+  while (i != buffer_map.end()) {
+    Buffer *b = i->second.get();
+    if (b->offset >= end) {
+      break;
+    }
+    if (b->level != Buffer::LEVEL_WARM_IN) {
+      // seen before (ghost) or already hot: the range is being re-referenced
+      level = Buffer::LEVEL_HOT;
+    }
+    if (b->offset < offset) {
+      uint64_t front = offset - b->offset;
+      if (b->end() > end) {
+	// drop the middle; the tail becomes a new buffer
+	uint64_t tail = b->end() - end;
+	Buffer *nb;
+	if (b->is_ghost()) {
+	  nb = new Buffer(this, b->level, end, tail);
+	} else {
+	  bufferlist t;
+	  t.substr_of(b->data, b->length - tail, tail);
+	  nb = new Buffer(this, b->level, end, t);
+	}
+	_add_buffer(nb, b);
+      }
+      cache->_adjust_buffer_size(b, (int64_t)front - (int64_t)b->length);
+      b->truncate(front);
+      ++i;
+      continue;
+    }
+    if (b->end() <= end) {
+      _rm_buffer(i++);
+      continue;
+    }
+    // drop the front
+    uint64_t keep = b->end() - end;
+    Buffer *nb;
+    if (b->is_ghost()) {
+      nb = new Buffer(this, b->level, end, keep);
+    } else {
+      bufferlist t;
+      t.substr_of(b->data, b->length - keep, keep);
+      nb = new Buffer(this, b->level, end, t);
+    }
+    _add_buffer(nb, b);
+    _rm_buffer(i);
+    break;
+  }
+  return level;
+}
+
+void BlueStore::BufferSpace::_add_data(uint64_t offset, const bufferlist& bl)
+{
+  int level = _discard(offset, bl.length());
+  Buffer *b = new Buffer(this, level, offset, bl);
+  dout(20) << __func__ << " " << *b << dendl;
+  _add_buffer(b, nullptr);
+}
+
+void BlueStore::BufferSpace::discard(uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  _discard(offset, length);
+}
+
+void BlueStore::BufferSpace::write(uint64_t offset, const bufferlist& bl)
+{
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  _add_data(offset, bl);
+}
+
+void BlueStore::BufferSpace::did_read(uint64_t offset, const bufferlist& bl)
+{
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  _add_data(offset, bl);
+}
+
+void BlueStore::BufferSpace::read(uint64_t offset, uint64_t length,
+				  map<uint64_t,bufferlist>& res)
+{
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  uint64_t end = offset + length;
+  for (auto i = _data_lower_bound(offset);
+       i != buffer_map.end() && i->second->offset < end;
+       ++i) {
+    Buffer *b = i->second.get();
+    if (b->is_ghost()) {
+      continue;
+    }
+    uint64_t s = MAX(offset, b->offset);
+    uint64_t e = MIN(end, b->end());
+    dout(30) << __func__ << " hit " << *b << " use " << s << "~" << e - s
+	     << dendl;
+    res[s].substr_of(b->data, s - b->offset, e - s);
+    cache->_touch_buffer(b);
+  }
+}
+
+void BlueStore::BufferSpace::truncate(uint64_t offset)
+{
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  dout(20) << __func__ << " " << offset << dendl;
+  auto i = _data_lower_bound(offset);
+  while (i != buffer_map.end()) {
+    Buffer *b = i->second.get();
+    if (b->offset >= offset) {
+      _rm_buffer(i++);
+      continue;
+    }
+    uint64_t keep = offset - b->offset;
+    cache->_adjust_buffer_size(b, (int64_t)keep - (int64_t)b->length);
+    b->truncate(keep);
+    ++i;
+  }
+}
+
+void BlueStore::BufferSpace::clear()
+{
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  while (!buffer_map.empty()) {
+    _rm_buffer(buffer_map.begin());
+  }
+}
+
+// Cache
 
 #undef dout_prefix
-#define dout_prefix *_dout << "bluestore.lru(" << this << ") "
+#define dout_prefix *_dout << "bluestore.Cache(" << this << ") "
+
+BlueStore::Cache::buffer_list_t& BlueStore::Cache::_buffer_list(int level)
+{
+  switch (level) {
+  case Buffer::LEVEL_WARM_IN:
+    return buffer_warm_in;
+  case Buffer::LEVEL_WARM_OUT:
+    return buffer_warm_out;
+  case Buffer::LEVEL_HOT:
+    return buffer_hot;
+  }
+  assert(0 == "bad buffer level");
+}
+
+void BlueStore::Cache::_account(Buffer *b, int64_t delta)
+{
+  switch (b->level) {
+  case Buffer::LEVEL_WARM_IN:
+    buffer_warm_in_bytes += delta;
+    buffer_bytes += delta;
+    break;
+  case Buffer::LEVEL_WARM_OUT:
+    buffer_warm_out_bytes += delta;
+    return;
+  case Buffer::LEVEL_HOT:
+    buffer_bytes += delta;
+    break;
+  }
+  if (delta > 0)
+    logger->inc(l_bluestore_buffer_bytes, delta);
+  else
+    logger->dec(l_bluestore_buffer_bytes, -delta);
+}
+
+void BlueStore::Cache::_add_onode(Onode *o)
+{
+  onode_lru.push_front(*o);
+  onode_bytes += o->cache_bytes;
+  logger->inc(l_bluestore_onodes);
+}
+
+void BlueStore::Cache::_rm_onode(Onode *o)
+{
+  onode_lru.erase(onode_lru.iterator_to(*o));
+  onode_bytes -= o->cache_bytes;
+  logger->dec(l_bluestore_onodes);
+}
+
+void BlueStore::Cache::_touch_onode(Onode *o)
+{
+  onode_lru.erase(onode_lru.iterator_to(*o));
+  onode_lru.push_front(*o);
+}
+
+void BlueStore::Cache::set_onode_bytes(Onode *o, uint64_t bytes)
+{
+  std::lock_guard<std::recursive_mutex> l(lock);
+  if (o->lru_item.is_linked()) {
+    onode_bytes -= o->cache_bytes;
+    onode_bytes += bytes;
+  }
+  o->cache_bytes = bytes;
+}
+
+void BlueStore::Cache::_add_buffer(Buffer *b, Buffer *near)
+{
+  buffer_list_t& l = _buffer_list(b->level);
+  if (near) {
+    assert(near->level == b->level);
+    l.insert(++l.iterator_to(*near), *b);
+  } else {
+    l.push_front(*b);
+  }
+  _account(b, b->length);
+  logger->inc(l_bluestore_buffers);
+}
+
+void BlueStore::Cache::_rm_buffer(Buffer *b)
+{
+  buffer_list_t& l = _buffer_list(b->level);
+  l.erase(l.iterator_to(*b));
+  _account(b, -(int64_t)b->length);
+  logger->dec(l_bluestore_buffers);
+}
+
+void BlueStore::Cache::_touch_buffer(Buffer *b)
+{
+  // 2Q: warm_in is a fifo; only hot buffers move on a hit
+  if (b->level == Buffer::LEVEL_HOT) {
+    buffer_hot.erase(buffer_hot.iterator_to(*b));
+    buffer_hot.push_front(*b);
+  }
+}
+
+void BlueStore::Cache::_adjust_buffer_size(Buffer *b, int64_t delta)
+{
+  assert(b->lru_item.is_linked());
+  _account(b, delta);
+}
 
-void BlueStore::OnodeHashLRU::_touch(OnodeRef o)
+void BlueStore::Cache::_evict_to_ghost(Buffer *b)
 {
-  lru_list_t::iterator p = lru.iterator_to(*o);
-  lru.erase(p);
-  lru.push_front(*o);
+  assert(b->level == Buffer::LEVEL_WARM_IN);
+  _account(b, -(int64_t)b->length);
+  buffer_warm_in.erase(buffer_warm_in.iterator_to(*b));
+  b->data.clear();
+  b->level = Buffer::LEVEL_WARM_OUT;
+  buffer_warm_out.push_front(*b);
+  _account(b, b->length);
+}
+
+void BlueStore::Cache::trim(uint64_t target_bytes, float target_meta_ratio)
+{
+  std::lock_guard<std::recursive_mutex> l(lock);
+
+  // each side may grow into whatever the other side is not using
+  uint64_t target_meta = target_bytes * target_meta_ratio;
+  uint64_t target_buffer = target_bytes - target_meta;
+  uint64_t onode_max = target_bytes - MIN(buffer_bytes, target_buffer);
+  uint64_t buffer_max = target_bytes - MIN(onode_bytes, target_meta);
+
+  dout(20) << __func__ << " onodes " << onode_lru.size()
+	   << " (" << onode_bytes << "/" << onode_max << " bytes)"
+	   << " buffers " << buffer_bytes << "/" << buffer_max
+	   << " (warm_in " << buffer_warm_in_bytes
+	   << " warm_out " << buffer_warm_out_bytes << ")" << dendl;
+
+  // buffers: evict from warm_in until it is down to its share, then hot
+  uint64_t kin = buffer_max * g_conf->bluestore_2q_cache_kin_ratio;
+  while (buffer_bytes > buffer_max) {
+    if (!buffer_warm_in.empty() &&
+	(buffer_warm_in_bytes > kin || buffer_hot.empty())) {
+      Buffer *b = &*buffer_warm_in.rbegin();
+      dout(20) << __func__ << " evict " << *b << " to warm_out" << dendl;
+      logger->inc(l_bluestore_buffer_evicted_bytes, b->length);
+      _evict_to_ghost(b);
+    } else {
+      assert(!buffer_hot.empty());
+      Buffer *b = &*buffer_hot.rbegin();
+      dout(20) << __func__ << " evict " << *b << dendl;
+      logger->inc(l_bluestore_buffer_evicted_bytes, b->length);
+      b->space->_rm_buffer(b->space->buffer_map.find(b->offset));
+    }
+  }
+
+  // ghosts only cost their Buffer, but bound them anyway
+  uint64_t kout = buffer_max * g_conf->bluestore_2q_cache_kout_ratio;
+  while (buffer_warm_out_bytes > kout) {
+    Buffer *b = &*buffer_warm_out.rbegin();
+    dout(20) << __func__ << " rm " << *b << dendl;
+    b->space->_rm_buffer(b->space->buffer_map.find(b->offset));
+  }
+
+  // onodes
+  onode_lru_list_t::iterator p = onode_lru.end();
+  while (onode_bytes > onode_max && p != onode_lru.begin()) {
+    --p;
+    Onode *o = &*p;
+    int refs = o->nref.load();
+    if (refs > 1) {
+      dout(20) << __func__ << "  " << o->oid << " has " << refs
+	       << " refs, skipping" << dendl;
+      continue;
+    }
+    dout(30) << __func__ << "  trim " << o->oid << dendl;
+    ++p;  // o is about to be unlinked
+    _rm_onode(o);
+    o->get();  // paranoia
+    o->space->onode_map.erase(o->oid);
+    o->put();
+  }
 }
 
-void BlueStore::OnodeHashLRU::add(const ghobject_t& oid, OnodeRef o)
+// OnodeSpace
+
+#undef dout_prefix
+#define dout_prefix *_dout << "bluestore.OnodeSpace(" << this << ") "
+
+BlueStore::OnodeRef BlueStore::OnodeSpace::add(const ghobject_t& oid,
+					       OnodeRef o)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
+  auto p = onode_map.find(oid);
+  if (p != onode_map.end()) {
+    dout(30) << __func__ << " " << oid << " " << o
+	     << " raced, returning existing " << p->second << dendl;
+    return p->second;
+  }
   dout(30) << __func__ << " " << oid << " " << o << dendl;
-  assert(onode_map.count(oid) == 0);
   onode_map[oid] = o;
-  lru.push_front(*o);
+  cache->_add_onode(o.get());
+  return o;
 }
 
-BlueStore::OnodeRef BlueStore::OnodeHashLRU::lookup(const ghobject_t& oid)
+BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
   dout(30) << __func__ << dendl;
   ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(oid);
   if (p == onode_map.end()) {
     dout(30) << __func__ << " " << oid << " miss" << dendl;
+    cache->logger->inc(l_bluestore_onode_misses);
     return OnodeRef();
   }
   dout(30) << __func__ << " " << oid << " hit " << p->second << dendl;
-  _touch(p->second);
+  cache->logger->inc(l_bluestore_onode_hits);
+  cache->_touch_onode(p->second.get());
   return p->second;
 }
 
-void BlueStore::OnodeHashLRU::clear()
+void BlueStore::OnodeSpace::clear()
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
   dout(10) << __func__ << dendl;
-  lru.clear();
+  for (auto& p : onode_map) {
+    cache->_rm_onode(p.second.get());
+  }
   onode_map.clear();
 }
 
-void BlueStore::OnodeHashLRU::rename(const ghobject_t& old_oid,
-				    const ghobject_t& new_oid)
+void BlueStore::OnodeSpace::rename(const ghobject_t& old_oid,
+				   const ghobject_t& new_oid)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
   dout(30) << __func__ << " " << old_oid << " -> " << new_oid << dendl;
   ceph::unordered_map<ghobject_t,OnodeRef>::iterator po, pn;
   po = onode_map.find(old_oid);
@@ -532,90 +938,51 @@ void BlueStore::OnodeHashLRU::rename(const ghobject_t& old_oid,
   assert(po != onode_map.end());
   if (pn != onode_map.end()) {
     dout(30) << __func__ << "  removing target " << pn->second << dendl;
-    lru_list_t::iterator p = lru.iterator_to(*pn->second);
-    lru.erase(p);
+    cache->_rm_onode(pn->second.get());
     onode_map.erase(pn);
   }
   OnodeRef o = po->second;
 
   // install a non-existent onode at old location
-  po->second.reset(new Onode(old_oid, o->key));
-  lru.push_back(*po->second);
+  po->second.reset(new Onode(this, old_oid, o->key));
+  cache->_add_onode(po->second.get());
 
   // add at new position and fix oid, key
   onode_map.insert(make_pair(new_oid, o));
-  _touch(o);
+  cache->_touch_onode(o.get());
   o->oid = new_oid;
   get_object_key(new_oid, &o->key);
 }
 
-bool BlueStore::OnodeHashLRU::get_next(
+bool BlueStore::OnodeSpace::get_next(
   const ghobject_t& after,
   pair<ghobject_t,OnodeRef> *next)
 {
-  std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::recursive_mutex> l(cache->lock);
   dout(20) << __func__ << " after " << after << dendl;
 
+  ceph::unordered_map<ghobject_t,OnodeRef>::iterator p;
   if (after == ghobject_t()) {
-    if (lru.empty()) {
-      return false;
+    p = onode_map.begin();
+  } else {
+    p = onode_map.find(after);
+    if (p == onode_map.end()) {
+      // trimmed out from under the caller (the cache is shared with
+      // other collections); start over.
+      dout(20) << __func__ << " " << after << " is gone, restarting" << dendl;
+      p = onode_map.begin();
+    } else {
+      ++p;
     }
-    ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.begin();
-    assert(p != onode_map.end());
-    next->first = p->first;
-    next->second = p->second;
-    return true;
   }
-
-  ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(after);
-  assert(p != onode_map.end()); // for now
-  lru_list_t::iterator pi = lru.iterator_to(*p->second);
-  ++pi;
-  if (pi == lru.end()) {
+  if (p == onode_map.end()) {
     return false;
   }
-  next->first = pi->oid;
-  next->second = onode_map[pi->oid];
+  next->first = p->first;
+  next->second = p->second;
   return true;
 }
 
-int BlueStore::OnodeHashLRU::trim(int max)
-{
-  std::lock_guard<std::mutex> l(lock);
-  dout(20) << __func__ << " max " << max
-	   << " size " << onode_map.size() << dendl;
-  int trimmed = 0;
-  int num = onode_map.size() - max;
-  if (onode_map.size() == 0 || num <= 0)
-    return 0; // don't even try
-  
-  lru_list_t::iterator p = lru.end();
-  if (num)
-    --p;
-  while (num > 0) {
-    Onode *o = &*p;
-    int refs = o->nref.load();
-    if (refs > 1) {
-      dout(20) << __func__ << "  " << o->oid << " has " << refs
-	       << " refs; stopping with " << num << " left to trim" << dendl;
-      break;
-    }
-    dout(30) << __func__ << "  trim " << o->oid << dendl;
-    if (p != lru.begin()) {
-      lru.erase(p--);
-    } else {
-      lru.erase(p);
-      assert(num == 1);
-    }
-    o->get();  // paranoia
-    onode_map.erase(o->oid);
-    o->put();
-    --num;
-    ++trimmed;
-  }
-  return trimmed;
-}
-
 // =======================================================
 
 // Collection
@@ -623,12 +990,13 @@ int BlueStore::OnodeHashLRU::trim(int max)
 #undef dout_prefix
 #define dout_prefix *_dout << "bluestore(" << store->path << ").collection(" << cid << ") "
 
-BlueStore::Collection::Collection(BlueStore *ns, coll_t c)
+BlueStore::Collection::Collection(BlueStore *ns, Cache *ca, coll_t c)
   : store(ns),
+    cache(ca),
     cid(c),
     lock("BlueStore::Collection::lock", true, false),
     exists(true),
-    onode_map(),
+    onode_map(ca),
     enode_set(g_conf->bluestore_onode_map_size)
 {
 }
@@ -706,18 +1074,37 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
       return OnodeRef();
 
     // new
-    on = new Onode(oid, key);
+    on = new Onode(&onode_map, oid, key);
   } else {
     // loaded
     assert(r >=0);
-    on = new Onode(oid, key);
+    on = new Onode(&onode_map, oid, key);
     on->exists = true;
+    on->cache_bytes += v.length();
     bufferlist::iterator p = v.begin();
     ::decode(on->onode, p);
+    // csums of sharded onodes used to be stored inline; move them out
+    // into the shards on the next write
+    bool inline_csum = on->onode.extent_map_shard_size &&
+      on->onode.get_csum_count();
+    for (auto& s : on->onode.extent_map_shards) {
+      string skey;
+      bufferlist sv;
+      get_extent_shard_key(on->onode.nid, s.first, &skey);
+      r = store->db->get(PREFIX_EXTENT, skey, &sv);
+      dout(20) << __func__ << " oid " << oid << " extent shard " << s.first
+	       << " r " << r << " v.len " << sv.length() << dendl;
+      assert(r >= 0);
+      assert(sv.length() == s.second);
+      bufferlist::iterator q = sv.begin();
+      on->onode.decode_extent_shard(s.first, q);
+      on->cache_bytes += sv.length();
+    }
+    if (inline_csum)
+      on->dirty_all_extents();
   }
   o.reset(on);
-  onode_map.add(oid, o);
-  return o;
+  return onode_map.add(oid, o);
 }
 
 
@@ -734,6 +1121,12 @@ static void aio_cb(void *priv, void *priv2)
   store->_txc_aio_finish(priv2);
 }
 
+static void discard_cb(void *priv, interval_set<uint64_t>& extents)
+{
+  BlueStore *store = static_cast<BlueStore*>(priv);
+  store->_discard_finish(extents);
+}
+
 BlueStore::BlueStore(CephContext *cct, const string& path)
   : ObjectStore(path),
     cct(cct),
@@ -767,16 +1160,33 @@ BlueStore::BlueStore(CephContext *cct, const string& path)
 	     cct->_conf->bluestore_wal_thread_timeout,
 	     cct->_conf->bluestore_wal_thread_suicide_timeout,
 	     &wal_tp),
+    wal_batch_thread(this),
+    wal_batch_stop(false),
+    wal_batch_queue_bytes(0),
     finisher(cct),
     kv_sync_thread(this),
     kv_stop(false),
-    logger(NULL)
+    logger(NULL),
+    asok_hook(NULL),
+    csum_type(bluestore_onode_t::CSUM_NONE),
+    comp_mode(COMP_NONE),
+    comp_alg(bluestore_compressed_t::COMP_ALG_NONE)
 {
   _init_logger();
+  _register_asok();
+  for (int i = 0; i < MAX(1, cct->_conf->bluestore_cache_shards); ++i) {
+    cache_shards.push_back(new Cache(logger));
+  }
 }
 
 BlueStore::~BlueStore()
 {
+  removed_collections.clear();
+  for (auto i : cache_shards) {
+    delete i;
+  }
+  cache_shards.clear();
+  _unregister_asok();
   _shutdown_logger();
   assert(!mounted);
   assert(db == NULL);
@@ -801,6 +1211,31 @@ void BlueStore::_init_logger()
   b.add_time_avg(l_bluestore_state_wal_done_lat, "state_wal_done_lat", "Average wal_done state latency");
   b.add_time_avg(l_bluestore_state_finishing_lat, "state_finishing_lat", "Average finishing state latency");
   b.add_time_avg(l_bluestore_state_done_lat, "state_done_lat", "Average done state latency");
+  b.add_u64(l_bluestore_onodes, "onodes", "Number of onodes in cache");
+  b.add_u64_counter(l_bluestore_onode_hits, "onode_hits", "Sum for onode-lookups hit in the cache");
+  b.add_u64_counter(l_bluestore_onode_misses, "onode_misses", "Sum for onode-lookups missed in the cache");
+  b.add_u64(l_bluestore_buffers, "buffers", "Number of buffers (including ghosts) in cache");
+  b.add_u64(l_bluestore_buffer_bytes, "buffer_bytes", "Bytes of data in buffer cache");
+  b.add_u64_counter(l_bluestore_buffer_hit_bytes, "buffer_hit_bytes", "Sum for bytes of read hit in the cache");
+  b.add_u64_counter(l_bluestore_buffer_miss_bytes, "buffer_miss_bytes", "Sum for bytes of read missed in the cache");
+  b.add_u64_counter(l_bluestore_buffer_evicted_bytes, "buffer_evicted_bytes", "Sum for bytes evicted from the cache");
+  b.add_u64_counter(l_bluestore_read_eio, "read_eio", "Read EIO errors propagated to high level callers");
+  b.add_u64_counter(l_bluestore_compress_success_count, "compress_success_count", "Sum for blobs stored compressed");
+  b.add_u64_counter(l_bluestore_compress_rejected_count, "compress_rejected_count", "Sum for blobs that did not compress well enough");
+  b.add_u64_counter(l_bluestore_compressed_original, "compressed_original", "Sum for original bytes of compressed blobs");
+  b.add_u64_counter(l_bluestore_compressed_allocated, "compressed_allocated", "Sum for bytes allocated for compressed blobs");
+  b.add_u64_counter(l_bluestore_decompress_count, "decompress_count", "Sum for compressed blobs read back");
+  b.add_u64_counter(l_bluestore_wal_batches, "wal_batches", "Sum for wal batches applied");
+  b.add_u64_avg(l_bluestore_wal_batch_txc, "wal_batch_txc", "Average transactions per wal batch");
+  b.add_u64_counter(l_bluestore_wal_write_ops, "wal_write_ops", "Sum for wal writes before merging");
+  b.add_u64_counter(l_bluestore_wal_write_ios, "wal_write_ios", "Sum for wal writes issued after merging");
+  b.add_u64(l_bluestore_fsck_collections, "fsck_collections", "Collections to check in the running fsck");
+  b.add_u64(l_bluestore_fsck_collections_done, "fsck_collections_done", "Collections checked so far by the running fsck");
+  b.add_u64(l_bluestore_fsck_objects, "fsck_objects", "Objects checked so far by the running fsck");
+  b.add_u64_avg(l_bluestore_onode_write_bytes, "onode_write_bytes", "Average onode metadata bytes (onode and extent shards) written per onode update");
+  b.add_u64_counter(l_bluestore_onode_shard_writes, "onode_shard_writes", "Sum for extent map shards written");
+  b.add_u64_counter(l_bluestore_read_ios, "read_ios", "Sum for device reads issued for object data");
+  b.add_u64_counter(l_bluestore_csum_verified_bytes, "csum_verified_bytes", "Sum for object data read and checked against a stored csum");
   logger = b.create_perf_counters();
   g_ceph_context->get_perfcounters_collection()->add(logger);
 }
@@ -811,6 +1246,122 @@ void BlueStore::_shutdown_logger()
   delete logger;
 }
 
+class BlueStore::SocketHook : public AdminSocketHook {
+  BlueStore *store;
+public:
+  explicit SocketHook(BlueStore *s) : store(s) {}
+  bool call(std::string command, cmdmap_t& cmdmap, std::string format,
+	    bufferlist& out) override {
+    stringstream ss;
+    bool r = store->asok_command(command, format, ss);
+    out.append(ss);
+    return r;
+  }
+};
+
+void BlueStore::_register_asok()
+{
+  AdminSocket *admin_socket = g_ceph_context->get_admin_socket();
+  asok_hook = new SocketHook(this);
+  int r = admin_socket->register_command(
+    "bluestore txc histogram dump", "bluestore txc histogram dump", asok_hook,
+    "dump log2 histograms of bluestore transaction state latencies");
+  if (r < 0) {
+    // another store in this process got there first
+    dout(1) << __func__ << " not registering admin socket commands: "
+	    << cpp_strerror(r) << dendl;
+    delete asok_hook;
+    asok_hook = NULL;
+    return;
+  }
+  r = admin_socket->register_command(
+    "bluestore txc histogram reset", "bluestore txc histogram reset",
+    asok_hook,
+    "reset the bluestore transaction state latency histograms");
+  assert(r == 0);
+}
+
+void BlueStore::_unregister_asok()
+{
+  if (!asok_hook)
+    return;
+  AdminSocket *admin_socket = g_ceph_context->get_admin_socket();
+  admin_socket->unregister_command("bluestore txc histogram dump");
+  admin_socket->unregister_command("bluestore txc histogram reset");
+  delete asok_hook;
+  asok_hook = NULL;
+}
+
+bool BlueStore::asok_command(string command, string format, ostream& ss)
+{
+  Formatter *f = Formatter::create(format, "json-pretty", "json-pretty");
+  if (command == "bluestore txc histogram dump") {
+    f->open_object_section("txc_histogram");
+    f->dump_bool("enabled", g_conf->bluestore_txc_histogram);
+    f->dump_bool("by_size", g_conf->bluestore_txc_histogram_size);
+    txc_hist.dump(f);
+    f->close_section();
+  } else if (command == "bluestore txc histogram reset") {
+    txc_hist.reset();
+  } else {
+    assert(0 == "broken asok registration");
+  }
+  f->flush(ss);
+  delete f;
+  return true;
+}
+
+// TxcStateHistogram
+
+void BlueStore::TxcStateHistogram::reset()
+{
+  for (unsigned s = 0; s < NUM_STATES; ++s) {
+    for (unsigned l = 0; l < LAT_BINS; ++l) {
+      lat[s][l] = 0;
+      for (unsigned b = 0; b < SIZE_BINS; ++b)
+	lat_size[s][l][b] = 0;
+    }
+  }
+}
+
+void BlueStore::TxcStateHistogram::dump(Formatter *f) const
+{
+  // bins past the last nonzero one are left out
+  f->dump_string("latency_bins", "log2 usec");
+  f->dump_string("size_bins", "log2 bytes");
+  f->open_object_section("states");
+  for (unsigned s = 0; s < NUM_STATES; ++s) {
+    f->open_object_section(TransContext::get_state_name(s));
+    uint64_t count = 0;
+    unsigned end = 0;
+    for (unsigned l = 0; l < LAT_BINS; ++l) {
+      uint64_t v = lat[s][l];
+      count += v;
+      if (v)
+	end = l + 1;
+    }
+    f->dump_unsigned("count", count);
+    f->open_array_section("latency");
+    for (unsigned l = 0; l < end; ++l)
+      f->dump_unsigned("count", lat[s][l]);
+    f->close_section();
+    f->open_array_section("latency_by_size");
+    for (unsigned l = 0; l < end; ++l) {
+      unsigned bend = 0;
+      for (unsigned b = 0; b < SIZE_BINS; ++b)
+	if (lat_size[s][l][b])
+	  bend = b + 1;
+      f->open_array_section("sizes");
+      for (unsigned b = 0; b < bend; ++b)
+	f->dump_unsigned("count", lat_size[s][l][b]);
+      f->close_section();
+    }
+    f->close_section();
+    f->close_section();
+  }
+  f->close_section();
+}
+
 int BlueStore::get_block_device_fsid(const string& path, uuid_d *fsid)
 {
   bluestore_bdev_label_t label;
@@ -942,6 +1493,7 @@ int BlueStore::_open_bdev(bool create)
   assert(bdev == NULL);
   string p = path + "/block";
   bdev = BlockDevice::create(p, aio_cb, static_cast<void*>(this));
+  bdev->set_discard_callback(discard_cb, static_cast<void*>(this));
   int r = bdev->open(p);
   if (r < 0)
     goto fail;
@@ -969,19 +1521,28 @@ void BlueStore::_close_bdev()
   bdev = NULL;
 }
 
-int BlueStore::_open_alloc()
+int BlueStore::_open_alloc(bool use_snapshot)
 {
   assert(fm == NULL);
   assert(alloc == NULL);
   fm = new FreelistManager();
-  int r = fm->init(db, PREFIX_ALLOC);
+  int r = fm->init(db, PREFIX_ALLOC, PREFIX_ALLOC_SNAP,
+		   use_snapshot && g_conf->bluestore_freelist_snapshot);
   if (r < 0) {
     delete fm;
     fm = NULL;
     return r;
   }
 
-  alloc = Allocator::create("stupid");
+  alloc = Allocator::create(g_conf->bluestore_allocator,
+			    bdev->get_size(),
+			    g_conf->bluestore_min_alloc_size);
+  if (!alloc) {
+    fm->shutdown();
+    delete fm;
+    fm = NULL;
+    return -EINVAL;
+  }
   uint64_t num = 0, bytes = 0;
   const auto& fl = fm->get_freelist();
   for (auto& p : fl) {
@@ -1118,6 +1679,7 @@ int BlueStore::_open_db(bool create)
   char fn[PATH_MAX];
   snprintf(fn, sizeof(fn), "%s/db", path.c_str());
   string options;
+  string cfs;
   stringstream err;
 
   string kv_backend;
@@ -1328,13 +1890,18 @@ int BlueStore::_open_db(bool create)
     return -EIO;
   }
   
-  if (kv_backend == "rocksdb")
+  if (kv_backend == "rocksdb") {
     options = g_conf->bluestore_rocksdb_options;
+    cfs = g_conf->bluestore_rocksdb_cfs;
+  }
   db->init(options);
-  if (create)
-    r = db->create_and_open(err);
-  else
-    r = db->open(err);
+  r = db->set_column_families(cfs);
+  if (r == 0) {
+    if (create)
+      r = db->create_and_open(err);
+    else
+      r = db->open(err);
+  }
   if (r) {
     derr << __func__ << " erroring opening db: " << err.str() << dendl;
     if (bluefs) {
@@ -1540,7 +2107,7 @@ int BlueStore::_open_collections(int *errors)
        it->next()) {
     coll_t cid;
     if (cid.parse(it->key())) {
-      CollectionRef c(new Collection(this, cid));
+      CollectionRef c(new Collection(this, _get_cache_shard(cid), cid));
       bufferlist bl = it->value();
       bufferlist::iterator p = bl.begin();
       try {
@@ -1804,6 +2371,18 @@ int BlueStore::mkfs()
   return r;
 }
 
+void BlueStore::_load_compressors()
+{
+  // load every plugin we know of; existing data may use any of them
+  compressors.clear();
+  compressors.resize(bluestore_compressed_t::COMP_ALG_MAX);
+  for (int a = bluestore_compressed_t::COMP_ALG_NONE + 1;
+       a < bluestore_compressed_t::COMP_ALG_MAX; ++a) {
+    compressors[a] = Compressor::create(
+      g_ceph_context, bluestore_compressed_t::get_comp_alg_name(a));
+  }
+}
+
 int BlueStore::mount()
 {
   dout(1) << __func__ << " path " << path << dendl;
@@ -1822,8 +2401,43 @@ int BlueStore::mount()
     }
   }
 
+  csum_type = bluestore_onode_t::get_csum_string_type(
+    g_conf->bluestore_csum_type);
+  if (csum_type < 0) {
+    derr << __func__ << " unrecognized bluestore_csum_type "
+	 << g_conf->bluestore_csum_type << dendl;
+    return -EINVAL;
+  }
+
+  if (g_conf->bluestore_compression == "none") {
+    comp_mode = COMP_NONE;
+  } else if (g_conf->bluestore_compression == "passive") {
+    comp_mode = COMP_PASSIVE;
+  } else if (g_conf->bluestore_compression == "aggressive") {
+    comp_mode = COMP_AGGRESSIVE;
+  } else if (g_conf->bluestore_compression == "force") {
+    comp_mode = COMP_FORCE;
+  } else {
+    derr << __func__ << " unrecognized bluestore_compression "
+	 << g_conf->bluestore_compression << dendl;
+    return -EINVAL;
+  }
+  comp_alg = bluestore_compressed_t::get_comp_alg_type(
+    g_conf->bluestore_compression_algorithm);
+  if (comp_alg <= bluestore_compressed_t::COMP_ALG_NONE) {
+    derr << __func__ << " unrecognized bluestore_compression_algorithm "
+	 << g_conf->bluestore_compression_algorithm << dendl;
+    return -EINVAL;
+  }
+  _load_compressors();
+  if (comp_mode != COMP_NONE && !compressors[comp_alg]) {
+    derr << __func__ << " unable to load compressor "
+	 << g_conf->bluestore_compression_algorithm << dendl;
+    return -EINVAL;
+  }
+
   if (g_conf->bluestore_fsck_on_mount) {
-    int rc = fsck();
+    int rc = fsck(g_conf->bluestore_fsck_on_mount_deep);
     if (rc < 0)
       return rc;
     if (rc > 0) {
@@ -1875,6 +2489,7 @@ int BlueStore::mount()
 
   finisher.start();
   wal_tp.start();
+  wal_batch_thread.create("bstore_wal_batch");
   kv_sync_thread.create("bstore_kv_sync");
 
   r = _wal_replay();
@@ -1886,6 +2501,8 @@ int BlueStore::mount()
 
  out_stop:
   _kv_stop();
+  bdev->discard_drain();
+  _wal_batch_stop();
   wal_wq.drain();
   wal_tp.stop();
   finisher.wait_for_empty();
@@ -1916,6 +2533,10 @@ int BlueStore::umount()
 
   dout(20) << __func__ << " stopping kv thread" << dendl;
   _kv_stop();
+  dout(20) << __func__ << " draining discards" << dendl;
+  bdev->discard_drain();
+  dout(20) << __func__ << " stopping wal batch thread" << dendl;
+  _wal_batch_stop();
   dout(20) << __func__ << " draining wal_wq" << dendl;
   wal_wq.drain();
   dout(20) << __func__ << " stopping wal_tp" << dendl;
@@ -1926,6 +2547,13 @@ int BlueStore::umount()
   finisher.stop();
   dout(20) << __func__ << " closing" << dendl;
 
+  if (g_conf->bluestore_freelist_snapshot) {
+    dout(20) << __func__ << " writing freelist snapshot" << dendl;
+    KeyValueDB::Transaction t = db->get_transaction();
+    if (fm->write_snapshot(t))
+      db->submit_transaction_sync(t);
+  }
+
   mounted = false;
   _close_alloc();
   _close_db();
@@ -1934,7 +2562,7 @@ int BlueStore::umount()
   _close_path();
 
   if (g_conf->bluestore_fsck_on_umount) {
-    int rc = fsck();
+    int rc = fsck(g_conf->bluestore_fsck_on_umount_deep);
     if (rc < 0)
       return rc;
     if (rc > 0) {
@@ -1966,25 +2594,239 @@ int BlueStore::_verify_enode_shared(
     for (interval_set<uint64_t>::iterator q = i.begin(); q != i.end(); ++q) {
       ref_map.get(q.get_start(), q.get_len());
     }
-    span.insert(t);
-  }
-  if (enode->ref_map != ref_map) {
-    derr << " hash " << enode->hash << " ref_map " << enode->ref_map
-	 << " != expected " << ref_map << dendl;
-    ++errors;
+    span.insert(t);
+  }
+  if (enode->ref_map != ref_map) {
+    derr << " hash " << enode->hash << " ref_map " << enode->ref_map
+	 << " != expected " << ref_map << dendl;
+    ++errors;
+  }
+  return errors;
+}
+
+void BlueStore::_fsck_collection(CollectionRef c, bool deep, FsckState *st)
+{
+  vector<bluestore_extent_t> hash_shared;
+  dout(1) << __func__ << " collection " << c->cid << dendl;
+  RWLock::RLocker l(c->lock);
+  ghobject_t pos;
+  EnodeRef enode;
+  while (true) {
+    vector<ghobject_t> ols;
+    int r = collection_list(c->cid, pos, ghobject_t::get_max(), true,
+			    100, &ols, &pos);
+    if (r < 0) {
+      ++st->errors;
+      break;
+    }
+    if (ols.empty()) {
+      break;
+    }
+    for (auto& oid : ols) {
+      dout(10) << __func__ << "  " << oid << dendl;
+      logger->inc(l_bluestore_fsck_objects);
+      OnodeRef o = c->get_onode(oid, false);
+      if (!o || !o->exists) {
+	++st->errors;
+	continue; // go for next object
+      }
+      if (!enode || enode->hash != o->oid.hobj.get_hash()) {
+	if (enode)
+	  st->errors += _verify_enode_shared(enode, hash_shared);
+	enode = c->get_enode(o->oid.hobj.get_hash());
+	hash_shared.clear();
+      }
+      if (o->onode.nid) {
+	if (st->used_nids.count(o->onode.nid)) {
+	  derr << " " << oid << " nid " << o->onode.nid << " already in use"
+	       << dendl;
+	  ++st->errors;
+	  continue; // go for next object
+	}
+	st->used_nids.insert(o->onode.nid);
+      }
+      // blocks
+      for (auto& b : o->onode.block_map) {
+	if (b.second.has_flag(bluestore_extent_t::FLAG_SHARED))
+	  hash_shared.push_back(b.second);
+	if (st->used_blocks.intersects(b.second.offset, b.second.length)) {
+	  derr << " " << oid << " extent " << b.first << ": " << b.second
+	       << " already allocated" << dendl;
+	  ++st->errors;
+	  continue;
+	}
+	st->used_blocks.insert(b.second.offset, b.second.length);
+	if (b.second.end() > bdev->get_size()) {
+	  derr << " " << oid << " extent " << b.first << ": " << b.second
+	       << " past end of block device" << dendl;
+	  ++st->errors;
+	}
+      }
+      for (auto& cp : o->onode.compressed_map) {
+	if (cp.first + cp.second.logical_length > o->onode.size) {
+	  derr << " " << oid << " compressed " << cp.first << ": "
+	       << cp.second << " extends past end of object" << dendl;
+	  ++st->errors;
+	}
+	auto bp = o->onode.seek_extent(cp.first);
+	if (bp != o->onode.block_map.end() &&
+	    bp->first < cp.first + cp.second.logical_length) {
+	  derr << " " << oid << " compressed " << cp.first << ": "
+	       << cp.second << " overlaps extent " << bp->first << ": "
+	       << bp->second << dendl;
+	  ++st->errors;
+	}
+	for (auto& e : cp.second.extents) {
+	  if (e.has_flag(bluestore_extent_t::FLAG_SHARED))
+	    hash_shared.push_back(e);
+	  if (st->used_blocks.intersects(e.offset, e.length)) {
+	    derr << " " << oid << " compressed " << cp.first << ": "
+		 << cp.second << " extent " << e << " already allocated"
+		 << dendl;
+	    ++st->errors;
+	    continue;
+	  }
+	  st->used_blocks.insert(e.offset, e.length);
+	  if (e.end() > bdev->get_size()) {
+	    derr << " " << oid << " compressed " << cp.first << ": "
+		 << cp.second << " extent " << e
+		 << " past end of block device" << dendl;
+	    ++st->errors;
+	  }
+	}
+      }
+      // overlays
+      set<string> overlay_keys;
+      map<uint64_t,int> refs;
+      for (auto& v : o->onode.overlay_map) {
+	if (v.first + v.second.length > o->onode.size) {
+	  derr << " " << oid << " overlay " << v.first << " " << v.second
+	       << " extends past end of object" << dendl;
+	  ++st->errors;
+	  continue; // go for next overlay
+	}
+	if (v.second.key > o->onode.last_overlay_key) {
+	  derr << " " << oid << " overlay " << v.first << " " << v.second
+	       << " is > last_overlay_key " << o->onode.last_overlay_key
+	       << dendl;
+	  ++st->errors;
+	  continue; // go for next overlay
+	}
+	++refs[v.second.key];
+	string key;
+	bufferlist val;
+	get_overlay_key(o->onode.nid, v.second.key, &key);
+	overlay_keys.insert(key);
+	int r = db->get(PREFIX_OVERLAY, key, &val);
+	if (r < 0) {
+	  derr << " " << oid << " overlay " << v.first << " " << v.second
+	       << " failed to fetch: " << cpp_strerror(r) << dendl;
+	  ++st->errors;
+	  continue;
+	}
+	if (val.length() < v.second.value_offset + v.second.length) {
+	  derr << " " << oid << " overlay " << v.first << " " << v.second
+	       << " too short, " << val.length() << dendl;
+	  ++st->errors;
+	}
+      }
+      for (auto& vr : o->onode.overlay_refs) {
+	if (refs[vr.first] != vr.second) {
+	  derr << " " << oid << " overlay key " << vr.first
+	       << " says " << vr.second << " refs but we have "
+	       << refs[vr.first] << dendl;
+	  ++st->errors;
+	}
+	refs.erase(vr.first);
+      }
+      for (auto& p : refs) {
+	if (p.second > 1) {
+	  derr << " " << oid << " overlay key " << p.first
+	       << " has " << p.second << " refs but they are not recorded"
+	       << dendl;
+	  ++st->errors;
+	}
+      }
+      do {
+	string start;
+	get_overlay_key(o->onode.nid, 0, &start);
+	KeyValueDB::Iterator it = db->get_iterator(PREFIX_OVERLAY);
+	if (!it)
+	  break;
+	for (it->lower_bound(start); it->valid(); it->next()) {
+	  string k = it->key();
+	  const char *p = k.c_str();
+	  uint64_t nid;
+	  p = _key_decode_u64(p, &nid);
+	  if (nid != o->onode.nid)
+	    break;
+	  if (!overlay_keys.count(k)) {
+	    derr << " " << oid << " has stray overlay kv pair for "
+		 << k << dendl;
+	    ++st->errors;
+	  }
+	}
+      } while (false);
+      // omap
+      while (o->onode.omap_head) {
+	if (st->used_omap_head.count(o->onode.omap_head)) {
+	  derr << " " << oid << " omap_head " << o->onode.omap_head
+	       << " already in use" << dendl;
+	  ++st->errors;
+	  break;
+	}
+	st->used_omap_head.insert(o->onode.omap_head);
+	// hrm, scan actual key/value pairs?
+	KeyValueDB::Iterator it = db->get_iterator(PREFIX_OMAP);
+	if (!it)
+	  break;
+	string head, tail;
+	get_omap_header(o->onode.omap_head, &head);
+	get_omap_tail(o->onode.omap_head, &tail);
+	it->lower_bound(head);
+	while (it->valid()) {
+	  if (it->key() == head) {
+	    dout(30) << __func__ << "  got header" << dendl;
+	  } else if (it->key() >= tail) {
+	    dout(30) << __func__ << "  reached tail" << dendl;
+	    break;
+	  } else {
+	    string user_key;
+	    decode_omap_key(it->key(), &user_key);
+	    dout(30) << __func__
+		     << "  got " << pretty_binary_string(it->key())
+		     << " -> " << user_key << dendl;
+	    assert(it->key() < tail);
+	  }
+	  it->next();
+	}
+	break;
+      }
+      // data
+      if (deep) {
+	bufferlist bl;
+	int r = _do_read(o, 0, o->onode.size, bl,
+			 CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+	if (r < 0) {
+	  derr << " " << oid << " failed to read data: " << cpp_strerror(r)
+	       << dendl;
+	  ++st->errors;
+	}
+      }
+    }
   }
-  return errors;
+  if (enode)
+    st->errors += _verify_enode_shared(enode, hash_shared);
 }
 
-int BlueStore::fsck()
+int BlueStore::fsck(bool deep)
 {
-  dout(1) << __func__ << dendl;
+  dout(1) << __func__ << (deep ? " (deep)" : " (shallow)") << dendl;
   int errors = 0;
   set<uint64_t> used_nids;
   set<uint64_t> used_omap_head;
   interval_set<uint64_t> used_blocks;
   KeyValueDB::Iterator it;
-  vector<bluestore_extent_t> hash_shared;
 
   int r = _open_path();
   if (r < 0)
@@ -2009,9 +2851,18 @@ int BlueStore::fsck()
   if (r < 0)
     goto out_bdev;
 
-  r = _open_alloc();
+  // always scan the real freelist, and check any snapshot against it
+  r = _open_alloc(false);
   if (r < 0)
     goto out_db;
+  r = fm->verify_snapshot(db);
+  if (r < 0) {
+    derr << __func__ << " freelist snapshot is damaged: " << cpp_strerror(r)
+	 << dendl;
+    ++errors;
+  } else {
+    errors += r;
+  }
 
   r = _open_super_meta();
   if (r < 0)
@@ -2021,6 +2872,9 @@ int BlueStore::fsck()
   if (r < 0)
     goto out_alloc;
 
+  if (deep && compressors.empty())
+    _load_compressors();
+
   used_blocks.insert(0, BLUEFS_START);
   if (bluefs) {
     used_blocks.insert(bluefs_extents);
@@ -2034,172 +2888,64 @@ int BlueStore::fsck()
   }
 
   // walk collections, objects
-  for (ceph::unordered_map<coll_t, CollectionRef>::iterator p = coll_map.begin();
-       p != coll_map.end();
-       ++p) {
-    dout(1) << __func__ << " collection " << p->first << dendl;
-    CollectionRef c = _get_collection(p->first);
-    RWLock::RLocker l(c->lock);
-    ghobject_t pos;
-    EnodeRef enode;
-    while (true) {
-      vector<ghobject_t> ols;
-      int r = collection_list(p->first, pos, ghobject_t::get_max(), true,
-			      100, &ols, &pos);
-      if (r < 0) {
-	++errors;
-	break;
-      }
-      if (ols.empty()) {
-	break;
-      }
-      for (auto& oid : ols) {
-	dout(10) << __func__ << "  " << oid << dendl;
-	OnodeRef o = c->get_onode(oid, false);
-	if (!o || !o->exists) {
+  {
+    vector<CollectionRef> colls;
+    for (auto& p : coll_map) {
+      colls.push_back(p.second);
+    }
+    int num_threads = g_conf->bluestore_fsck_threads;
+    if (num_threads <= 0) {
+      num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    num_threads = MAX(1, MIN(num_threads, (int)colls.size()));
+    dout(1) << __func__ << " checking " << colls.size() << " collections with "
+	    << num_threads << " threads" << dendl;
+    logger->set(l_bluestore_fsck_collections, colls.size());
+    logger->set(l_bluestore_fsck_collections_done, 0);
+    logger->set(l_bluestore_fsck_objects, 0);
+
+    // each worker takes whole collections (contiguous ranges of the onode
+    // key space) and accumulates what it finds in its own FsckState
+    vector<FsckState> states(num_threads);
+    vector<std::thread> workers;
+    std::atomic<size_t> next(0);
+    for (int i = 0; i < num_threads; ++i) {
+      workers.push_back(std::thread([&, i] {
+	    size_t n;
+	    while ((n = next++) < colls.size()) {
+	      _fsck_collection(colls[n], deep, &states[i]);
+	      logger->inc(l_bluestore_fsck_collections_done);
+	    }
+	  }));
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+
+    // merge, looking for conflicts between workers
+    for (auto& st : states) {
+      errors += st.errors;
+      for (auto nid : st.used_nids) {
+	if (!used_nids.insert(nid).second) {
+	  derr << __func__ << " nid " << nid << " already in use" << dendl;
 	  ++errors;
-	  continue; // go for next object
-	}
-	if (!enode || enode->hash != o->oid.hobj.get_hash()) {
-	  if (enode)
-	    errors += _verify_enode_shared(enode, hash_shared);
-	  enode = c->get_enode(o->oid.hobj.get_hash());
-	  hash_shared.clear();
-	}
-	if (o->onode.nid) {
-	  if (used_nids.count(o->onode.nid)) {
-	    derr << " " << oid << " nid " << o->onode.nid << " already in use"
-		 << dendl;
-	    ++errors;
-	    continue; // go for next object
-	  }
-	  used_nids.insert(o->onode.nid);
-	}
-	// blocks
-	for (auto& b : o->onode.block_map) {
-	  if (b.second.has_flag(bluestore_extent_t::FLAG_SHARED))
-	    hash_shared.push_back(b.second);
-	  if (used_blocks.intersects(b.second.offset, b.second.length)) {
-	    derr << " " << oid << " extent " << b.first << ": " << b.second
-		 << " already allocated" << dendl;
-	    ++errors;
-	    continue;
-	  }
-	  used_blocks.insert(b.second.offset, b.second.length);
-	  if (b.second.end() > bdev->get_size()) {
-	    derr << " " << oid << " extent " << b.first << ": " << b.second
-		 << " past end of block device" << dendl;
-	    ++errors;
-	  }
-	}
-	// overlays
-	set<string> overlay_keys;
-	map<uint64_t,int> refs;
-	for (auto& v : o->onode.overlay_map) {
-	  if (v.first + v.second.length > o->onode.size) {
-	    derr << " " << oid << " overlay " << v.first << " " << v.second
-		 << " extends past end of object" << dendl;
-	    ++errors;
-            continue; // go for next overlay
-	  }
-	  if (v.second.key > o->onode.last_overlay_key) {
-	    derr << " " << oid << " overlay " << v.first << " " << v.second
-		 << " is > last_overlay_key " << o->onode.last_overlay_key
-		 << dendl;
-	    ++errors;
-            continue; // go for next overlay
-	  }
-	  ++refs[v.second.key];
-	  string key;
-	  bufferlist val;
-	  get_overlay_key(o->onode.nid, v.second.key, &key);
-	  overlay_keys.insert(key);
-	  int r = db->get(PREFIX_OVERLAY, key, &val);
-	  if (r < 0) {
-	    derr << " " << oid << " overlay " << v.first << " " << v.second
-		 << " failed to fetch: " << cpp_strerror(r) << dendl;
-	    ++errors;
-            continue;
-	  }
-	  if (val.length() < v.second.value_offset + v.second.length) {
-	    derr << " " << oid << " overlay " << v.first << " " << v.second
-		 << " too short, " << val.length() << dendl;
-	    ++errors;
-	  }
-	}
-	for (auto& vr : o->onode.overlay_refs) {
-	  if (refs[vr.first] != vr.second) {
-	    derr << " " << oid << " overlay key " << vr.first
-		 << " says " << vr.second << " refs but we have "
-		 << refs[vr.first] << dendl;
-	    ++errors;
-	  }
-	  refs.erase(vr.first);
-	}
-	for (auto& p : refs) {
-	  if (p.second > 1) {
-	    derr << " " << oid << " overlay key " << p.first
-		 << " has " << p.second << " refs but they are not recorded"
-		 << dendl;
-	    ++errors;
-	  }
 	}
-	do {
-	  string start;
-	  get_overlay_key(o->onode.nid, 0, &start);
-	  KeyValueDB::Iterator it = db->get_iterator(PREFIX_OVERLAY);
-	  if (!it)
-	    break;
-	  for (it->lower_bound(start); it->valid(); it->next()) {
-	    string k = it->key();
-	    const char *p = k.c_str();
-	    uint64_t nid;
-	    p = _key_decode_u64(p, &nid);
-	    if (nid != o->onode.nid)
-	      break;
-	    if (!overlay_keys.count(k)) {
-	      derr << " " << oid << " has stray overlay kv pair for "
-		   << k << dendl;
-	      ++errors;
-	    }
-	  }
-	} while (false);
-	// omap
-	while (o->onode.omap_head) {
-	  if (used_omap_head.count(o->onode.omap_head)) {
-	    derr << " " << oid << " omap_head " << o->onode.omap_head
-		 << " already in use" << dendl;
-	    ++errors;
-	    break;
-	  }
-	  used_omap_head.insert(o->onode.omap_head);
-	  // hrm, scan actual key/value pairs?
-	  KeyValueDB::Iterator it = db->get_iterator(PREFIX_OMAP);
-	  if (!it)
-	    break;
-	  string head, tail;
-	  get_omap_header(o->onode.omap_head, &head);
-	  get_omap_tail(o->onode.omap_head, &tail);
-	  it->lower_bound(head);
-	  while (it->valid()) {
-	    if (it->key() == head) {
-	      dout(30) << __func__ << "  got header" << dendl;
-	    } else if (it->key() >= tail) {
-	      dout(30) << __func__ << "  reached tail" << dendl;
-	      break;
-	    } else {
-	      string user_key;
-	      decode_omap_key(it->key(), &user_key);
-	      dout(30) << __func__
-		       << "  got " << pretty_binary_string(it->key())
-		       << " -> " << user_key << dendl;
-	      assert(it->key() < tail);
-	    }
-	    it->next();
-	  }
-	  break;
+      }
+      for (auto head : st.used_omap_head) {
+	if (!used_omap_head.insert(head).second) {
+	  derr << __func__ << " omap_head " << head << " already in use"
+	       << dendl;
+	  ++errors;
 	}
       }
+      interval_set<uint64_t> overlap;
+      overlap.intersection_of(used_blocks, st.used_blocks);
+      if (!overlap.empty()) {
+	derr << __func__ << " extents " << overlap << " already allocated"
+	     << dendl;
+	errors += overlap.num_intervals();
+      }
+      used_blocks.union_of(st.used_blocks);
     }
   }
 
@@ -2252,6 +2998,22 @@ int BlueStore::fsck()
     }
   }
 
+  dout(1) << __func__ << " checking for stray extent shards" << dendl;
+  it = db->get_iterator(PREFIX_EXTENT);
+  if (it) {
+    for (it->lower_bound(string()); it->valid(); it->next()) {
+      string key = it->key();
+      const char *p = key.c_str();
+      uint64_t nid;
+      p = _key_decode_u64(p, &nid);
+      if (used_nids.count(nid) == 0) {
+	derr << __func__ << " found stray extent shard on nid " << nid
+	     << dendl;
+	++errors;
+      }
+    }
+  }
+
   dout(1) << __func__ << " checking for stray omap data" << dendl;
   it = db->get_iterator(PREFIX_OMAP);
   if (it) {
@@ -2370,6 +3132,17 @@ int BlueStore::statfs(struct statfs *buf)
 // ---------------
 // cache
 
+BlueStore::Cache *BlueStore::_get_cache_shard(const coll_t& cid)
+{
+  return cache_shards[std::hash<coll_t>()(cid) % cache_shards.size()];
+}
+
+void BlueStore::_trim_cache(Cache *cache)
+{
+  cache->trim(g_conf->bluestore_cache_size / cache_shards.size(),
+	      g_conf->bluestore_cache_meta_ratio);
+}
+
 BlueStore::CollectionRef BlueStore::_get_collection(const coll_t& cid)
 {
   RWLock::RLocker l(coll_lock);
@@ -2526,6 +3299,12 @@ int BlueStore::read(
     length = o->onode.size;
 
   r = _do_read(o, offset, length, bl, op_flags);
+  _trim_cache(c->cache);
+  if (r == -EIO && !allow_eio && g_conf->bluestore_fail_eio) {
+    derr << __func__ << " " << cid << " " << oid << " " << offset << "~"
+	 << length << " got EIO" << dendl;
+    assert(0 == "EIO on read");
+  }
 
  out:
   dout(10) << __func__ << " " << cid << " " << oid
@@ -2541,11 +3320,10 @@ int BlueStore::_do_read(
     bufferlist& bl,
     uint32_t op_flags)
 {
-  map<uint64_t,bluestore_extent_t>::iterator bp, bend;
-  map<uint64_t,bluestore_overlay_t>::iterator op, oend;
-  uint64_t block_size = bdev->get_block_size();
   int r = 0;
-  IOContext ioc(NULL);   // FIXME?
+  uint64_t end, hit_bytes = 0;
+  map<uint64_t,bufferlist> cached;
+  map<uint64_t,bufferlist>::iterator p;
 
   // generally, don't buffer anything, unless the client explicitly requests
   // it.
@@ -2560,6 +3338,10 @@ int BlueStore::_do_read(
     buffered = true;
   }
 
+  // our own cache keeps what we read unless told otherwise
+  bool cache = (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+			    CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0;
+
   dout(20) << __func__ << " " << offset << "~" << length << " size "
 	   << o->onode.size << dendl;
   bl.clear();
@@ -2575,6 +3357,180 @@ int BlueStore::_do_read(
 
   o->flush();
 
+  // use cached pieces, and fill the gaps between them from disk
+  end = offset + length;
+  o->bc.read(offset, length, cached);
+  p = cached.begin();
+  while (offset < end) {
+    if (p != cached.end() && p->first == offset) {
+      uint64_t x_len = p->second.length();
+      dout(30) << __func__ << " cached " << offset << "~" << x_len << dendl;
+      bl.claim_append(p->second);
+      hit_bytes += x_len;
+      offset += x_len;
+      ++p;
+      continue;
+    }
+    uint64_t x_len = (p != cached.end() ? p->first : end) - offset;
+    bufferlist t;
+    if (o->onode.has_csum()) {
+      // read whole csum chunks so we can verify them
+      uint64_t chunk = o->onode.get_csum_chunk_size();
+      uint64_t r_off = offset - offset % chunk;
+      uint64_t r_end = MIN(ROUND_UP_TO(offset + x_len, chunk), o->onode.size);
+      bufferlist u;
+      r = _do_read_uncached(o, r_off, r_end - r_off, u, buffered);
+      if (r < 0) {
+	goto out;
+      }
+      uint64_t bad, verified = 0;
+      r = o->onode.csum_verify(r_off, u, &bad, &verified);
+      logger->inc(l_bluestore_csum_verified_bytes, verified);
+      if (r < 0) {
+	derr << __func__ << " bad "
+	     << bluestore_onode_t::get_csum_type_string(o->onode.csum_type)
+	     << "/0x" << std::hex << o->onode.get_csum_chunk_size()
+	     << " checksum at 0x" << bad << std::dec
+	     << " on " << o->oid << dendl;
+	logger->inc(l_bluestore_read_eio);
+	goto out;
+      }
+      t.substr_of(u, offset - r_off, x_len);
+    } else {
+      r = _do_read_uncached(o, offset, x_len, t, buffered);
+      if (r < 0) {
+	goto out;
+      }
+    }
+    if (cache) {
+      o->bc.did_read(offset, t);
+    }
+    logger->inc(l_bluestore_buffer_miss_bytes, x_len);
+    bl.claim_append(t);
+    offset += x_len;
+  }
+  logger->inc(l_bluestore_buffer_hit_bytes, hit_bytes);
+  r = bl.length();
+
+ out:
+  return r;
+}
+
+int BlueStore::_do_read_uncached(
+    OnodeRef o,
+    uint64_t offset,
+    uint64_t length,
+    bufferlist& bl,
+    bool buffered)
+{
+  if (o->onode.compressed_map.empty())
+    return _do_read_plain(o, offset, length, bl, buffered);
+
+  // compressed runs are holes in the block_map; read around them
+  map<uint64_t,bluestore_compressed_t>::iterator cp =
+    o->onode.seek_compressed(offset);
+  while (length > 0) {
+    if (cp == o->onode.compressed_map.end() ||
+	cp->first >= offset + length) {
+      return _do_read_plain(o, offset, length, bl, buffered);
+    }
+    if (cp->first > offset) {
+      uint64_t x_len = cp->first - offset;
+      int r = _do_read_plain(o, offset, x_len, bl, buffered);
+      if (r < 0)
+	return r;
+      offset += x_len;
+      length -= x_len;
+    }
+    bufferlist t;
+    int r = _do_read_compressed(o, cp->first, cp->second, &t, buffered);
+    if (r < 0)
+      return r;
+    uint64_t x_off = offset - cp->first;
+    uint64_t x_len = MIN(length, cp->second.logical_length - x_off);
+    dout(30) << __func__ << " compressed " << cp->first << ": " << cp->second
+	     << " use " << x_off << "~" << x_len << dendl;
+    bufferlist u;
+    u.substr_of(t, x_off, x_len);
+    bl.claim_append(u);
+    offset += x_len;
+    length -= x_len;
+    ++cp;
+  }
+  return 0;
+}
+
+int BlueStore::_do_read_compressed(
+    OnodeRef o,
+    uint64_t offset,
+    const bluestore_compressed_t& cm,
+    bufferlist *bl,
+    bool buffered,
+    TransContext *txc)
+{
+  uint64_t block_size = bdev->get_block_size();
+  bufferlist raw;
+  map<uint64_t,bufferlist>::iterator q;
+  if (txc &&
+      (q = txc->compressed_writes.find(cm.extents.front().offset)) !=
+      txc->compressed_writes.end()) {
+    // written earlier in this same transaction; not on disk yet
+    raw = q->second;
+  } else {
+    IOContext ioc(NULL);
+    uint64_t want = ROUND_UP_TO(cm.compressed_length, block_size);
+    for (auto& e : cm.extents) {
+      if (want == 0)
+	break;
+      uint64_t r_len = MIN(want, e.length);
+      bufferlist t;
+      int r = bdev->read(e.offset, r_len, &t, &ioc, buffered);
+      if (r < 0)
+	return r;
+      raw.claim_append(t);
+      want -= r_len;
+    }
+  }
+  if (raw.length() < cm.compressed_length) {
+    derr << __func__ << " " << o->oid << " short compressed payload at "
+	 << offset << ": " << cm << dendl;
+    return -EIO;
+  }
+  CompressorRef cp;
+  if (cm.alg < compressors.size())
+    cp = compressors[cm.alg];
+  if (!cp) {
+    derr << __func__ << " " << o->oid << " no compressor for " << cm << dendl;
+    return -EIO;
+  }
+  bufferlist in;
+  in.substr_of(raw, 0, cm.compressed_length);
+  int r = cp->decompress(in, *bl);
+  if (r < 0 || bl->length() != cm.logical_length) {
+    derr << __func__ << " " << o->oid << " failed to decompress " << offset
+	 << ": " << cm << " (got " << bl->length() << " bytes, r " << r << ")"
+	 << dendl;
+    return -EIO;
+  }
+  logger->inc(l_bluestore_decompress_count);
+  return 0;
+}
+
+int BlueStore::_do_read_plain(
+    OnodeRef o,
+    uint64_t offset,
+    uint64_t length,
+    bufferlist& bl,
+    bool buffered)
+{
+  map<uint64_t,bluestore_extent_t>::iterator bp, bend;
+  map<uint64_t,bluestore_overlay_t>::iterator op, oend;
+  uint64_t block_size = bdev->get_block_size();
+  int r = 0;
+  IOContext ioc(NULL);   // FIXME?
+
+  dout(20) << __func__ << " " << offset << "~" << length << dendl;
+
   // loop over overlays and data fragments.  overlays take precedence.
   bend = o->onode.block_map.end();
   bp = o->onode.block_map.lower_bound(offset);
@@ -2614,7 +3570,7 @@ int BlueStore::_do_read(
         derr << " failed to fetch overlay(nid = " << o->onode.nid
              << ", key = " << key 
              << "): " << cpp_strerror(r) << dendl;
-        goto out;
+        return r;
       }
       bufferlist frag;
       frag.substr_of(v, x_off, x_len);
@@ -2634,12 +3590,31 @@ int BlueStore::_do_read(
     // extent?
     if (bp != bend && bp->first <= offset) {
       uint64_t x_off = offset - bp->first;
+      uint64_t limit = x_len;
       x_len = MIN(x_len, bp->second.length - x_off);
+      map<uint64_t,bluestore_extent_t>::iterator last = bp;
+      uint64_t last_used = x_off + x_len;  // bytes of *last we consume
       if (!bp->second.has_flag(bluestore_extent_t::FLAG_UNWRITTEN)) {
 	dout(30) << __func__ << " data " << bp->first << ": " << bp->second
 		 << " use " << x_off << "~" << x_len
 		 << " final offset " << x_off + bp->second.offset
 		 << dendl;
+	// read on through any following extents that continue this one on
+	// disk, so that one device buffer backs the whole run
+	while (x_len < limit && last_used == last->second.length) {
+	  map<uint64_t,bluestore_extent_t>::iterator n = last;
+	  ++n;
+	  if (n == bend ||
+	      n->first != last->first + last->second.length ||
+	      n->second.offset != last->second.end() ||
+	      n->second.has_flag(bluestore_extent_t::FLAG_UNWRITTEN))
+	    break;
+	  last_used = MIN(limit - x_len, n->second.length);
+	  dout(30) << __func__ << " data " << n->first << ": " << n->second
+		   << " use 0~" << last_used << " (contiguous)" << dendl;
+	  x_len += last_used;
+	  last = n;
+	}
 	uint64_t front_extra = x_off % block_size;
 	uint64_t r_off = x_off - front_extra;
 	uint64_t r_len = ROUND_UP_TO(x_len + front_extra, block_size);
@@ -2647,9 +3622,9 @@ int BlueStore::_do_read(
 	bufferlist t;
 	r = bdev->read(r_off + bp->second.offset, r_len, &t, &ioc, buffered);
 	if (r < 0) {
-	  goto out;
+	  return r;
 	}
-	r = r_len;
+	logger->inc(l_bluestore_read_ios);
 	bufferlist u;
 	u.substr_of(t, front_extra, x_len);
 	bl.claim_append(u);
@@ -2661,7 +3636,8 @@ int BlueStore::_do_read(
       }
       offset += x_len;
       length -= x_len;
-      if (x_off + x_len == bp->second.length) {
+      bp = last;
+      if (last_used == bp->second.length) {
 	++bp;
       }
       continue;
@@ -2678,10 +3654,7 @@ int BlueStore::_do_read(
     offset += x_len;
     length -= x_len;
   }
-  r = bl.length();
-
- out:
-  return r;
+  return 0;
 }
 
 int BlueStore::fiemap(
@@ -2729,6 +3702,18 @@ int BlueStore::fiemap(
     len = o->onode.size - offset;
   }
 
+  // compressed runs never overlap extents or overlays
+  for (map<uint64_t,bluestore_compressed_t>::iterator cp =
+	 o->onode.seek_compressed(offset);
+       cp != o->onode.compressed_map.end() && cp->first < offset + len;
+       ++cp) {
+    uint64_t start = MAX(cp->first, offset);
+    uint64_t end = MIN(cp->first + cp->second.logical_length, offset + len);
+    dout(30) << __func__ << " compressed " << start << "~" << end - start
+	     << dendl;
+    m.insert(start, end - start);
+  }
+
   // loop over overlays and data fragments.  overlays take precedence.
   bend = o->onode.block_map.end();
   bp = o->onode.block_map.lower_bound(offset);
@@ -3346,14 +4331,22 @@ int BlueStore::omap_get_values(
   if (!o->onode.omap_head)
     goto out;
   o->flush();
-  for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
-    string key;
-    get_omap_key(o->onode.omap_head, *p, &key);
-    bufferlist val;
-    if (db->get(PREFIX_OMAP, key, &val) >= 0) {
-      dout(30) << __func__ << "  got " << pretty_binary_string(key)
-	       << " -> " << *p << dendl;
-      out->insert(make_pair(*p, val));
+  {
+    // the omap key prefix preserves order, so this is one sorted batch
+    string head;
+    get_omap_key(o->onode.omap_head, string(), &head);
+    set<string> to_get;
+    for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p)
+      to_get.insert(to_get.end(), head + *p);
+    map<string,bufferlist> got;
+    r = db->get(PREFIX_OMAP, to_get, &got);
+    for (map<string,bufferlist>::iterator p = got.begin();
+	 p != got.end();
+	 ++p) {
+      dout(30) << __func__ << "  got " << pretty_binary_string(p->first)
+	       << dendl;
+      out->insert(out->end(),
+		  make_pair(p->first.substr(head.length()), p->second));
     }
   }
  out:
@@ -3486,6 +4479,23 @@ int BlueStore::_open_super_meta()
   return 0;
 }
 
+void BlueStore::_set_csum(OnodeRef o)
+{
+  // large sequential writers get fewer, larger chunks
+  uint64_t chunk = g_conf->bluestore_csum_min_chunk;
+  if (o->onode.expected_write_size > chunk) {
+    chunk = MIN(o->onode.expected_write_size,
+		(uint64_t)g_conf->bluestore_csum_max_chunk);
+  }
+  unsigned order = 0;
+  while ((2ull << order) <= chunk)
+    ++order;
+  dout(20) << __func__ << " " << o->oid << " "
+	   << bluestore_onode_t::get_csum_type_string(csum_type)
+	   << " chunk " << (1ull << order) << dendl;
+  o->onode.set_csum(csum_type, order);
+}
+
 void BlueStore::_assign_nid(TransContext *txc, OnodeRef o)
 {
   if (o->onode.nid)
@@ -3534,6 +4544,16 @@ void BlueStore::_txc_release(
   }
 }
 
+void BlueStore::_txc_release_compressed(
+  TransContext *txc, CollectionRef& c, OnodeRef& o,
+  const bluestore_compressed_t& cm)
+{
+  for (auto& e : cm.extents) {
+    _txc_release(txc, c, o, e.offset, e.length,
+		 e.has_flag(bluestore_extent_t::FLAG_SHARED));
+  }
+}
+
 void BlueStore::_txc_state_proc(TransContext *txc)
 {
   while (true) {
@@ -3541,7 +4561,7 @@ void BlueStore::_txc_state_proc(TransContext *txc)
 	     << " " << txc->get_state_name() << dendl;
     switch (txc->state) {
     case TransContext::STATE_PREPARE:
-      txc->log_state_latency(logger, l_bluestore_state_prepare_lat);
+      txc->log_state_latency(logger, l_bluestore_state_prepare_lat, &txc_hist);
       if (txc->ioc.has_aios()) {
 	txc->state = TransContext::STATE_AIO_WAIT;
 	_txc_aio_submit(txc);
@@ -3550,13 +4570,13 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       // ** fall-thru **
 
     case TransContext::STATE_AIO_WAIT:
-      txc->log_state_latency(logger, l_bluestore_state_aio_wait_lat);
+      txc->log_state_latency(logger, l_bluestore_state_aio_wait_lat, &txc_hist);
       _txc_finish_io(txc);  // may trigger blocked txc's too
       return;
 
     case TransContext::STATE_IO_DONE:
       //assert(txc->osr->qlock.is_locked());  // see _txc_finish_io
-      txc->log_state_latency(logger, l_bluestore_state_io_done_lat);
+      txc->log_state_latency(logger, l_bluestore_state_io_done_lat, &txc_hist);
       txc->state = TransContext::STATE_KV_QUEUED;
       if (!g_conf->bluestore_sync_transaction) {
 	if (g_conf->bluestore_sync_submit_transaction) {
@@ -3574,16 +4594,18 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       }
       return;
     case TransContext::STATE_KV_QUEUED:
-      txc->log_state_latency(logger, l_bluestore_state_kv_queued_lat);
+      txc->log_state_latency(logger, l_bluestore_state_kv_queued_lat, &txc_hist);
       txc->state = TransContext::STATE_KV_DONE;
       _txc_finish_kv(txc);
       // ** fall-thru **
 
     case TransContext::STATE_KV_DONE:
-      txc->log_state_latency(logger, l_bluestore_state_kv_done_lat);
+      txc->log_state_latency(logger, l_bluestore_state_kv_done_lat, &txc_hist);
       if (txc->wal_txn) {
 	txc->state = TransContext::STATE_WAL_QUEUED;
-	if (g_conf->bluestore_sync_wal_apply) {
+	if (g_conf->bluestore_wal_batch_max_txc > 1) {
+	  _wal_batch_queue(txc);
+	} else if (g_conf->bluestore_sync_wal_apply) {
 	  _wal_apply(txc);
 	} else {
 	  wal_wq.queue(txc);
@@ -3594,7 +4616,7 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       break;
 
     case TransContext::STATE_WAL_APPLYING:
-      txc->log_state_latency(logger, l_bluestore_state_wal_applying_lat);
+      txc->log_state_latency(logger, l_bluestore_state_wal_applying_lat, &txc_hist);
       if (txc->ioc.has_aios()) {
 	txc->state = TransContext::STATE_WAL_AIO_WAIT;
 	_txc_aio_submit(txc);
@@ -3603,17 +4625,17 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       // ** fall-thru **
 
     case TransContext::STATE_WAL_AIO_WAIT:
-      txc->log_state_latency(logger, l_bluestore_state_wal_aio_wait_lat);
+      txc->log_state_latency(logger, l_bluestore_state_wal_aio_wait_lat, &txc_hist);
       _wal_finish(txc);
       return;
 
     case TransContext::STATE_WAL_CLEANUP:
-      txc->log_state_latency(logger, l_bluestore_state_wal_cleanup_lat);
+      txc->log_state_latency(logger, l_bluestore_state_wal_cleanup_lat, &txc_hist);
       txc->state = TransContext::STATE_FINISHING;
       // ** fall-thru **
 
     case TransContext::TransContext::STATE_FINISHING:
-      txc->log_state_latency(logger, l_bluestore_state_finishing_lat);
+      txc->log_state_latency(logger, l_bluestore_state_finishing_lat, &txc_hist);
       _txc_finish(txc);
       return;
 
@@ -3658,6 +4680,44 @@ void BlueStore::_txc_finish_io(TransContext *txc)
 	   p->state == TransContext::STATE_IO_DONE);
 }
 
+uint64_t BlueStore::_txc_write_extent_shards(TransContext *txc, OnodeRef o)
+{
+  bluestore_onode_t& on = o->onode;
+  if (!on.extent_map_shard_size && g_conf->bluestore_extent_map_shard_size) {
+    // new or inline; move block_map out into shards.  an extent belongs
+    // to the shard it starts in, and shards are whole allocation units so
+    // an allocation never starts in a shard before the one written to.
+    on.extent_map_shard_size = ROUND_UP_TO(
+      g_conf->bluestore_extent_map_shard_size,
+      g_conf->bluestore_min_alloc_size);
+    dout(20) << __func__ << " " << o->oid << " sharding extent map every "
+	     << on.extent_map_shard_size << dendl;
+    o->dirty_all_extents();
+  }
+  uint64_t bytes = 0;
+  for (auto s : o->dirty_extent_shards) {
+    string key;
+    get_extent_shard_key(on.nid, s, &key);
+    bufferlist bl;
+    unsigned n = on.encode_extent_shard(s, bl);
+    if (n) {
+      dout(20) << __func__ << " " << o->oid << " shard " << s << " has "
+	       << n << " extents and csums in " << bl.length() << " bytes"
+	       << dendl;
+      txc->t->set(PREFIX_EXTENT, key, bl);
+      on.extent_map_shards[s] = bl.length();
+      bytes += bl.length();
+      logger->inc(l_bluestore_onode_shard_writes);
+    } else if (on.extent_map_shards.erase(s)) {
+      dout(20) << __func__ << " " << o->oid << " shard " << s << " is empty"
+	       << dendl;
+      txc->t->rmkey(PREFIX_EXTENT, key);
+    }
+  }
+  o->dirty_extent_shards.clear();
+  return bytes;
+}
+
 int BlueStore::_txc_finalize(OpSequencer *osr, TransContext *txc)
 {
   dout(20) << __func__ << " osr " << osr << " txc " << txc
@@ -3667,10 +4727,17 @@ int BlueStore::_txc_finalize(OpSequencer *osr, TransContext *txc)
   for (set<OnodeRef>::iterator p = txc->onodes.begin();
        p != txc->onodes.end();
        ++p) {
+    uint64_t shard_bytes = _txc_write_extent_shards(txc, *p);
     bufferlist bl;
     ::encode((*p)->onode, bl);
     dout(20) << "  onode " << (*p)->oid << " is " << bl.length() << dendl;
     txc->t->set(PREFIX_OBJ, (*p)->key, bl);
+    logger->inc(l_bluestore_onode_write_bytes, bl.length() + shard_bytes);
+    uint64_t extent_bytes = 0;
+    for (auto& s : (*p)->onode.extent_map_shards)
+      extent_bytes += s.second;
+    (*p)->space->cache->set_onode_bytes(
+      p->get(), sizeof(Onode) + bl.length() + extent_bytes);
 
     std::lock_guard<std::mutex> l((*p)->flush_lock);
     (*p)->flush_txns.insert(txc);
@@ -3782,11 +4849,11 @@ void BlueStore::_osr_reap_done(OpSequencer *osr)
     }
 
     if (txc->first_collection) {
-      txc->first_collection->onode_map.trim(g_conf->bluestore_onode_map_size);
+      _trim_cache(txc->first_collection->cache);
     }
 
     osr->q.pop_front();
-    txc->log_state_latency(logger, l_bluestore_state_done_lat);
+    txc->log_state_latency(logger, l_bluestore_state_done_lat, &txc_hist);
     delete txc;
     osr->qcond.notify_all();
     if (osr->q.empty())
@@ -3824,21 +4891,51 @@ void BlueStore::_txc_update_fm(TransContext *txc)
 	<< "~" << p.get_len() << dendl;
       fm->release(p.get_start(), p.get_len(), txc->t);
 
-      if (!g_conf->bluestore_debug_no_reuse_blocks)
-	alloc->release(p.get_start(), p.get_len());
-    }
+      // if we discard, the kv sync thread does it once this commits
+      if (!g_conf->bluestore_debug_no_reuse_blocks &&
+	  !bdev->supports_discard())
+	alloc->release(p.get_start(), p.get_len());
+    }
+  }
+}
+
+
+void BlueStore::_discard_finish(interval_set<uint64_t>& extents)
+{
+  dout(20) << __func__ << " " << extents << dendl;
+  // the kv sync thread releases them ahead of its next commit so that
+  // they become allocatable even if nothing else is being committed
+  std::lock_guard<std::mutex> l(kv_lock);
+  discard_finished.insert(extents);
+  kv_cond.notify_one();
+}
+
+void BlueStore::discard_drain()
+{
+  bdev->discard_drain();
+  std::unique_lock<std::mutex> l(kv_lock);
+  while (!discard_finished.empty() ||
+	 !discard_releasing.empty()) {
+    dout(20) << " waiting for discarded extents to commit" << dendl;
+    kv_sync_cond.wait(l);
   }
 }
 
+uint64_t BlueStore::get_alloc_free()
+{
+  return alloc->get_free();
+}
 
 void BlueStore::_kv_sync_thread()
 {
   dout(10) << __func__ << " start" << dendl;
+  utime_t last_snapshot = ceph_clock_now(NULL);
   std::unique_lock<std::mutex> l(kv_lock);
   while (true) {
     assert(kv_committing.empty());
     assert(wal_cleaning.empty());
-    if (kv_queue.empty() && wal_cleanup_queue.empty()) {
+    if (kv_queue.empty() && wal_cleanup_queue.empty() &&
+	discard_finished.empty()) {
       if (kv_stop)
 	break;
       dout(20) << __func__ << " sleep" << dendl;
@@ -3850,6 +4947,7 @@ void BlueStore::_kv_sync_thread()
 	       << " cleaning " << wal_cleanup_queue.size() << dendl;
       kv_committing.swap(kv_queue);
       wal_cleaning.swap(wal_cleanup_queue);
+      discard_releasing.swap(discard_finished);
       utime_t start = ceph_clock_now(NULL);
       l.unlock();
 
@@ -3885,7 +4983,8 @@ void BlueStore::_kv_sync_thread()
 	   ++p) {
 	dout(20) << __func__ << " release " << p.get_start()
 		 << "~" << p.get_len() << dendl;
-	if (!g_conf->bluestore_debug_no_reuse_blocks)
+	if (!g_conf->bluestore_debug_no_reuse_blocks &&
+	    !bdev->supports_discard())
 	  alloc->release(p.get_start(), p.get_len());
       }
 
@@ -3906,6 +5005,13 @@ void BlueStore::_kv_sync_thread()
 	}
       }
 
+      // trimmed extents take the normal commit path back to the allocator
+      for (interval_set<uint64_t>::iterator p = discard_releasing.begin();
+	   p != discard_releasing.end();
+	   ++p) {
+	alloc->release(p.get_start(), p.get_len());
+      }
+
       alloc->commit_start();
 
       // flush/barrier on block device
@@ -3940,7 +5046,33 @@ void BlueStore::_kv_sync_thread()
 	get_wal_key(wt.seq, &key);
 	t->rmkey(PREFIX_WAL, key);
       }
+
+      // every freelist update is applied by this thread and submitted
+      // ahead of t, so a snapshot taken now is exactly what t commits.
+      if (g_conf->bluestore_freelist_snapshot &&
+	  g_conf->bluestore_freelist_snapshot_interval > 0 &&
+	  !g_conf->bluestore_sync_transaction &&
+	  !g_conf->bluestore_sync_submit_transaction &&
+	  start - last_snapshot >=
+	    utime_t(g_conf->bluestore_freelist_snapshot_interval, 0)) {
+	if (fm->write_snapshot(t))
+	  dout(10) << __func__ << " wrote freelist snapshot" << dendl;
+	last_snapshot = start;
+      }
+
       db->submit_transaction_sync(t);
+
+      // now that the frees are durable, trim them; they go back to the
+      // allocator once the discard completes (see _discard_finish)
+      if (bdev->supports_discard() &&
+	  !g_conf->bluestore_debug_no_reuse_blocks) {
+	for (auto txc : kv_committing) {
+	  released.insert(txc->released);
+	}
+	if (!released.empty())
+	  bdev->queue_discard(released);
+      }
+
       utime_t finish = ceph_clock_now(NULL);
       utime_t dur = finish - start;
       dout(20) << __func__ << " committed " << kv_committing.size()
@@ -3969,6 +5101,7 @@ void BlueStore::_kv_sync_thread()
       }
 
       l.lock();
+      discard_releasing.clear();
     }
   }
   dout(10) << __func__ << " finish" << dendl;
@@ -3984,21 +5117,73 @@ bluestore_wal_op_t *BlueStore::_get_wal_op(TransContext *txc, OnodeRef o)
   return &txc->wal_txn->ops.back();
 }
 
+void BlueStore::WALBatch::write(uint64_t offset, bufferlist& bl)
+{
+  uint64_t end = offset + bl.length();
+  ++num_writes;
+  auto p = writes.lower_bound(offset);
+  if (p != writes.begin()) {
+    --p;
+    uint64_t pend = p->first + p->second.length();
+    if (pend > offset) {
+      // trim the queued write that we start inside of
+      if (pend > end) {
+	bufferlist tail;
+	tail.substr_of(p->second, end - p->first, pend - end);
+	writes[end].swap(tail);
+      }
+      bufferlist head;
+      head.substr_of(p->second, 0, offset - p->first);
+      p->second.swap(head);
+    }
+    ++p;
+  }
+  while (p != writes.end() && p->first < end) {
+    uint64_t pend = p->first + p->second.length();
+    if (pend > end) {
+      bufferlist tail;
+      tail.substr_of(p->second, end - p->first, pend - end);
+      writes[end].swap(tail);
+    }
+    writes.erase(p++);
+  }
+  writes[offset].claim(bl);
+}
+
+void BlueStore::WALBatch::overlay(uint64_t offset, uint64_t length,
+				  bufferlist *bl)
+{
+  uint64_t end = offset + length;
+  auto p = writes.lower_bound(offset);
+  if (p != writes.begin())
+    --p;
+  for (; p != writes.end() && p->first < end; ++p) {
+    uint64_t start = MAX(p->first, offset);
+    uint64_t stop = MIN(p->first + p->second.length(), end);
+    if (start >= stop)
+      continue;
+    p->second.copy(start - p->first, stop - start,
+		   bl->c_str() + (start - offset));
+  }
+}
+
 int BlueStore::_wal_apply(TransContext *txc)
 {
   bluestore_wal_transaction_t& wt = *txc->wal_txn;
   dout(20) << __func__ << " txc " << txc << " seq " << wt.seq << dendl;
-  txc->log_state_latency(logger, l_bluestore_state_wal_queued_lat);
+  txc->log_state_latency(logger, l_bluestore_state_wal_queued_lat, &txc_hist);
   txc->state = TransContext::STATE_WAL_APPLYING;
 
   assert(txc->ioc.pending_aios.empty());
-  vector<OnodeRef>::iterator q = txc->wal_op_onodes.begin();
+  txc->ioc.prio = BDEV_PRIO_WAL;
+  WALBatch b;
   for (list<bluestore_wal_op_t>::iterator p = wt.ops.begin();
        p != wt.ops.end();
-       ++p, ++q) {
-    int r = _do_wal_op(*p, &txc->ioc);
+       ++p) {
+    int r = _do_wal_op(*p, b, &txc->ioc);
     assert(r == 0);
   }
+  _wal_submit(b, &txc->ioc);
 
   _txc_state_proc(txc);
   return 0;
@@ -4012,11 +5197,152 @@ int BlueStore::_wal_finish(TransContext *txc)
   std::lock_guard<std::mutex> l(kv_lock);
   txc->state = TransContext::STATE_WAL_CLEANUP;
   wal_cleanup_queue.push_back(txc);
+  for (auto t : txc->wal_batch) {
+    t->log_state_latency(logger, l_bluestore_state_wal_aio_wait_lat, &txc_hist);
+    t->state = TransContext::STATE_WAL_CLEANUP;
+    wal_cleanup_queue.push_back(t);
+  }
+  txc->wal_batch.clear();
   kv_cond.notify_one();
   return 0;
 }
 
-int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
+void BlueStore::_wal_batch_queue(TransContext *txc)
+{
+  uint64_t bytes = 0;
+  for (auto& wo : txc->wal_txn->ops)
+    bytes += wo.extent.length;
+  std::lock_guard<std::mutex> l(wal_batch_lock);
+  dout(20) << __func__ << " txc " << txc << " " << bytes << " bytes, "
+	   << wal_batch_queue.size() << " already queued" << dendl;
+  wal_batch_queue.push_back(txc);
+  wal_batch_queue_bytes += bytes;
+  // the thread is either idle or waiting for the batch to fill
+  if (wal_batch_queue.size() == 1 ||
+      wal_batch_queue.size() >= g_conf->bluestore_wal_batch_max_txc ||
+      wal_batch_queue_bytes >= g_conf->bluestore_wal_batch_max_bytes)
+    wal_batch_cond.notify_one();
+}
+
+void BlueStore::_wal_batch_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(wal_batch_lock);
+  while (true) {
+    if (wal_batch_queue.empty()) {
+      if (wal_batch_stop)
+	break;
+      dout(20) << __func__ << " sleep" << dendl;
+      wal_batch_cond.wait(l);
+      dout(20) << __func__ << " wake" << dendl;
+      continue;
+    }
+    uint64_t max_txc = g_conf->bluestore_wal_batch_max_txc;
+    uint64_t max_bytes = g_conf->bluestore_wal_batch_max_bytes;
+    if (!wal_batch_stop &&
+	wal_batch_queue.size() < max_txc &&
+	wal_batch_queue_bytes < max_bytes) {
+      // give the batch a chance to fill, measured from when the oldest
+      // txc committed
+      utime_t due = wal_batch_queue.front()->start;
+      due += g_conf->bluestore_wal_batch_max_age;
+      utime_t now = ceph_clock_now(g_ceph_context);
+      if (now < due) {
+	wal_batch_cond.wait_for(
+	  l, std::chrono::nanoseconds((due - now).to_nsec()));
+	continue;
+      }
+    }
+    vector<TransContext*> txcs;
+    uint64_t bytes = 0;
+    while (!wal_batch_queue.empty() &&
+	   txcs.size() < max_txc &&
+	   (txcs.empty() || bytes < max_bytes)) {
+      TransContext *txc = wal_batch_queue.front();
+      wal_batch_queue.pop_front();
+      for (auto& wo : txc->wal_txn->ops)
+	bytes += wo.extent.length;
+      txcs.push_back(txc);
+    }
+    wal_batch_queue_bytes -= bytes;
+    l.unlock();
+    _wal_batch_apply(txcs);
+    l.lock();
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void BlueStore::_wal_batch_apply(vector<TransContext*>& txcs)
+{
+  // the first txc's ioc carries the io for the whole batch, and its
+  // completion finishes the rest (see _wal_finish)
+  TransContext *leader = txcs.front();
+  dout(20) << __func__ << " " << txcs.size() << " txcs, leader " << leader
+	   << dendl;
+  assert(leader->ioc.pending_aios.empty());
+  leader->ioc.prio = BDEV_PRIO_WAL;
+  WALBatch b;
+  for (auto txc : txcs) {
+    dout(20) << __func__ << "  txc " << txc << " seq " << txc->wal_txn->seq
+	     << dendl;
+    txc->log_state_latency(logger, l_bluestore_state_wal_queued_lat, &txc_hist);
+    txc->state = TransContext::STATE_WAL_APPLYING;
+    for (auto& wo : txc->wal_txn->ops) {
+      int r = _do_wal_op(wo, b, &leader->ioc);
+      assert(r == 0);
+    }
+    if (txc != leader)
+      leader->wal_batch.push_back(txc);
+  }
+  _wal_submit(b, &leader->ioc);
+  logger->inc(l_bluestore_wal_batches);
+  logger->inc(l_bluestore_wal_batch_txc, txcs.size());
+  _txc_state_proc(leader);
+}
+
+int BlueStore::_wal_read(WALBatch& b, uint64_t offset, uint64_t length,
+			 bufferlist *bl, IOContext *ioc)
+{
+  int r = bdev->read(offset, length, bl, ioc, true);
+  if (r < 0)
+    return r;
+  b.overlay(offset, length, bl);
+  return 0;
+}
+
+void BlueStore::_wal_submit(WALBatch& b, IOContext *ioc)
+{
+  uint64_t max_bytes = MAX(g_conf->bluestore_wal_batch_max_bytes,
+			   bdev->get_block_size());
+  unsigned ios = 0;
+  auto p = b.writes.begin();
+  while (p != b.writes.end()) {
+    uint64_t offset = p->first;
+    bufferlist bl;
+    bl.claim(p->second);
+    ++p;
+    // merge adjacent writes into a single io
+    while (p != b.writes.end() &&
+	   p->first == offset + bl.length() &&
+	   bl.length() + p->second.length() <= max_bytes &&
+	   bl.get_num_buffers() + p->second.get_num_buffers() <= IOV_MAX) {
+      bl.claim_append(p->second);
+      ++p;
+    }
+    dout(20) << __func__ << " write " << offset << "~" << bl.length() << dendl;
+    int r = bdev->aio_write(offset, bl, ioc, true);
+    assert(r == 0);
+    ++ios;
+  }
+  dout(20) << __func__ << " " << b.num_writes << " writes in " << ios
+	   << " ios" << dendl;
+  logger->inc(l_bluestore_wal_write_ops, b.num_writes);
+  logger->inc(l_bluestore_wal_write_ios, ios);
+  b.writes.clear();
+  b.num_writes = 0;
+}
+
+int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, WALBatch& b, IOContext *ioc)
 {
   const uint64_t block_size = bdev->get_block_size();
   const uint64_t block_mask = ~(block_size - 1);
@@ -4027,6 +5353,8 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
 
   // NOTE: we are doing all reads and writes buffered so that we can
   // avoid worrying about multiple RMW cycles over the same blocks.
+  // Reads go through the batch so that they see writes queued by
+  // earlier ops that have not been submitted yet.
 
   switch (wo.op) {
   case bluestore_wal_op_t::OP_WRITE:
@@ -4047,7 +5375,7 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
       offset = offset & block_mask;
       dout(20) << __func__ << "  reading initial partial block "
 	       << src_offset << "~" << block_size << dendl;
-      r = bdev->read(src_offset, block_size, &first, ioc, true);
+      r = _wal_read(b, src_offset, block_size, &first, ioc);
       assert(r == 0);
       bufferlist t;
       t.substr_of(first, 0, first_len);
@@ -4066,7 +5394,7 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
       } else {
 	dout(20) << __func__ << "  reading trailing partial block "
 		 << last_offset << "~" << block_size << dendl;
-	r = bdev->read(last_offset, block_size, &last, ioc, true);
+	r = _wal_read(b, last_offset, block_size, &last, ioc);
         assert(r == 0);
       }
       bufferlist t;
@@ -4075,8 +5403,7 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
       bl.claim_append(t);
     }
     assert((bl.length() & ~block_mask) == 0);
-    r = bdev->aio_write(offset, bl, ioc, true);
-    assert(r == 0);
+    b.write(offset, bl);
   }
   break;
 
@@ -4089,12 +5416,10 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
     assert(wo.extent.length == wo.src_extent.length);
     assert((wo.src_extent.offset & ~block_mask) == 0);
     bufferlist bl;
-    r = bdev->read(wo.src_extent.offset, wo.src_extent.length, &bl, ioc,
-		       true);
+    r = _wal_read(b, wo.src_extent.offset, wo.src_extent.length, &bl, ioc);
     assert(r == 0);
     assert(bl.length() == wo.extent.length);
-    r = bdev->aio_write(wo.extent.offset, bl, ioc, true);
-    assert(r == 0);
+    b.write(wo.extent.offset, bl);
   }
   break;
 
@@ -4109,12 +5434,11 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
       uint64_t first_offset = offset & block_mask;
       dout(20) << __func__ << "  reading initial partial block "
 	       << first_offset << "~" << block_size << dendl;
-      r = bdev->read(first_offset, block_size, &first, ioc, true);
+      r = _wal_read(b, first_offset, block_size, &first, ioc);
       assert(r == 0);
       size_t z_len = MIN(block_size - first_len, length);
       memset(first.c_str() + first_len, 0, z_len);
-      r = bdev->aio_write(first_offset, first, ioc, true);
-      assert(r == 0);
+      b.write(first_offset, first);
       offset += block_size - first_len;
       length -= z_len;
     }
@@ -4122,8 +5446,16 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
     if (length >= block_size) {
       uint64_t middle_len = length & block_mask;
       dout(20) << __func__ << "  zero " << offset << "~" << length << dendl;
-      r = bdev->aio_zero(offset, middle_len, ioc);
-      assert(r == 0);
+      // share one zeroed buffer across the whole range
+      bufferptr z = buffer::create_page_aligned(MIN(middle_len, 1024 * 1024));
+      z.zero();
+      bufferlist zbl;
+      for (uint64_t left = middle_len; left > 0; ) {
+	uint64_t l = MIN(left, (uint64_t)z.length());
+	zbl.append(z, 0, l);
+	left -= l;
+      }
+      b.write(offset, zbl);
       offset += middle_len;
       length -= middle_len;
     }
@@ -4133,11 +5465,10 @@ int BlueStore::_do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc)
       bufferlist last;
       dout(20) << __func__ << "  reading trailing partial block "
 	       << offset << "~" << block_size << dendl;
-      r = bdev->read(offset, block_size, &last, ioc, true);
+      r = _wal_read(b, offset, block_size, &last, ioc);
       assert(r == 0);
       memset(last.c_str(), 0, length);
-      r = bdev->aio_write(offset, last, ioc, true);
-      assert(r == 0);
+      b.write(offset, last);
     }
   }
   break;
@@ -4550,9 +5881,11 @@ void BlueStore::_txc_add_transaction(TransContext *txc, Transaction *t)
       {
         uint64_t expected_object_size = op->expected_object_size;
         uint64_t expected_write_size = op->expected_write_size;
+        uint32_t flags = op->hint_type;
 	r = _setallochint(txc, c, o,
 			  expected_object_size,
-			  expected_write_size);
+			  expected_write_size,
+			  flags);
       }
       break;
 
@@ -4846,6 +6179,7 @@ void BlueStore::_dump_onode(OnodeRef o, int log_level)
 	   << " size " << o->onode.size
 	   << " expected_object_size " << o->onode.expected_object_size
 	   << " expected_write_size " << o->onode.expected_write_size
+	   << " alloc_hint_flags " << o->onode.alloc_hint_flags
 	   << dendl;
   for (map<string,bufferptr>::iterator p = o->onode.attrs.begin();
        p != o->onode.attrs.end();
@@ -4874,6 +6208,10 @@ void BlueStore::_dump_onode(OnodeRef o, int log_level)
   if (!o->onode.overlay_refs.empty()) {
     dout(log_level) << __func__ << "  overlay_refs " << o->onode.overlay_refs << dendl;
   }
+  for (auto& p : o->onode.compressed_map) {
+    dout(log_level) << __func__ << "  compressed " << p.first << " " << p.second
+	     << dendl;
+  }
 }
 
 void BlueStore::_pad_zeros(
@@ -5046,6 +6384,11 @@ int BlueStore::_do_allocate(
   uint64_t block_size = bdev->get_block_size();
   uint64_t block_mask = ~(block_size - 1);
 
+  o->dirty_extents(
+    orig_offset - orig_offset % min_alloc_size,
+    ROUND_UP_TO(orig_offset + orig_length, min_alloc_size) -
+    (orig_offset - orig_offset % min_alloc_size));
+
   // start with any full blocks we will write
   uint64_t offset = orig_offset;
   uint64_t length = orig_length;
@@ -5319,6 +6662,234 @@ bool BlueStore::_can_overlay_write(OnodeRef o, uint64_t length)
     (int)length <= g_conf->bluestore_overlay_max_length;
 }
 
+bool BlueStore::_wants_compression(OnodeRef o)
+{
+  uint32_t hint = o->onode.alloc_hint_flags;
+  switch (comp_mode) {
+  case COMP_PASSIVE:
+    return hint & CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE;
+  case COMP_AGGRESSIVE:
+    return !(hint & CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE);
+  case COMP_FORCE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool BlueStore::_compress(const bufferlist& in, bufferlist *out)
+{
+  uint64_t min_alloc_size = g_conf->bluestore_min_alloc_size;
+  int r = compressors[comp_alg]->compress(in, *out);
+  if (r < 0) {
+    dout(10) << __func__ << " compress failed: " << cpp_strerror(r) << dendl;
+    logger->inc(l_bluestore_compress_rejected_count);
+    return false;
+  }
+  // we only win if we allocate fewer units than the raw data would
+  uint64_t want = ROUND_UP_TO(out->length(), min_alloc_size);
+  if (want >= in.length() ||
+      want > in.length() * g_conf->bluestore_compression_required_ratio) {
+    dout(20) << __func__ << " " << in.length() << " -> " << out->length()
+	     << " (" << want << " allocated), not worth it" << dendl;
+    logger->inc(l_bluestore_compress_rejected_count);
+    return false;
+  }
+  dout(20) << __func__ << " " << in.length() << " -> " << out->length()
+	   << " (" << want << " allocated)" << dendl;
+  return true;
+}
+
+void BlueStore::_do_release_range(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef o,
+  uint64_t offset,
+  uint64_t length)
+{
+  // offset and length are min_alloc_size aligned, and so are extents,
+  // so anything we split stays aligned.
+  uint64_t end = offset + length;
+  o->dirty_extents(offset, length);
+  map<uint64_t,bluestore_extent_t>::iterator bp = o->onode.seek_extent(offset);
+  while (bp != o->onode.block_map.end() && bp->first < end) {
+    if (bp->first < offset) {
+      uint64_t left = offset - bp->first;
+      o->onode.block_map[offset] =
+	bluestore_extent_t(bp->second.offset + left,
+			   bp->second.length - left,
+			   bp->second.flags);
+      bp->second.length = left;
+      dout(20) << __func__ << "  keep " << bp->first << ": " << bp->second
+	       << dendl;
+      ++bp;
+      continue;
+    }
+    if (bp->first + bp->second.length > end) {
+      uint64_t overlap = end - bp->first;
+      o->onode.block_map[end] =
+	bluestore_extent_t(bp->second.offset + overlap,
+			   bp->second.length - overlap,
+			   bp->second.flags);
+      bp->second.length = overlap;
+    }
+    dout(20) << __func__ << "  dealloc " << bp->first << ": " << bp->second
+	     << dendl;
+    _txc_release(
+      txc, c, o,
+      bp->second.offset, bp->second.length,
+      bp->second.has_flag(bluestore_extent_t::FLAG_SHARED));
+    o->onode.block_map.erase(bp++);
+  }
+
+  map<uint64_t,bluestore_compressed_t>::iterator cp =
+    o->onode.seek_compressed(offset);
+  while (cp != o->onode.compressed_map.end() && cp->first < end) {
+    // _do_expand_compressed made sure nothing straddles the range
+    assert(cp->first >= offset);
+    assert(cp->first + cp->second.logical_length <= end);
+    dout(20) << __func__ << "  dealloc " << cp->first << ": " << cp->second
+	     << dendl;
+    _txc_release_compressed(txc, c, o, cp->second);
+    o->onode.compressed_map.erase(cp++);
+  }
+}
+
+int BlueStore::_do_expand_compressed(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef o,
+  uint64_t offset,
+  uint64_t length)
+{
+  uint64_t end = offset + length;
+  map<uint64_t,bluestore_compressed_t>::iterator cp =
+    o->onode.seek_compressed(offset);
+  while (cp != o->onode.compressed_map.end() && cp->first < end) {
+    uint64_t c_off = cp->first;
+    uint64_t c_end = c_off + cp->second.logical_length;
+    if (c_off >= offset && c_end <= end) {
+      // the caller replaces all of it
+      dout(20) << __func__ << " drop " << c_off << ": " << cp->second << dendl;
+      _txc_release_compressed(txc, c, o, cp->second);
+      o->onode.compressed_map.erase(cp++);
+      continue;
+    }
+
+    // keep whatever lies outside offset~length, uncompressed
+    dout(20) << __func__ << " expand " << c_off << ": " << cp->second << dendl;
+    if (!txc->compressed_writes.count(cp->second.extents.front().offset))
+      o->flush();   // in case an earlier txc is still writing it
+    bufferlist bl;
+    int r = _do_read_compressed(o, c_off, cp->second, &bl, false, txc);
+    if (r < 0)
+      return r;
+    _txc_release_compressed(txc, c, o, cp->second);
+    o->onode.compressed_map.erase(cp++);
+    if (c_off < offset) {
+      bufferlist head;
+      head.substr_of(bl, 0, offset - c_off);
+      r = _do_write_data(txc, c, o, c_off, head.length(), head, 0);
+      if (r < 0)
+	return r;
+    }
+    if (c_end > end) {
+      bufferlist tail;
+      tail.substr_of(bl, end - c_off, c_end - end);
+      r = _do_write_data(txc, c, o, end, tail.length(), tail, 0);
+      if (r < 0)
+	return r;
+    }
+    // we may have rewritten the map under us
+    cp = o->onode.seek_compressed(c_end);
+  }
+  return 0;
+}
+
+int BlueStore::_do_write_compressed(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef o,
+  uint64_t offset,
+  uint64_t length,
+  bufferlist& cbl)
+{
+  uint64_t min_alloc_size = g_conf->bluestore_min_alloc_size;
+  uint64_t block_size = bdev->get_block_size();
+  assert(offset % min_alloc_size == 0);
+  assert(length % min_alloc_size == 0);
+
+  dout(20) << __func__ << " " << o->oid << " " << offset << "~" << length
+	   << " as " << cbl.length() << " bytes" << dendl;
+
+  _do_overlay_trim(txc, o, offset, length);
+  _do_release_range(txc, c, o, offset, length);
+  if (offset + length > (o->onode.size & ~(block_size - 1)) &&
+      o->tail_bl.length()) {
+    dout(20) << __func__ << " clearing cached tail" << dendl;
+    o->clear_tail();
+  }
+
+  // zero tail of previous existing extent?
+  if (offset > o->onode.size) {
+    uint64_t end = ROUND_UP_TO(o->onode.size, block_size);
+    map<uint64_t, bluestore_extent_t>::iterator pp = o->onode.find_extent(end);
+    if (offset > end &&
+	pp != o->onode.block_map.end()) {
+      uint64_t x_off = end - pp->first;
+      uint64_t x_len = pp->second.length - x_off;
+      dout(10) << __func__ << " zero tail " << x_off << "~" << x_len
+	       << " of prior extent " << pp->first << ": " << pp->second
+	       << dendl;
+      bdev->aio_zero(pp->second.offset + x_off, x_len, &txc->ioc);
+    }
+  }
+
+  uint64_t want = ROUND_UP_TO(cbl.length(), min_alloc_size);
+  int r = alloc->reserve(want);
+  if (r < 0) {
+    derr << __func__ << " failed to reserve " << want << dendl;
+    return r;
+  }
+
+  bluestore_compressed_t& cm = o->onode.compressed_map[offset];
+  cm.logical_length = length;
+  cm.compressed_length = cbl.length();
+  cm.alg = comp_alg;
+  bufferlist padded = cbl;
+  if (padded.length() % block_size)
+    padded.append_zero(block_size - padded.length() % block_size);
+  uint64_t pos = 0;
+  uint64_t hint = 0;
+  while (want > 0) {
+    bluestore_extent_t e;
+    r = alloc->allocate(want, min_alloc_size, hint, &e.offset, &e.length);
+    assert(r == 0);
+    txc->allocated.insert(e.offset, e.length);
+    cm.extents.push_back(e);
+    if (pos < padded.length()) {
+      bufferlist t;
+      t.substr_of(padded, pos, MIN(e.length, padded.length() - pos));
+      bdev->aio_write(e.offset, t, &txc->ioc, false);
+      pos += t.length();
+    }
+    want -= e.length;
+    hint = e.end();
+  }
+  txc->compressed_writes[cm.extents.front().offset] = cbl;
+  dout(10) << __func__ << " " << offset << ": " << cm << dendl;
+
+  logger->inc(l_bluestore_compress_success_count);
+  logger->inc(l_bluestore_compressed_original, length);
+  logger->inc(l_bluestore_compressed_allocated, cm.get_allocated());
+
+  if (offset + length > o->onode.size) {
+    dout(20) << __func__ << " extending size to " << offset + length << dendl;
+    o->onode.size = offset + length;
+  }
+  return 0;
+}
+
 int BlueStore::_do_write(
   TransContext *txc,
   CollectionRef& c,
@@ -5330,6 +6901,101 @@ int BlueStore::_do_write(
 {
   int r = 0;
 
+  dout(20) << __func__
+	   << " " << o->oid << " " << orig_offset << "~" << orig_length
+	   << " - have " << o->onode.size
+	   << " bytes in " << o->onode.block_map.size()
+	   << " extents" << dendl;
+
+  if (orig_length == 0) {
+    return 0;
+  }
+
+  if (o->onode.size == 0 ||
+      (!o->onode.has_csum() && !o->onode.has_data())) {
+    _set_csum(o);
+  }
+
+  r = _do_expand_compressed(txc, c, o, orig_offset, orig_length);
+  if (r < 0)
+    return r;
+
+  // before the size changes
+  o->dirty_csum(orig_offset, orig_length);
+  o->onode.csum_write(orig_offset, orig_length, &orig_bl);
+
+  // compress the whole min_alloc_size units we cover, in blobs of
+  // up to bluestore_compression_max_blob_size
+  uint64_t min_alloc_size = g_conf->bluestore_min_alloc_size;
+  uint64_t orig_end = orig_offset + orig_length;
+  uint64_t c_start = ROUND_UP_TO(orig_offset, min_alloc_size);
+  uint64_t c_end = orig_end - orig_end % min_alloc_size;
+  uint64_t blob_size = MAX(min_alloc_size,
+			   g_conf->bluestore_compression_max_blob_size -
+			   g_conf->bluestore_compression_max_blob_size %
+			   min_alloc_size);
+  if (c_end > c_start &&
+      c_end - c_start >= g_conf->bluestore_compression_min_blob_size &&
+      _wants_compression(o)) {
+    uint64_t offset = orig_offset;
+    for (uint64_t pos = c_start; pos < c_end; pos += blob_size) {
+      uint64_t length = MIN(blob_size, c_end - pos);
+      if (length < g_conf->bluestore_compression_min_blob_size)
+	break;
+      bufferlist bl, cbl;
+      bl.substr_of(orig_bl, pos - orig_offset, length);
+      if (!_compress(bl, &cbl))
+	continue;
+      if (pos > offset) {
+	bufferlist t;
+	t.substr_of(orig_bl, offset - orig_offset, pos - offset);
+	r = _do_write_data(txc, c, o, offset, pos - offset, t, fadvise_flags);
+	if (r < 0)
+	  goto out;
+      }
+      r = _do_write_compressed(txc, c, o, pos, length, cbl);
+      if (r < 0)
+	goto out;
+      offset = pos + length;
+    }
+    if (offset < orig_end) {
+      bufferlist t;
+      t.substr_of(orig_bl, offset - orig_offset, orig_end - offset);
+      r = _do_write_data(txc, c, o, offset, orig_end - offset, t,
+			 fadvise_flags);
+    }
+  } else {
+    r = _do_write_data(txc, c, o, orig_offset, orig_length, orig_bl,
+		       fadvise_flags);
+  }
+  if (r < 0)
+    goto out;
+
+  if (g_conf->bluestore_default_buffered_write &&
+      (fadvise_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+			CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0) {
+    bufferlist t;
+    t.substr_of(orig_bl, 0, orig_length);
+    o->bc.write(orig_offset, t);
+  } else {
+    o->bc.discard(orig_offset, orig_length);
+  }
+
+ out:
+  return r;
+}
+
+int BlueStore::_do_write_data(
+  TransContext *txc,
+  CollectionRef& c,
+  OnodeRef o,
+  uint64_t orig_offset,
+  uint64_t orig_length,
+  bufferlist& orig_bl,
+  uint32_t fadvise_flags)
+{
+  int r = 0;
+
   dout(20) << __func__
 	   << " " << o->oid << " " << orig_offset << "~" << orig_length
 	   << " - have " << o->onode.size
@@ -5653,7 +7319,7 @@ int BlueStore::_do_write_zero(
 {
   bufferlist zl;
   zl.append_zero(length);
-  return _do_write(txc, c, o, offset, length, zl, 0);
+  return _do_write_data(txc, c, o, offset, length, zl, 0);
 }
 
 int BlueStore::_zero(TransContext *txc,
@@ -5670,10 +7336,20 @@ int BlueStore::_zero(TransContext *txc,
   _dump_onode(o);
   _assign_nid(txc, o);
 
+  if (o->onode.size == 0 ||
+      (!o->onode.has_csum() && !o->onode.has_data()))
+    _set_csum(o);
+  o->bc.discard(offset, length);
+
+  r = _do_expand_compressed(txc, c, o, offset, length);
+  if (r < 0)
+    return r;
+
   // overlay
   _do_overlay_trim(txc, o, offset, length);
 
   uint64_t block_size = bdev->get_block_size();
+  o->dirty_extents(offset, length);
   map<uint64_t,bluestore_extent_t>::iterator bp = o->onode.seek_extent(offset);
 
   // zero tail of previous existing extent?
@@ -5741,6 +7417,8 @@ int BlueStore::_zero(TransContext *txc,
     ++bp;
   }
 
+  o->dirty_csum(offset, length);
+  o->onode.csum_write(offset, length, NULL);
   if (offset + length > o->onode.size) {
     o->onode.size = offset + length;
     dout(20) << __func__ << " extending size to " << offset + length
@@ -5765,6 +7443,12 @@ int BlueStore::_do_truncate(
   // they may touch.
   o->flush();
 
+  if (offset < o->onode.size) {
+    int r = _do_expand_compressed(txc, c, o, offset, o->onode.size - offset);
+    if (r < 0)
+      return r;
+  }
+
   // trim down cached tail
   if (o->tail_bl.length()) {
     // we could adjust this if we truncate down within the same
@@ -5772,11 +7456,15 @@ int BlueStore::_do_truncate(
     dout(20) << __func__ << " clear cached tail" << dendl;
     o->clear_tail();
   }
+  o->bc.truncate(offset);
 
   // trim down fragments
   map<uint64_t,bluestore_extent_t>::iterator bp = o->onode.block_map.end();
   if (bp != o->onode.block_map.begin())
     --bp;
+  if (bp != o->onode.block_map.end() &&
+      bp->first + bp->second.length > alloc_end)
+    o->dirty_extents(alloc_end, bp->first + bp->second.length - alloc_end);
   while (bp != o->onode.block_map.end()) {
     if (bp->first + bp->second.length <= alloc_end) {
       break;
@@ -5902,6 +7590,11 @@ int BlueStore::_do_truncate(
     }
   }
 
+  if (o->onode.size < old_size)
+    o->dirty_csum(o->onode.size, old_size - o->onode.size);
+  else
+    o->dirty_csum(old_size, o->onode.size - old_size);
+  o->onode.csum_truncate(old_size);
   txc->write_onode(o);
   return 0;
 }
@@ -5932,8 +7625,14 @@ int BlueStore::_do_remove(
   if (o->onode.omap_head) {
     _do_omap_clear(txc, o->onode.omap_head);
   }
+  for (auto& s : o->onode.extent_map_shards) {
+    string key;
+    get_extent_shard_key(o->onode.nid, s.first, &key);
+    txc->t->rmkey(PREFIX_EXTENT, key);
+  }
   o->exists = false;
   o->onode = bluestore_onode_t();
+  o->dirty_extent_shards.clear();
   txc->onodes.erase(o);
   txc->t->rmkey(PREFIX_OBJ, o->key);
   return 0;
@@ -6179,19 +7878,23 @@ int BlueStore::_setallochint(TransContext *txc,
 			     CollectionRef& c,
 			     OnodeRef& o,
 			     uint64_t expected_object_size,
-			     uint64_t expected_write_size)
+			     uint64_t expected_write_size,
+			     uint32_t flags)
 {
   dout(15) << __func__ << " " << c->cid << " " << o->oid
 	   << " object_size " << expected_object_size
 	   << " write_size " << expected_write_size
+	   << " flags " << flags
 	   << dendl;
   int r = 0;
   o->onode.expected_object_size = expected_object_size;
   o->onode.expected_write_size = expected_write_size;
+  o->onode.alloc_hint_flags = flags;
   txc->write_onode(o);
   dout(10) << __func__ << " " << c->cid << " " << o->oid
 	   << " object_size " << expected_object_size
 	   << " write_size " << expected_write_size
+	   << " flags " << flags
 	   << " = " << r << dendl;
   return r;
 }
@@ -6221,8 +7924,11 @@ int BlueStore::_clone(TransContext *txc,
   if (r < 0)
     goto out;
 
+  newo->onode.alloc_hint_flags = oldo->onode.alloc_hint_flags;
+
   if (g_conf->bluestore_clone_cow) {
-    if (!oldo->onode.block_map.empty()) {
+    if (!oldo->onode.block_map.empty() ||
+	!oldo->onode.compressed_map.empty()) {
       EnodeRef e = c->get_enode(newo->oid.hobj.get_hash());
       bool marked = false;
       for (auto& p : oldo->onode.block_map) {
@@ -6234,9 +7940,23 @@ int BlueStore::_clone(TransContext *txc,
 	  marked = true;
 	}
       }
+      for (auto& p : oldo->onode.compressed_map) {
+	for (auto& x : p.second.extents) {
+	  if (x.has_flag(bluestore_extent_t::FLAG_SHARED)) {
+	    e->ref_map.get(x.offset, x.length);
+	  } else {
+	    x.set_flag(bluestore_extent_t::FLAG_SHARED);
+	    e->ref_map.add(x.offset, x.length, 2);
+	    marked = true;
+	  }
+	}
+      }
       dout(20) << __func__ << " hash " << std::hex << e->hash << std::dec << " ref_map now "
 	<< e->ref_map << dendl;
       newo->onode.block_map = oldo->onode.block_map;
+      newo->onode.compressed_map = oldo->onode.compressed_map;
+      if (marked)
+	oldo->dirty_all_extents();
       newo->enode = e;
       dout(20) << __func__ << " block_map " << newo->onode.block_map << dendl;
       txc->write_enode(e);
@@ -6264,6 +7984,11 @@ int BlueStore::_clone(TransContext *txc,
     }
 
     newo->onode.size = oldo->onode.size;
+    newo->onode.csum_type = oldo->onode.csum_type;
+    newo->onode.csum_chunk_order = oldo->onode.csum_chunk_order;
+    newo->onode.csum_data = oldo->onode.csum_data;
+    newo->onode.csum_unknown = oldo->onode.csum_unknown;
+    newo->dirty_all_extents();
   } else {
     // read + write
     r = _do_read(oldo, 0, oldo->onode.size, bl, 0);
@@ -6403,7 +8128,7 @@ int BlueStore::_create_collection(
       r = -EEXIST;
       goto out;
     }
-    c->reset(new Collection(this, cid));
+    c->reset(new Collection(this, _get_cache_shard(cid), cid));
     (*c)->cnode.bits = bits;
     coll_map[cid] = *c;
   }
@@ -32,6 +32,7 @@
 #include "include/memory.h"
 #include "common/Finisher.h"
 #include "os/ObjectStore.h"
+#include "compressor/Compressor.h"
 
 #include "bluestore_types.h"
 #include "BlockDevice.h"
@@ -54,6 +55,31 @@ enum {
   l_bluestore_state_wal_done_lat,
   l_bluestore_state_finishing_lat,
   l_bluestore_state_done_lat,
+  l_bluestore_onodes,
+  l_bluestore_onode_hits,
+  l_bluestore_onode_misses,
+  l_bluestore_buffers,
+  l_bluestore_buffer_bytes,
+  l_bluestore_buffer_hit_bytes,
+  l_bluestore_buffer_miss_bytes,
+  l_bluestore_buffer_evicted_bytes,
+  l_bluestore_read_eio,
+  l_bluestore_compress_success_count,
+  l_bluestore_compress_rejected_count,
+  l_bluestore_compressed_original,
+  l_bluestore_compressed_allocated,
+  l_bluestore_decompress_count,
+  l_bluestore_wal_batches,
+  l_bluestore_wal_batch_txc,
+  l_bluestore_wal_write_ops,
+  l_bluestore_wal_write_ios,
+  l_bluestore_fsck_collections,
+  l_bluestore_fsck_collections_done,
+  l_bluestore_fsck_objects,
+  l_bluestore_onode_write_bytes,
+  l_bluestore_onode_shard_writes,
+  l_bluestore_read_ios,
+  l_bluestore_csum_verified_bytes,
   l_bluestore_last
 };
 
@@ -119,19 +145,113 @@ public:
     }
   };
 
+  class Cache;
+  struct BufferSpace;
+  struct OnodeSpace;
+
+  /// cached buffer
+  struct Buffer {
+    enum {
+      LEVEL_WARM_IN,   ///< first reference; evicted first
+      LEVEL_WARM_OUT,  ///< ghost: evicted from warm_in, data dropped
+      LEVEL_HOT,       ///< referenced again after leaving warm_in
+    };
+    static const char *get_level_name(int l) {
+      switch (l) {
+      case LEVEL_WARM_IN: return "warm_in";
+      case LEVEL_WARM_OUT: return "warm_out";
+      case LEVEL_HOT: return "hot";
+      default: return "???";
+      }
+    }
+
+    BufferSpace *space;
+    int level;
+    uint64_t offset, length;
+    bufferlist data;
+
+    boost::intrusive::list_member_hook<> lru_item;
+
+    Buffer(BufferSpace *space, int l, uint64_t o, const bufferlist& b)
+      : space(space), level(l), offset(o), length(b.length()), data(b) {}
+    Buffer(BufferSpace *space, int l, uint64_t o, uint64_t len)
+      : space(space), level(l), offset(o), length(len) {}
+
+    bool is_ghost() const {
+      return level == LEVEL_WARM_OUT;
+    }
+    uint64_t end() const {
+      return offset + length;
+    }
+    /// bytes this buffer pins in memory
+    uint64_t resident() const {
+      return is_ghost() ? 0 : length;
+    }
+    void truncate(uint64_t newlen) {
+      assert(newlen < length);
+      if (!is_ghost()) {
+	bufferlist t;
+	t.substr_of(data, 0, newlen);
+	data.claim(t);
+      }
+      length = newlen;
+    }
+  };
+
+  /// map logical extent range (object) onto buffers
+  struct BufferSpace {
+    typedef map<uint64_t,std::unique_ptr<Buffer>> buffer_map_t;
+
+    Cache *cache;
+    buffer_map_t buffer_map;
+
+    explicit BufferSpace(Cache *c) : cache(c) {}
+    ~BufferSpace();
+
+    buffer_map_t::iterator _data_lower_bound(uint64_t offset) {
+      auto i = buffer_map.lower_bound(offset);
+      if (i != buffer_map.begin()) {
+	--i;
+	if (i->second->end() <= offset)
+	  ++i;
+      }
+      return i;
+    }
+
+    void _add_buffer(Buffer *b, Buffer *near);
+    void _rm_buffer(buffer_map_t::iterator p);
+
+    /// drop cached data in a range; return the level new data there gets
+    int _discard(uint64_t offset, uint64_t length);
+    void _add_data(uint64_t offset, const bufferlist& bl);
+
+    void discard(uint64_t offset, uint64_t length);
+    void write(uint64_t offset, const bufferlist& bl);
+    void did_read(uint64_t offset, const bufferlist& bl);
+    /// get cached (non-ghost) pieces of a range, keyed by offset
+    void read(uint64_t offset, uint64_t length,
+	      map<uint64_t,bufferlist>& res);
+    void truncate(uint64_t offset);
+    void clear();
+  };
+
   /// an in-memory object
   struct Onode {
     std::atomic_int nref;  ///< reference count
 
+    OnodeSpace *space;  ///< containing onode map
     ghobject_t oid;
     string key;     ///< key under PREFIX_OBJ where we are stored
     boost::intrusive::list_member_hook<> lru_item;
+    uint64_t cache_bytes;  ///< accounted against the cache while in lru
 
     EnodeRef enode;  ///< ref to Enode [optional]
 
     bluestore_onode_t onode;  ///< metadata stored as value in kv store
     bool exists;
 
+    set<uint64_t> dirty_extent_shards;  ///< block_map/csum shards to rewrite
+
     std::mutex flush_lock;  ///< protect flush_txns
     std::condition_variable flush_cond;   ///< wait here for unapplied txns
     set<TransContext*> flush_txns;   ///< committing or wal txns
@@ -139,14 +259,18 @@ public:
     uint64_t tail_offset;
     bufferlist tail_bl;
 
-    Onode(const ghobject_t& o, const string& k)
-      : nref(0),
-	oid(o),
-	key(k),
-	exists(false) {
-    }
+    BufferSpace bc;  ///< cached object data
+
+    Onode(OnodeSpace *s, const ghobject_t& o, const string& k);
 
     void flush();
+    /// note that extents overlapping offset~length may change
+    void dirty_extents(uint64_t offset, uint64_t length);
+    /// note that any extent or csum may change
+    void dirty_all_extents();
+    /// note that csums of chunks overlapping offset~length, or between
+    /// the current eof and offset, may change
+    void dirty_csum(uint64_t offset, uint64_t length);
     void get() {
       ++nref;
     }
@@ -162,40 +286,97 @@ public:
   };
   typedef boost::intrusive_ptr<Onode> OnodeRef;
 
-  struct OnodeHashLRU {
+  /// a shard of the onode and data cache, shared by many collections
+  class Cache {
+  public:
     typedef boost::intrusive::list<
       Onode,
       boost::intrusive::member_hook<
         Onode,
 	boost::intrusive::list_member_hook<>,
-	&Onode::lru_item> > lru_list_t;
+	&Onode::lru_item> > onode_lru_list_t;
+    typedef boost::intrusive::list<
+      Buffer,
+      boost::intrusive::member_hook<
+	Buffer,
+	boost::intrusive::list_member_hook<>,
+	&Buffer::lru_item> > buffer_list_t;
+
+    /// recursive: trimming an onode frees its buffers
+    std::recursive_mutex lock;
+    PerfCounters *logger;
+
+    onode_lru_list_t onode_lru;
+    uint64_t onode_bytes;
+
+    buffer_list_t buffer_hot;       ///< "Am"
+    buffer_list_t buffer_warm_in;   ///< "A1in"
+    buffer_list_t buffer_warm_out;  ///< "A1out" (ghosts)
+    uint64_t buffer_bytes;          ///< resident: hot + warm_in
+    uint64_t buffer_warm_in_bytes;
+    uint64_t buffer_warm_out_bytes;
+
+    explicit Cache(PerfCounters *l)
+      : logger(l),
+	onode_bytes(0),
+	buffer_bytes(0),
+	buffer_warm_in_bytes(0),
+	buffer_warm_out_bytes(0) {}
+    ~Cache() {
+      assert(onode_lru.empty());
+      assert(buffer_hot.empty());
+      assert(buffer_warm_in.empty());
+      assert(buffer_warm_out.empty());
+    }
+
+    buffer_list_t& _buffer_list(int level);
+    void _account(Buffer *b, int64_t delta);
+
+    void _add_onode(Onode *o);
+    void _rm_onode(Onode *o);
+    void _touch_onode(Onode *o);
+    void set_onode_bytes(Onode *o, uint64_t bytes);
+
+    void _add_buffer(Buffer *b, Buffer *near);
+    void _rm_buffer(Buffer *b);
+    void _touch_buffer(Buffer *b);
+    void _adjust_buffer_size(Buffer *b, int64_t delta);
+    void _evict_to_ghost(Buffer *b);
 
-    std::mutex lock;
+    /// trim to target bytes, giving onodes up to meta_ratio of it
+    void trim(uint64_t target_bytes, float target_meta_ratio);
+  };
+
+  /// onodes in a collection, cached in the collection's Cache shard
+  struct OnodeSpace {
+    Cache *cache;
     ceph::unordered_map<ghobject_t,OnodeRef> onode_map;  ///< forward lookups
-    lru_list_t lru;                                      ///< lru
 
-    OnodeHashLRU() {}
+    explicit OnodeSpace(Cache *c) : cache(c) {}
+    ~OnodeSpace() {
+      clear();
+    }
 
-    void add(const ghobject_t& oid, OnodeRef o);
-    void _touch(OnodeRef o);
+    /// add onode; return the existing one if we raced with another loader
+    OnodeRef add(const ghobject_t& oid, OnodeRef o);
     OnodeRef lookup(const ghobject_t& o);
     void rename(const ghobject_t& old_oid, const ghobject_t& new_oid);
     void clear();
     bool get_next(const ghobject_t& after, pair<ghobject_t,OnodeRef> *next);
-    int trim(int max=-1);
   };
 
   struct Collection : public CollectionImpl {
     BlueStore *store;
+    Cache *cache;       ///< our cache shard
     coll_t cid;
     bluestore_cnode_t cnode;
     RWLock lock;
 
     bool exists;
 
-    // cache onodes on a per-collection basis to avoid lock
-    // contention.
-    OnodeHashLRU onode_map;
+    // onodes are indexed per collection, while the lru and memory
+    // budget live in a shared cache shard.
+    OnodeSpace onode_map;
 
     EnodeSet enode_set;      ///< open Enodes
 
@@ -217,7 +398,7 @@ public:
       return false;
     }
 
-    Collection(BlueStore *ns, coll_t c);
+    Collection(BlueStore *ns, Cache *ca, coll_t c);
   };
   typedef boost::intrusive_ptr<Collection> CollectionRef;
 
@@ -243,6 +424,43 @@ public:
   class OpSequencer;
   typedef boost::intrusive_ptr<OpSequencer> OpSequencerRef;
 
+  /// log2 histograms of the time txcs spend in each state, for the tail
+  /// latencies that the state_*_lat averages hide
+  struct TxcStateHistogram {
+    static const unsigned NUM_STATES =
+      l_bluestore_state_done_lat - l_bluestore_state_prepare_lat + 1;
+    static const unsigned LAT_BINS = 32;   ///< bin b is [2^(b-1), 2^b) usec
+    static const unsigned SIZE_BINS = 32;  ///< bin b is [2^(b-1), 2^b) bytes
+
+    std::atomic<uint64_t> lat[NUM_STATES][LAT_BINS];
+    /// latency x txc bytes; only filled if bluestore_txc_histogram_size
+    std::atomic<uint64_t> lat_size[NUM_STATES][LAT_BINS][SIZE_BINS];
+
+    TxcStateHistogram() {
+      reset();
+    }
+
+    static unsigned get_bin(uint64_t v, unsigned bins) {
+      unsigned b = 0;
+      while (v) {
+	v >>= 1;
+	++b;
+      }
+      return MIN(b, bins - 1);
+    }
+
+    void add(unsigned state, utime_t l, uint64_t bytes, bool by_size) {
+      assert(state < NUM_STATES);
+      unsigned lb = get_bin(l.to_nsec() / 1000, LAT_BINS);
+      lat[state][lb].fetch_add(1, std::memory_order_relaxed);
+      if (by_size)
+	lat_size[state][lb][get_bin(bytes, SIZE_BINS)].fetch_add(
+	  1, std::memory_order_relaxed);
+    }
+    void reset();
+    void dump(Formatter *f) const;
+  };
+
   struct TransContext {
     typedef enum {
       STATE_PREPARE,
@@ -263,6 +481,9 @@ public:
     state_t state;
 
     const char *get_state_name() {
+      return get_state_name(state);
+    }
+    static const char *get_state_name(int state) {
       switch (state) {
       case STATE_PREPARE: return "prepare";
       case STATE_AIO_WAIT: return "aio_wait";
@@ -281,10 +502,14 @@ public:
       return "???";
     }
 
-    void log_state_latency(PerfCounters *logger, int state) {
+    void log_state_latency(PerfCounters *logger, int state,
+			   TxcStateHistogram *hist) {
       utime_t lat, now = ceph_clock_now(g_ceph_context);
       lat = now - start;
       logger->tinc(state, lat);
+      if (g_conf->bluestore_txc_histogram)
+	hist->add(state - l_bluestore_state_prepare_lat, lat, bytes,
+		  g_conf->bluestore_txc_histogram_size);
       start = now;
     }
 
@@ -305,9 +530,13 @@ public:
     boost::intrusive::list_member_hook<> wal_queue_item;
     bluestore_wal_transaction_t *wal_txn; ///< wal transaction (if any)
     vector<OnodeRef> wal_op_onodes;
+    vector<TransContext*> wal_batch; ///< others applied with us (we own ioc)
 
     interval_set<uint64_t> allocated, released;
 
+    /// compressed payloads written by this txc, by first device offset
+    map<uint64_t,bufferlist> compressed_writes;
+
     IOContext ioc;
 
     CollectionRef first_collection;  ///< first referenced collection
@@ -474,6 +703,26 @@ public:
     }
   };
 
+  /// merged device writes for a group of wal transactions
+  struct WALBatch {
+    map<uint64_t,bufferlist> writes;  ///< block-aligned, disjoint, by offset
+    uint64_t num_writes = 0;          ///< writes added, before merging
+
+    /// queue a write; it supersedes anything already queued underneath
+    void write(uint64_t offset, bufferlist& bl);
+    /// apply queued writes to bl, which holds offset~length from disk
+    void overlay(uint64_t offset, uint64_t length, bufferlist *bl);
+  };
+
+  struct WALBatchThread : public Thread {
+    BlueStore *store;
+    explicit WALBatchThread(BlueStore *s) : store(s) {}
+    void *entry() {
+      store->_wal_batch_thread();
+      return NULL;
+    }
+  };
+
   struct KVSyncThread : public Thread {
     BlueStore *store;
     explicit KVSyncThread(BlueStore *s) : store(s) {}
@@ -501,6 +750,8 @@ private:
   RWLock coll_lock;    ///< rwlock to protect coll_map
   ceph::unordered_map<coll_t, CollectionRef> coll_map;
 
+  vector<Cache*> cache_shards;
+
   std::mutex nid_lock;
   uint64_t nid_last;
   uint64_t nid_max;
@@ -515,6 +766,13 @@ private:
   ThreadPool wal_tp;
   WALWQ wal_wq;
 
+  WALBatchThread wal_batch_thread;
+  std::mutex wal_batch_lock;
+  std::condition_variable wal_batch_cond;
+  bool wal_batch_stop;
+  deque<TransContext*> wal_batch_queue;  ///< committed, waiting for apply
+  uint64_t wal_batch_queue_bytes;
+
   Finisher finisher;
 
   KVSyncThread kv_sync_thread;
@@ -523,8 +781,26 @@ private:
   bool kv_stop;
   deque<TransContext*> kv_queue, kv_committing;
   deque<TransContext*> wal_cleanup_queue, wal_cleaning;
+  interval_set<uint64_t> discard_finished;   ///< trimmed, not yet released
+  interval_set<uint64_t> discard_releasing;  ///< released by this kv commit
 
   PerfCounters *logger;
+  TxcStateHistogram txc_hist;
+
+  class SocketHook;
+  SocketHook *asok_hook;
+
+  int csum_type;  ///< bluestore_onode_t::CSUM_* for new objects
+
+  enum {
+    COMP_NONE,        ///< never compress
+    COMP_PASSIVE,     ///< compress if hinted compressible
+    COMP_AGGRESSIVE,  ///< compress unless hinted incompressible
+    COMP_FORCE,       ///< compress regardless of hints
+  };
+  int comp_mode;      ///< COMP_*
+  int comp_alg;       ///< bluestore_compressed_t::COMP_ALG_* for new data
+  vector<CompressorRef> compressors;  ///< by COMP_ALG_*
 
   std::mutex reap_lock;
   list<CollectionRef> removed_collections;
@@ -535,6 +811,9 @@ private:
 
   void _init_logger();
   void _shutdown_logger();
+  void _register_asok();
+  void _unregister_asok();
+  void _load_compressors();
 
   int _open_path();
   void _close_path();
@@ -547,7 +826,7 @@ private:
   void _close_bdev();
   int _open_db(bool create);
   void _close_db();
-  int _open_alloc();
+  int _open_alloc(bool use_snapshot = true);
   void _close_alloc();
   int _open_collections(int *errors=0);
   void _close_collections();
@@ -567,11 +846,14 @@ private:
 				KeyValueDB::Transaction t);
   void _commit_bluefs_freespace(const vector<bluestore_extent_t>& extents);
 
+  Cache *_get_cache_shard(const coll_t& cid);
+  void _trim_cache(Cache *cache);
   CollectionRef _get_collection(const coll_t& cid);
   void _queue_reap_collection(CollectionRef& c);
   void _reap_collections();
 
   void _assign_nid(TransContext *txc, OnodeRef o);
+  void _set_csum(OnodeRef o);
 
   void _dump_onode(OnodeRef o, int log_leverl=30);
 
@@ -579,7 +861,11 @@ private:
   void _txc_release(TransContext *txc, CollectionRef& c, OnodeRef& onode,
 		    uint64_t offset, uint64_t length,
 		    bool shared);
+  void _txc_release_compressed(TransContext *txc, CollectionRef& c,
+			       OnodeRef& onode,
+			       const bluestore_compressed_t& cm);
   void _txc_add_transaction(TransContext *txc, Transaction *t);
+  uint64_t _txc_write_extent_shards(TransContext *txc, OnodeRef o);
   int _txc_finalize(OpSequencer *osr, TransContext *txc);
   void _txc_state_proc(TransContext *txc);
   void _txc_aio_submit(TransContext *txc);
@@ -588,6 +874,7 @@ public:
   void _txc_aio_finish(void *p) {
     _txc_state_proc(static_cast<TransContext*>(p));
   }
+  void _discard_finish(interval_set<uint64_t>& extents);
 private:
   void _txc_finish_io(TransContext *txc);
   void _txc_finish_kv(TransContext *txc);
@@ -609,11 +896,34 @@ private:
   bluestore_wal_op_t *_get_wal_op(TransContext *txc, OnodeRef o);
   int _wal_apply(TransContext *txc);
   int _wal_finish(TransContext *txc);
-  int _do_wal_op(bluestore_wal_op_t& wo, IOContext *ioc);
+  int _do_wal_op(bluestore_wal_op_t& wo, WALBatch& b, IOContext *ioc);
+  int _wal_read(WALBatch& b, uint64_t offset, uint64_t length,
+		bufferlist *bl, IOContext *ioc);
+  void _wal_submit(WALBatch& b, IOContext *ioc);
+  void _wal_batch_queue(TransContext *txc);
+  void _wal_batch_apply(vector<TransContext*>& txcs);
+  void _wal_batch_thread();
+  void _wal_batch_stop() {
+    {
+      std::lock_guard<std::mutex> l(wal_batch_lock);
+      wal_batch_stop = true;
+      wal_batch_cond.notify_all();
+    }
+    wal_batch_thread.join();
+    wal_batch_stop = false;
+  }
   int _wal_replay();
 
   // for fsck
+  struct FsckState {
+    int errors = 0;
+    set<uint64_t> used_nids;
+    set<uint64_t> used_omap_head;
+    interval_set<uint64_t> used_blocks;
+  };
+
   int _verify_enode_shared(EnodeRef enode, vector<bluestore_extent_t>& v);
+  void _fsck_collection(CollectionRef c, bool deep, FsckState *st);
 
 public:
   BlueStore(CephContext *cct, const string& path);
@@ -626,6 +936,7 @@ public:
   bool needs_journal() override { return false; };
   bool wants_journal() override { return false; };
   bool allows_journal() override { return false; };
+  bool wants_alloc_hint_flags() override { return true; }
 
   static int get_block_device_fsid(const string& path, uuid_d *fsid);
 
@@ -635,7 +946,7 @@ public:
   int umount() override;
   void _sync();
 
-  int fsck() override;
+  int fsck(bool deep) override;
 
   unsigned get_max_object_name_length() override {
     return 4096;
@@ -686,6 +997,25 @@ public:
     size_t len,
     bufferlist& bl,
     uint32_t op_flags = 0);
+  int _do_read_uncached(
+    OnodeRef o,
+    uint64_t offset,
+    uint64_t length,
+    bufferlist& bl,
+    bool buffered);
+  int _do_read_plain(
+    OnodeRef o,
+    uint64_t offset,
+    uint64_t length,
+    bufferlist& bl,
+    bool buffered);
+  int _do_read_compressed(
+    OnodeRef o,
+    uint64_t offset,
+    const bluestore_compressed_t& cm,
+    bufferlist *bl,
+    bool buffered,
+    TransContext *txc = nullptr);
 
   int fiemap(const coll_t& cid, const ghobject_t& oid,
 	     uint64_t offset, size_t len, bufferlist& bl) override;
@@ -803,6 +1133,16 @@ public:
   objectstore_perf_stat_t get_cur_stats() override {
     return objectstore_perf_stat_t();
   }
+  const PerfCounters* get_perf_counters() const override {
+    return logger;
+  }
+
+  /// handle one of our admin socket commands
+  bool asok_command(string command, string format, ostream& ss);
+
+  /// wait until queued discards are trimmed and back in the allocator
+  void discard_drain();
+  uint64_t get_alloc_free();
 
   int queue_transactions(
     Sequencer *osr,
@@ -859,6 +1199,27 @@ private:
 		uint64_t offset, uint64_t length,
 		bufferlist& bl,
 		uint32_t fadvise_flags);
+  int _do_write_data(TransContext *txc,
+		     CollectionRef &c,
+		     OnodeRef o,
+		     uint64_t offset, uint64_t length,
+		     bufferlist& bl,
+		     uint32_t fadvise_flags);
+  bool _wants_compression(OnodeRef o);
+  bool _compress(const bufferlist& in, bufferlist *out);
+  int _do_write_compressed(TransContext *txc,
+			   CollectionRef &c,
+			   OnodeRef o,
+			   uint64_t offset, uint64_t length,
+			   bufferlist& cbl);
+  int _do_expand_compressed(TransContext *txc,
+			    CollectionRef &c,
+			    OnodeRef o,
+			    uint64_t offset, uint64_t length);
+  void _do_release_range(TransContext *txc,
+			 CollectionRef &c,
+			 OnodeRef o,
+			 uint64_t offset, uint64_t length);
   int _touch(TransContext *txc,
 	     CollectionRef& c,
 	     OnodeRef& o);
@@ -924,7 +1285,8 @@ private:
 		    CollectionRef& c,
 		    OnodeRef& o,
 		    uint64_t expected_object_size,
-		    uint64_t expected_write_size);
+		    uint64_t expected_write_size,
+		    uint32_t flags);
   int _clone(TransContext *txc,
 	     CollectionRef& c,
 	     OnodeRef& oldo,
@@ -6,17 +6,50 @@
 #include "kv.h"
 
 #include "common/debug.h"
+#include "common/errno.h"
 
 #define dout_subsys ceph_subsys_bluestore
 #undef dout_prefix
 #define dout_prefix *_dout << "freelist "
 
-int FreelistManager::init(KeyValueDB *db, string p)
+// The snapshot is a header plus fixed-size chunks of (offset, length)
+// pairs, so no single value grows with the fragmentation of the device.
+static const string SNAP_HEADER_KEY = "header";
+static const unsigned SNAP_CHUNK_EXTENTS = 65536;
+
+static void get_snap_chunk_key(uint32_t n, string *key)
+{
+  key->clear();
+  key->push_back('c');
+  _key_encode_u32(n, key);
+}
+
+int FreelistManager::init(KeyValueDB *db, string p, string sp,
+			  bool use_snapshot)
 {
   dout(1) << __func__ << " prefix " << p << dendl;
 
   // load state from kvstore
   prefix = p;
+  snap_prefix = sp;
+
+  if (snap_prefix.length()) {
+    bufferlist bl;
+    snapshot_current = db->get(snap_prefix, SNAP_HEADER_KEY, &bl) >= 0;
+    if (snapshot_current && use_snapshot) {
+      int r = _load_snapshot(db, &kv_free, &total_free);
+      if (r == 0) {
+	dout(1) << __func__ << " loaded " << kv_free.size()
+		<< " extents from snapshot" << dendl;
+	return 0;
+      }
+      derr << __func__ << " unable to load snapshot: " << cpp_strerror(r)
+	   << ", scanning freelist" << dendl;
+      kv_free.clear();
+      total_free = 0;
+      snapshot_current = false;
+    }
+  }
 
   KeyValueDB::Transaction txn = db->get_transaction();
   int fixed = 0;
@@ -62,6 +95,7 @@ int FreelistManager::init(KeyValueDB *db, string p)
   }
 
   if (fixed) {
+    _invalidate_snapshot(txn);
     db->submit_transaction_sync(txn);
     derr << " fixed " << fixed << " extents" << dendl;
   }
@@ -70,6 +104,144 @@ int FreelistManager::init(KeyValueDB *db, string p)
   return 0;
 }
 
+int FreelistManager::_load_snapshot(KeyValueDB *db, map_t *out,
+				    uint64_t *out_total)
+{
+  bufferlist hbl;
+  int r = db->get(snap_prefix, SNAP_HEADER_KEY, &hbl);
+  if (r < 0)
+    return r;
+  uint64_t total, num_extents;
+  uint32_t num_chunks, crc;
+  try {
+    bufferlist::iterator p = hbl.begin();
+    DECODE_START(1, p);
+    ::decode(total, p);
+    ::decode(num_extents, p);
+    ::decode(num_chunks, p);
+    ::decode(crc, p);
+    DECODE_FINISH(p);
+  } catch (buffer::error& e) {
+    derr << __func__ << " unable to decode snapshot header" << dendl;
+    return -EIO;
+  }
+
+  uint32_t actual_crc = -1;
+  uint64_t sum = 0;
+  for (uint32_t n = 0; n < num_chunks; ++n) {
+    string key;
+    get_snap_chunk_key(n, &key);
+    bufferlist bl;
+    r = db->get(snap_prefix, key, &bl);
+    if (r < 0) {
+      derr << __func__ << " missing snapshot chunk " << n << dendl;
+      return -EIO;
+    }
+    actual_crc = bl.crc32c(actual_crc);
+    if (bl.length() % (2 * sizeof(uint64_t))) {
+      derr << __func__ << " bad snapshot chunk " << n << " length "
+	   << bl.length() << dendl;
+      return -EIO;
+    }
+    bufferlist::iterator p = bl.begin();
+    while (!p.end()) {
+      uint64_t offset, length;
+      ::decode(offset, p);
+      ::decode(length, p);
+      (*out)[offset] = length;
+      sum += length;
+    }
+  }
+  if (actual_crc != crc) {
+    derr << __func__ << " snapshot crc " << std::hex << actual_crc
+	 << " != expected " << crc << std::dec << dendl;
+    return -EIO;
+  }
+  if (out->size() != num_extents || sum != total) {
+    derr << __func__ << " snapshot has " << out->size() << " extents, "
+	 << sum << " bytes; expected " << num_extents << " extents, "
+	 << total << " bytes" << dendl;
+    return -EIO;
+  }
+  *out_total = total;
+  return 0;
+}
+
+bool FreelistManager::write_snapshot(KeyValueDB::Transaction txn)
+{
+  std::lock_guard<std::mutex> l(lock);
+  assert(snap_prefix.length());
+  if (snapshot_current)
+    return false;
+
+  // drop chunks left over from an older, larger snapshot
+  txn->rmkeys_by_prefix(snap_prefix);
+
+  uint32_t crc = -1;
+  uint32_t num_chunks = 0;
+  bufferlist bl;
+  unsigned n = 0;
+  auto flush_chunk = [&]() {
+    string key;
+    get_snap_chunk_key(num_chunks++, &key);
+    crc = bl.crc32c(crc);
+    txn->set(snap_prefix, key, bl);
+    bl.clear();
+    n = 0;
+  };
+  for (auto& p : kv_free) {
+    ::encode(p.first, bl);
+    ::encode(p.second, bl);
+    if (++n == SNAP_CHUNK_EXTENTS)
+      flush_chunk();
+  }
+  if (n)
+    flush_chunk();
+
+  bufferlist hbl;
+  ENCODE_START(1, 1, hbl);
+  ::encode(total_free, hbl);
+  ::encode((uint64_t)kv_free.size(), hbl);
+  ::encode(num_chunks, hbl);
+  ::encode(crc, hbl);
+  ENCODE_FINISH(hbl);
+  txn->set(snap_prefix, SNAP_HEADER_KEY, hbl);
+  snapshot_current = true;
+
+  dout(10) << __func__ << " " << kv_free.size() << " extents in "
+	   << num_chunks << " chunks" << dendl;
+  return true;
+}
+
+int FreelistManager::verify_snapshot(KeyValueDB *db)
+{
+  std::lock_guard<std::mutex> l(lock);
+  if (!snapshot_current)
+    return 0;
+  map_t snap;
+  uint64_t snap_total = 0;
+  int r = _load_snapshot(db, &snap, &snap_total);
+  if (r < 0)
+    return r;
+  if (snap_total != total_free || snap != kv_free) {
+    derr << __func__ << " snapshot (" << snap.size() << " extents, "
+	 << snap_total << " bytes) does not match freelist ("
+	 << kv_free.size() << " extents, " << total_free << " bytes)"
+	 << dendl;
+    return 1;
+  }
+  return 0;
+}
+
+void FreelistManager::_invalidate_snapshot(KeyValueDB::Transaction txn)
+{
+  if (snapshot_current) {
+    dout(10) << __func__ << dendl;
+    txn->rmkey(snap_prefix, SNAP_HEADER_KEY);
+    snapshot_current = false;
+  }
+}
+
 void FreelistManager::shutdown()
 {
   dout(1) << __func__ << dendl;
@@ -112,6 +284,7 @@ int FreelistManager::allocate(
 {
   std::lock_guard<std::mutex> l(lock);
   dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  _invalidate_snapshot(txn);
   total_free -= length;
   auto p = kv_free.lower_bound(offset);
   if ((p == kv_free.end() || p->first > offset) &&
@@ -189,6 +362,7 @@ int FreelistManager::release(
 {
   std::lock_guard<std::mutex> l(lock);
   dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  _invalidate_snapshot(txn);
   total_free += length;
   auto p = kv_free.lower_bound(offset);
 
@@ -14,8 +14,10 @@
 
 class FreelistManager {
   std::string prefix;
+  std::string snap_prefix;  ///< where the freelist snapshot lives, if any
   std::mutex lock;
   uint64_t total_free;
+  bool snapshot_current;    ///< on-disk snapshot matches kv_free
 
   typedef btree::btree_map<uint64_t,uint64_t> map_t;
   static const bool map_t_has_stable_iterators = false;
@@ -25,14 +27,43 @@ class FreelistManager {
   void _audit();
   void _dump();
 
+  void _invalidate_snapshot(KeyValueDB::Transaction txn);
+  int _load_snapshot(KeyValueDB *kvdb, map_t *out, uint64_t *out_total);
+
 public:
   FreelistManager() :
-    total_free(0) {
+    total_free(0),
+    snapshot_current(false) {
   }
 
-  int init(KeyValueDB *kvdb, std::string prefix);
+  /**
+   * load the freelist
+   *
+   * If snap_prefix is non-empty and holds a current snapshot (see
+   * write_snapshot), load that instead of scanning every key under
+   * prefix.  A missing, damaged or stale snapshot falls back to the
+   * full scan.
+   */
+  int init(KeyValueDB *kvdb, std::string prefix,
+	   std::string snap_prefix = std::string(),
+	   bool use_snapshot = true);
   void shutdown();
 
+  /**
+   * queue a snapshot of the current freelist in txn
+   *
+   * The snapshot is dropped in the same transaction as the next
+   * allocate or release, so a snapshot found on disk is never stale.
+   * The caller must ensure no other freelist update can commit between
+   * the ones already applied here and txn.
+   *
+   * @return false if the on-disk snapshot is already current
+   */
+  bool write_snapshot(KeyValueDB::Transaction txn);
+
+  /// compare the on-disk snapshot, if current, with the loaded freelist
+  int verify_snapshot(KeyValueDB *kvdb);
+
   void dump();
 
   uint64_t get_total_free() {
@@ -25,11 +25,30 @@
 #include "common/errno.h"
 #include "common/debug.h"
 #include "common/blkdev.h"
+#include "common/io_priority.h"
+#include "include/stringify.h"
 
 #define dout_subsys ceph_subsys_bdev
 #undef dout_prefix
 #define dout_prefix *_dout << "bdev(" << path << ") "
 
+enum {
+  l_bdev_aio_queue_first = 642430,
+  l_bdev_aio_queue_depth,
+  l_bdev_aio_queue_submitted,
+  l_bdev_aio_queue_completed,
+  l_bdev_aio_queue_lat,
+  l_bdev_aio_queue_sched_queued,
+  l_bdev_aio_queue_submitted_kv,  // one per BDEV_PRIO_*, in order
+  l_bdev_aio_queue_submitted_client,
+  l_bdev_aio_queue_submitted_wal,
+  l_bdev_aio_queue_submitted_background,
+  l_bdev_aio_queue_last
+};
+
+std::mutex KernelDevice::aio_sched_registry_lock;
+map<string,KernelDevice::AioSched*> KernelDevice::aio_sched_registry;
+
 KernelDevice::KernelDevice(aio_callback_t cb, void *cbpriv)
   : fd_direct(-1),
     fd_buffered(-1),
@@ -37,12 +56,16 @@ KernelDevice::KernelDevice(aio_callback_t cb, void *cbpriv)
     fs(NULL), aio(false), dio(false),
     debug_lock("KernelDevice::debug_lock"),
     flush_lock("KernelDevice::flush_lock"),
-    aio_queue(g_conf->bdev_aio_max_queue_depth),
     aio_callback(cb),
     aio_callback_priv(cbpriv),
     aio_stop(false),
-    aio_thread(this),
-    injecting_crash(0)
+    aio_sched(NULL),
+    aio_sched_user(0),
+    injecting_crash(0),
+    discard(false),
+    discard_stop(false),
+    discard_running(false),
+    discard_thread(this)
 {
   zeros = buffer::create_page_aligned(1048576);
   zeros.zero();
@@ -116,9 +139,23 @@ int KernelDevice::open(string p)
       goto out_fail;
     }
     size = s;
+    if (g_conf->bdev_enable_discard) {
+      char dev[PATH_MAX];
+      if (::realpath(path.c_str(), dev) &&
+	  block_device_support_discard(dev)) {
+	discard = true;
+      } else {
+	dout(1) << __func__ << " bdev_enable_discard set but " << path
+		<< " does not support discard" << dendl;
+      }
+    }
   } else {
     size = st.st_size;
   }
+  if (g_conf->bdev_enable_discard && g_conf->bdev_debug_fake_discard) {
+    dout(1) << __func__ << " faking discard on " << path << dendl;
+    discard = true;
+  }
 
   // Operate as though the block size is 4 KB.  The backing file
   // blksize doesn't strictly matter except that some file systems may
@@ -136,12 +173,14 @@ int KernelDevice::open(string p)
 
   r = _aio_start();
   assert(r == 0);
+  _discard_start();
 
   dout(1) << __func__
 	  << " size " << size
 	  << " (" << pretty_si_t(size) << "B)"
 	  << " block_size " << block_size
 	  << " (" << pretty_si_t(block_size) << "B)"
+	  << (discard ? " discard" : "")
 	  << dendl;
   return 0;
 
@@ -157,6 +196,7 @@ int KernelDevice::open(string p)
 void KernelDevice::close()
 {
   dout(1) << __func__ << dendl;
+  _discard_stop();
   _aio_stop();
 
   assert(fs);
@@ -210,13 +250,54 @@ int KernelDevice::flush()
 int KernelDevice::_aio_start()
 {
   if (aio) {
-    dout(10) << __func__ << dendl;
-    int r = aio_queue.init();
-    if (r < 0) {
-      derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
-      return r;
+    int n = g_conf->bdev_aio_queues;
+    if (n <= 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      n = MAX(1, cpus / 8);
+    }
+    _aio_sched_get();
+    for (int c = 0; c < BDEV_PRIO_MAX; ++c) {
+      if (g_conf->bdev_aio_ioprio) {
+	// best effort levels 0..7, leaving room between the classes
+	aio_ioprio[c] = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE,
+					  c == BDEV_PRIO_BACKGROUND ? 7 : c * 2);
+      } else {
+	aio_ioprio[c] = -1;
+      }
+    }
+    dout(10) << __func__ << " " << n << " queues, sched depth "
+	     << aio_sched->depth << ", user " << aio_sched_user << dendl;
+    // name the per-queue counters after the device (block, block.db,
+    // block.wal) so they stay stable across restarts
+    string devname = path.substr(path.rfind('/') + 1);
+    if (aio_sched_user)
+      devname += "-" + stringify(aio_sched_user);
+    for (int i = 0; i < n; ++i) {
+      AioQueue *q = new AioQueue(this, i, g_conf->bdev_aio_max_queue_depth);
+      int r = q->aio_queue.init();
+      if (r < 0) {
+	derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
+	delete q;
+	_aio_stop();
+	return r;
+      }
+      PerfCountersBuilder b(g_ceph_context,
+			    "KernelDevice-" + devname + "-aio-queue-" + stringify(i),
+			    l_bdev_aio_queue_first, l_bdev_aio_queue_last);
+      b.add_u64(l_bdev_aio_queue_depth, "queue_depth", "Aios in flight");
+      b.add_u64_counter(l_bdev_aio_queue_submitted, "submitted", "Sum for aios submitted");
+      b.add_u64_counter(l_bdev_aio_queue_completed, "completed", "Sum for aios completed");
+      b.add_time_avg(l_bdev_aio_queue_lat, "aio_lat", "Average aio completion latency");
+      b.add_u64(l_bdev_aio_queue_sched_queued, "sched_queued", "Aios on this device waiting for their priority class");
+      b.add_u64_counter(l_bdev_aio_queue_submitted_kv, "submitted_kv", "Sum for kv aios submitted");
+      b.add_u64_counter(l_bdev_aio_queue_submitted_client, "submitted_client", "Sum for client aios submitted");
+      b.add_u64_counter(l_bdev_aio_queue_submitted_wal, "submitted_wal", "Sum for wal aios submitted");
+      b.add_u64_counter(l_bdev_aio_queue_submitted_background, "submitted_background", "Sum for background aios submitted");
+      q->logger = b.create_perf_counters();
+      g_ceph_context->get_perfcounters_collection()->add(q->logger);
+      aio_queues.push_back(q);
+      q->thread.create("bstore_aio");
     }
-    aio_thread.create("bstore_aio");
   }
   return 0;
 }
@@ -226,30 +307,101 @@ void KernelDevice::_aio_stop()
   if (aio) {
     dout(10) << __func__ << dendl;
     aio_stop = true;
-    aio_thread.join();
+    for (auto q : aio_queues)
+      q->thread.join();
     aio_stop = false;
-    aio_queue.shutdown();
+    for (auto q : aio_queues) {
+      _aio_reap(q);
+      q->aio_queue.shutdown();
+      g_ceph_context->get_perfcounters_collection()->remove(q->logger);
+      delete q->logger;
+      delete q;
+    }
+    aio_queues.clear();
+    _aio_sched_put();
   }
 }
 
-void KernelDevice::_aio_thread()
+void KernelDevice::_aio_sched_get()
 {
-  dout(10) << __func__ << " start" << dendl;
+  char real[PATH_MAX];
+  string key = ::realpath(path.c_str(), real) ? string(real) : path;
+  std::lock_guard<std::mutex> l(aio_sched_registry_lock);
+  AioSched *&s = aio_sched_registry[key];
+  if (!s) {
+    s = new AioSched(key);
+    s->depth = MAX(0, g_conf->bdev_aio_sched_depth);
+    s->prio_weight[BDEV_PRIO_KV] = g_conf->bdev_aio_prio_weight_kv;
+    s->prio_weight[BDEV_PRIO_CLIENT] = g_conf->bdev_aio_prio_weight_client;
+    s->prio_weight[BDEV_PRIO_WAL] = g_conf->bdev_aio_prio_weight_wal;
+    s->prio_weight[BDEV_PRIO_BACKGROUND] =
+      g_conf->bdev_aio_prio_weight_background;
+    for (int c = 0; c < BDEV_PRIO_MAX; ++c)
+      s->prio_weight[c] = MAX(1, s->prio_weight[c]);
+  }
+  aio_sched_user = 0;
+  while (s->users.count(aio_sched_user))
+    ++aio_sched_user;
+  s->users.insert(aio_sched_user);
+  aio_sched = s;
+}
+
+void KernelDevice::_aio_sched_put()
+{
+  std::lock_guard<std::mutex> l(aio_sched_registry_lock);
+  aio_sched->users.erase(aio_sched_user);
+  if (aio_sched->users.empty()) {
+    for (int c = 0; c < BDEV_PRIO_MAX; ++c)
+      assert(aio_sched->queue[c].empty());
+    aio_sched_registry.erase(aio_sched->key);
+    delete aio_sched;
+  }
+  aio_sched = NULL;
+}
+
+void KernelDevice::queue_reap_ioc(IOContext *ioc)
+{
+  if (aio_queues.empty()) {
+    BlockDevice::queue_reap_ioc(ioc);
+    return;
+  }
+  // only the thread that completes this ioc's aios may free it, since it
+  // may still be touching it after waking the waiter.
+  AioQueue *q = _aio_queue_of(ioc);
+  std::lock_guard<std::mutex> l(q->reap_lock);
+  q->reap_queue.push_back(ioc);
+}
+
+void KernelDevice::_aio_reap(AioQueue *q)
+{
+  std::lock_guard<std::mutex> l(q->reap_lock);
+  for (auto p : q->reap_queue) {
+    dout(20) << __func__ << " reap ioc " << p << dendl;
+    delete p;
+  }
+  q->reap_queue.clear();
+}
+
+void KernelDevice::_aio_thread(AioQueue *q)
+{
+  dout(10) << __func__ << " " << q->id << " start" << dendl;
   int inject_crash_count = 0;
   while (!aio_stop) {
     dout(40) << __func__ << " polling" << dendl;
     int max = 16;
     FS::aio_t *aio[max];
-    int r = aio_queue.get_next_completed(g_conf->bdev_aio_poll_ms,
-					 aio, max);
+    int r = q->aio_queue.get_next_completed(g_conf->bdev_aio_poll_ms,
+					    aio, max);
     if (r < 0) {
       derr << __func__ << " got " << cpp_strerror(r) << dendl;
     }
     if (r > 0) {
       dout(30) << __func__ << " got " << r << " completed aios" << dendl;
+      utime_t now = ceph_clock_now(g_ceph_context);
       for (int i = 0; i < r; ++i) {
 	IOContext *ioc = static_cast<IOContext*>(aio[i]->priv);
 	_aio_log_finish(ioc, aio[i]->offset, aio[i]->length);
+	q->logger->tinc(l_bdev_aio_queue_lat, now - aio[i]->start);
 	int left = --ioc->num_running;
 	int r = aio[i]->get_return_value();
 	dout(10) << __func__ << " finished aio " << aio[i] << " r " << r
@@ -265,7 +417,17 @@ void KernelDevice::_aio_thread()
 	  }
 	}
       }
+      q->logger->inc(l_bdev_aio_queue_completed, r);
+      q->logger->set(l_bdev_aio_queue_depth, q->inflight -= r);
+      if (aio_sched->depth) {
+	{
+	  std::lock_guard<std::mutex> l(aio_sched->lock);
+	  aio_sched->inflight -= r;
+	}
+	_aio_dispatch(q);
+      }
     }
+    _aio_reap(q);
     reap_ioc();
     if (g_conf->bdev_inject_crash) {
       ++inject_crash_count;
@@ -278,7 +440,103 @@ void KernelDevice::_aio_thread()
       }
     }
   }
-  dout(10) << __func__ << " end" << dendl;
+  dout(10) << __func__ << " " << q->id << " end" << dendl;
+}
+
+void KernelDevice::_discard_start()
+{
+  if (discard)
+    discard_thread.create("bstore_discard");
+}
+
+void KernelDevice::_discard_stop()
+{
+  if (discard) {
+    dout(10) << __func__ << dendl;
+    {
+      std::lock_guard<std::mutex> l(discard_lock);
+      discard_stop = true;
+      discard_cond.notify_all();
+    }
+    discard_thread.join();
+    discard_stop = false;
+    discard = false;
+  }
+}
+
+void KernelDevice::queue_discard(interval_set<uint64_t>& extents)
+{
+  assert(discard);
+  std::lock_guard<std::mutex> l(discard_lock);
+  dout(20) << __func__ << " " << extents << dendl;
+  discard_queued.insert(extents);
+  discard_cond.notify_all();
+}
+
+void KernelDevice::discard_drain()
+{
+  if (!discard)
+    return;
+  dout(10) << __func__ << dendl;
+  std::unique_lock<std::mutex> l(discard_lock);
+  while (!discard_queued.empty() || discard_running)
+    discard_cond.wait(l);
+}
+
+void KernelDevice::_discard_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(discard_lock);
+  while (true) {
+    if (discard_queued.empty()) {
+      if (discard_stop)
+	break;
+      dout(20) << __func__ << " sleep" << dendl;
+      discard_cond.notify_all();  // for discard_drain
+      discard_cond.wait(l);
+      dout(20) << __func__ << " wake" << dendl;
+      continue;
+    }
+    // take the lowest extent, up to one chunk of it
+    uint64_t offset = discard_queued.range_start();
+    uint64_t length = MIN(discard_queued.begin().get_len(),
+			  g_conf->bdev_discard_max_chunk);
+    discard_queued.erase(offset, length);
+    discard_running = true;
+    l.unlock();
+
+    utime_t start = ceph_clock_now(g_ceph_context);
+    if (!discard_stop && !g_conf->bdev_debug_fake_discard) {
+      dout(20) << __func__ << " discard " << offset << "~" << length << dendl;
+      int r = block_device_discard(fd_direct, offset, length);
+      if (r < 0) {
+	r = -errno;
+	derr << __func__ << " discard " << offset << "~" << length
+	     << " got " << cpp_strerror(r) << dendl;
+      }
+    }
+    interval_set<uint64_t> done;
+    done.insert(offset, length);
+    if (discard_callback)
+      discard_callback(discard_callback_priv, done);
+
+    // stay under the rate limit so that we do not compete with real io
+    uint64_t rate = g_conf->bdev_discard_max_bytes_per_sec;
+    if (rate && !discard_stop) {
+      utime_t want;
+      want.set_from_double((double)length / (double)rate);
+      utime_t took = ceph_clock_now(g_ceph_context) - start;
+      if (took < want) {
+	utime_t left = want - took;
+	l.lock();
+	discard_cond.wait_for(l, std::chrono::nanoseconds(left.to_nsec()));
+	l.unlock();
+      }
+    }
+    l.lock();
+    discard_running = false;
+  }
+  dout(10) << __func__ << " finish" << dendl;
 }
 
 void KernelDevice::_aio_log_start(
@@ -329,15 +587,37 @@ void KernelDevice::aio_submit(IOContext *ioc)
   ioc->num_pending -= pending;
   assert(ioc->num_pending.load() == 0);  // we should be only thread doing this
 
+  AioQueue *q = _aio_queue_of(ioc);
+  int prio = ioc->prio;
+  assert(prio >= 0 && prio < BDEV_PRIO_MAX);
+  q->logger->inc(l_bdev_aio_queue_submitted, pending);
+  q->logger->inc(l_bdev_aio_queue_submitted_kv + prio, pending);
+  q->logger->set(l_bdev_aio_queue_depth, q->inflight += pending);
+  utime_t now = ceph_clock_now(g_ceph_context);
+
   bool done = false;
   while (!done) {
     FS::aio_t& aio = *p;
     aio.priv = static_cast<void*>(ioc);
+    aio.start = now;
+    if (aio_ioprio[prio] >= 0)
+      aio.set_ioprio(aio_ioprio[prio]);
     dout(20) << __func__ << "  aio " << &aio << " fd " << aio.fd
-	     << " " << aio.offset << "~" << aio.length << dendl;
-    for (vector<iovec>::iterator q = aio.iov.begin(); q != aio.iov.end(); ++q)
-      dout(30) << __func__ << "   iov " << (void*)q->iov_base
-	       << " len " << q->iov_len << dendl;
+	     << " " << aio.offset << "~" << aio.length
+	     << " prio " << prio << dendl;
+    for (vector<iovec>::iterator v = aio.iov.begin(); v != aio.iov.end(); ++v)
+      dout(30) << __func__ << "   iov " << (void*)v->iov_base
+	       << " len " << v->iov_len << dendl;
+
+    if (aio_sched->depth) {
+      // the ioc stays alive until this aio completes, which cannot
+      // happen before _aio_dispatch submits it
+      ++p;
+      done = (p == e);
+      std::lock_guard<std::mutex> l(aio_sched->lock);
+      aio_sched->queue[prio].push_back(make_pair(q, &aio));
+      continue;
+    }
 
     // be careful: as soon as we submit aio we race with completion.
     // since we are holding a ref take care not to dereference txc at
@@ -349,7 +629,7 @@ void KernelDevice::aio_submit(IOContext *ioc)
     // do not dereference txc (or it's contents) after we submit (if
     // done == true and we don't loop)
     int retries = 0;
-    int r = aio_queue.submit(*cur, &retries);
+    int r = q->aio_queue.submit(*cur, &retries);
     if (retries)
       derr << __func__ << " retries " << retries << dendl;
     if (r) {
@@ -357,6 +637,58 @@ void KernelDevice::aio_submit(IOContext *ioc)
       assert(r == 0);
     }
   }
+
+  if (aio_sched->depth)
+    _aio_dispatch(q);
+}
+
+bool KernelDevice::_aio_sched_next(pair<AioQueue*,FS::aio_t*> *next)
+{
+  // weighted round robin: each class may submit up to its weight per
+  // round, most urgent class first; a new round starts once no class
+  // with queued aios has credit left.
+  AioSched *s = aio_sched;
+  for (int round = 0; round < 2; ++round) {
+    for (int c = 0; c < BDEV_PRIO_MAX; ++c) {
+      if (!s->queue[c].empty() && s->credit[c] > 0) {
+	--s->credit[c];
+	*next = s->queue[c].front();
+	s->queue[c].pop_front();
+	return true;
+      }
+    }
+    for (int c = 0; c < BDEV_PRIO_MAX; ++c)
+      s->credit[c] = s->prio_weight[c];
+  }
+  return false;
+}
+
+void KernelDevice::_aio_dispatch(AioQueue *q)
+{
+  // the aios may belong to another instance open on this device; each
+  // goes to the aio queue it was queued from, which completes it.
+  std::lock_guard<std::mutex> l(aio_sched->lock);
+  utime_t now = ceph_clock_now(g_ceph_context);
+  while (aio_sched->inflight < aio_sched->depth) {
+    pair<AioQueue*,FS::aio_t*> next;
+    if (!_aio_sched_next(&next))
+      break;
+    ++aio_sched->inflight;
+    FS::aio_t *aio = next.second;
+    aio->start = now;
+    int retries = 0;
+    int r = next.first->aio_queue.submit(*aio, &retries);
+    if (retries)
+      derr << __func__ << " retries " << retries << dendl;
+    if (r) {
+      derr << " aio submit got " << cpp_strerror(r) << dendl;
+      assert(r == 0);
+    }
+  }
+  unsigned queued = 0;
+  for (int c = 0; c < BDEV_PRIO_MAX; ++c)
+    queued += aio_sched->queue[c].size();
+  q->logger->set(l_bdev_aio_queue_sched_queued, queued);
 }
 
 int KernelDevice::aio_write(
@@ -534,6 +866,17 @@ int KernelDevice::read_buffered(uint64_t off, uint64_t len, char *buf)
   return r < 0 ? r : 0;
 }
 
+void KernelDevice::prefetch(uint64_t off, uint64_t len)
+{
+  dout(20) << __func__ << " " << off << "~" << len << dendl;
+  // we disabled kernel readahead on fd_buffered, so ask explicitly
+  int r = posix_fadvise(fd_buffered, off, len, POSIX_FADV_WILLNEED);
+  if (r) {
+    dout(1) << __func__ << " " << off << "~" << len << " error: "
+	    << cpp_strerror(r) << dendl;
+  }
+}
+
 int KernelDevice::invalidate_cache(uint64_t off, uint64_t len)
 {
   dout(5) << __func__ << " " << off << "~" << len << dendl;
@@ -16,9 +16,12 @@
 #define CEPH_OS_BLUESTORE_KERNELDEVICE_H
 
 #include <atomic>
+#include <deque>
+#include <set>
 
 #include "os/fs/FS.h"
 #include "include/interval_set.h"
+#include "common/perf_counters.h"
 
 #include "BlockDevice.h"
 
@@ -37,25 +40,101 @@ class KernelDevice : public BlockDevice {
   Mutex flush_lock;
   atomic_t io_since_flush;
 
-  FS::aio_queue_t aio_queue;
   aio_callback_t aio_callback;
   void *aio_callback_priv;
   bool aio_stop;
 
+  struct AioQueue;
+
   struct AioCompletionThread : public Thread {
     KernelDevice *bdev;
-    explicit AioCompletionThread(KernelDevice *b) : bdev(b) {}
+    AioQueue *q;
+    AioCompletionThread(KernelDevice *b, AioQueue *q) : bdev(b), q(q) {}
     void *entry() {
-      bdev->_aio_thread();
+      bdev->_aio_thread(q);
       return NULL;
     }
-  } aio_thread;
+  };
+
+  /// an aio context, and the thread that reaps its completions
+  struct AioQueue {
+    unsigned id;
+    FS::aio_queue_t aio_queue;
+    AioCompletionThread thread;
+    PerfCounters *logger;
+    std::atomic_int inflight = {0};
+
+    std::mutex reap_lock;
+    vector<IOContext*> reap_queue;  ///< iocs to free from our thread
+
+    AioQueue(KernelDevice *b, unsigned i, unsigned depth)
+      : id(i), aio_queue(depth), thread(b, this), logger(NULL) {}
+  };
+  vector<AioQueue*> aio_queues;  ///< each IOContext always uses the same one
+
+  /// aios held back by class once depth are in flight.  BlueFS opens its
+  /// own KernelDevice on a device it shares with BlueStore, so every
+  /// instance open on the same device shares one of these.
+  struct AioSched {
+    string key;                  ///< resolved device path
+    std::set<unsigned> users;    ///< instance numbers of the open devices
+    int depth;                   ///< 0 if we submit immediately
+    int prio_weight[BDEV_PRIO_MAX];
+
+    std::mutex lock;
+    std::deque<pair<AioQueue*,FS::aio_t*>> queue[BDEV_PRIO_MAX];
+    int credit[BDEV_PRIO_MAX];   ///< left in this round, per class
+    int inflight = 0;
+
+    explicit AioSched(const string& k) : key(k), depth(0) {
+      for (unsigned c = 0; c < BDEV_PRIO_MAX; ++c) {
+	prio_weight[c] = 1;
+	credit[c] = 0;
+      }
+    }
+  };
+  AioSched *aio_sched;
+  unsigned aio_sched_user;           ///< our instance number in aio_sched
+  int aio_ioprio[BDEV_PRIO_MAX];     ///< kernel ioprio per class, or -1
+
+  static std::mutex aio_sched_registry_lock;
+  static map<string,AioSched*> aio_sched_registry;  ///< by resolved path
+
+  AioQueue *_aio_queue_of(IOContext *ioc) {
+    uint64_t h = (uintptr_t)ioc * 0x9E3779B97F4A7C15ull;
+    return aio_queues[(h >> 32) % aio_queues.size()];
+  }
 
   std::atomic_int injecting_crash;
 
-  void _aio_thread();
+  bool discard;  ///< we trim released extents
+  std::mutex discard_lock;
+  std::condition_variable discard_cond;
+  bool discard_stop;
+  bool discard_running;
+  interval_set<uint64_t> discard_queued;  ///< coalesced, not yet trimmed
+
+  struct DiscardThread : public Thread {
+    KernelDevice *bdev;
+    explicit DiscardThread(KernelDevice *b) : bdev(b) {}
+    void *entry() {
+      bdev->_discard_thread();
+      return NULL;
+    }
+  } discard_thread;
+
+  void _discard_thread();
+  void _discard_start();
+  void _discard_stop();
+
+  void _aio_thread(AioQueue *q);
   int _aio_start();
   void _aio_stop();
+  void _aio_reap(AioQueue *q);
+  void _aio_sched_get();
+  void _aio_sched_put();
+  bool _aio_sched_next(pair<AioQueue*,FS::aio_t*> *next);
+  void _aio_dispatch(AioQueue *q);
 
   void _aio_log_start(IOContext *ioc, uint64_t offset, uint64_t length);
   void _aio_log_finish(IOContext *ioc, uint64_t offset, uint64_t length);
@@ -66,6 +145,7 @@ public:
   KernelDevice(aio_callback_t cb, void *cbpriv);
 
   void aio_submit(IOContext *ioc) override;
+  void queue_reap_ioc(IOContext *ioc) override;
 
   uint64_t get_size() const override {
     return size;
@@ -78,6 +158,7 @@ public:
 	   IOContext *ioc,
 	   bool buffered) override;
   int read_buffered(uint64_t off, uint64_t len, char *buf) override;
+  void prefetch(uint64_t off, uint64_t len) override;
 
   int aio_write(uint64_t off, bufferlist& bl,
 		IOContext *ioc,
@@ -86,6 +167,12 @@ public:
 	       IOContext *ioc) override;
   int flush() override;
 
+  bool supports_discard() const override {
+    return discard;
+  }
+  void queue_discard(interval_set<uint64_t>& extents) override;
+  void discard_drain() override;
+
   // for managing buffered readers/writers
   int invalidate_cache(uint64_t off, uint64_t len) override;
   int open(string path) override;
@@ -96,6 +96,7 @@ struct bluefs_transaction_t {
     OP_FILE_UPDATE, ///< set/update file metadata (file)
     OP_FILE_REMOVE, ///< remove file (ino)
     OP_JUMP_SEQ,    ///< jump the seq #
+    OP_JUMP,        ///< jump the seq # and log offset (next_seq, offset)
   } op_t;
 
   uuid_d uuid;          ///< fs uuid
@@ -157,6 +158,11 @@ struct bluefs_transaction_t {
     ::encode((__u8)OP_JUMP_SEQ, op_bl);
     ::encode(next_seq, op_bl);
   }
+  void op_jump(uint64_t next_seq, uint64_t offset) {
+    ::encode((__u8)OP_JUMP, op_bl);
+    ::encode(next_seq, op_bl);
+    ::encode(offset, op_bl);
+  }
 
   void encode(bufferlist& bl) const;
   void decode(bufferlist::iterator& p);
@@ -15,6 +15,7 @@
 #include "bluestore_types.h"
 #include "common/Formatter.h"
 #include "include/stringify.h"
+#include "xxHash/xxhash.h"
 
 // bluestore_bdev_label_t
 
@@ -394,27 +395,470 @@ ostream& operator<<(ostream& out, const bluestore_overlay_t& o)
   return out;
 }
 
+// bluestore_compressed_t
+
+const char *bluestore_compressed_t::get_comp_alg_name(unsigned a)
+{
+  switch (a) {
+  case COMP_ALG_NONE: return "none";
+  case COMP_ALG_SNAPPY: return "snappy";
+  case COMP_ALG_ZLIB: return "zlib";
+  default: return "???";
+  }
+}
+
+int bluestore_compressed_t::get_comp_alg_type(const string& s)
+{
+  if (s == "none")
+    return COMP_ALG_NONE;
+  if (s == "snappy")
+    return COMP_ALG_SNAPPY;
+  if (s == "zlib")
+    return COMP_ALG_ZLIB;
+  return -EINVAL;
+}
+
+void bluestore_compressed_t::encode(bufferlist& bl) const
+{
+  ENCODE_START(1, 1, bl);
+  ::encode(extents, bl);
+  ::encode(logical_length, bl);
+  ::encode(compressed_length, bl);
+  ::encode(alg, bl);
+  ENCODE_FINISH(bl);
+}
+
+void bluestore_compressed_t::decode(bufferlist::iterator& p)
+{
+  DECODE_START(1, p);
+  ::decode(extents, p);
+  ::decode(logical_length, p);
+  ::decode(compressed_length, p);
+  ::decode(alg, p);
+  DECODE_FINISH(p);
+}
+
+void bluestore_compressed_t::dump(Formatter *f) const
+{
+  f->open_array_section("extents");
+  for (auto& e : extents) {
+    f->open_object_section("extent");
+    e.dump(f);
+    f->close_section();
+  }
+  f->close_section();
+  f->dump_unsigned("logical_length", logical_length);
+  f->dump_unsigned("compressed_length", compressed_length);
+  f->dump_string("alg", get_comp_alg_name(alg));
+}
+
+void bluestore_compressed_t::generate_test_instances(
+  list<bluestore_compressed_t*>& o)
+{
+  o.push_back(new bluestore_compressed_t());
+  o.push_back(new bluestore_compressed_t());
+  o.back()->extents.push_back(bluestore_extent_t(65536, 65536));
+  o.back()->extents.push_back(bluestore_extent_t(262144, 65536, 2));
+  o.back()->logical_length = 262144;
+  o.back()->compressed_length = 100000;
+  o.back()->alg = COMP_ALG_SNAPPY;
+}
+
+ostream& operator<<(ostream& out, const bluestore_compressed_t& c)
+{
+  out << "compressed(" << c.logical_length << " -> " << c.compressed_length
+      << " " << bluestore_compressed_t::get_comp_alg_name(c.alg)
+      << " " << c.extents << ")";
+  return out;
+}
+
 // bluestore_onode_t
 
+const char *bluestore_onode_t::get_csum_type_string(unsigned t)
+{
+  switch (t) {
+  case CSUM_NONE: return "none";
+  case CSUM_CRC32C: return "crc32c";
+  case CSUM_CRC32C_16: return "crc32c_16";
+  case CSUM_CRC32C_8: return "crc32c_8";
+  case CSUM_XXHASH32: return "xxhash32";
+  case CSUM_XXHASH64: return "xxhash64";
+  default: return "???";
+  }
+}
+
+int bluestore_onode_t::get_csum_string_type(const string& s)
+{
+  if (s == "none")
+    return CSUM_NONE;
+  if (s == "crc32c")
+    return CSUM_CRC32C;
+  if (s == "crc32c_16")
+    return CSUM_CRC32C_16;
+  if (s == "crc32c_8")
+    return CSUM_CRC32C_8;
+  if (s == "xxhash32")
+    return CSUM_XXHASH32;
+  if (s == "xxhash64")
+    return CSUM_XXHASH64;
+  return -EINVAL;
+}
+
+unsigned bluestore_onode_t::get_csum_value_size(unsigned t)
+{
+  switch (t) {
+  case CSUM_NONE: return 0;
+  case CSUM_CRC32C: return 4;
+  case CSUM_CRC32C_16: return 2;
+  case CSUM_CRC32C_8: return 1;
+  case CSUM_XXHASH32: return 4;
+  case CSUM_XXHASH64: return 8;
+  default: return 0;
+  }
+}
+
+uint64_t bluestore_onode_t::get_csum_value(unsigned i) const
+{
+  unsigned vs = get_csum_value_size(csum_type);
+  assert(i < get_csum_count());
+  const unsigned char *p = (const unsigned char *)csum_data.data() + i * vs;
+  uint64_t v = 0;
+  for (unsigned k = 0; k < vs; ++k)
+    v |= (uint64_t)p[k] << (8 * k);
+  return v;
+}
+
+void bluestore_onode_t::set_csum_value(unsigned i, uint64_t v)
+{
+  unsigned vs = get_csum_value_size(csum_type);
+  assert(i < get_csum_count());
+  for (unsigned k = 0; k < vs; ++k)
+    csum_data[i * vs + k] = (v >> (8 * k)) & 0xff;
+}
+
+uint64_t bluestore_onode_t::calc_csum(const bufferlist& bl) const
+{
+  switch (csum_type) {
+  case CSUM_CRC32C:
+  case CSUM_CRC32C_16:
+  case CSUM_CRC32C_8:
+    {
+      uint32_t crc = bl.crc32c(-1);
+      if (csum_type == CSUM_CRC32C_16)
+	return crc & 0xffff;
+      if (csum_type == CSUM_CRC32C_8)
+	return crc & 0xff;
+      return crc;
+    }
+  case CSUM_XXHASH32:
+    {
+      XXH32_state_t state;
+      XXH32_reset(&state, -1);
+      for (auto& p : bl.buffers())
+	XXH32_update(&state, p.c_str(), p.length());
+      return XXH32_digest(&state);
+    }
+  case CSUM_XXHASH64:
+    {
+      XXH64_state_t state;
+      XXH64_reset(&state, -1);
+      for (auto& p : bl.buffers())
+	XXH64_update(&state, p.c_str(), p.length());
+      return XXH64_digest(&state);
+    }
+  }
+  assert(0 == "bad csum type");
+  return 0;
+}
+
+void bluestore_onode_t::set_csum(unsigned type, unsigned order)
+{
+  csum_type = type;
+  csum_chunk_order = order;
+  csum_data.clear();
+  csum_unknown.clear();
+}
+
+void bluestore_onode_t::_csum_extend(unsigned count)
+{
+  unsigned old = get_csum_count();
+  if (count <= old)
+    return;
+  csum_data.resize(count * get_csum_value_size(csum_type));
+  _csum_invalidate(old, count - old);
+}
+
+void bluestore_onode_t::_csum_invalidate(unsigned first, unsigned num)
+{
+  interval_set<uint32_t> t;
+  t.insert(first, num);
+  csum_unknown.union_of(t);
+}
+
+void bluestore_onode_t::csum_write(uint64_t offset, uint64_t length,
+				   const bufferlist *bl)
+{
+  if (!has_csum() || length == 0)
+    return;
+  uint64_t chunk = get_csum_chunk_size();
+  uint64_t end = offset + length;
+  uint64_t new_size = MAX(size, end);
+
+  // a partial chunk at the old eof is about to grow
+  if (new_size > size && size % chunk && size / chunk < get_csum_count())
+    _csum_invalidate(size / chunk, 1);
+
+  unsigned first = offset / chunk;
+  unsigned last = (end - 1) / chunk;
+  _csum_extend(last + 1);
+  bufferlist zeros;
+  for (unsigned i = first; i <= last; ++i) {
+    uint64_t cs = (uint64_t)i * chunk;
+    uint64_t ce = MIN(cs + chunk, new_size);
+    if (offset > cs || end < ce) {
+      _csum_invalidate(i, 1);
+      continue;
+    }
+    bufferlist t;
+    if (bl) {
+      t.substr_of(*bl, cs - offset, ce - cs);
+    } else {
+      if (zeros.length() != ce - cs) {
+	zeros.clear();
+	zeros.append_zero(ce - cs);
+      }
+      t = zeros;
+    }
+    set_csum_value(i, calc_csum(t));
+    if (csum_unknown.contains(i))
+      csum_unknown.erase(i);
+  }
+}
+
+void bluestore_onode_t::csum_truncate(uint64_t old_size)
+{
+  if (!has_csum())
+    return;
+  uint64_t chunk = get_csum_chunk_size();
+  unsigned count = get_csum_count();
+  unsigned n = ROUND_UP_TO(size, chunk) / chunk;
+  if (size < old_size) {
+    if (count > n) {
+      csum_data.resize(n * get_csum_value_size(csum_type));
+      interval_set<uint32_t> keep;
+      if (n)
+	keep.insert(0, n);
+      csum_unknown.intersection_of(keep);
+      count = n;
+    }
+    if (size % chunk && size / chunk < count)
+      _csum_invalidate(size / chunk, 1);
+  } else if (size > old_size) {
+    // the grown range reads back as zeros; don't vouch for it
+    unsigned first = old_size / chunk;
+    if (first < count)
+      _csum_invalidate(first, MIN(count, n) - first);
+  }
+}
+
+int bluestore_onode_t::csum_verify(uint64_t offset, const bufferlist& bl,
+				   uint64_t *bad_offset,
+				   uint64_t *verified) const
+{
+  if (!has_csum())
+    return 0;
+  uint64_t chunk = get_csum_chunk_size();
+  assert(offset % chunk == 0);
+  uint64_t end = offset + bl.length();
+  for (uint64_t cs = offset; cs < end; cs += chunk) {
+    unsigned i = cs / chunk;
+    uint64_t ce = MIN(cs + chunk, size);
+    if (ce > end || !has_csum_value(i))
+      continue;
+    bufferlist t;
+    t.substr_of(bl, cs - offset, ce - cs);
+    if (calc_csum(t) != get_csum_value(i)) {
+      if (bad_offset)
+	*bad_offset = cs;
+      return -EIO;
+    }
+    if (verified)
+      *verified += ce - cs;
+  }
+  return 0;
+}
+
+// Extent shards are rewritten on every overwrite of the range they
+// cover, so keep them small: lengths, gaps and device offset deltas are
+// varints, and consecutive extents are usually contiguous on disk.
+
+static void _encode_varint(uint64_t v, bufferlist& bl)
+{
+  while (v >= 0x80) {
+    __u8 b = (v & 0x7f) | 0x80;
+    ::encode(b, bl);
+    v >>= 7;
+  }
+  __u8 b = v;
+  ::encode(b, bl);
+}
+
+static void _decode_varint(uint64_t *v, bufferlist::iterator& p)
+{
+  *v = 0;
+  unsigned shift = 0;
+  __u8 b;
+  do {
+    ::decode(b, p);
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+}
+
+static void _encode_signed_varint(int64_t v, bufferlist& bl)
+{
+  // zigzag, so small negative deltas stay small
+  _encode_varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63), bl);
+}
+
+static void _decode_signed_varint(int64_t *v, bufferlist::iterator& p)
+{
+  uint64_t u;
+  _decode_varint(&u, p);
+  *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+void bluestore_onode_t::get_csum_shard_chunks(uint64_t shard,
+					      unsigned *first,
+					      unsigned *last) const
+{
+  uint64_t chunk = get_csum_chunk_size();
+  uint64_t end = shard + extent_map_shard_size;
+  *first = (shard + chunk - 1) / chunk;
+  *last = MIN((end + chunk - 1) / chunk, (uint64_t)get_csum_count());
+  if (*last < *first)
+    *last = *first;
+}
+
+unsigned bluestore_onode_t::encode_extent_shard(uint64_t shard,
+						bufferlist& bl) const
+{
+  assert(extent_map_shard_size);
+  assert(shard % extent_map_shard_size == 0);
+  uint64_t end = shard + extent_map_shard_size;
+  auto first = block_map.lower_bound(shard);
+  auto last = block_map.lower_bound(end);
+  unsigned n = std::distance(first, last);
+  unsigned cfirst = 0, clast = 0;
+  if (has_csum())
+    get_csum_shard_chunks(shard, &cfirst, &clast);
+  if (n == 0 && clast == cfirst)
+    return 0;
+  ENCODE_START(2, 1, bl);
+  _encode_varint(n, bl);
+  uint64_t pos = shard;   // logical end of the previous extent
+  uint64_t dpos = 0;      // device end of the previous extent
+  for (auto p = first; p != last; ++p) {
+    assert(p->first >= pos);
+    _encode_varint(p->first - pos, bl);
+    _encode_signed_varint((int64_t)(p->second.offset - dpos), bl);
+    _encode_varint(p->second.length, bl);
+    _encode_varint(p->second.flags, bl);
+    pos = p->first + p->second.length;
+    dpos = p->second.end();
+  }
+  // csums travel with the shard so a small overwrite rewrites only these
+  _encode_varint(clast - cfirst, bl);
+  if (clast > cfirst) {
+    unsigned vs = get_csum_value_size(csum_type);
+    bl.append(csum_data.data() + cfirst * vs, (clast - cfirst) * vs);
+    interval_set<uint32_t> unknown;
+    unknown.insert(cfirst, clast - cfirst);
+    unknown.intersection_of(csum_unknown);
+    ::encode(unknown, bl);
+  }
+  ENCODE_FINISH(bl);
+  return n + clast - cfirst;
+}
+
+void bluestore_onode_t::decode_extent_shard(uint64_t shard,
+					    bufferlist::iterator& p)
+{
+  DECODE_START(2, p);
+  uint64_t n;
+  _decode_varint(&n, p);
+  uint64_t pos = shard;
+  uint64_t dpos = 0;
+  while (n--) {
+    uint64_t gap, length, flags;
+    int64_t delta;
+    _decode_varint(&gap, p);
+    _decode_signed_varint(&delta, p);
+    _decode_varint(&length, p);
+    _decode_varint(&flags, p);
+    uint64_t offset = pos + gap;
+    bluestore_extent_t& e = block_map[offset];
+    e.offset = dpos + delta;
+    e.length = length;
+    e.flags = flags;
+    pos = offset + length;
+    dpos = e.end();
+  }
+  if (struct_v >= 2) {
+    uint64_t num;
+    _decode_varint(&num, p);
+    if (num) {
+      assert(has_csum());
+      uint64_t chunk = get_csum_chunk_size();
+      unsigned first = (shard + chunk - 1) / chunk;
+      unsigned vs = get_csum_value_size(csum_type);
+      if (csum_data.size() < (first + num) * vs)
+	csum_data.resize((first + num) * vs);
+      p.copy(num * vs, &csum_data[first * vs]);
+      interval_set<uint32_t> unknown;
+      ::decode(unknown, p);
+      csum_unknown.union_of(unknown);
+    }
+  }
+  DECODE_FINISH(p);
+}
+
 void bluestore_onode_t::encode(bufferlist& bl) const
 {
-  ENCODE_START(1, 1, bl);
+  // older code would take a sharded onode for one without data
+  ENCODE_START(5, extent_map_shard_size ? 4 : 1, bl);
   ::encode(nid, bl);
   ::encode(size, bl);
   ::encode(attrs, bl);
-  ::encode(block_map, bl);
+  if (extent_map_shard_size)
+    ::encode(map<uint64_t,bluestore_extent_t>(), bl);
+  else
+    ::encode(block_map, bl);
   ::encode(overlay_map, bl);
   ::encode(overlay_refs, bl);
   ::encode(last_overlay_key, bl);
   ::encode(omap_head, bl);
   ::encode(expected_object_size, bl);
   ::encode(expected_write_size, bl);
+  ::encode(csum_type, bl);
+  ::encode(csum_chunk_order, bl);
+  if (extent_map_shard_size) {
+    ::encode(string(), bl);
+    ::encode(interval_set<uint32_t>(), bl);
+  } else {
+    ::encode(csum_data, bl);
+    ::encode(csum_unknown, bl);
+  }
+  ::encode(compressed_map, bl);
+  ::encode(alloc_hint_flags, bl);
+  ::encode(extent_map_shard_size, bl);
+  ::encode(extent_map_shards, bl);
   ENCODE_FINISH(bl);
 }
 
 void bluestore_onode_t::decode(bufferlist::iterator& p)
 {
-  DECODE_START(1, p);
+  DECODE_START(5, p);
   ::decode(nid, p);
   ::decode(size, p);
   ::decode(attrs, p);
@@ -425,6 +869,20 @@ void bluestore_onode_t::decode(bufferlist::iterator& p)
   ::decode(omap_head, p);
   ::decode(expected_object_size, p);
   ::decode(expected_write_size, p);
+  if (struct_v >= 2) {
+    ::decode(csum_type, p);
+    ::decode(csum_chunk_order, p);
+    ::decode(csum_data, p);
+    ::decode(csum_unknown, p);
+  }
+  if (struct_v >= 3) {
+    ::decode(compressed_map, p);
+    ::decode(alloc_hint_flags, p);
+  }
+  if (struct_v >= 4) {
+    ::decode(extent_map_shard_size, p);
+    ::decode(extent_map_shards, p);
+  }
   DECODE_FINISH(p);
 }
 
@@ -468,15 +926,56 @@ void bluestore_onode_t::dump(Formatter *f) const
     f->close_section();
   }
   f->close_section();
+  f->open_array_section("compressed_map");
+  for (map<uint64_t,bluestore_compressed_t>::const_iterator p =
+	 compressed_map.begin();
+       p != compressed_map.end(); ++p) {
+    f->open_object_section("compressed");
+    f->dump_unsigned("offset", p->first);
+    p->second.dump(f);
+    f->close_section();
+  }
+  f->close_section();
   f->dump_unsigned("last_overlay_key", last_overlay_key);
   f->dump_unsigned("omap_head", omap_head);
   f->dump_unsigned("expected_object_size", expected_object_size);
   f->dump_unsigned("expected_write_size", expected_write_size);
+  f->dump_unsigned("alloc_hint_flags", alloc_hint_flags);
+  f->dump_string("csum_type", get_csum_type_string(csum_type));
+  f->dump_unsigned("csum_chunk_size", get_csum_chunk_size());
+  f->dump_unsigned("csum_count", get_csum_count());
+  f->dump_stream("csum_unknown") << csum_unknown;
+  f->dump_unsigned("extent_map_shard_size", extent_map_shard_size);
+  f->open_array_section("extent_map_shards");
+  for (auto& p : extent_map_shards) {
+    f->open_object_section("shard");
+    f->dump_unsigned("offset", p.first);
+    f->dump_unsigned("bytes", p.second);
+    f->close_section();
+  }
+  f->close_section();
 }
 
 void bluestore_onode_t::generate_test_instances(list<bluestore_onode_t*>& o)
 {
   o.push_back(new bluestore_onode_t());
+  o.push_back(new bluestore_onode_t());
+  o.back()->size = 10000;
+  o.back()->set_csum(CSUM_CRC32C, 12);
+  o.back()->csum_write(0, 8192, NULL);
+  o.push_back(new bluestore_onode_t());
+  o.back()->size = 262144;
+  o.back()->alloc_hint_flags = 1;
+  o.back()->compressed_map[0].extents.push_back(
+    bluestore_extent_t(65536, 65536));
+  o.back()->compressed_map[0].logical_length = 262144;
+  o.back()->compressed_map[0].compressed_length = 4000;
+  o.back()->compressed_map[0].alg = bluestore_compressed_t::COMP_ALG_ZLIB;
+  o.push_back(new bluestore_onode_t());
+  o.back()->size = 4194304;
+  o.back()->extent_map_shard_size = 524288;
+  o.back()->extent_map_shards[0] = 20;
+  o.back()->extent_map_shards[1048576] = 12;
   // FIXME
 }
 
@@ -179,19 +179,79 @@ WRITE_CLASS_ENCODER(bluestore_overlay_t)
 
 ostream& operator<<(ostream& out, const bluestore_overlay_t& o);
 
+/// compressed: a run of object data stored compressed on the device
+struct bluestore_compressed_t {
+  enum {
+    COMP_ALG_NONE = 0,
+    COMP_ALG_SNAPPY = 1,
+    COMP_ALG_ZLIB = 2,
+    COMP_ALG_MAX = 3,
+  };
+  static const char *get_comp_alg_name(unsigned a);
+  static int get_comp_alg_type(const string& s);
+
+  vector<bluestore_extent_t> extents; ///< device extents holding the payload
+  uint32_t logical_length;            ///< bytes of object data
+  uint32_t compressed_length;         ///< bytes of compressed payload
+  uint8_t alg;                        ///< COMP_ALG_*
+
+  bluestore_compressed_t()
+    : logical_length(0), compressed_length(0), alg(COMP_ALG_NONE) {}
+
+  /// allocated bytes on the device
+  uint64_t get_allocated() const {
+    uint64_t r = 0;
+    for (auto& e : extents)
+      r += e.length;
+    return r;
+  }
+
+  void encode(bufferlist& bl) const;
+  void decode(bufferlist::iterator& p);
+  void dump(Formatter *f) const;
+  static void generate_test_instances(list<bluestore_compressed_t*>& o);
+};
+WRITE_CLASS_ENCODER(bluestore_compressed_t)
+
+ostream& operator<<(ostream& out, const bluestore_compressed_t& c);
+
 /// onode: per-object metadata
 struct bluestore_onode_t {
+  enum {
+    CSUM_NONE = 0,
+    CSUM_CRC32C = 1,
+    CSUM_CRC32C_16 = 2,  ///< low 16 bits of crc32c
+    CSUM_CRC32C_8 = 3,   ///< low 8 bits of crc32c
+    CSUM_XXHASH32 = 4,
+    CSUM_XXHASH64 = 5,
+  };
+  static const char *get_csum_type_string(unsigned t);
+  static int get_csum_string_type(const string& s);
+  static unsigned get_csum_value_size(unsigned t);
+
   uint64_t nid;                        ///< numeric id (locally unique)
   uint64_t size;                       ///< object size
   map<string, bufferptr> attrs;        ///< attrs
   map<uint64_t, bluestore_extent_t> block_map;   ///< block data
   map<uint64_t,bluestore_overlay_t> overlay_map; ///< overlay data (stored in db)
   map<uint64_t,uint16_t> overlay_refs; ///< overlay keys ref counts (if >1)
+  map<uint64_t,bluestore_compressed_t> compressed_map; ///< compressed data
   uint32_t last_overlay_key;           ///< key for next overlay
   uint64_t omap_head;                  ///< id for omap root node
 
   uint32_t expected_object_size;
   uint32_t expected_write_size;
+  uint32_t alloc_hint_flags;           ///< CEPH_OSD_ALLOC_HINT_FLAG_*
+
+  uint8_t csum_type;                   ///< CSUM_*
+  uint8_t csum_chunk_order;            ///< csum covers 1 << order bytes
+  string csum_data;                    ///< packed le values, one per chunk
+  interval_set<uint32_t> csum_unknown; ///< chunks w/o a valid csum value
+
+  /// if nonzero, block_map and the csums are stored in separately keyed
+  /// shards covering this many bytes of the object each, not inline
+  uint32_t extent_map_shard_size;
+  map<uint64_t,uint32_t> extent_map_shards; ///< shard offset -> encoded bytes
 
   bluestore_onode_t()
     : nid(0),
@@ -199,7 +259,11 @@ struct bluestore_onode_t {
       last_overlay_key(0),
       omap_head(0),
       expected_object_size(0),
-      expected_write_size(0) {}
+      expected_write_size(0),
+      alloc_hint_flags(0),
+      csum_type(CSUM_NONE),
+      csum_chunk_order(0),
+      extent_map_shard_size(0) {}
 
   map<uint64_t,bluestore_extent_t>::iterator find_extent(uint64_t offset) {
     map<uint64_t,bluestore_extent_t>::iterator fp = block_map.lower_bound(offset);
@@ -225,6 +289,27 @@ struct bluestore_onode_t {
     return fp;
   }
 
+  /// first compressed run that ends after offset
+  map<uint64_t,bluestore_compressed_t>::iterator seek_compressed(
+    uint64_t offset) {
+    map<uint64_t,bluestore_compressed_t>::iterator cp =
+      compressed_map.lower_bound(offset);
+    if (cp != compressed_map.begin()) {
+      --cp;
+      if (cp->first + cp->second.logical_length <= offset) {
+	++cp;
+      }
+    }
+    return cp;
+  }
+
+  /// true if any data has been written (as opposed to a size set by
+  /// truncate, which reads back as zeros)
+  bool has_data() const {
+    return !block_map.empty() || !overlay_map.empty() ||
+      !compressed_map.empty();
+  }
+
   bool put_overlay_ref(uint64_t key) {
     map<uint64_t,uint16_t>::iterator q = overlay_refs.find(key);
     if (q == overlay_refs.end())
@@ -243,6 +328,52 @@ struct bluestore_onode_t {
       ++q->second;
   }
 
+  // Checksums cover the logical object data in fixed-size chunks; the
+  // last chunk covers only up to eof.  Chunks past the end of csum_data
+  // or in csum_unknown (partially overwritten, or zero-filled by a
+  // truncate) have no checksum and are not verified.
+  bool has_csum() const {
+    return csum_type != CSUM_NONE;
+  }
+  uint64_t get_csum_chunk_size() const {
+    return 1ull << csum_chunk_order;
+  }
+  unsigned get_csum_count() const {
+    return has_csum() ? csum_data.size() / get_csum_value_size(csum_type) : 0;
+  }
+  bool has_csum_value(unsigned i) const {
+    return i < get_csum_count() && !csum_unknown.contains(i);
+  }
+  uint64_t get_csum_value(unsigned i) const;
+  void set_csum_value(unsigned i, uint64_t v);
+  uint64_t calc_csum(const bufferlist& bl) const;
+
+  /// set the checksum algorithm; drops any existing checksums
+  void set_csum(unsigned type, unsigned order);
+  /// update csums for a write (bl == NULL for zeros), before size changes
+  void csum_write(uint64_t offset, uint64_t length, const bufferlist *bl);
+  /// update csums after size changed from old_size by a truncate
+  void csum_truncate(uint64_t old_size);
+  /// verify bl at offset (chunk aligned); return 0 or -EIO and bad chunk
+  /// offset, and add the bytes covered by a csum value to *verified
+  int csum_verify(uint64_t offset, const bufferlist& bl,
+		  uint64_t *bad_offset, uint64_t *verified = NULL) const;
+
+  void _csum_extend(unsigned count);
+  void _csum_invalidate(unsigned first, unsigned num);
+
+  uint64_t get_extent_shard(uint64_t offset) const {
+    return offset - offset % extent_map_shard_size;
+  }
+  /// csum chunks [*first, *last) start in shard
+  void get_csum_shard_chunks(uint64_t shard, unsigned *first,
+			     unsigned *last) const;
+  /// encode the block_map extents and csum chunks starting in shard;
+  /// return how many of them there are
+  unsigned encode_extent_shard(uint64_t shard, bufferlist& bl) const;
+  /// add the extents and csums of an encoded shard
+  void decode_extent_shard(uint64_t shard, bufferlist::iterator& p);
+
   void encode(bufferlist& bl) const;
   void decode(bufferlist::iterator& p);
   void dump(Formatter *f) const;
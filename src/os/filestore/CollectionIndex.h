@@ -15,6 +15,7 @@
 #ifndef OS_COLLECTIONINDEX_H
 #define OS_COLLECTIONINDEX_H
 
+#include <errno.h>
 #include <string>
 #include <vector>
 #include "include/memory.h"
@@ -190,6 +191,35 @@ protected:
       uint64_t expected_num_objs  ///< [in] expected number of objects this collection has
       ) { assert(0); return 0; }
 
+  /// True if created() has queued directories for a background split
+  virtual bool has_queued_splits() { return false; }
+
+  /**
+   * Split one directory queued by created()
+   *
+   * Caller must hold access_lock for write.
+   *
+   * @return Error Code, 0 for success
+   */
+  virtual int split_queued(
+    bool *more, ///< [out] more directories remain queued
+    bool *split ///< [out] false if the directory no longer needed a split
+    ) { *more = false; *split = false; return 0; }
+
+  /**
+   * Split directories until the collection could hold expected_num_objs
+   * objects, distributed like its current contents, without further
+   * runtime splitting.
+   *
+   * Caller must hold access_lock for write.
+   *
+   * @return Error Code, 0 for success
+   */
+  virtual int pre_split(
+    uint64_t expected_num_objs, ///< [in] expected number of objects
+    unsigned *splits            ///< [out] number of directories split
+    ) { return -EOPNOTSUPP; }
+
   /// Virtual destructor
   virtual ~CollectionIndex() {}
 };
@@ -17,6 +17,7 @@
 
 #include "common/debug.h"
 #include "common/config.h"
+#include "common/perf_counters.h"
 #include "include/assert.h"
 
 #define dout_subsys ceph_subsys_filestore
@@ -36,6 +37,34 @@ const string DBObjectMap::HOBJECT_TO_SEQ = "_HOBJTOSEQ_";
 const string DBObjectMap::LEAF_PREFIX = "_LEAF_";
 const string DBObjectMap::REVERSE_LEAF_PREFIX = "_REVLEAF_";
 
+DBObjectMap::DBObjectMap(KeyValueDB *db)
+  : db(db), header_lock("DBOBjectMap"), logger(NULL)
+{
+  int shards = MAX(1, g_conf->filestore_omap_header_cache_shards);
+  size_t per_shard = MAX(1, g_conf->filestore_omap_header_cache_size / shards);
+  for (int i = 0; i < shards; ++i)
+    caches.push_back(new HeaderCache(per_shard));
+
+  PerfCountersBuilder b(g_ceph_context, "dbobjectmap",
+			l_dbom_first, l_dbom_last);
+  b.add_u64_counter(l_dbom_header_cache_hit, "header_cache_hit",
+		    "Map header lookups served from the cache");
+  b.add_u64_counter(l_dbom_header_cache_miss, "header_cache_miss",
+		    "Map header lookups read from the db");
+  logger = b.create_perf_counters();
+  g_ceph_context->get_perfcounters_collection()->add(logger);
+}
+
+DBObjectMap::~DBObjectMap()
+{
+  g_ceph_context->get_perfcounters_collection()->remove(logger);
+  delete logger;
+  for (vector<HeaderCache*>::iterator i = caches.begin();
+       i != caches.end();
+       ++i)
+    delete *i;
+}
+
 static void append_escaped(const string &in, string *out)
 {
   for (string::const_iterator i = in.begin(); i != in.end(); ++i) {
@@ -786,20 +815,8 @@ int DBObjectMap::scan(Header header,
 		      map<string, bufferlist> *out_values)
 {
   ObjectMapIterator db_iter = _get_iterator(header);
-  for (set<string>::const_iterator key_iter = in_keys.begin();
-       key_iter != in_keys.end();
-       ++key_iter) {
-    db_iter->lower_bound(*key_iter);
-    if (db_iter->status())
-      return db_iter->status();
-    if (db_iter->valid() && db_iter->key() == *key_iter) {
-      if (out_keys)
-	out_keys->insert(*key_iter);
-      if (out_values)
-	out_values->insert(make_pair(db_iter->key(), db_iter->value()));
-    }
-  }
-  return 0;
+  return KeyValueDB::get_by_iterator(db_iter.get(), in_keys, out_keys,
+				     out_values);
 }
 
 int DBObjectMap::get_values(const ghobject_t &oid,
@@ -1073,41 +1090,33 @@ int DBObjectMap::write_state(KeyValueDB::Transaction _t) {
 }
 
 
-DBObjectMap::Header DBObjectMap::_lookup_map_header(
+DBObjectMap::Header DBObjectMap::lookup_map_header(
   const MapHeaderLock &l,
   const ghobject_t &oid)
 {
   assert(l.get_locked() == oid);
 
   _Header *header = new _Header();
-  {
-    Mutex::Locker l(cache_lock);
-    if (caches.lookup(oid, header)) {
-      assert(!in_use.count(header->seq));
-      in_use.insert(header->seq);
-      return Header(header, RemoveOnDelete(this));
+  HeaderCache &cache = get_cache(oid);
+  if (cache.lookup(oid, header)) {
+    logger->inc(l_dbom_header_cache_hit);
+  } else {
+    logger->inc(l_dbom_header_cache_miss);
+    bufferlist out;
+    int r = db->get(HOBJECT_TO_SEQ, map_header_key(oid), &out);
+    if (r < 0 || out.length()==0) {
+      delete header;
+      return Header();
     }
+    bufferlist::iterator iter = out.begin();
+    header->decode(iter);
+    cache.add(oid, *header);
   }
 
-  bufferlist out;
-  int r = db->get(HOBJECT_TO_SEQ, map_header_key(oid), &out);
-  if (r < 0 || out.length()==0) {
-    delete header;
-    return Header();
-  }
-
-  Header ret(header, RemoveOnDelete(this));
-  bufferlist::iterator iter = out.begin();
-
-  ret->decode(iter);
-  {
-    Mutex::Locker l(cache_lock);
-    caches.add(oid, *ret);
-  }
-
+  Mutex::Locker hl(header_lock);
   assert(!in_use.count(header->seq));
   in_use.insert(header->seq);
-  return ret;
+  return Header(header, RemoveOnDelete(this));
 }
 
 DBObjectMap::Header DBObjectMap::_generate_new_header(const ghobject_t &oid,
@@ -1164,10 +1173,9 @@ DBObjectMap::Header DBObjectMap::lookup_create_map_header(
   const ghobject_t &oid,
   KeyValueDB::Transaction t)
 {
-  Mutex::Locker l(header_lock);
-  Header header = _lookup_map_header(hl, oid);
+  Header header = lookup_map_header(hl, oid);
   if (!header) {
-    header = _generate_new_header(oid, Header());
+    header = generate_new_header(oid, Header());
     set_map_header(hl, oid, *header, t);
   }
   return header;
@@ -1205,10 +1213,7 @@ void DBObjectMap::remove_map_header(
   set<string> to_remove;
   to_remove.insert(map_header_key(oid));
   t->rmkeys(HOBJECT_TO_SEQ, to_remove);
-  {
-    Mutex::Locker l(cache_lock);
-    caches.clear(oid);
-  }
+  get_cache(oid).clear(oid);
 }
 
 void DBObjectMap::set_map_header(
@@ -1223,10 +1228,7 @@ void DBObjectMap::set_map_header(
   map<string, bufferlist> to_set;
   header.encode(to_set[map_header_key(oid)]);
   t->set(HOBJECT_TO_SEQ, to_set);
-  {
-    Mutex::Locker l(cache_lock);
-    caches.add(oid, header);
-  }
+  get_cache(oid).add(oid, header);
 }
 
 bool DBObjectMap::check_spos(const ghobject_t &oid,
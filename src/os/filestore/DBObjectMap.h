@@ -21,6 +21,15 @@
 
 #include "SequencerPosition.h"
 
+class PerfCounters;
+
+enum {
+  l_dbom_first = 999100,
+  l_dbom_header_cache_hit,
+  l_dbom_header_cache_miss,
+  l_dbom_last
+};
+
 /**
  * DBObjectMap: Implements ObjectMap in terms of KeyValueDB
  *
@@ -115,10 +124,8 @@ public:
     }
   };
 
-  explicit DBObjectMap(KeyValueDB *db) : db(db), header_lock("DBOBjectMap"),
-           	                         cache_lock("DBObjectMap::CacheLock"),
-      	                                 caches(g_conf->filestore_omap_header_cache_size)
-    {}
+  explicit DBObjectMap(KeyValueDB *db);
+  ~DBObjectMap();
 
   int set_keys(
     const ghobject_t &oid,
@@ -328,8 +335,17 @@ public:
 private:
   /// Implicit lock on Header->seq
   typedef ceph::shared_ptr<_Header> Header;
-  Mutex cache_lock;
-  SimpleLRU<ghobject_t, _Header, ghobject_t::BitwiseComparator> caches;
+
+  /// Leaf headers by oid, sharded by hash so that lookups of
+  /// different objects do not serialize on a single LRU lock
+  typedef SimpleLRU<ghobject_t, _Header, ghobject_t::BitwiseComparator>
+    HeaderCache;
+  vector<HeaderCache*> caches;
+  HeaderCache &get_cache(const ghobject_t &oid) {
+    return *caches[oid.hobj.get_hash() % caches.size()];
+  }
+
+  PerfCounters *logger;
 
   string map_header_key(const ghobject_t &oid);
   string header_key(uint64_t seq);
@@ -459,16 +475,16 @@ private:
     return _generate_new_header(oid, parent);
   }
 
-  /// Lookup leaf header for c oid
-  Header _lookup_map_header(
+  /**
+   * Lookup leaf header for c oid
+   *
+   * The MapHeaderLock keeps the leaf stable, so header_lock is only
+   * taken to mark the seq in use and a miss does not hold up lookups
+   * of other objects while it reads the db.
+   */
+  Header lookup_map_header(
     const MapHeaderLock &l,
     const ghobject_t &oid);
-  Header lookup_map_header(
-    const MapHeaderLock &l2,
-    const ghobject_t &oid) {
-    Mutex::Locker l(header_lock);
-    return _lookup_map_header(l2, oid);
-  }
 
   /// Lookup header node for input
   Header lookup_parent(Header input);
@@ -897,13 +897,10 @@ int FileJournal::prepare_multi_write(bufferlist& bl, uint64_t& orig_ops, uint64_
       if (r == 0) { // prepare ok, delete it
 	items.erase(it++);
 #ifdef HAVE_LIBAIO
-	{
-	  Mutex::Locker locker(aio_lock);
-	  assert(aio_write_queue_ops > 0);
-	  aio_write_queue_ops--;
-	  assert(aio_write_queue_bytes >= bytes);
-	  aio_write_queue_bytes -= bytes;
-	}
+	assert(aio_write_queue_ops > 0);
+	aio_write_queue_ops--;
+	assert(aio_write_queue_bytes >= bytes);
+	aio_write_queue_bytes -= bytes;
 #endif
       }
       if (r == -ENOSPC) {
@@ -1285,21 +1282,51 @@ void FileJournal::write_thread_entry()
       // but should be fine given that we will have plenty of aios in
       // flight if we hit this limit to ensure we keep the device
       // saturated.
+      //
+      // we do not hold a partial batch back for longer than a fraction
+      // of the observed aio latency, though: on a fast device the
+      // extra batching costs more latency than it saves.
+      utime_t throttle_start;
       while (aio_num > 0) {
 	int exp = MIN(aio_num * 2, 24);
 	long unsigned min_new = 1ull << exp;
+	// set before sampling the queue, so that submit_entry either
+	// sees it and signals us, or we see its bytes
+	aio_write_waiting = true;
 	uint64_t cur = aio_write_queue_bytes;
 	dout(20) << "write_thread_entry aio throttle: aio num " << aio_num << " bytes " << aio_bytes
 		 << " ... exp " << exp << " min_new " << min_new
 		 << " ... pending " << cur << dendl;
 	if (cur >= min_new)
 	  break;
-	dout(20) << "write_thread_entry deferring until more aios complete: "
-		 << aio_num << " aios with " << aio_bytes << " bytes needs " << min_new
-		 << " bytes to start a new aio (currently " << cur << " pending)" << dendl;
-	aio_cond.Wait(aio_lock);
+	double ratio = g_conf->journal_aio_batch_max_wait_ratio;
+	if (ratio > 0 && aio_lat_avg > 0) {
+	  utime_t now = ceph_clock_now(g_ceph_context);
+	  if (throttle_start.is_zero())
+	    throttle_start = now;
+	  utime_t max_wait;
+	  max_wait.set_from_double(aio_lat_avg * ratio);
+	  utime_t waited = now - throttle_start;
+	  if (waited >= max_wait) {
+	    dout(20) << "write_thread_entry waited " << waited
+		     << " for a batch, submitting " << cur << " pending bytes"
+		     << dendl;
+	    break;
+	  }
+	  dout(20) << "write_thread_entry deferring up to " << max_wait - waited
+		   << " for more aios to complete: "
+		   << aio_num << " aios with " << aio_bytes << " bytes needs " << min_new
+		   << " bytes to start a new aio (currently " << cur << " pending)" << dendl;
+	  aio_cond.WaitInterval(g_ceph_context, aio_lock, max_wait - waited);
+	} else {
+	  dout(20) << "write_thread_entry deferring until more aios complete: "
+		   << aio_num << " aios with " << aio_bytes << " bytes needs " << min_new
+		   << " bytes to start a new aio (currently " << cur << " pending)" << dendl;
+	  aio_cond.Wait(aio_lock);
+	}
 	dout(20) << "write_thread_entry woke up" << dendl;
       }
+      aio_write_waiting = false;
     }
 #endif
 
@@ -1470,6 +1497,7 @@ int FileJournal::write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq)
 
     aio_num++;
     aio_bytes += aio.len;
+    aio.start = ceph_clock_now(g_ceph_context);
 
     // need to save current aio len to update write_pos later because current
     // aio could be ereased from aio_queue once it is done
@@ -1533,6 +1561,7 @@ void FileJournal::write_finish_thread_entry()
 
     {
       Mutex::Locker locker(aio_lock);
+      utime_t now = ceph_clock_now(g_ceph_context);
       for (int i=0; i<r; i++) {
 	aio_info *ai = (aio_info *)event[i].obj;
 	if (event[i].res != ai->len) {
@@ -1540,9 +1569,16 @@ void FileJournal::write_finish_thread_entry()
 	       << " wrote " << event[i].res << dendl;
 	  assert(0 == "unexpected aio error");
 	}
+	utime_t lat = now - ai->start;
 	dout(10) << "write_finish_thread_entry aio " << ai->off
-		 << "~" << ai->len << " done" << dendl;
+		 << "~" << ai->len << " done, lat " << lat << dendl;
 	ai->done = true;
+	if (aio_lat_avg > 0)
+	  aio_lat_avg = aio_lat_avg * .9 + (double)lat * .1;
+	else
+	  aio_lat_avg = lat;
+	if (logger)
+	  logger->tinc(l_os_j_aio_lat, lat);
       }
       check_aio_completion();
     }
@@ -1676,26 +1712,30 @@ void FileJournal::submit_entry(uint64_t seq, bufferlist& e, uint32_t orig_len,
     logger->inc(l_os_j_bytes, e.length());
   }
 
-  {
-    Mutex::Locker l1(writeq_lock);
+  utime_t now = ceph_clock_now(g_ceph_context);
 #ifdef HAVE_LIBAIO
-    Mutex::Locker l2(aio_lock);
+  // counted before the item is visible to the write thread, which
+  // subtracts it again once it has taken the item off writeq
+  aio_write_queue_ops++;
+  aio_write_queue_bytes += e.length();
 #endif
-    Mutex::Locker l3(completions_lock);
 
-#ifdef HAVE_LIBAIO
-    aio_write_queue_ops++;
-    aio_write_queue_bytes += e.length();
-    aio_cond.Signal();
-#endif
-
-    completions.push_back(
-      completion_item(
-	seq, oncommit, ceph_clock_now(g_ceph_context), osd_op));
+  {
+    Mutex::Locker l1(writeq_lock);
+    Mutex::Locker l3(completions_lock);
+    completions.push_back(completion_item(seq, oncommit, now, osd_op));
     if (writeq.empty())
       writeq_cond.Signal();
     writeq.push_back(write_item(seq, e, orig_len, osd_op));
   }
+
+#ifdef HAVE_LIBAIO
+  // only take aio_lock if the write thread is waiting for a bigger batch
+  if (aio_write_waiting) {
+    Mutex::Locker l(aio_lock);
+    aio_cond.Signal();
+  }
+#endif
 }
 
 bool FileJournal::writeq_empty()
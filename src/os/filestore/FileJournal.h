@@ -16,6 +16,7 @@
 #ifndef CEPH_FILEJOURNAL_H
 #define CEPH_FILEJOURNAL_H
 
+#include <atomic>
 #include <deque>
 using std::deque;
 
@@ -253,6 +254,7 @@ private:
     bool done;
     uint64_t off, len;    ///< these are for debug only
     uint64_t seq;         ///< seq number to complete on aio completion, if non-zero
+    utime_t start;        ///< when we submitted it
 
     aio_info(bufferlist& b, uint64_t o, uint64_t s)
       : iov(NULL), done(false), off(o), len(b.length()), seq(s) {
@@ -269,9 +271,14 @@ private:
   io_context_t aio_ctx;
   list<aio_info> aio_queue;
   int aio_num, aio_bytes;
-  uint64_t aio_write_queue_ops;
-  uint64_t aio_write_queue_bytes;
+  double aio_lat_avg;   ///< moving average of aio latency, in seconds
   /// End protected by aio_lock
+
+  /// queued for the write thread; updated by submit_entry without aio_lock
+  std::atomic<uint64_t> aio_write_queue_ops;
+  std::atomic<uint64_t> aio_write_queue_bytes;
+  /// write thread is waiting on aio_cond for more bytes to be queued
+  std::atomic<bool> aio_write_waiting;
 #endif
 
   uint64_t last_committed_seq;
@@ -408,8 +415,10 @@ private:
     aio_lock("FileJournal::aio_lock"),
     aio_ctx(0),
     aio_num(0), aio_bytes(0),
+    aio_lat_avg(0),
     aio_write_queue_ops(0),
     aio_write_queue_bytes(0),
+    aio_write_waiting(false),
 #endif
     last_committed_seq(0),
     journaled_since_start(0),
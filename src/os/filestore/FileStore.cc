@@ -65,6 +65,7 @@
 #include "common/run_cmd.h"
 #include "common/safe_io.h"
 #include "common/perf_counters.h"
+#include "common/admin_socket.h"
 #include "common/sync_filesystem.h"
 #include "common/fd.h"
 #include "HashIndex.h"
@@ -523,6 +524,9 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, osflagbit
   sync_entry_timeo_lock("sync_entry_timeo_lock"),
   timer(g_ceph_context, sync_entry_timeo_lock),
   stop(false), sync_thread(this),
+  split_lock("FileStore::split_lock"),
+  split_stop(false), split_thread(this),
+  asok_hook(NULL),
   fdcache(g_ceph_context),
   wbthrottle(g_ceph_context),
   next_osr_id(0),
@@ -610,7 +614,11 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, osflagbit
   plb.add_time_avg(l_os_commit_len, "commitcycle_interval", "Average interval between commits");
   plb.add_time_avg(l_os_commit_lat, "commitcycle_latency", "Average latency of commit");
   plb.add_u64_counter(l_os_j_full, "journal_full", "Journal writes while full");
+  plb.add_time_avg(l_os_j_aio_lat, "journal_aio_latency", "Average journal aio completion latency");
   plb.add_time_avg(l_os_queue_lat, "queue_transaction_latency_avg", "Store operation queue latency");
+  plb.add_u64_counter(l_os_read_hole_bytes, "read_hole_bytes", "Bytes of holes zero-filled on read without I/O");
+  plb.add_u64_counter(l_os_split_ahead, "split_ahead", "Directories split in the background");
+  plb.add_u64_counter(l_os_split_ahead_skipped, "split_ahead_skipped", "Queued splits no longer needed");
 
   logger = plb.create_perf_counters();
 
@@ -1652,6 +1660,12 @@ int FileStore::mount()
 
   timer.init();
 
+  if (g_conf->filestore_split_ahead_ratio > 0) {
+    split_stop = false;
+    split_thread.create("filestore_split");
+  }
+  _register_asok();
+
   // upgrade?
   if (g_conf->filestore_update_to >= (int)get_target_version()) {
     int err = upgrade();
@@ -1732,6 +1746,15 @@ int FileStore::umount()
 {
   dout(5) << "umount " << basedir << dendl;
 
+  _unregister_asok();
+  if (split_thread.is_started()) {
+    split_lock.Lock();
+    split_stop = true;
+    split_cond.Signal();
+    split_lock.Unlock();
+    split_thread.join();
+  }
+
   flush();
   sync();
   do_force_sync();
@@ -1790,6 +1813,81 @@ int FileStore::umount()
   return 0;
 }
 
+class FileStore::SocketHook : public AdminSocketHook {
+  FileStore *store;
+public:
+  explicit SocketHook(FileStore *s) : store(s) {}
+  bool call(std::string command, cmdmap_t& cmdmap, std::string format,
+	    bufferlist& out) override {
+    stringstream ss;
+    bool r = store->asok_command(command, cmdmap, format, ss);
+    out.append(ss);
+    return r;
+  }
+};
+
+void FileStore::_register_asok()
+{
+  AdminSocket *admin_socket = g_ceph_context->get_admin_socket();
+  asok_hook = new SocketHook(this);
+  int r = admin_socket->register_command(
+    "filestore presplit",
+    "filestore presplit " \
+    "name=collection,type=CephString " \
+    "name=expected_num_objects,type=CephInt,range=1",
+    asok_hook,
+    "split a collection's directories ahead of time for an expected "
+    "object count");
+  if (r < 0) {
+    // another store in this process got there first
+    dout(1) << __func__ << " not registering admin socket commands: "
+	    << cpp_strerror(r) << dendl;
+    delete asok_hook;
+    asok_hook = NULL;
+  }
+}
+
+void FileStore::_unregister_asok()
+{
+  if (!asok_hook)
+    return;
+  AdminSocket *admin_socket = g_ceph_context->get_admin_socket();
+  admin_socket->unregister_command("filestore presplit");
+  delete asok_hook;
+  asok_hook = NULL;
+}
+
+bool FileStore::asok_command(string command, cmdmap_t& cmdmap, string format,
+			     ostream& ss)
+{
+  Formatter *f = Formatter::create(format, "json-pretty", "json-pretty");
+  if (command == "filestore presplit") {
+    string cstr;
+    int64_t expected_num_objs = 0;
+    cmd_getval(g_ceph_context, cmdmap, "collection", cstr);
+    cmd_getval(g_ceph_context, cmdmap, "expected_num_objects",
+	       expected_num_objs);
+    coll_t c;
+    unsigned splits = 0;
+    int r = -EINVAL;
+    if (c.parse(cstr) && expected_num_objs > 0)
+      r = pre_split_collection(c, expected_num_objs, &splits);
+    f->open_object_section("presplit");
+    f->dump_stream("collection") << cstr;
+    f->dump_int("expected_num_objects", expected_num_objs);
+    f->dump_int("result", r);
+    if (r < 0)
+      f->dump_string("error", cpp_strerror(r));
+    f->dump_unsigned("splits", splits);
+    f->close_section();
+  } else {
+    assert(0 == "broken asok registration");
+  }
+  f->flush(ss);
+  delete f;
+  return true;
+}
+
 
 
 
@@ -1837,7 +1935,62 @@ void FileStore::queue_op(OpSequencer *osr, Op *o)
 	  << " " << o->bytes << " bytes"
 	  << "   (queue has " << throttle_ops.get_current() << " ops and " << throttle_bytes.get_current() << " bytes)"
 	  << dendl;
-  op_wq.queue(osr);
+  op_wq.queue_op(osr, o->bytes);
+}
+
+FileStore::OpSequencer *FileStore::OpWQ::_dequeue()
+{
+  list<OpSequencer*> &q = store->op_queue;
+  uint64_t quantum = g_conf->filestore_op_queue_quantum;
+
+  // rounds of credit until the first idle sequencer can afford its
+  // next op; grant that many to every idle sequencer at once rather
+  // than spinning round by round.  this is linear in the sequencers
+  // with queued ops and takes no lock but ours.
+  bool found = false;
+  uint64_t rounds = 0;
+  for (list<OpSequencer*>::iterator p = q.begin(); p != q.end(); ++p) {
+    OpSequencer *osr = *p;
+    if (osr->wq_busy)
+      continue;
+    uint64_t cost = quantum ? osr->wq_bytes.front() : 0;
+    uint64_t r = 0;
+    if (cost > osr->wq_deficit)
+      r = (cost - osr->wq_deficit + quantum - 1) / quantum;
+    if (!found || r < rounds)
+      rounds = r;
+    found = true;
+    if (rounds == 0)
+      break;
+  }
+  if (!found)
+    return NULL;  // everything queued is already being applied
+  if (rounds) {
+    for (list<OpSequencer*>::iterator p = q.begin(); p != q.end(); ++p) {
+      if (!(*p)->wq_busy)
+	(*p)->wq_deficit += rounds * quantum;
+    }
+  }
+
+  // rotate to the first sequencer that can afford its next op
+  while (true) {
+    OpSequencer *osr = q.front();
+    q.pop_front();
+    if (!osr->wq_busy) {
+      uint64_t cost = quantum ? osr->wq_bytes.front() : 0;
+      if (cost <= osr->wq_deficit) {
+	osr->wq_deficit -= cost;
+	osr->wq_busy = true;
+	osr->wq_bytes.pop_front();
+	if (!osr->wq_bytes.empty())
+	  q.push_back(osr);
+	else
+	  osr->wq_deficit = 0;
+	return osr;
+      }
+    }
+    q.push_back(osr);
+  }
 }
 
 void FileStore::op_queue_reserve_throttle(Op *o)
@@ -2988,7 +3141,12 @@ int FileStore::read(
 #endif
 
   bufferptr bptr(len);  // prealloc space for entire read
-  got = safe_pread(**fd, bptr.c_str(), len, offset);
+  if (g_conf->filestore_sparse_read &&
+      len > (size_t)m_filestore_fiemap_threshold &&
+      (backend->has_seek_data_hole() || backend->has_fiemap()))
+    got = _do_sparse_read(**fd, offset, len, bptr.c_str());
+  else
+    got = safe_pread(**fd, bptr.c_str(), len, offset);
   if (got < 0) {
     dout(10) << "FileStore::read(" << cid << "/" << oid << ") pread error: " << cpp_strerror(got) << dendl;
     lfn_close(fd);
@@ -3032,6 +3190,62 @@ int FileStore::read(
   }
 }
 
+/*
+ * Like safe_pread, but only read the data extents of offset~len and
+ * zero-fill the holes in between.
+ */
+int FileStore::_do_sparse_read(int fd, uint64_t offset, size_t len, char *buf)
+{
+  struct stat st;
+  if (::fstat(fd, &st) < 0)
+    return -errno;
+  if (offset >= (uint64_t)st.st_size)
+    return 0;
+  if (offset + len > (uint64_t)st.st_size)
+    len = st.st_size - offset;
+
+  map<uint64_t, uint64_t> m;
+  int r;
+  if (backend->has_seek_data_hole())
+    r = _do_seek_hole_data(fd, offset, len, &m);
+  else
+    r = _do_fiemap(fd, offset, len, &m);
+  if (r < 0)
+    return r;
+
+  const uint64_t end = offset + len;
+  uint64_t pos = offset;
+  uint64_t holes = 0;
+  for (map<uint64_t, uint64_t>::iterator p = m.begin(); p != m.end(); ++p) {
+    uint64_t ext_off = MAX(p->first, pos);
+    uint64_t ext_end = MIN(p->first + p->second, end);
+    if (ext_end <= ext_off)
+      continue;
+    if (ext_off > pos) {
+      memset(buf + (pos - offset), 0, ext_off - pos);
+      holes += ext_off - pos;
+    }
+    ssize_t got = safe_pread(fd, buf + (ext_off - offset), ext_end - ext_off,
+			     ext_off);
+    if (got < 0)
+      return got;
+    if ((uint64_t)got < ext_end - ext_off) {
+      // truncated under us; report what we have, as pread would
+      return ext_off - offset + got;
+    }
+    pos = ext_end;
+  }
+  if (pos < end) {
+    memset(buf + (pos - offset), 0, end - pos);
+    holes += end - pos;
+  }
+  dout(20) << __func__ << " " << offset << "~" << len << " " << m.size()
+	   << " extents, " << holes << " bytes of holes" << dendl;
+  if (holes)
+    logger->inc(l_os_read_hole_bytes, holes);
+  return len;
+}
+
 int FileStore::_do_fiemap(int fd, uint64_t offset, size_t len,
                           map<uint64_t, uint64_t> *m)
 {
@@ -3832,6 +4046,73 @@ void FileStore::sync_entry()
   lock.Unlock();
 }
 
+void FileStore::split_entry()
+{
+  dout(10) << __func__ << " start" << dendl;
+  split_lock.Lock();
+  utime_t last = ceph_clock_now(g_ceph_context);
+  while (!split_stop) {
+    vector<coll_t> ls;
+    index_manager.get_queued_splits(&ls);
+    if (ls.empty()) {
+      split_cond.WaitInterval(g_ceph_context, split_lock, utime_t(1, 0));
+      continue;
+    }
+    // one directory per collection per pass, so that a collection with
+    // a long queue does not starve the others
+    for (vector<coll_t>::iterator p = ls.begin();
+	 p != ls.end() && !split_stop;
+	 ++p) {
+      // stay under the rate; a rate change wakes us to recompute
+      while (!split_stop) {
+	double rate = g_conf->filestore_split_ahead_rate;
+	if (rate <= 0)
+	  break;
+	utime_t next;
+	next.set_from_double((double)last + 1.0 / rate);
+	utime_t now = ceph_clock_now(g_ceph_context);
+	if (now >= next)
+	  break;
+	split_cond.WaitInterval(g_ceph_context, split_lock, next - now);
+      }
+      if (split_stop)
+	break;
+      split_lock.Unlock();
+      _split_queued(*p);
+      split_lock.Lock();
+      last = ceph_clock_now(g_ceph_context);
+    }
+  }
+  split_lock.Unlock();
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void FileStore::_split_queued(const coll_t& c)
+{
+  Index index;
+  int r = get_index(c, &index);
+  if (r < 0) {
+    derr << __func__ << " " << c << " get_index failed: " << cpp_strerror(r)
+	 << dendl;
+    return;
+  }
+  assert(NULL != index.index);
+  bool more = false, split = false;
+  {
+    RWLock::WLocker l((index.index)->access_lock);
+    r = index->split_queued(&more, &split);
+  }
+  dout(15) << __func__ << " " << c << " = " << r << " more " << more
+	   << " split " << split << dendl;
+  if (r >= 0)
+    logger->inc(split ? l_os_split_ahead : l_os_split_ahead_skipped);
+  if (r < 0) {
+    derr << __func__ << " " << c << " split failed: " << cpp_strerror(r)
+	 << dendl;
+    assert(!m_filestore_fail_eio || r != -EIO);
+  }
+}
+
 void FileStore::_start_sync()
 {
   if (!journal) {  // don't do a big sync if the journal is on
@@ -5096,6 +5377,28 @@ int FileStore::_destroy_collection(const coll_t& c)
 }
 
 
+int FileStore::pre_split_collection(const coll_t& c, uint64_t expected_num_objs,
+				    unsigned *splits)
+{
+  dout(10) << __func__ << " " << c << " expected_num_objs "
+	   << expected_num_objs << dendl;
+  *splits = 0;
+  if (!collection_exists(c))
+    return -ENOENT;
+  Index index;
+  int r = get_index(c, &index);
+  if (r < 0)
+    return r;
+  assert(NULL != index.index);
+  {
+    RWLock::WLocker l((index.index)->access_lock);
+    r = index->pre_split(expected_num_objs, splits);
+  }
+  dout(10) << __func__ << " " << c << " = " << r << " splits " << *splits
+	   << dendl;
+  return r;
+}
+
 int FileStore::_collection_add(const coll_t& c, const coll_t& oldcid, const ghobject_t& o,
 			       const SequencerPosition& spos)
 {
@@ -5516,6 +5819,7 @@ const char** FileStore::get_tracked_conf_keys() const
     "filestore_sloppy_crc",
     "filestore_sloppy_crc_block_size",
     "filestore_max_alloc_hint_size",
+    "filestore_split_ahead_rate",
     NULL
   };
   return KEYS;
@@ -5570,6 +5874,10 @@ void FileStore::handle_conf_change(const struct md_config_t *conf,
     Mutex::Locker l(sync_entry_timeo_lock);
     m_filestore_commit_timeout = conf->filestore_commit_timeout;
   }
+  if (changed.count("filestore_split_ahead_rate")) {
+    Mutex::Locker l(split_lock);
+    split_cond.Signal();
+  }
   if (changed.count("filestore_dump_file")) {
     if (conf->filestore_dump_file.length() &&
 	conf->filestore_dump_file != "-") {
@@ -35,6 +35,7 @@ using namespace std;
 #include "common/WorkQueue.h"
 
 #include "common/Mutex.h"
+#include "common/cmdparse.h"
 #include "HashIndex.h"
 #include "IndexManager.h"
 #include "os/ObjectMap.h"
@@ -115,6 +116,9 @@ public:
     perf_tracker.update_from_perfcounters(*logger);
     return perf_tracker.get_cur_stats();
   }
+  const PerfCounters* get_perf_counters() const {
+    return logger;
+  }
 
 private:
   string internal_name;         ///< internal name, used to name the perfcounter instance
@@ -187,6 +191,28 @@ private:
     }
   } sync_thread;
 
+  // background index splits
+  Mutex split_lock;
+  Cond split_cond;
+  bool split_stop;
+  void split_entry();
+  void _split_queued(const coll_t& c);
+  struct SplitThread : public Thread {
+    FileStore *fs;
+    explicit SplitThread(FileStore *f) : fs(f) {}
+    void *entry() {
+      fs->split_entry();
+      return 0;
+    }
+  } split_thread;
+
+  class SocketHook;
+  SocketHook *asok_hook;
+  void _register_asok();
+  void _unregister_asok();
+  bool asok_command(string command, cmdmap_t& cmdmap, string format,
+		    ostream& ss);
+
   // -- op workqueue --
   struct Op {
     utime_t start;
@@ -207,6 +233,11 @@ private:
     Mutex apply_lock;  // for apply mutual exclusion
     int id;
 
+    // op_wq scheduling state, protected by the op_tp lock
+    deque<uint64_t> wq_bytes; ///< sizes of ops queued to op_wq, not yet picked up
+    uint64_t wq_deficit;      ///< deficit round robin byte credit
+    bool wq_busy;             ///< an op thread is applying our front op
+
     /// get_max_uncompleted
     bool _get_max_uncompleted(
       uint64_t *seq ///< [out] max uncompleted seq
@@ -324,7 +355,8 @@ private:
       : qlock("FileStore::OpSequencer::qlock", false, false),
 	parent(0),
 	apply_lock("FileStore::OpSequencer::apply_lock", false, false),
-        id(i) {}
+        id(i),
+	wq_deficit(0), wq_busy(false) {}
     ~OpSequencer() {
       assert(q.empty());
     }
@@ -341,7 +373,8 @@ private:
 
   atomic_t next_osr_id;
   bool m_disable_wbthrottle;
-  deque<OpSequencer*> op_queue;
+  /// sequencers with ops queued to op_wq, each listed once
+  list<OpSequencer*> op_queue;
   BackoffThrottle throttle_ops, throttle_bytes;
   const int m_ondisk_finisher_num;
   const int m_apply_finisher_num;
@@ -349,14 +382,31 @@ private:
   vector<Finisher*> apply_finishers;
 
   ThreadPool op_tp;
+  /**
+   * Each queue_op() is one op for osr.  Ops of one sequencer are applied
+   * one at a time, so a sequencer that an op thread is already working
+   * on is skipped rather than handed to a second thread to block on its
+   * apply_lock.  The others are served deficit round robin by op bytes
+   * (filestore_op_queue_quantum per round), so a deep backlog of large
+   * writes on one sequencer does not hold up the rest.
+   */
   struct OpWQ : public ThreadPool::WorkQueue<OpSequencer> {
     FileStore *store;
     OpWQ(FileStore *fs, time_t timeout, time_t suicide_timeout, ThreadPool *tp)
       : ThreadPool::WorkQueue<OpSequencer>("FileStore::OpWQ", timeout, suicide_timeout, tp), store(fs) {}
 
+    /// the op was already queued on osr; note its size for the scheduler
+    void queue_op(OpSequencer *osr, uint64_t bytes) {
+      lock();
+      osr->wq_bytes.push_back(bytes);
+      if (osr->wq_bytes.size() == 1)
+	store->op_queue.push_back(osr);
+      _wake();
+      unlock();
+    }
     bool _enqueue(OpSequencer *osr) {
-      store->op_queue.push_back(osr);
-      return true;
+      assert(0 == "use queue_op");
+      return false;
     }
     void _dequeue(OpSequencer *o) {
       assert(0);
@@ -364,17 +414,12 @@ private:
     bool _empty() {
       return store->op_queue.empty();
     }
-    OpSequencer *_dequeue() {
-      if (store->op_queue.empty())
-	return NULL;
-      OpSequencer *osr = store->op_queue.front();
-      store->op_queue.pop_front();
-      return osr;
-    }
+    OpSequencer *_dequeue();
     void _process(OpSequencer *osr, ThreadPool::TPHandle &handle) override {
       store->_do_op(osr, handle);
     }
     void _process_finish(OpSequencer *osr) {
+      osr->wq_busy = false;
       store->_finish_op(osr);
     }
     void _clear() {
@@ -546,6 +591,7 @@ public:
     bufferlist& bl,
     uint32_t op_flags = 0,
     bool allow_eio = false);
+  int _do_sparse_read(int fd, uint64_t offset, size_t len, char *buf);
   int _do_fiemap(int fd, uint64_t offset, size_t len,
                  map<uint64_t, uint64_t> *m);
   int _do_seek_hole_data(int fd, uint64_t offset, size_t len,
@@ -636,6 +682,30 @@ public:
   bool collection_exists(const coll_t& c);
   bool collection_empty(const coll_t& c);
 
+  /**
+   * Split the index of c ahead of time so that it can grow to
+   * expected_num_objs objects without splitting on the write path.
+   *
+   * Unlike a COLL_HINT_EXPECTED_NUM_OBJECTS hint this works on a
+   * populated collection, projecting from how its current objects are
+   * spread over the hash space.
+   *
+   * @param c                 - collection id.
+   * @param expected_num_objs - expected number of objects in c
+   * @param splits            - [out] number of directories split
+   *
+   * @return 0 on success, an error code otherwise
+   */
+  int pre_split_collection(const coll_t& c, uint64_t expected_num_objs,
+			   unsigned *splits);
+
+  /// True if any collection has directories queued for a background split
+  bool has_queued_splits() {
+    vector<coll_t> ls;
+    index_manager.get_queued_splits(&ls);
+    return !ls.empty();
+  }
+
   // omap (see ObjectStore.h for documentation)
   using ObjectStore::omap_get;
   int omap_get(const coll_t& c, const ghobject_t &oid, bufferlist *header,
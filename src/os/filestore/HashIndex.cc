@@ -329,6 +329,10 @@ int HashIndex::_created(const vector<string> &path,
       return r;
     return complete_split(path, info);
   } else {
+    if (should_split_ahead(info)) {
+      Mutex::Locker l(split_queue_lock);
+      split_queue.insert(path);
+    }
     return 0;
   }
 }
@@ -399,9 +403,58 @@ int HashIndex::_collection_list_partial(const ghobject_t &start,
 }
 
 int HashIndex::prep_delete() {
+  {
+    Mutex::Locker l(split_queue_lock);
+    split_queue.clear();
+  }
   return recursive_remove(vector<string>());
 }
 
+bool HashIndex::has_queued_splits() {
+  Mutex::Locker l(split_queue_lock);
+  return !split_queue.empty();
+}
+
+int HashIndex::split_queued(bool *more, bool *split) {
+  vector<string> path;
+  *split = false;
+  {
+    Mutex::Locker l(split_queue_lock);
+    if (split_queue.empty()) {
+      *more = false;
+      return 0;
+    }
+    path = *split_queue.begin();
+    split_queue.erase(split_queue.begin());
+    *more = !split_queue.empty();
+  }
+  WRAP_RETRY(
+    r = split_ahead(path, split);
+    goto out;
+    );
+}
+
+int HashIndex::pre_split(uint64_t expected_num_objs, unsigned *splits) {
+  // Merging would undo splits of subdirs that are still sparse
+  if (merge_threshold > 0)
+    return -EOPNOTSUPP;
+  WRAP_RETRY(
+    *splits = 0;
+    vector<string> path;
+    uint64_t objs = 0;
+    r = count_objects(path, &objs);
+    if (r < 0)
+      goto out;
+    // Nothing to project the distribution from
+    if (objs == 0) {
+      r = -ENODATA;
+      goto out;
+    }
+    if (expected_num_objs > objs)
+      r = pre_split_subdirs(path, (double)expected_num_objs / objs, splits);
+    );
+}
+
 int HashIndex::_pre_hash_collection(uint32_t pg_num, uint64_t expected_num_objs) {
   int ret;
   vector<string> path;
@@ -638,6 +691,101 @@ bool HashIndex::must_split(const subdir_info_s &info) {
 
 }
 
+bool HashIndex::should_split_ahead(const subdir_info_s &info) {
+  return (split_ahead_ratio > 0 &&
+	  info.hash_level < (unsigned)MAX_HASH_LEVEL &&
+	  info.objs > ((unsigned)(abs(merge_threshold)) * 16 * split_multiplier *
+		       split_ahead_ratio));
+}
+
+int HashIndex::split_ahead(const vector<string> &path, bool *split) {
+  *split = false;
+  int exists;
+  int r = path_exists(path, &exists);
+  if (r < 0)
+    return r;
+  // merged away since it was queued
+  if (!exists)
+    return 0;
+  subdir_info_s info;
+  r = get_info(path, &info);
+  if (r < 0)
+    return r;
+  // already split by created(), or objects have since been removed
+  if (!should_split_ahead(info))
+    return 0;
+  dout(10) << __func__ << " " << coll() << " " << path
+	   << " objs " << info.objs << dendl;
+  r = initiate_split(path, info);
+  if (r < 0)
+    return r;
+  r = complete_split(path, info);
+  if (r < 0)
+    return r;
+  *split = true;
+  return 0;
+}
+
+int HashIndex::count_objects(vector<string> &path, uint64_t *objs) {
+  subdir_info_s info;
+  int r = get_info(path, &info);
+  if (r < 0)
+    return r;
+  *objs += info.objs;
+  if (info.subdirs == 0)
+    return 0;
+  vector<string> subdirs;
+  r = list_subdirs(path, &subdirs);
+  if (r < 0)
+    return r;
+  for (vector<string>::iterator i = subdirs.begin();
+       i != subdirs.end();
+       ++i) {
+    path.push_back(*i);
+    r = count_objects(path, objs);
+    if (r < 0)
+      return r;
+    path.pop_back();
+  }
+  return 0;
+}
+
+int HashIndex::pre_split_subdirs(vector<string> &path, double scale,
+				 unsigned *splits) {
+  subdir_info_s info;
+  int r = get_info(path, &info);
+  if (r < 0)
+    return r;
+  if (info.hash_level < (unsigned)MAX_HASH_LEVEL &&
+      info.objs * scale >
+      (double)((unsigned)(abs(merge_threshold)) * 16 * split_multiplier)) {
+    dout(10) << __func__ << " " << coll() << " " << path
+	     << " objs " << info.objs << " projected " << info.objs * scale
+	     << dendl;
+    r = initiate_split(path, info);
+    if (r < 0)
+      return r;
+    r = complete_split(path, info);
+    if (r < 0)
+      return r;
+    ++*splits;
+  }
+  vector<string> subdirs;
+  r = list_subdirs(path, &subdirs);
+  if (r < 0)
+    return r;
+  for (vector<string>::iterator i = subdirs.begin();
+       i != subdirs.end();
+       ++i) {
+    path.push_back(*i);
+    r = pre_split_subdirs(path, scale, splits);
+    if (r < 0)
+      return r;
+    path.pop_back();
+  }
+  return 0;
+}
+
 int HashIndex::initiate_merge(const vector<string> &path, subdir_info_s info) {
   return start_merge(path);
 }
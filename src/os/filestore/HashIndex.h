@@ -17,6 +17,7 @@
 
 #include "include/buffer_fwd.h"
 #include "include/encoding.h"
+#include "common/Mutex.h"
 #include "LFNIndex.h"
 
 extern string reverse_hexdigit_bits_string(string l);
@@ -67,6 +68,17 @@ private:
   int merge_threshold;
   int split_multiplier;
 
+  /**
+   * Once a subdir holds split_ahead_ratio of the split threshold it is
+   * queued for a background split (@see split_queued), so that the
+   * synchronous split in created() is only hit if the background split
+   * falls behind.  0 disables queueing.
+   */
+  double split_ahead_ratio;
+
+  Mutex split_queue_lock;
+  set<vector<string> > split_queue; ///< subdirs waiting for split_queued()
+
   /// Encodes current subdir state for determining when to split/merge.
   struct subdir_info_s {
     uint64_t objs;       ///< Objects in subdir.
@@ -139,10 +151,13 @@ public:
     int merge_at,          ///< [in] Merge threshhold.
     int split_multiple,	   ///< [in] Split threshhold.
     uint32_t index_version,///< [in] Index version
-    double retry_probability=0) ///< [in] retry probability
+    double retry_probability=0, ///< [in] retry probability
+    double split_ahead=0)  ///< [in] background split ratio
     : LFNIndex(collection, base_path, index_version, retry_probability),
       merge_threshold(merge_at),
-      split_multiplier(split_multiple) {}
+      split_multiplier(split_multiple),
+      split_ahead_ratio(split_ahead),
+      split_queue_lock("HashIndex::split_queue_lock") {}
 
   /// @see CollectionIndex
   uint32_t collection_version() { return index_version; }
@@ -160,6 +175,21 @@ public:
     CollectionIndex* dest
     );
 
+  /// @see CollectionIndex
+  bool has_queued_splits();
+
+  /// @see CollectionIndex
+  int split_queued(
+    bool *more,
+    bool *split
+    );
+
+  /// @see CollectionIndex
+  int pre_split(
+    uint64_t expected_num_objs,
+    unsigned *splits
+    );
+
 protected:
   int _init();
 
@@ -240,6 +270,31 @@ private:
     const subdir_info_s &info ///< [in] Info to check
     ); /// @return True if info must be split, False otherwise
 
+  /// Encapsulates logic for when to queue a background split.
+  bool should_split_ahead(
+    const subdir_info_s &info ///< [in] Info to check
+    ); /// @return True if info should be queued for split_queued()
+
+  /// Split path if it still qualifies for a background split
+  int split_ahead(
+    const vector<string> &path, ///< [in] Subdir to split
+    bool *split                 ///< [out] True if path was split
+    ); /// @return Error Code, 0 on success
+
+  /// Sum objs over path and its subdirs
+  int count_objects(
+    vector<string> &path, ///< [in] Subdir to count
+    uint64_t *objs        ///< [in,out] Running total
+    ); /// @return Error Code, 0 on success
+
+  /// Split path and its subdirs until none is projected to exceed
+  /// the split threshold once its objs grow by scale
+  int pre_split_subdirs(
+    vector<string> &path, ///< [in] Subdir to split
+    double scale,         ///< [in] Expected growth factor
+    unsigned *splits      ///< [in,out] Running count of splits
+    ); /// @return Error Code, 0 on success
+
   /// Initiates merge
   int initiate_merge(
     const vector<string> &path, ///< [in] Subdir to merge
@@ -100,7 +100,8 @@ int IndexManager::build_index(coll_t c, const char *path, CollectionIndex **inde
     case CollectionIndex::HOBJECT_WITH_POOL: {
       // Must be a HashIndex
       *index = new HashIndex(c, path, g_conf->filestore_merge_threshold,
-				   g_conf->filestore_split_multiple, version);
+				   g_conf->filestore_split_multiple, version,
+				   0, g_conf->filestore_split_ahead_ratio);
       return 0;
     }
     default: assert(0);
@@ -111,7 +112,8 @@ int IndexManager::build_index(coll_t c, const char *path, CollectionIndex **inde
     *index = new HashIndex(c, path, g_conf->filestore_merge_threshold,
 				 g_conf->filestore_split_multiple,
 				 CollectionIndex::HOBJECT_WITH_POOL,
-				 g_conf->filestore_index_retry_probability);
+				 g_conf->filestore_index_retry_probability,
+				 g_conf->filestore_split_ahead_ratio);
     return 0;
   }
 }
@@ -134,3 +136,12 @@ int IndexManager::get_index(coll_t c, const string& baseDir, Index *index) {
   }
   return 0;
 }
+
+void IndexManager::get_queued_splits(vector<coll_t> *ls) {
+  Mutex::Locker l(lock);
+  for (ceph::unordered_map<coll_t, CollectionIndex* > ::iterator it = col_indices.begin();
+       it != col_indices.end(); ++it) {
+    if (it->second->has_queued_splits())
+      ls->push_back(it->first);
+  }
+}
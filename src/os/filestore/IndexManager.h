@@ -91,6 +91,14 @@ public:
    * @return error code
    */
   int init_index(coll_t c, const char *path, uint32_t filestore_version);
+
+  /**
+   * List collections whose index has directories queued for a
+   * background split
+   *
+   * @param [out] ls collections with queued splits
+   */
+  void get_queued_splits(vector<coll_t> *ls);
 };
 
 #endif
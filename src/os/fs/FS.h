@@ -21,6 +21,9 @@
 #include "acconfig.h"
 #ifdef HAVE_LIBAIO
 # include <libaio.h>
+# ifndef IOCB_FLAG_IOPRIO
+#  define IOCB_FLAG_IOPRIO (1 << 1)  // linux/aio_abi.h, 4.18+
+# endif
 #endif
 
 #include <string>
@@ -60,6 +63,7 @@ public:
     uint64_t offset, length;
     int rval;
     bufferlist bl;  ///< write payload (so that it remains stable for duration)
+    utime_t start;  ///< when we submitted it
 
     aio_t(void *p, int f) : priv(p), fd(f), rval(-1000) {
       memset(&iocb, 0, sizeof(iocb));
@@ -80,6 +84,12 @@ public:
       bl.append(std::move(p));
     }
 
+    /// ask the kernel to queue this aio at the given ioprio
+    void set_ioprio(int ioprio) {
+      iocb.u.c.flags |= IOCB_FLAG_IOPRIO;
+      iocb.aio_reqprio = ioprio;
+    }
+
     int get_return_value() {
       return rval;
     }
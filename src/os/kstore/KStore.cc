@@ -550,6 +550,87 @@ int KStore::OnodeHashLRU::trim(int max)
   return trimmed;
 }
 
+// StripeLRU
+
+#undef dout_prefix
+#define dout_prefix *_dout << "kstore.stripes(" << this << ") "
+
+bool KStore::StripeLRU::lookup(uint64_t nid, uint64_t offset, bufferlist *bl)
+{
+  std::lock_guard<std::mutex> l(lock);
+  auto p = stripes.find(make_pair(nid, offset));
+  if (p == stripes.end()) {
+    dout(30) << __func__ << " " << nid << " " << offset << " miss" << dendl;
+    return false;
+  }
+  dout(30) << __func__ << " " << nid << " " << offset << " hit" << dendl;
+  lru.erase(lru.iterator_to(p->second));
+  lru.push_front(p->second);
+  *bl = p->second.bl;
+  return true;
+}
+
+void KStore::StripeLRU::add(uint64_t nid, uint64_t offset,
+			    const bufferlist& bl)
+{
+  std::lock_guard<std::mutex> l(lock);
+  if (bl.length() > max_bytes)
+    return;
+  auto key = make_pair(nid, offset);
+  auto p = stripes.find(key);
+  if (p == stripes.end()) {
+    p = stripes.emplace(key, Stripe(key)).first;
+  } else {
+    lru.erase(lru.iterator_to(p->second));
+    bytes -= p->second.bl.length();
+  }
+  p->second.bl = bl;
+  // don't let a small stripe pin a much larger (e.g., message) buffer
+  uint64_t raw = 0;
+  for (auto& q : p->second.bl.buffers())
+    raw += q.raw_length();
+  if (raw > 2 * bl.length())
+    p->second.bl.rebuild();
+  bytes += bl.length();
+  lru.push_front(p->second);
+  _trim();
+}
+
+void KStore::StripeLRU::remove(uint64_t nid, uint64_t offset)
+{
+  std::lock_guard<std::mutex> l(lock);
+  auto p = stripes.find(make_pair(nid, offset));
+  if (p != stripes.end())
+    _erase(p);
+}
+
+void KStore::StripeLRU::clear()
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << dendl;
+  lru.clear();
+  stripes.clear();
+  bytes = 0;
+}
+
+void KStore::StripeLRU::_erase(map<pair<uint64_t,uint64_t>,Stripe>::iterator p)
+{
+  lru.erase(lru.iterator_to(p->second));
+  bytes -= p->second.bl.length();
+  stripes.erase(p);
+}
+
+void KStore::StripeLRU::_trim()
+{
+  while (bytes > max_bytes) {
+    assert(!lru.empty());
+    Stripe& s = lru.back();
+    dout(30) << __func__ << " trim " << s.key.first << " " << s.key.second
+	     << dendl;
+    _erase(stripes.find(s.key));
+  }
+}
+
 // =======================================================
 
 // Collection
@@ -659,6 +740,10 @@ void KStore::_init_logger()
   b.add_time_avg(l_kstore_state_kv_done_lat, "state_kv_done_lat", "Average kv_done state latency");
   b.add_time_avg(l_kstore_state_finishing_lat, "state_finishing_lat", "Average finishing state latency");
   b.add_time_avg(l_kstore_state_done_lat, "state_done_lat", "Average done state latency");
+  b.add_u64_counter(l_kstore_stripe_cache_hit, "stripe_cache_hit", "Stripe reads served without a kv lookup");
+  b.add_u64_counter(l_kstore_stripe_cache_miss, "stripe_cache_miss", "Stripe reads from the kv store");
+  b.add_u64(l_kstore_stripe_cache_bytes, "stripe_cache_bytes", "Bytes of stripes in the stripe cache");
+  b.add_u64_counter(l_kstore_stripe_coalesced, "stripe_coalesced", "Stripe updates merged with an earlier one in the same transaction");
   logger = b.create_perf_counters();
   g_ceph_context->get_perfcounters_collection()->add(logger);
 }
@@ -972,7 +1057,7 @@ int KStore::mount()
   dout(1) << __func__ << " path " << path << dendl;
 
   if (g_conf->kstore_fsck_on_mount) {
-    int rc = fsck();
+    int rc = fsck(false);
     if (rc < 0)
       return rc;
   }
@@ -1004,6 +1089,8 @@ int KStore::mount()
   if (r < 0)
     goto out_db;
 
+  stripe_cache.max_bytes = g_conf->kstore_stripe_cache_size;
+
   finisher.start();
   kv_sync_thread.create("kstore_kv_sync");
 
@@ -1037,13 +1124,14 @@ int KStore::umount()
   dout(20) << __func__ << " closing" << dendl;
 
   mounted = false;
+  stripe_cache.clear();
   _close_db();
   _close_fsid();
   _close_path();
   return 0;
 }
 
-int KStore::fsck()
+int KStore::fsck(bool deep)
 {
   dout(1) << __func__ << dendl;
   int errors = 0;
@@ -2049,14 +2137,22 @@ int KStore::omap_get_values(
   if (!o->onode.omap_head)
     goto out;
   o->flush();
-  for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
-    string key;
-    get_omap_key(o->onode.omap_head, *p, &key);
-    bufferlist val;
-    if (db->get(PREFIX_OMAP, key, &val) >= 0) {
-      dout(30) << __func__ << "  got " << pretty_binary_string(key)
-	       << " -> " << *p << dendl;
-      out->insert(make_pair(*p, val));
+  {
+    // the omap key prefix preserves order, so this is one sorted batch
+    string head;
+    get_omap_key(o->onode.omap_head, string(), &head);
+    set<string> to_get;
+    for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p)
+      to_get.insert(to_get.end(), head + *p);
+    map<string,bufferlist> got;
+    r = db->get(PREFIX_OMAP, to_get, &got);
+    for (map<string,bufferlist>::iterator p = got.begin();
+	 p != got.end();
+	 ++p) {
+      dout(30) << __func__ << "  got " << pretty_binary_string(p->first)
+	       << dendl;
+      out->insert(out->end(),
+		  make_pair(p->first.substr(head.length()), p->second));
     }
   }
  out:
@@ -2225,6 +2321,16 @@ int KStore::_txc_finalize(OpSequencer *osr, TransContext *txc)
   dout(20) << __func__ << " osr " << osr << " txc " << txc
 	   << " onodes " << txc->onodes << dendl;
 
+  // apply coalesced stripe updates
+  for (auto& p : txc->stripe_ops) {
+    string key;
+    get_data_key(p.first.first, p.first.second, &key);
+    if (p.second.remove)
+      txc->t->rmkey(PREFIX_DATA, key);
+    else
+      txc->t->set(PREFIX_DATA, key, p.second.bl);
+  }
+
   // finalize onodes
   for (set<OnodeRef>::iterator p = txc->onodes.begin();
        p != txc->onodes.end();
@@ -2267,6 +2373,20 @@ void KStore::_txc_finish_kv(TransContext *txc)
   throttle_bytes.put(txc->bytes);
 }
 
+void KStore::_txc_update_stripe_cache(TransContext *txc, uint64_t nid)
+{
+  // only stripes this txc committed go into the shared cache; pending
+  // stripes may belong to a txc that is still being built.
+  auto p = txc->stripe_ops.lower_bound(make_pair(nid, 0));
+  while (p != txc->stripe_ops.end() && p->first.first == nid) {
+    if (p->second.remove)
+      stripe_cache.remove(nid, p->first.second);
+    else
+      stripe_cache.add(nid, p->first.second, p->second.bl);
+    txc->stripe_ops.erase(p++);
+  }
+}
+
 void KStore::_txc_finish(TransContext *txc)
 {
   dout(20) << __func__ << " " << txc << " onodes " << txc->onodes << dendl;
@@ -2279,12 +2399,17 @@ void KStore::_txc_finish(TransContext *txc)
     dout(20) << __func__ << " onode " << *p << " had " << (*p)->flush_txns
 	     << dendl;
     assert((*p)->flush_txns.count(txc));
+    _txc_update_stripe_cache(txc, (*p)->onode.nid);
     (*p)->flush_txns.erase(txc);
     if ((*p)->flush_txns.empty()) {
       (*p)->flush_cond.notify_all();
       (*p)->clear_pending_stripes();
     }
   }
+  // whatever is left belongs to objects this txc removed
+  while (!txc->stripe_ops.empty())
+    _txc_update_stripe_cache(txc, txc->stripe_ops.begin()->first.first);
+  logger->set(l_kstore_stripe_cache_bytes, stripe_cache.get_bytes());
 
   // clear out refs
   txc->onodes.clear();
@@ -2833,13 +2958,25 @@ void KStore::_dump_onode(OnodeRef o)
 void KStore::_do_read_stripe(OnodeRef o, uint64_t offset, bufferlist *pbl)
 {
   map<uint64_t,bufferlist>::iterator p = o->pending_stripes.find(offset);
-  if (p == o->pending_stripes.end()) {
-    string key;
-    get_data_key(o->onode.nid, offset, &key);
-    db->get(PREFIX_DATA, key, pbl);
-    o->pending_stripes[offset] = *pbl;
-  } else {
+  if (p != o->pending_stripes.end()) {
     *pbl = p->second;
+    logger->inc(l_kstore_stripe_cache_hit);
+    return;
+  }
+  // hold flush_lock so a txc finishing on this onode cannot update the
+  // cache between our kv read and our insert
+  std::lock_guard<std::mutex> l(o->flush_lock);
+  if (stripe_cache.lookup(o->onode.nid, offset, pbl)) {
+    logger->inc(l_kstore_stripe_cache_hit);
+    return;
+  }
+  string key;
+  get_data_key(o->onode.nid, offset, &key);
+  db->get(PREFIX_DATA, key, pbl);
+  logger->inc(l_kstore_stripe_cache_miss);
+  if (pbl->length()) {
+    stripe_cache.add(o->onode.nid, offset, *pbl);
+    logger->set(l_kstore_stripe_cache_bytes, stripe_cache.get_bytes());
   }
 }
 
@@ -2847,17 +2984,24 @@ void KStore::_do_write_stripe(TransContext *txc, OnodeRef o,
 			      uint64_t offset, bufferlist& bl)
 {
   o->pending_stripes[offset] = bl;
-  string key;
-  get_data_key(o->onode.nid, offset, &key);
-  txc->t->set(PREFIX_DATA, key, bl);
+  auto r = txc->stripe_ops.insert(
+    make_pair(make_pair(o->onode.nid, offset), TransContext::stripe_op_t()));
+  if (!r.second)
+    logger->inc(l_kstore_stripe_coalesced);
+  r.first->second.remove = false;
+  r.first->second.bl = bl;
 }
 
 void KStore::_do_remove_stripe(TransContext *txc, OnodeRef o, uint64_t offset)
 {
-  o->pending_stripes.erase(offset);
-  string key;
-  get_data_key(o->onode.nid, offset, &key);
-  txc->t->rmkey(PREFIX_DATA, key);
+  // an empty pending stripe hides any cached copy until we commit
+  o->pending_stripes[offset] = bufferlist();
+  auto r = txc->stripe_ops.insert(
+    make_pair(make_pair(o->onode.nid, offset), TransContext::stripe_op_t()));
+  if (!r.second)
+    logger->inc(l_kstore_stripe_coalesced);
+  r.first->second.remove = true;
+  r.first->second.bl.clear();
 }
 
 int KStore::_do_write(TransContext *txc,
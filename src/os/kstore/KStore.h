@@ -45,6 +45,10 @@ enum {
   l_kstore_state_kv_done_lat,
   l_kstore_state_finishing_lat,
   l_kstore_state_done_lat,
+  l_kstore_stripe_cache_hit,
+  l_kstore_stripe_cache_miss,
+  l_kstore_stripe_cache_bytes,
+  l_kstore_stripe_coalesced,
   l_kstore_last
 };
 
@@ -126,6 +130,41 @@ public:
     int trim(int max=-1);
   };
 
+  /// committed stripes, shared by all onodes and bounded by bytes
+  struct StripeLRU {
+    struct Stripe {
+      pair<uint64_t,uint64_t> key;  ///< (nid, offset)
+      bufferlist bl;
+      boost::intrusive::list_member_hook<> lru_item;
+      explicit Stripe(const pair<uint64_t,uint64_t>& k) : key(k) {}
+    };
+    typedef boost::intrusive::list<
+      Stripe,
+      boost::intrusive::member_hook<
+        Stripe,
+	boost::intrusive::list_member_hook<>,
+	&Stripe::lru_item> > lru_list_t;
+
+    std::mutex lock;
+    map<pair<uint64_t,uint64_t>,Stripe> stripes;
+    lru_list_t lru;
+    uint64_t bytes;
+    uint64_t max_bytes;
+
+    StripeLRU() : bytes(0), max_bytes(0) {}
+
+    bool lookup(uint64_t nid, uint64_t offset, bufferlist *bl);
+    void add(uint64_t nid, uint64_t offset, const bufferlist& bl);
+    void remove(uint64_t nid, uint64_t offset);
+    void clear();
+    uint64_t get_bytes() {
+      std::lock_guard<std::mutex> l(lock);
+      return bytes;
+    }
+    void _erase(map<pair<uint64_t,uint64_t>,Stripe>::iterator p);
+    void _trim();
+  };
+
   struct Collection {
     KStore *store;
     coll_t cid;
@@ -216,6 +255,14 @@ public:
     uint64_t ops, bytes;
 
     set<OnodeRef> onodes;     ///< these onodes need to be updated/written
+
+    struct stripe_op_t {
+      bool remove;
+      bufferlist bl;
+      stripe_op_t() : remove(false) {}
+    };
+    /// (nid, offset) -> latest stripe update; applied to t at finalize
+    map<pair<uint64_t,uint64_t>,stripe_op_t> stripe_ops;
     KeyValueDB::Transaction t; ///< then we will commit this
     Context *oncommit;         ///< signal on commit
     Context *onreadable;         ///< signal on readable
@@ -329,6 +376,8 @@ private:
   bool kv_stop;
   deque<TransContext*> kv_queue, kv_committing;
 
+  StripeLRU stripe_cache;  ///< committed stripes
+
   //Logger *logger;
   PerfCounters *logger;
   std::mutex reap_lock;
@@ -369,6 +418,7 @@ private:
   int _txc_finalize(OpSequencer *osr, TransContext *txc);
   void _txc_state_proc(TransContext *txc);
   void _txc_finish_kv(TransContext *txc);
+  void _txc_update_stripe_cache(TransContext *txc, uint64_t nid);
   void _txc_finish(TransContext *txc);
 
   void _osr_reap_done(OpSequencer *osr);
@@ -409,7 +459,7 @@ public:
   int umount();
   void _sync();
 
-  int fsck();
+  int fsck(bool deep);
 
   unsigned get_max_object_name_length() {
     return 4096;
@@ -524,6 +574,9 @@ public:
   objectstore_perf_stat_t get_cur_stats() {
     return objectstore_perf_stat_t();
   }
+  const PerfCounters* get_perf_counters() const {
+    return logger;
+  }
 
   int queue_transactions(
     Sequencer *osr,
@@ -40,6 +40,55 @@ bool operator>(const MemStore::CollectionRef& l,
   return (unsigned long)l.get() > (unsigned long)r.get();
 }
 
+MemStore::MemStore(CephContext *cct, const string& path)
+  : ObjectStore(path),
+    cct(cct),
+    coll_lock("MemStore::coll_lock"),
+    finisher(cct),
+    used_bytes(0),
+    page_alloc(NULL),
+    logger(NULL)
+{
+  if (cct->_conf->memstore_page_set && cct->_conf->memstore_page_slab_size)
+    page_alloc = new PageAllocator(cct->_conf->memstore_page_size,
+				   cct->_conf->memstore_page_slab_size,
+				   cct->_conf->memstore_page_hugepages);
+  _init_logger();
+}
+
+MemStore::~MemStore()
+{
+  _shutdown_logger();
+  // pages still referenced elsewhere keep the allocator alive
+  if (page_alloc)
+    page_alloc->put();
+}
+
+void MemStore::_init_logger()
+{
+  PerfCountersBuilder b(cct, "memstore",
+			l_memstore_first, l_memstore_last);
+  b.add_u64(l_memstore_used_bytes, "used_bytes", "Bytes of object data stored");
+  b.add_u64(l_memstore_page_bytes, "page_bytes", "Bytes of slab pages in use");
+  b.add_u64(l_memstore_slab_bytes, "slab_bytes", "Bytes mapped for page slabs");
+  logger = b.create_perf_counters();
+  cct->get_perfcounters_collection()->add(logger);
+}
+
+void MemStore::_shutdown_logger()
+{
+  cct->get_perfcounters_collection()->remove(logger);
+  delete logger;
+}
+
+void MemStore::_update_logger()
+{
+  logger->set(l_memstore_used_bytes, used_bytes);
+  if (page_alloc) {
+    logger->set(l_memstore_page_bytes, page_alloc->get_page_bytes());
+    logger->set(l_memstore_slab_bytes, page_alloc->get_slab_bytes());
+  }
+}
 
 int MemStore::mount()
 {
@@ -157,7 +206,7 @@ int MemStore::_load()
     int r = cbl.read_file(fn.c_str(), &err);
     if (r < 0)
       return r;
-    CollectionRef c(new Collection(cct, *q));
+    CollectionRef c(new Collection(cct, *q, page_alloc));
     bufferlist::iterator p = cbl.begin();
     c->decode(p);
     coll_map[*q] = c;
@@ -647,6 +696,7 @@ int MemStore::queue_transactions(Sequencer *osr,
 
     _do_transaction(*p);
   }
+  _update_logger();
 
   Context *on_apply = NULL, *on_apply_sync = NULL, *on_commit = NULL;
   ObjectStore::Transaction::collect_contexts(tls, &on_apply, &on_commit,
@@ -1297,7 +1347,7 @@ int MemStore::_create_collection(const coll_t& cid)
   auto result = coll_map.insert(std::make_pair(cid, CollectionRef()));
   if (!result.second)
     return -EEXIST;
-  result.first->second.reset(new Collection(cct, cid));
+  result.first->second.reset(new Collection(cct, cid, page_alloc));
   return 0;
 }
 
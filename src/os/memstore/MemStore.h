@@ -25,10 +25,19 @@
 #include "common/Finisher.h"
 #include "common/RefCountedObj.h"
 #include "common/RWLock.h"
+#include "common/perf_counters.h"
 #include "os/ObjectStore.h"
 #include "PageSet.h"
 #include "include/assert.h"
 
+enum {
+  l_memstore_first = 932430,
+  l_memstore_used_bytes,
+  l_memstore_page_bytes,
+  l_memstore_slab_bytes,
+  l_memstore_last
+};
+
 class MemStore : public ObjectStore {
 private:
   CephContext *const cct;
@@ -130,7 +139,8 @@ public:
     static thread_local PageSet::page_vector tls_pages;
 #endif
 
-    explicit PageSetObject(size_t page_size) : data(page_size), data_len(0) {}
+    PageSetObject(size_t page_size, PageAllocator *alloc, unsigned partitions)
+      : data(page_size, alloc, partitions), data_len(0) {}
 
     size_t get_size() const override { return data_len; }
 
@@ -159,6 +169,7 @@ public:
   struct Collection : public CollectionImpl {
     coll_t cid;
     CephContext *cct;
+    PageAllocator *page_alloc; ///< owned by MemStore, may be null
     bool use_page_set;
     ceph::unordered_map<ghobject_t, ObjectRef> object_hash;  ///< for lookup
     map<ghobject_t, ObjectRef,ghobject_t::BitwiseComparator> object_map;        ///< for iteration
@@ -176,7 +187,8 @@ public:
 
     ObjectRef create_object() const {
       if (use_page_set)
-        return new PageSetObject(cct->_conf->memstore_page_size);
+        return new PageSetObject(cct->_conf->memstore_page_size, page_alloc,
+                                 cct->_conf->memstore_page_set_partitions);
       return new BufferlistObject();
     }
 
@@ -243,9 +255,10 @@ public:
       return result;
     }
 
-    explicit Collection(CephContext *cct, coll_t c)
+    Collection(CephContext *cct, coll_t c, PageAllocator *page_alloc)
       : cid(c),
 	cct(cct),
+	page_alloc(page_alloc),
 	use_page_set(cct->_conf->memstore_page_set),
         lock("MemStore::Collection::lock", true, false),
 	exists(true) {}
@@ -308,6 +321,13 @@ private:
 
   uint64_t used_bytes;
 
+  PageAllocator *page_alloc; ///< slab allocator for PageSet pages, if enabled
+  PerfCounters *logger;
+
+  void _init_logger();
+  void _shutdown_logger();
+  void _update_logger();
+
   void _do_transaction(Transaction& t);
 
   int _touch(const coll_t& cid, const ghobject_t& oid);
@@ -346,13 +366,8 @@ private:
   void dump_all();
 
 public:
-  MemStore(CephContext *cct, const string& path)
-    : ObjectStore(path),
-      cct(cct),
-      coll_lock("MemStore::coll_lock"),
-      finisher(cct),
-      used_bytes(0) {}
-  ~MemStore() { }
+  MemStore(CephContext *cct, const string& path);
+  ~MemStore();
 
   string get_type() {
     return "memstore";
@@ -18,24 +18,32 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <new>
+#include <thread>
 #include <vector>
+#include <sched.h>
+#include <sys/mman.h>
 #include <boost/intrusive/avl_set.hpp>
 #include <boost/intrusive_ptr.hpp>
 
 #include "include/encoding.h"
 #include "include/Spinlock.h"
 
+class PageAllocator;
 
 struct Page {
   char *const data;
   boost::intrusive::avl_set_member_hook<> hook;
   uint64_t offset;
+  PageAllocator *const alloc; // slab allocator that owns data, or null
 
   // avoid RefCountedObject because it has a virtual destructor
   std::atomic<uint16_t> nrefs;
   void get() { ++nrefs; }
-  void put() { if (--nrefs == 0) delete this; }
+  inline void put();
 
   typedef boost::intrusive_ptr<Page> Ref;
   friend void intrusive_ptr_add_ref(Page *p) { p->get(); }
@@ -77,13 +85,217 @@ struct Page {
   const Page& operator=(const Page&) = delete;
 
  private: // private constructor, use create() instead
-  Page(char *data, uint64_t offset) : data(data), offset(offset), nrefs(1) {}
+  friend class PageAllocator;
+  Page(char *data, uint64_t offset, PageAllocator *alloc = nullptr)
+    : data(data), offset(offset), alloc(alloc), nrefs(1) {}
 
   static void operator delete(void *p) {
     delete[] reinterpret_cast<Page*>(p)->data;
   }
 };
 
+/*
+ * PageAllocator carves pages out of large slabs rather than allocating
+ * each page from the heap.  Slabs are mmapped, from hugepages if asked
+ * and available (otherwise transparent hugepages are requested), and
+ * stay mapped for the life of the allocator; freed pages are kept on
+ * per-cpu free lists for reuse.  A free list that grows past a slab's
+ * worth of pages spills into a shared overflow list, and an empty one
+ * refills from the overflow list or other cpus' lists before another
+ * slab is mapped, so pages freed on one cpu are reused by another.  Slab
+ * memory is first touched by the thread that allocates from it, so
+ * pages tend to stay on the numa node of the cpu that writes them.
+ *
+ * The allocator is reference counted, and every live page holds a
+ * reference, so it is only unmapped once the last page is released.
+ */
+class PageAllocator {
+  const size_t page_size;
+  const size_t slab_size;
+  const bool hugepages;
+
+  struct Slab {
+    char *data;
+    Page *pages; // one Page header for each page in data
+  };
+  Spinlock slab_lock;
+  std::vector<Slab> slabs;
+
+  struct Shard {
+    Spinlock lock;
+    std::vector<Page*> free;
+  };
+  unsigned nshards;
+  std::unique_ptr<Shard[]> shards;
+  const size_t shard_max; // free pages a shard keeps before spilling
+
+  Spinlock overflow_lock;
+  std::vector<Page*> overflow; // spilled from full shards
+
+  std::atomic<uint64_t> nrefs;
+  std::atomic<uint64_t> slab_bytes;
+  std::atomic<uint64_t> page_bytes;
+
+  Shard &local_shard() {
+#if defined(__linux__)
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+      return shards[cpu % nshards];
+#endif
+    auto h = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return shards[h % nshards];
+  }
+
+  // map a new slab and add its pages to the given free list
+  void add_slab(std::vector<Page*> &free) {
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugepages)
+      p = ::mmap(nullptr, slab_size, PROT_READ | PROT_WRITE,
+                 flags | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED) {
+      p = ::mmap(nullptr, slab_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (p == MAP_FAILED)
+        throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+      if (hugepages)
+        ::madvise(p, slab_size, MADV_HUGEPAGE);
+#endif
+    }
+    char *data = static_cast<char*>(p);
+    const size_t count = slab_size / page_size;
+    auto pages = static_cast<Page*>(::operator new(sizeof(Page) * count));
+    free.reserve(free.size() + count);
+    // push in reverse so the free list hands pages out in address order
+    for (size_t i = count; i > 0; i--)
+      free.push_back(new (&pages[i - 1])
+                     Page(data + (i - 1) * page_size, 0, this));
+    {
+      std::lock_guard<Spinlock> lock(slab_lock);
+      slabs.push_back(Slab{data, pages});
+    }
+    slab_bytes += slab_size;
+  }
+
+  // the local free list is empty: take pages from the overflow list or
+  // from other shards, and only map a new slab if there are none
+  Page *refill(Shard &shard) {
+    std::vector<Page*> batch;
+    {
+      std::lock_guard<Spinlock> lock(overflow_lock);
+      const size_t n = std::min(overflow.size(), shard_max);
+      batch.assign(overflow.end() - n, overflow.end());
+      overflow.resize(overflow.size() - n);
+    }
+    for (unsigned i = 0; batch.empty() && i < nshards; i++) {
+      Shard &other = shards[i];
+      if (&other == &shard)
+        continue;
+      std::lock_guard<Spinlock> lock(other.lock);
+      const size_t n = (other.free.size() + 1) / 2;
+      batch.assign(other.free.end() - n, other.free.end());
+      other.free.resize(other.free.size() - n);
+    }
+    if (batch.empty())
+      add_slab(batch);
+    Page *page = batch.back();
+    batch.pop_back();
+    if (!batch.empty()) {
+      std::lock_guard<Spinlock> lock(shard.lock);
+      shard.free.insert(shard.free.begin(), batch.begin(), batch.end());
+      spill(shard);
+    }
+    return page;
+  }
+
+  // move the coldest half of an overfull shard to the overflow list;
+  // called with the shard locked
+  void spill(Shard &shard) {
+    if (shard.free.size() <= shard_max)
+      return;
+    const size_t n = shard.free.size() - shard_max / 2;
+    std::lock_guard<Spinlock> lock(overflow_lock);
+    overflow.insert(overflow.end(), shard.free.begin(),
+                    shard.free.begin() + n);
+    shard.free.erase(shard.free.begin(), shard.free.begin() + n);
+  }
+
+  ~PageAllocator() {
+    const size_t count = slab_size / page_size;
+    for (auto &slab : slabs) {
+      for (size_t i = 0; i < count; i++)
+        slab.pages[i].~Page();
+      ::operator delete(slab.pages);
+      ::munmap(slab.data, slab_size);
+    }
+  }
+
+ public:
+  PageAllocator(size_t page_size, size_t slab_size, bool hugepages)
+    : page_size(page_size),
+      slab_size(std::max(page_size, slab_size - slab_size % page_size)),
+      hugepages(hugepages),
+      nshards(std::max(1u, std::min(64u, std::thread::hardware_concurrency()))),
+      shards(new Shard[nshards]),
+      shard_max(this->slab_size / page_size),
+      nrefs(1), slab_bytes(0), page_bytes(0) {}
+
+  // disable copy
+  PageAllocator(const PageAllocator&) = delete;
+  const PageAllocator& operator=(const PageAllocator&) = delete;
+
+  void get() { ++nrefs; }
+  void put() { if (--nrefs == 0) delete this; }
+
+  size_t get_page_size() const { return page_size; }
+  // bytes mapped for slabs
+  uint64_t get_slab_bytes() const { return slab_bytes; }
+  // bytes of slab memory handed out as pages
+  uint64_t get_page_bytes() const { return page_bytes; }
+
+  Page::Ref allocate(uint64_t offset) {
+    Page *page = nullptr;
+    Shard &shard = local_shard();
+    {
+      std::lock_guard<Spinlock> lock(shard.lock);
+      if (!shard.free.empty()) {
+        page = shard.free.back();
+        shard.free.pop_back();
+      }
+    }
+    if (!page)
+      page = refill(shard);
+    get();
+    page_bytes += page_size;
+    page->offset = offset;
+    page->nrefs = 1;
+    return page;
+  }
+
+  void release(Page *page) {
+    {
+      Shard &shard = local_shard();
+      std::lock_guard<Spinlock> lock(shard.lock);
+      shard.free.push_back(page);
+      spill(shard);
+    }
+    page_bytes -= page_size;
+    put();
+  }
+};
+
+inline void Page::put()
+{
+  if (--nrefs == 0) {
+    if (alloc)
+      alloc->release(this);
+    else
+      delete this;
+  }
+}
+
 class PageSet {
  public:
   // alloc_range() and get_range() return page refs in a vector
@@ -99,14 +311,40 @@ class PageSet {
           boost::intrusive::compare<page_cmp>, member_option> page_set;
 
   typedef typename page_set::iterator iterator;
+  typedef typename page_vector::reverse_iterator out_iterator;
+
+  typedef Spinlock lock_type;
 
-  page_set pages;
+  // pages are spread over partitions in stripes of consecutive pages, each
+  // with its own lock, so that writes to disjoint ranges don't contend
+  struct Partition {
+    page_set pages;
+    lock_type mutex;
+  };
   uint64_t page_size;
+  PageAllocator *alloc;
+  unsigned npartitions;
+  unsigned stripe_pages;
+  uint64_t stripe_size;
+  std::unique_ptr<Partition[]> partitions;
+
+  Partition& partition_of(uint64_t offset) {
+    return partitions[(offset / stripe_size) % npartitions];
+  }
+  // end of the stripe containing offset
+  uint64_t stripe_end(uint64_t offset) const {
+    if (npartitions == 1)
+      return std::numeric_limits<uint64_t>::max();
+    return (offset / stripe_size + 1) * stripe_size;
+  }
 
-  typedef Spinlock lock_type;
-  lock_type mutex;
+  Page::Ref create_page(uint64_t offset) {
+    if (alloc)
+      return alloc->allocate(offset);
+    return Page::create(page_size, offset);
+  }
 
-  void free_pages(iterator cur, iterator end) {
+  void free_pages(page_set &pages, iterator cur, iterator end) {
     while (cur != end) {
       Page *page = &*cur;
       cur = pages.erase(cur);
@@ -128,41 +366,25 @@ class PageSet {
     return count;
   }
 
- public:
-  explicit PageSet(size_t page_size) : page_size(page_size) {}
-  PageSet(PageSet &&rhs)
-    : pages(std::move(rhs.pages)), page_size(rhs.page_size) {}
-  ~PageSet() {
-    free_pages(pages.begin(), pages.end());
-  }
-
-  // disable copy
-  PageSet(const PageSet&) = delete;
-  const PageSet& operator=(const PageSet&) = delete;
-
-  bool empty() const { return pages.empty(); }
-  size_t size() const { return pages.size(); }
-  size_t get_page_size() const { return page_size; }
-
-  // allocate all pages that intersect the range [offset,length)
-  void alloc_range(uint64_t offset, uint64_t length, page_vector &range) {
+  // allocate the pages of [offset,length) within a single partition,
+  // filling the output vector backwards from out
+  out_iterator alloc_stripe(Partition &part, uint64_t offset, uint64_t length,
+                            out_iterator out) {
     // loop in reverse so we can provide hints to avl_set::insert_check()
     //	and get O(1) insertions after the first
     uint64_t position = offset + length - 1;
 
-    range.resize(count_pages(offset, length));
-    auto out = range.rbegin();
-
-    std::lock_guard<lock_type> lock(mutex);
-    iterator cur = pages.end();
+    std::lock_guard<lock_type> lock(part.mutex);
+    iterator cur = part.pages.end();
     while (length) {
       const uint64_t page_offset = position & ~(page_size-1);
 
       typename page_set::insert_commit_data commit;
-      auto insert = pages.insert_check(cur, page_offset, page_cmp(), commit);
+      auto insert = part.pages.insert_check(cur, page_offset, page_cmp(),
+                                            commit);
       if (insert.second) {
-        auto page = Page::create(page_size, page_offset);
-        cur = pages.insert_commit(*page, commit);
+        auto page = create_page(page_offset);
+        cur = part.pages.insert_commit(*page, commit);
 
         // assume that the caller will write to the range [offset,length),
         //  so we only need to zero memory outside of this range
@@ -185,44 +407,122 @@ class PageSet {
       position -= c;
       length -= c;
     }
+    return out;
+  }
+
+ public:
+  explicit PageSet(size_t page_size, PageAllocator *alloc = nullptr,
+                   unsigned npartitions = 1, unsigned stripe_pages = 16)
+    : page_size(page_size),
+      alloc(alloc && alloc->get_page_size() == page_size ? alloc : nullptr),
+      npartitions(std::max(1u, npartitions)),
+      stripe_pages(std::max(1u, stripe_pages)),
+      stripe_size(page_size * this->stripe_pages),
+      partitions(new Partition[this->npartitions]) {}
+  PageSet(PageSet &&rhs)
+    : page_size(rhs.page_size), alloc(rhs.alloc),
+      npartitions(rhs.npartitions), stripe_pages(rhs.stripe_pages),
+      stripe_size(rhs.stripe_size),
+      partitions(std::move(rhs.partitions)) {}
+  ~PageSet() {
+    if (!partitions)
+      return;
+    for (unsigned i = 0; i < npartitions; i++)
+      free_pages(partitions[i].pages, partitions[i].pages.begin(),
+                 partitions[i].pages.end());
+  }
+
+  // disable copy
+  PageSet(const PageSet&) = delete;
+  const PageSet& operator=(const PageSet&) = delete;
+
+  bool empty() const {
+    for (unsigned i = 0; i < npartitions; i++)
+      if (!partitions[i].pages.empty())
+        return false;
+    return true;
+  }
+  size_t size() const {
+    size_t count = 0;
+    for (unsigned i = 0; i < npartitions; i++)
+      count += partitions[i].pages.size();
+    return count;
+  }
+  size_t get_page_size() const { return page_size; }
+
+  // allocate all pages that intersect the range [offset,length)
+  void alloc_range(uint64_t offset, uint64_t length, page_vector &range) {
+    range.resize(count_pages(offset, length));
+    auto out = range.rbegin();
+
+    // walk the stripes backwards as well, so the vector fills in order
+    uint64_t end = offset + length;
+    while (end > offset) {
+      uint64_t start = offset;
+      if (npartitions > 1)
+        start = std::max(offset, (end - 1) / stripe_size * stripe_size);
+      out = alloc_stripe(partition_of(start), start, end - start, out);
+      end = start;
+    }
     // make sure we sized the vector correctly
     assert(out == range.rend());
   }
 
   // return all allocated pages that intersect the range [offset,length)
   void get_range(uint64_t offset, uint64_t length, page_vector &range) {
-    auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
-    while (cur != pages.end() && cur->offset < offset + length)
-      range.push_back(&*cur++);
+    const uint64_t end = offset + length;
+    uint64_t position = offset & ~(page_size-1);
+    while (position < end) {
+      const uint64_t last = std::min(end, stripe_end(position));
+      Partition &part = partition_of(position);
+      std::lock_guard<lock_type> lock(part.mutex);
+      auto cur = part.pages.lower_bound(position, page_cmp());
+      while (cur != part.pages.end() && cur->offset < last)
+        range.push_back(&*cur++);
+      position = last;
+    }
   }
 
   void free_pages_after(uint64_t offset) {
-    std::lock_guard<lock_type> lock(mutex);
-    auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
-    if (cur == pages.end())
-      return;
-    if (cur->offset < offset)
-      cur++;
-    free_pages(cur, pages.end());
+    for (unsigned i = 0; i < npartitions; i++) {
+      Partition &part = partitions[i];
+      std::lock_guard<lock_type> lock(part.mutex);
+      auto cur = part.pages.lower_bound(offset & ~(page_size-1), page_cmp());
+      if (cur == part.pages.end())
+        continue;
+      if (cur->offset < offset)
+        cur++;
+      free_pages(part.pages, cur, part.pages.end());
+    }
   }
 
   void encode(bufferlist &bl) const {
     ::encode(page_size, bl);
-    unsigned count = pages.size();
+    // pages are encoded in descending offset order across all partitions
+    std::vector<const Page*> sorted;
+    sorted.reserve(size());
+    for (unsigned i = 0; i < npartitions; i++)
+      for (auto &page : partitions[i].pages)
+        sorted.push_back(&page);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Page *l, const Page *r) { return l->offset > r->offset; });
+    unsigned count = sorted.size();
     ::encode(count, bl);
-    for (auto p = pages.rbegin(); p != pages.rend(); ++p)
+    for (auto p : sorted)
       p->encode(bl, page_size);
   }
   void decode(bufferlist::iterator &p) {
     assert(empty());
     ::decode(page_size, p);
+    if (alloc && alloc->get_page_size() != page_size)
+      alloc = nullptr;
+    stripe_size = page_size * stripe_pages;
     unsigned count;
     ::decode(count, p);
-    auto cur = pages.end();
     for (unsigned i = 0; i < count; i++) {
-      auto page = Page::create(page_size);
+      auto page = create_page(0);
       page->decode(p, page_size);
-      cur = pages.insert_before(cur, *page);
+      partition_of(page->offset).pages.insert(*page);
     }
   }
 };
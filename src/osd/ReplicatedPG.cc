@@ -4028,6 +4028,34 @@ bool ReplicatedPG::maybe_create_new_object(OpContext *ctx)
   return false;
 }
 
+uint32_t ReplicatedPG::get_pool_alloc_hint_flags() const
+{
+  string hint;
+  if (!pool.info.opts.get(pool_opts_t::COMPRESSION_HINT, &hint))
+    return 0;
+  if (hint == "compressible")
+    return CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE;
+  if (hint == "incompressible")
+    return CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE;
+  return 0;
+}
+
+void ReplicatedPG::maybe_set_pool_alloc_hint(OpContext *ctx)
+{
+  // hint new objects before their first write lands so that the backend
+  // can act on the pool's hint without help from the client.  this costs
+  // an extra op per create, so skip it for backends that ignore the flags
+  if (ctx->new_obs.exists || !osd->store->wants_alloc_hint_flags())
+    return;
+  uint32_t flags = get_pool_alloc_hint_flags();
+  if (!flags)
+    return;
+  const hobject_t& soid = ctx->new_obs.oi.soid;
+  dout(20) << __func__ << " " << soid << " flags " << flags << dendl;
+  ctx->op_t->touch(soid);
+  ctx->op_t->set_alloc_hint(soid, 0, 0, flags);
+}
+
 int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 {
   int result = 0;
@@ -4868,8 +4896,12 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
           ctx->mod_desc.create();
           t->touch(soid);
 	}
+	uint32_t flags = op.alloc_hint.flags;
+	if (!(flags & (CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE |
+		       CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE)))
+	  flags |= get_pool_alloc_hint_flags();
         t->set_alloc_hint(soid, op.alloc_hint.expected_object_size,
-                          op.alloc_hint.expected_write_size);
+                          op.alloc_hint.expected_write_size, flags);
         ctx->delta_stats.num_wr++;
         result = 0;
       }
@@ -4951,6 +4983,7 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 	if (pool.info.require_rollback()) {
 	  t->append(soid, op.extent.offset, op.extent.length, osd_op.indata, op.flags);
 	} else {
+	  maybe_set_pool_alloc_hint(ctx);
 	  t->write(soid, op.extent.offset, op.extent.length, osd_op.indata, op.flags);
 	}
 
@@ -5011,6 +5044,7 @@ int ReplicatedPG::do_osd_ops(OpContext *ctx, vector<OSDOp>& ops)
 	  }
 	} else {
 	  ctx->mod_desc.mark_unrollbackable();
+	  maybe_set_pool_alloc_hint(ctx);
 	  t->write(soid, 0, op.extent.length, osd_op.indata, op.flags);
 	  if (obs.exists && op.extent.length < oi.size) {
 	    t->truncate(soid, op.extent.length);
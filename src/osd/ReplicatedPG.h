@@ -1593,6 +1593,8 @@ private:
   // return true if we're creating a local object, false for a
   // whiteout or no change.
   bool maybe_create_new_object(OpContext *ctx);
+  uint32_t get_pool_alloc_hint_flags() const;
+  void maybe_set_pool_alloc_hint(OpContext *ctx);
   int _delete_oid(OpContext *ctx, bool no_whiteout);
   int _rollback_to(OpContext *ctx, ceph_osd_op& op);
 public:
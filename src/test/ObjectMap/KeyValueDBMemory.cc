@@ -200,6 +200,29 @@ int KeyValueDBMemory::rmkey(const string &prefix,
   return 0;
 }
 
+int KeyValueDBMemory::merge(const string &prefix,
+			    const string &key,
+			    const bufferlist &bl) {
+  map<string, std::shared_ptr<MergeOperator> >::iterator mop =
+    merge_ops.find(prefix);
+  assert(mop != merge_ops.end());
+  string v, out;
+  bl.copy(0, bl.length(), v);
+  map<std::pair<string,string>,bufferlist>::iterator i =
+    db.find(make_pair(prefix, key));
+  if (i == db.end()) {
+    mop->second->merge_nonexistent(v.data(), v.length(), &out);
+  } else {
+    string cur;
+    i->second.copy(0, i->second.length(), cur);
+    mop->second->merge(cur.data(), cur.length(), v.data(), v.length(), &out);
+  }
+  bufferlist &dest = db[make_pair(prefix, key)];
+  dest.clear();
+  dest.append(out);
+  return 0;
+}
+
 int KeyValueDBMemory::rmkeys_by_prefix(const string &prefix) {
   map<std::pair<string,string>,bufferlist>::iterator i;
   i = db.lower_bound(make_pair(prefix, ""));
@@ -14,6 +14,7 @@ using std::string;
 class KeyValueDBMemory : public KeyValueDB {
 public:
   std::map<std::pair<string,string>,bufferlist> db;
+  std::map<string, std::shared_ptr<MergeOperator> > merge_ops;
 
   KeyValueDBMemory() { }
   explicit KeyValueDBMemory(KeyValueDBMemory *db) : db(db->db) { }
@@ -29,6 +30,12 @@ public:
     return 0;
   }
 
+  int set_merge_operator(const string &prefix,
+			 std::shared_ptr<MergeOperator> mop) {
+    merge_ops[prefix] = mop;
+    return 0;
+  }
+
   int get(
     const string &prefix,
     const std::set<string> &key,
@@ -57,6 +64,12 @@ public:
     const string &prefix
     );
 
+  int merge(
+    const string &prefix,
+    const string &key,
+    const bufferlist &bl
+    );
+
   class TransactionImpl_ : public TransactionImpl {
   public:
     list<Context *> on_commit;
@@ -111,6 +124,23 @@ public:
       on_commit.push_back(new RmKeysByPrefixOp(db, prefix));
     }
 
+    struct MergeOp : public Context {
+      KeyValueDBMemory *db;
+      std::pair<string,string> key;
+      bufferlist value;
+      MergeOp(KeyValueDBMemory *db,
+	      const std::pair<string,string> &key,
+	      const bufferlist &value)
+	: db(db), key(key), value(value) {}
+      void finish(int r) {
+	db->merge(key.first, key.second, value);
+      }
+    };
+
+    void merge(const string &prefix, const string &k, const bufferlist &bl) {
+      on_commit.push_back(new MergeOp(db, std::make_pair(prefix, k), bl));
+    }
+
     int complete() {
       for (list<Context *>::iterator i = on_commit.begin();
 	   i != on_commit.end();
@@ -5,6 +5,7 @@
 #include <boost/scoped_ptr.hpp>
 
 #include "include/buffer.h"
+#include "include/stringify.h"
 #include "test/ObjectMap/KeyValueDBMemory.h"
 #include "kv/KeyValueDB.h"
 #include "os/filestore/DBObjectMap.h"
@@ -744,6 +745,48 @@ TEST_F(ObjectMapTest, OddEvenClone) {
   db->clear(hoid2);
 }
 
+TEST_F(ObjectMapTest, SmallHeaderCache) {
+  // force evictions and shard collisions in the map header cache
+  g_ceph_context->_conf->set_val("filestore_omap_header_cache_size", "4");
+  g_ceph_context->_conf->set_val("filestore_omap_header_cache_shards", "2");
+  db.reset(new DBObjectMap(new KeyValueDBMemory()));
+  tester.db = db.get();
+  g_ceph_context->_conf->set_val("filestore_omap_header_cache_size", "1024");
+  g_ceph_context->_conf->set_val("filestore_omap_header_cache_shards", "8");
+
+  const unsigned num = 16;
+  for (unsigned round = 0; round < 3; ++round) {
+    for (unsigned i = 0; i < num; ++i) {
+      // rewrite the same header several times between lookups
+      for (unsigned j = 0; j <= round; ++j)
+	tester.set_key("obj" + stringify(i), "key", stringify(round * num + i));
+    }
+    for (unsigned i = 0; i < num; ++i) {
+      string result;
+      ASSERT_EQ(1, tester.get_key("obj" + stringify(i), "key", &result));
+      ASSERT_EQ(stringify(round * num + i), result);
+    }
+  }
+  for (unsigned i = 0; i < num; i += 2) {
+    ghobject_t from(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+    ghobject_t to(hobject_t(sobject_t("obj" + stringify(i + 1),
+				      CEPH_NOSNAP)));
+    // replaces the header cached for the target
+    ASSERT_EQ(0, db->clone(from, to));
+  }
+  for (unsigned i = 0; i < num; ++i) {
+    string result;
+    ASSERT_EQ(1, tester.get_key("obj" + stringify(i), "key", &result));
+    ASSERT_EQ(stringify(2 * num + i - i % 2), result);
+  }
+  for (unsigned i = 0; i < num; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("obj" + stringify(i), CEPH_NOSNAP)));
+    ASSERT_EQ(0, db->clear(hoid));
+    string result;
+    ASSERT_EQ(0, tester.get_key("obj" + stringify(i), "key", &result));
+  }
+}
+
 TEST_F(ObjectMapTest, RandomTest) {
   tester.def_init();
   for (unsigned i = 0; i < 5000; ++i) {
@@ -21,9 +21,31 @@
 
 class TestFileStore {
 public:
+  typedef FileStore::OpSequencer OpSequencer;
+
   static void create_backend(FileStore &fs, long f_type) {
     fs.create_backend(f_type);
   }
+
+  // drive op_wq's scheduling without running its threads
+  static OpSequencer *new_osr(int id) {
+    return new OpSequencer(id);
+  }
+  static void queue_op(FileStore &fs, OpSequencer *osr, uint64_t bytes) {
+    fs.op_wq.queue_op(osr, bytes);
+  }
+  /// the sequencer an op thread would pick up next, or NULL
+  static OpSequencer *dequeue(FileStore &fs) {
+    fs.op_wq.lock();
+    OpSequencer *osr = fs.op_wq._dequeue();
+    fs.op_wq.unlock();
+    return osr;
+  }
+  static void finish_op(FileStore &fs, OpSequencer *osr) {
+    fs.op_wq.lock();
+    osr->wq_busy = false;
+    fs.op_wq.unlock();
+  }
 };
 
 TEST(FileStore, create)
@@ -64,6 +86,71 @@ TEST(FileStore, create)
 #endif
 }
 
+TEST(FileStore, op_wq_fairness)
+{
+  typedef TestFileStore::OpSequencer OpSequencer;
+  FileStore fs("a", "b");
+  OpSequencer *big = TestFileStore::new_osr(1);
+  OpSequencer *small = TestFileStore::new_osr(2);
+
+  // a deep queue of large writes on one sequencer
+  const unsigned num = 20;
+  for (unsigned i = 0; i < num; ++i)
+    TestFileStore::queue_op(fs, big, 4 << 20);
+  ASSERT_EQ(big, TestFileStore::dequeue(fs));
+  // its next op cannot run until this one finishes
+  ASSERT_FALSE(TestFileStore::dequeue(fs));
+
+  // a small op on another sequencer goes next, even with the big
+  // sequencer idle again and well ahead of it in the queue
+  TestFileStore::queue_op(fs, small, 4096);
+  TestFileStore::finish_op(fs, big);
+  ASSERT_EQ(small, TestFileStore::dequeue(fs));
+  TestFileStore::finish_op(fs, small);
+
+  // with both backlogged the small ops keep getting through, many for
+  // each large one
+  for (unsigned i = 0; i < num; ++i)
+    TestFileStore::queue_op(fs, small, 4096);
+  unsigned big_ops = 1, small_ops = 0;
+  while (small_ops < num) {
+    OpSequencer *osr = TestFileStore::dequeue(fs);
+    ASSERT_TRUE(osr);
+    if (osr == big)
+      ++big_ops;
+    else
+      ++small_ops;
+    TestFileStore::finish_op(fs, osr);
+  }
+  ASSERT_LE(big_ops, 2u);  // including the one above
+  while (OpSequencer *osr = TestFileStore::dequeue(fs)) {
+    ASSERT_EQ(big, osr);
+    ++big_ops;
+    TestFileStore::finish_op(fs, osr);
+  }
+  ASSERT_EQ(num, big_ops);
+
+  // a quantum of 0 ignores size: plain round robin
+  g_ceph_context->_conf->set_val("filestore_op_queue_quantum", "0");
+  for (unsigned i = 0; i < num; ++i) {
+    TestFileStore::queue_op(fs, big, 4 << 20);
+    TestFileStore::queue_op(fs, small, 4096);
+  }
+  OpSequencer *last = NULL;
+  for (unsigned i = 0; i < 2 * num; ++i) {
+    OpSequencer *osr = TestFileStore::dequeue(fs);
+    ASSERT_TRUE(osr);
+    ASSERT_NE(last, osr);
+    last = osr;
+    TestFileStore::finish_op(fs, osr);
+  }
+  ASSERT_FALSE(TestFileStore::dequeue(fs));
+  g_ceph_context->_conf->set_val("filestore_op_queue_quantum", "65536");
+
+  big->put();
+  small->put();
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
@@ -0,0 +1,206 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Compare the BlueStore allocators under overwrite churn.
+ *
+ * Each allocator is given an empty device, filled to a target
+ * utilization with object-sized writes, and then aged by freeing a
+ * random old extent and allocating a new one of random size.  We report
+ * the mean latency of each allocate() call, and fragmentation as the mean
+ * number of extents needed to satisfy one request.  A final phase
+ * hammers the allocator from several threads to show lock contention.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+#include "common/ceph_argparse.h"
+#include "common/debug.h"
+#include "common/Cycles.h"
+#include "global/global_init.h"
+#include "include/memory.h"
+#include "os/bluestore/Allocator.h"
+
+struct Extent {
+  uint64_t offset;
+  uint32_t length;
+};
+
+struct Stats {
+  uint64_t ticks = 0;     ///< cycles spent in allocate()
+  uint64_t calls = 0;     ///< allocate() calls
+  uint64_t requests = 0;  ///< logical allocation requests
+
+  void add(const Stats& o) {
+    ticks += o.ticks;
+    calls += o.calls;
+    requests += o.requests;
+  }
+};
+
+static void alloc_request(Allocator *alloc, uint64_t want, uint64_t unit,
+			  vector<Extent> *out, Stats *st)
+{
+  int r = alloc->reserve(want);
+  assert(r == 0);
+  st->requests++;
+  while (want > 0) {
+    Extent e;
+    uint64_t start = Cycles::rdtsc();
+    r = alloc->allocate(want, unit, 0, &e.offset, &e.length);
+    st->ticks += Cycles::rdtsc() - start;
+    st->calls++;
+    assert(r == 0);
+    out->push_back(e);
+    want -= e.length;
+  }
+}
+
+static void dump(const string& phase, const Stats& st)
+{
+  cout << "  " << phase << ": " << st.requests << " requests, "
+       << (double)st.calls / MAX(st.requests, 1) << " extents/request, "
+       << Cycles::to_nanoseconds(st.ticks / MAX(st.calls, 1)) << " ns/alloc"
+       << std::endl;
+}
+
+static void run(const string& type, uint64_t size, uint64_t unit,
+		double fill, uint64_t ops, unsigned threads)
+{
+  cout << type << std::endl;
+  ceph::shared_ptr<Allocator> alloc(Allocator::create(type, size, unit));
+  assert(alloc);
+  alloc->init_add_free(0, size);
+
+  const uint64_t object_size = 4 * 1024 * 1024;
+  vector<Extent> live;
+
+  // prefill
+  Stats fill_stats;
+  while (size - alloc->get_free() < size * fill) {
+    alloc_request(alloc.get(), object_size, unit, &live, &fill_stats);
+  }
+  dump("fill", fill_stats);
+
+  // age: free a random extent, allocate a random overwrite
+  Stats age_stats;
+  for (uint64_t i = 0; i < ops && !live.empty(); ++i) {
+    unsigned victim = rand() % live.size();
+    alloc->release(live[victim].offset, live[victim].length);
+    live[victim] = live.back();
+    live.pop_back();
+    if (i % 64 == 0) {
+      alloc->commit_start();
+      alloc->commit_finish();
+    }
+    uint64_t want = unit * (1 + rand() % (object_size / unit));
+    if (want > alloc->get_free())
+      continue;
+    alloc_request(alloc.get(), want, unit, &live, &age_stats);
+  }
+  alloc->commit_start();
+  alloc->commit_finish();
+  dump("age", age_stats);
+
+  // concurrent small allocations from several threads
+  vector<Stats> thread_stats(threads);
+  vector<std::thread> workers;
+  uint64_t per_thread = MIN(ops, alloc->get_free() / unit / threads / 2);
+  uint64_t start = Cycles::rdtsc();
+  for (unsigned t = 0; t < threads; ++t) {
+    workers.push_back(std::thread([&, t] {
+	  vector<Extent> mine;
+	  for (uint64_t i = 0; i < per_thread; ++i) {
+	    alloc_request(alloc.get(), unit, unit, &mine, &thread_stats[t]);
+	  }
+	}));
+  }
+  for (auto& w : workers)
+    w.join();
+  uint64_t elapsed = Cycles::rdtsc() - start;
+  Stats mt_stats;
+  for (auto& s : thread_stats)
+    mt_stats.add(s);
+  dump("concurrent", mt_stats);
+  cout << "  concurrent: " << threads << " threads, "
+       << mt_stats.calls / MAX(Cycles::to_seconds(elapsed), 0.000001)
+       << " allocs/sec" << std::endl;
+
+  alloc->shutdown();
+}
+
+void usage(const string &name) {
+  cerr << "Usage: " << name
+       << " [--size bytes] [--unit bytes] [--fill ratio]"
+       << " [--ops n] [--threads n] [allocator ...]"
+       << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+  env_to_vec(args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  uint64_t size = 100ull * 1024 * 1024 * 1024;
+  uint64_t unit = g_conf->bluestore_min_alloc_size;
+  double fill = .8;
+  uint64_t ops = 1000000;
+  unsigned threads = 8;
+  vector<string> types;
+  std::string val;
+  for (auto i = args.begin(); i != args.end();) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_witharg(args, i, &val, "--size", (char*)NULL)) {
+      size = strtoull(val.c_str(), NULL, 10);
+    } else if (ceph_argparse_witharg(args, i, &val, "--unit", (char*)NULL)) {
+      unit = strtoull(val.c_str(), NULL, 10);
+    } else if (ceph_argparse_witharg(args, i, &val, "--fill", (char*)NULL)) {
+      fill = atof(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--ops", (char*)NULL)) {
+      ops = strtoull(val.c_str(), NULL, 10);
+    } else if (ceph_argparse_witharg(args, i, &val, "--threads", (char*)NULL)) {
+      threads = atoi(val.c_str());
+    } else if (ceph_argparse_flag(args, i, "-h", "--help", (char*)NULL)) {
+      usage(argv[0]);
+      return 0;
+    } else {
+      types.push_back(*i);
+      ++i;
+    }
+  }
+  if (types.empty()) {
+    types.push_back("stupid");
+    types.push_back("bitmap");
+  }
+  if (fill <= 0 || fill >= 1 || !threads || !unit || size < unit * 1024) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  cout << "device " << size << " bytes, alloc unit " << unit
+       << ", fill " << fill << ", " << ops << " ops" << std::endl;
+  for (auto& t : types)
+    run(t, size, unit, fill, ops, threads);
+  return 0;
+}
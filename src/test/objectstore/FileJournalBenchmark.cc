@@ -0,0 +1,231 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Measure FileJournal throughput in entries/sec.
+ *
+ * Several threads prepare entries of a fixed size and submit them, taking
+ * a lock around seq assignment and submit_entry() as JournalingObjectStore
+ * does.  A committer thread stands in for the FileStore sync: every few
+ * milliseconds it trims the journal through the last completed seq so
+ * that long runs do not fill it.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string>
+#include <iostream>
+#include <thread>
+#include <atomic>
+
+using namespace std;
+
+#include "common/ceph_argparse.h"
+#include "common/debug.h"
+#include "common/Cond.h"
+#include "common/Finisher.h"
+#include "common/Mutex.h"
+#include "global/global_init.h"
+#include "include/Context.h"
+#include "include/str_list.h"
+#include "common/errno.h"
+#include "os/filestore/FileJournal.h"
+
+struct Bench {
+  FileJournal *j;
+  uint64_t total;
+
+  std::atomic<uint64_t> claimed = {0};  ///< entries a thread will submit
+
+  Mutex submit_lock;
+  uint64_t seq = 0;
+
+  Mutex lock;
+  Cond cond;
+  uint64_t done = 0;
+  std::atomic<uint64_t> journaled_seq = {0};
+
+  Bench(FileJournal *j, uint64_t total)
+    : j(j), total(total),
+      submit_lock("Bench::submit_lock"),
+      lock("Bench::lock") {}
+};
+
+class C_Journaled : public Context {
+  Bench *b;
+  uint64_t seq;
+public:
+  C_Journaled(Bench *b, uint64_t s) : b(b), seq(s) {}
+  void finish(int r) {
+    // the finisher completes entries in seq order
+    b->journaled_seq = seq;
+    Mutex::Locker l(b->lock);
+    ++b->done;
+    b->cond.Signal();
+  }
+};
+
+static void submit_thread(Bench *b, unsigned entry_size)
+{
+  bufferptr payload = buffer::create_page_aligned(entry_size);
+  payload.zero();
+  // claim an entry before reserving journal space for it, so that no
+  // thread is left holding throttle it will not submit against
+  while (b->claimed++ < b->total) {
+    bufferlist bl;
+    bl.append(payload);
+    vector<ObjectStore::Transaction> tls;
+    int orig_len = b->j->prepare_entry(tls, &bl);
+    b->j->reserve_throttle_and_backoff(bl.length());
+    Mutex::Locker l(b->submit_lock);
+    uint64_t s = ++b->seq;
+    b->j->submit_entry(s, bl, orig_len, new C_Journaled(b, s));
+  }
+}
+
+static void commit_thread(Bench *b, std::atomic<bool> *stop)
+{
+  uint64_t committed = 0;
+  while (!*stop) {
+    usleep(20000);
+    uint64_t s = b->journaled_seq;
+    if (s > committed) {
+      b->j->commit_start(s);
+      b->j->committed_thru(s);
+      committed = s;
+    }
+  }
+}
+
+static int run(const char *path, bool directio, bool aio,
+	       unsigned entry_size, uint64_t entries, unsigned threads)
+{
+  Finisher finisher(g_ceph_context);
+  Cond sync_cond;
+  uuid_d fsid;
+  fsid.generate_random();
+  FileJournal j(fsid, &finisher, &sync_cond, path, directio, aio, aio);
+  int r = j.create();
+  if (r < 0) {
+    cerr << "unable to create journal at " << path << ": "
+	 << cpp_strerror(r) << std::endl;
+    return r;
+  }
+  r = j.make_writeable();
+  if (r < 0) {
+    cerr << "unable to open journal at " << path << ": "
+	 << cpp_strerror(r) << std::endl;
+    return r;
+  }
+  finisher.start();
+
+  Bench b(&j, entries);
+  std::atomic<bool> stop = {false};
+  std::thread committer(commit_thread, &b, &stop);
+
+  utime_t start = ceph_clock_now(g_ceph_context);
+  vector<std::thread> submitters;
+  for (unsigned i = 0; i < threads; ++i)
+    submitters.push_back(std::thread(submit_thread, &b, entry_size));
+  for (auto& t : submitters)
+    t.join();
+  {
+    Mutex::Locker l(b.lock);
+    while (b.done < entries)
+      b.cond.Wait(b.lock);
+  }
+  utime_t dur = ceph_clock_now(g_ceph_context) - start;
+
+  stop = true;
+  committer.join();
+  j.close();
+  finisher.stop();
+
+  cout << "  " << threads << " threads: " << entries << " entries in "
+       << dur << " s, " << (uint64_t)(entries / (double)dur) << " entries/s, "
+       << (entries * entry_size) / (double)dur / (1024 * 1024) << " MB/s"
+       << std::endl;
+  return 0;
+}
+
+void usage(const string &name) {
+  cerr << "Usage: " << name
+       << " [--size bytes] [--entries n] [--threads n[,n...]]"
+       << " [--no-directio] [--no-aio] <journal path>"
+       << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+  env_to_vec(args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+  g_ceph_context->_conf->set_val("journal_write_header_frequency", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  unsigned entry_size = 4096;
+  uint64_t entries = 100000;
+  vector<unsigned> threads;
+  bool directio = true, aio = true;
+  string path;
+  std::string val;
+  for (auto i = args.begin(); i != args.end();) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_witharg(args, i, &val, "--size", (char*)NULL)) {
+      entry_size = atoi(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--entries", (char*)NULL)) {
+      entries = strtoull(val.c_str(), NULL, 10);
+    } else if (ceph_argparse_witharg(args, i, &val, "--threads", (char*)NULL)) {
+      list<string> ls;
+      get_str_list(val, ",", ls);
+      for (auto& s : ls)
+	threads.push_back(atoi(s.c_str()));
+    } else if (ceph_argparse_flag(args, i, "--no-directio", (char*)NULL)) {
+      directio = false;
+      aio = false;
+    } else if (ceph_argparse_flag(args, i, "--no-aio", (char*)NULL)) {
+      aio = false;
+    } else if (ceph_argparse_flag(args, i, "-h", "--help", (char*)NULL)) {
+      usage(argv[0]);
+      return 0;
+    } else {
+      path = *i;
+      ++i;
+    }
+  }
+  if (threads.empty()) {
+    threads.push_back(1);
+    threads.push_back(4);
+    threads.push_back(16);
+  }
+  if (path.empty() || !entry_size || !entries) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  cout << "journal " << path << ", " << entry_size << " byte entries"
+       << (directio ? ", directio" : "") << (aio ? ", aio" : "")
+       << std::endl;
+  for (auto t : threads) {
+    if (!t)
+      continue;
+    int r = run(path.c_str(), directio, aio, entry_size, entries, t);
+    if (r < 0)
+      return 1;
+  }
+  return 0;
+}
@@ -17,8 +17,13 @@
 #include <iostream>
 #include <time.h>
 #include <sys/mount.h>
+#include <dirent.h>
 #include "os/ObjectStore.h"
 #include "os/filestore/FileStore.h"
+#include "os/bluestore/BlueStore.h"
+#include "os/kstore/KStore.h"
+#include "common/perf_counters.h"
+#include "common/ceph_json.h"
 #include "include/Context.h"
 #include "common/ceph_argparse.h"
 #include "global/global_init.h"
@@ -289,6 +294,56 @@ TEST_P(StoreTest, FiemapHoles) {
   }
 }
 
+TEST_P(StoreTest, SparseRead) {
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  int r = 0;
+  ghobject_t oid(hobject_t(sobject_t("sparse_object", CEPH_NOSNAP)));
+  bufferlist a, b;
+  a.append(string(4096, 'a'));
+  b.append(string(3, 'b'));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, oid, 0, a.length(), a);
+    t.write(cid, oid, 1048576, a.length(), a);
+    t.write(cid, oid, 4194304, b.length(), b);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // whole object, past eof
+    bufferlist bl;
+    r = store->read(cid, oid, 0, 8388608, bl);
+    ASSERT_EQ(4194307, r);
+    bufferlist expected;
+    expected.append(a);
+    expected.append_zero(1048576 - 4096);
+    expected.append(a);
+    expected.append_zero(4194304 - 1048576 - 4096);
+    expected.append(b);
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+  {
+    // start and end inside holes
+    bufferlist bl;
+    r = store->read(cid, oid, 8192, 1048576, bl);
+    ASSERT_EQ(1048576, r);
+    bufferlist expected;
+    expected.append_zero(1048576 - 8192);
+    expected.append(a);
+    expected.append_zero(8192 - 4096);
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, oid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, SimpleMetaColTest) {
   ObjectStore::Sequencer osr("test");
   coll_t cid;
@@ -3417,24 +3472,1286 @@ TEST_P(StoreTest, SetAllocHint) {
   }
   {
     ObjectStore::Transaction t;
-    t.set_alloc_hint(cid, hoid, 4*1024*1024, 1024*4);
+    t.set_alloc_hint(cid, hoid, 4*1024*1024, 1024*4, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.set_alloc_hint(cid, hoid, 4*1024*1024, 1024*4, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, BluestoreCompression) {
+  if (GetParam() != string("bluestore"))
+    return;
+  g_ceph_context->_conf->set_val("bluestore_compression", "passive");
+  g_ceph_context->_conf->apply_changes(NULL);
+  store->umount();
+  ASSERT_EQ(0, store->mount());
+
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t hoid2(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+  string expected;
+  for (unsigned i = 0; expected.length() < 1024 * 1024; ++i) {
+    expected += "compressible line " + stringify(i % 100) + "\n";
+  }
+  expected.resize(1024 * 1024);
+  int r;
+  {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(expected);
+    t.create_collection(cid, 0);
+    t.touch(cid, hoid);
+    t.set_alloc_hint(cid, hoid, 0, 0, CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE);
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    bufferlist exp;
+    exp.append(expected);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  {
+    cerr << "overwrite, clone and zero" << std::endl;
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(string(100, 'x'));
+    t.write(cid, hoid, 300000, bl.length(), bl);
+    t.clone(cid, hoid, hoid2);
+    t.zero(cid, hoid, 600000, 10000);
+    expected.replace(300000, 100, string(100, 'x'));
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist in;
+    r = store->read(cid, hoid2, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    bufferlist exp;
+    exp.append(expected);
+    ASSERT_TRUE(in.contents_equal(exp));
+    expected.replace(600000, 10000, string(10000, '\0'));
+    in.clear();
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    exp.clear();
+    exp.append(expected);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.truncate(cid, hoid, 200000);
+    expected.resize(200000);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  store->umount();
+  ASSERT_EQ(0, store->mount());
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, 1024 * 1024, in);
+    ASSERT_EQ((int)expected.length(), r);
+    bufferlist exp;
+    exp.append(expected);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, hoid2);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_ceph_context->_conf->set_val("bluestore_compression", "none");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, BluestoreBufferCache) {
+  if (GetParam() != string("bluestore"))
+    return;
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  const unsigned size = 128 * 1024;
+  bufferlist expected;
+  expected.append(string(size, 'a'));
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, expected.length(), expected);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // start with a cold cache
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  const PerfCounters *logger = store->get_perf_counters();
+  ASSERT_TRUE(logger);
+  uint64_t hit = logger->get(l_bluestore_buffer_hit_bytes);
+  uint64_t miss = logger->get(l_bluestore_buffer_miss_bytes);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  ASSERT_EQ(hit, logger->get(l_bluestore_buffer_hit_bytes));
+  ASSERT_EQ(miss + size, logger->get(l_bluestore_buffer_miss_bytes));
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  ASSERT_EQ(hit + size, logger->get(l_bluestore_buffer_hit_bytes));
+  ASSERT_EQ(miss + size, logger->get(l_bluestore_buffer_miss_bytes));
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, BluestoreWALBatch) {
+  if (GetParam() != string("bluestore"))
+    return;
+  // overlapping small overwrites from two sequencers, queued without
+  // waiting so that they get applied in the same wal batches
+  ObjectStore::Sequencer osr1("test1"), osr2("test2");
+  coll_t cid;
+  ghobject_t hoid1(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t hoid2(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+  const unsigned size = 256 * 1024;
+  string expected1(size, 'a'), expected2(size, 'b');
+  int r;
+  {
+    ObjectStore::Transaction t;
+    bufferlist bl1, bl2;
+    bl1.append(expected1);
+    bl2.append(expected2);
+    t.create_collection(cid, 0);
+    t.write(cid, hoid1, 0, bl1.length(), bl1);
+    t.write(cid, hoid2, 0, bl2.length(), bl2);
+    r = store->apply_transaction(&osr1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const PerfCounters *logger = store->get_perf_counters();
+  ASSERT_TRUE(logger);
+  uint64_t batches = logger->get(l_bluestore_wal_batches);
+  for (unsigned i = 0; i < 200; ++i) {
+    unsigned off = (i * 3001) % (size - 5000);
+    unsigned len = 1 + (i * 37) % 5000;
+    string data(len, 'c' + i % 20);
+    bufferlist bl;
+    bl.append(data);
+    ObjectStore::Transaction t;
+    if (i % 2) {
+      t.write(cid, hoid1, off, len, bl);
+      expected1.replace(off, len, data);
+      r = store->queue_transaction(&osr1, std::move(t), NULL);
+    } else {
+      t.write(cid, hoid2, off, len, bl);
+      expected2.replace(off, len, data);
+      r = store->queue_transaction(&osr2, std::move(t), NULL);
+    }
+    ASSERT_EQ(r, 0);
+  }
+  osr1.flush();
+  osr2.flush();
+  // read back from disk rather than the buffer cache
+  ASSERT_EQ(0, store->umount());
+  ASSERT_GT(logger->get(l_bluestore_wal_batches), batches);
+  ASSERT_EQ(0, store->mount());
+  {
+    bufferlist in, exp;
+    r = store->read(cid, hoid1, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    exp.append(expected1);
+    ASSERT_TRUE(in.contents_equal(exp));
+    in.clear();
+    exp.clear();
+    r = store->read(cid, hoid2, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    exp.append(expected2);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid1);
+    t.remove(cid, hoid2);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr1, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, BluestoreExtentRunRead) {
+  if (GetParam() != string("bluestore"))
+    return;
+  // appends get extents that usually follow each other on disk; reads
+  // spanning them (and a hole) must come back intact at any alignment
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  const unsigned chunk = 65536, num = 16, hole = 5;
+  string expected;
+  int r;
+  // keep each append to a single allocation
+  int small_allocs = g_conf->bluestore_debug_small_allocations;
+  g_conf->set_val("bluestore_debug_small_allocations", "0");
+  g_conf->apply_changes(NULL);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  for (unsigned i = 0; i < num; ++i) {
+    string data(chunk, 'a' + i);
+    if (i == hole) {
+      expected.append(chunk, '\0');
+      continue;
+    }
+    bufferlist bl;
+    bl.append(data);
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, i * chunk, bl.length(), bl);
     r = store->apply_transaction(&osr, std::move(t));
     ASSERT_EQ(r, 0);
+    expected.append(data);
+  }
+  g_conf->set_val("bluestore_debug_small_allocations",
+		  stringify(small_allocs));
+  g_conf->apply_changes(NULL);
+  // start from a cold cache
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  {
+    // the extents either side of the hole are each allocated in order,
+    // so a full read should need far fewer ios than there are extents
+    const PerfCounters *logger = store->get_perf_counters();
+    ASSERT_TRUE(logger);
+    uint64_t ios = logger->get(l_bluestore_read_ios);
+    bufferlist in;
+    r = store->read(cid, hoid, 0, chunk * num, in,
+		    CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    ASSERT_EQ((int)(chunk * num), r);
+    ASSERT_LT(logger->get(l_bluestore_read_ios) - ios, (uint64_t)num - 1);
+    ios = logger->get(l_bluestore_read_ios);
+    in.clear();
+    r = store->read(cid, hoid, chunk, chunk, in,
+		    CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+    ASSERT_EQ((int)chunk, r);
+    ASSERT_EQ(1u, logger->get(l_bluestore_read_ios) - ios);
+  }
+  unsigned offs[] = { 0, 1, 4095, chunk - 1, chunk * 3 + 17, chunk * 7 };
+  unsigned lens[] = { chunk * num, chunk + 2, chunk * 4 + 100, 3 };
+  for (auto off : offs) {
+    for (auto len : lens) {
+      unsigned l = MIN(len, chunk * num - off);
+      bufferlist in, exp;
+      r = store->read(cid, hoid, off, l, in,
+		      CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+      ASSERT_EQ((int)l, r);
+      exp.append(expected.substr(off, l));
+      ASSERT_TRUE(in.contents_equal(exp));
+    }
   }
   {
     ObjectStore::Transaction t;
     t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, BluestoreFsck) {
+  if (GetParam() != string("bluestore"))
+    return;
+  ObjectStore::Sequencer osr("test");
+  const unsigned num_colls = 8, num_objects = 20;
+  int r;
+  for (unsigned c = 0; c < num_colls; ++c) {
+    coll_t cid(spg_t(pg_t(c, 1), shard_id_t::NO_SHARD));
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (unsigned i = 0; i < num_objects; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      hoid.hobj.pool = 1;
+      hoid.hobj.set_hash(c);
+      bufferlist bl;
+      bl.append(string(4096 * (1 + i % 4), 'a' + i % 26));
+      t.write(cid, hoid, 0, bl.length(), bl);
+      map<string,bufferlist> omap;
+      omap["key"] = bl;
+      t.omap_setkeys(cid, hoid, omap);
+    }
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->fsck(true));
+  g_conf->set_val("bluestore_fsck_threads", "1");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->fsck(true));
+  g_conf->set_val("bluestore_fsck_threads", "0");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->mount());
+  for (unsigned c = 0; c < num_colls; ++c) {
+    coll_t cid(spg_t(pg_t(c, 1), shard_id_t::NO_SHARD));
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < num_objects; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      hoid.hobj.pool = 1;
+      hoid.hobj.set_hash(c);
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, BluestoreFreelistSnapshot) {
+  if (GetParam() != string("bluestore"))
+    return;
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (unsigned i = 0; i < 10; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      bufferlist bl;
+      bl.append(string(65536 * (1 + i % 3), 'a' + i));
+      t.write(cid, hoid, 0, bl.length(), bl);
+    }
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // umount writes the snapshot, fsck checks it against the freelist,
+  // and mount loads it
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->mount());
+
+  // freeing space drops the snapshot; the next umount writes a new one
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < 10; i += 2) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->fsck(false));
+  ASSERT_EQ(0, store->mount());
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 1; i < 10; i += 2) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+// number of txcs the txc histogram has seen leave the prepare state
+static uint64_t txc_histogram_prepared(BlueStore *bs)
+{
+  stringstream ss;
+  bs->asok_command("bluestore txc histogram dump", "json", ss);
+  string s = ss.str();
+  JSONParser parser;
+  assert(parser.parse(s.c_str(), s.length()));
+  JSONObj *states = parser.find_obj("states");
+  assert(states);
+  JSONObj *prepare = states->find_obj("prepare");
+  assert(prepare);
+  string count;
+  assert(prepare->get_data("count", &count));
+  return strtoull(count.c_str(), NULL, 10);
+}
+
+TEST_P(StoreTest, BluestoreTxcHistogram) {
+  if (GetParam() != string("bluestore"))
+    return;
+  BlueStore *bs = static_cast<BlueStore*>(store.get());
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  int r;
+  g_conf->set_val("bluestore_txc_histogram", "true");
+  g_conf->set_val("bluestore_txc_histogram_size", "true");
+  g_conf->apply_changes(NULL);
+  stringstream ss;
+  bs->asok_command("bluestore txc histogram reset", "json", ss);
+  ASSERT_EQ(0u, txc_histogram_prepared(bs));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const unsigned num = 10;
+  for (unsigned i = 0; i < num; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(string(4096, 'a' + i));
+    t.write(cid, hoid, 0, bl.length(), bl);
     r = store->apply_transaction(&osr, std::move(t));
     ASSERT_EQ(r, 0);
   }
+  ASSERT_GE(txc_histogram_prepared(bs), num + 1);
+  ss.str("");
+  bs->asok_command("bluestore txc histogram reset", "json", ss);
+  ASSERT_EQ(0u, txc_histogram_prepared(bs));
   {
     ObjectStore::Transaction t;
-    t.set_alloc_hint(cid, hoid, 4*1024*1024, 1024*4);
+    for (unsigned i = 0; i < num; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
     r = store->apply_transaction(&osr, std::move(t));
     ASSERT_EQ(r, 0);
   }
+  ASSERT_GE(txc_histogram_prepared(bs), 1u);
+  g_conf->set_val("bluestore_txc_histogram", "false");
+  g_conf->set_val("bluestore_txc_histogram_size", "false");
+  g_conf->apply_changes(NULL);
+}
+
+// sum one counter over the aio queues of bluestore's main device; also
+// report how many queues there are and how many of them it moved on
+static uint64_t sum_bdev_aio_counter(const string& counter,
+				     unsigned *num_queues = NULL,
+				     unsigned *num_busy = NULL)
+{
+  JSONFormatter f;
+  g_ceph_context->get_perfcounters_collection()->dump_formatted(&f, false);
+  stringstream ss;
+  f.flush(ss);
+  string s = ss.str();
+  JSONParser parser;
+  assert(parser.parse(s.c_str(), s.length()));
+  const string prefix = "KernelDevice-block-aio-queue-";
+  uint64_t sum = 0;
+  if (num_queues)
+    *num_queues = 0;
+  if (num_busy)
+    *num_busy = 0;
+  for (JSONObjIter p = parser.find_first(); !p.end(); ++p) {
+    JSONObj *o = *p;
+    const string& name = o->get_name();
+    // skip bluefs' own instance on the same device
+    if (name.compare(0, prefix.length(), prefix) != 0 ||
+	name.find_first_not_of("0123456789", prefix.length()) != string::npos)
+      continue;
+    string v;
+    uint64_t n = 0;
+    if (o->get_data(counter, &v))
+      n = strtoull(v.c_str(), NULL, 10);
+    sum += n;
+    if (num_queues)
+      ++*num_queues;
+    if (num_busy && n)
+      ++*num_busy;
+  }
+  return sum;
+}
+
+TEST_P(StoreTest, BluestoreAioSched) {
+  if (GetParam() != string("bluestore"))
+    return;
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  int r;
+  // hold back most aios so that wal and client writes queue by class,
+  // and apply the wal writes in batches
+  g_conf->set_val("bdev_aio_sched_depth", "2");
+  g_conf->set_val("bluestore_wal_batch_max_txc", "8");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  const PerfCounters *logger = store->get_perf_counters();
+  ASSERT_TRUE(logger);
+  uint64_t batches = logger->get(l_bluestore_wal_batches);
+  uint64_t wal_aios = sum_bdev_aio_counter("submitted_wal");
   {
     ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  for (unsigned i = 0; i < 20; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(string(65536, 'a' + i));
+    t.write(cid, hoid, 0, bl.length(), bl);
+    bufferlist small;
+    small.append(string(100, 'A' + i));
+    t.write(cid, hoid, 1000, small.length(), small);  // wal
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  osr.flush();
+  ASSERT_GT(sum_bdev_aio_counter("submitted_client"), 0u);
+  // the wal is applied after the commit; the aio queue counters go away
+  // with the device, so wait for it here rather than umount
+  for (unsigned i = 0;
+       i < 1000 && sum_bdev_aio_counter("submitted_wal") == wal_aios;
+       ++i)
+    usleep(10000);
+  ASSERT_GT(sum_bdev_aio_counter("submitted_wal"), wal_aios);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_GT(logger->get(l_bluestore_wal_batches), batches);
+  ASSERT_EQ(0, store->mount());
+  for (unsigned i = 0; i < 20; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    bufferlist bl;
+    ASSERT_EQ(100, store->read(cid, hoid, 1000, 100, bl));
+    ASSERT_EQ(string(100, 'A' + i), bl.to_str());
+  }
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < 20; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bdev_aio_sched_depth", "0");
+  g_conf->set_val("bluestore_wal_batch_max_txc", "64");
+  g_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, BluestoreAioQueues) {
+  if (GetParam() != string("bluestore"))
+    return;
+  coll_t cid;
+  int r;
+  g_conf->set_val("bdev_aio_queues", "4");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  unsigned num_queues = 0;
+  uint64_t submitted = sum_bdev_aio_counter("submitted", &num_queues);
+  ASSERT_EQ(4u, num_queues);
+  {
+    ObjectStore::Sequencer osr("test");
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // several sequencers so that the iocs spread over the queues
+  const unsigned num_osrs = 8, num_objs = 64;
+  vector<ObjectStore::Sequencer*> osrs;
+  for (unsigned i = 0; i < num_osrs; ++i)
+    osrs.push_back(new ObjectStore::Sequencer("test" + stringify(i)));
+  for (unsigned i = 0; i < num_objs; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(string(65536, 'a' + i % 26));
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->queue_transaction(osrs[i % num_osrs], std::move(t), NULL);
+    ASSERT_EQ(r, 0);
+  }
+  for (auto osr : osrs) {
+    osr->flush();
+    delete osr;
+  }
+  unsigned num_busy = 0;
+  ASSERT_GE(sum_bdev_aio_counter("submitted", NULL, &num_busy),
+	    submitted + num_objs);
+  ASSERT_GT(num_busy, 1u);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  for (unsigned i = 0; i < num_objs; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    bufferlist bl;
+    ASSERT_EQ(65536, store->read(cid, hoid, 0, 65536, bl));
+    ASSERT_EQ(string(65536, 'a' + i % 26), bl.to_str());
+  }
+  {
+    ObjectStore::Sequencer osr("test");
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < num_objs; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bdev_aio_queues", "0");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+}
+
+TEST_P(StoreTest, BluestoreDiscard) {
+  if (GetParam() != string("bluestore"))
+    return;
+  // trimmed extents must become allocatable again on their own, without
+  // waiting for some other transaction to commit
+  BlueStore *bs = static_cast<BlueStore*>(store.get());
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  const unsigned size = 1024 * 1024;
+  bufferlist bl;
+  bl.append(string(size, 'a'));
+  int r;
+  g_conf->set_val("bdev_enable_discard", "true");
+  g_conf->set_val("bdev_debug_fake_discard", "true");
+  g_conf->set_val("bdev_discard_max_bytes_per_sec", "0");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bs->discard_drain();
+  uint64_t avail = bs->get_alloc_free();
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bs->discard_drain();
+  ASSERT_GE(bs->get_alloc_free(), avail + size);
+  // and the recovered space is handed out again
+  avail = bs->get_alloc_free();
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_LE(bs->get_alloc_free() + size, avail);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(bl));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bdev_enable_discard", "false");
+  g_conf->set_val("bdev_debug_fake_discard", "false");
+  g_conf->set_val("bdev_discard_max_bytes_per_sec", "268435456");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+}
+
+TEST_P(StoreTest, BluestoreCsumShards) {
+  if (GetParam() != string("bluestore"))
+    return;
+  // csums are stored with the extent map shards, so a small overwrite of
+  // a large object doesn't rewrite the csums of the whole object
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t hoid2(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+  const unsigned size = 16 * 1024 * 1024;
+  const PerfCounters *logger = store->get_perf_counters();
+  ASSERT_TRUE(logger);
+  bufferlist bl;
+  bl.append(string(size, 'a'));
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist x;
+    x.append(string(4096, 'b'));
+    uint64_t written = logger->get(l_bluestore_onode_write_bytes);
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, size / 2, x.length(), x);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    // 4096 crc32c values inline would be 16k on their own
+    ASSERT_LT(logger->get(l_bluestore_onode_write_bytes) - written, 8192u);
+    bl.copy_in(size / 2, x.length(), x);
+  }
+  // an object first grown by truncate still gets csums for its data
+  bufferlist small;
+  small.append(string(65536, 'c'));
+  {
+    ObjectStore::Transaction t;
+    t.touch(cid, hoid2);
+    t.truncate(cid, hoid2, 1024 * 1024);
+    t.write(cid, hoid2, 0, small.length(), small);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  logger = store->get_perf_counters();
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(bl));
+  }
+  {
+    uint64_t verified = logger->get(l_bluestore_csum_verified_bytes);
+    bufferlist in;
+    r = store->read(cid, hoid2, 0, small.length(), in);
+    ASSERT_EQ((int)small.length(), r);
+    ASSERT_TRUE(in.contents_equal(small));
+    ASSERT_EQ(small.length(),
+	      logger->get(l_bluestore_csum_verified_bytes) - verified);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, hoid2);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, FilestorePreSplit) {
+  if (GetParam() != string("filestore"))
+    return;
+  ObjectStore::Sequencer osr("test");
+  FileStore *fs = static_cast<FileStore*>(store.get());
+  // pre-splitting requires merging to be disabled; the index picks the
+  // threshold up when the collection is created
+  int merge_threshold = g_ceph_context->_conf->filestore_merge_threshold;
+  if (merge_threshold > 0) {
+    g_ceph_context->_conf->set_val("filestore_merge_threshold",
+				   stringify(-merge_threshold).c_str());
+  }
+  coll_t cid(spg_t(pg_t(3, 21), shard_id_t::NO_SHARD));
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  unsigned splits = 0;
+  ASSERT_EQ(-ENODATA, fs->pre_split_collection(cid, 100000, &splits));
+  const unsigned num_objs = 200;
+  for (unsigned i = 0; i < num_objs; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(stringify(i));
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  int objs_per_folder = abs(merge_threshold) * 16 *
+    g_ceph_context->_conf->filestore_split_multiple;
+  uint64_t expected = (uint64_t)objs_per_folder * 64;
+  ASSERT_EQ(0, fs->pre_split_collection(cid, expected, &splits));
+  ASSERT_GT(splits, 1u);
+  // already split far enough
+  ASSERT_EQ(0, fs->pre_split_collection(cid, expected, &splits));
+  ASSERT_EQ(0u, splits);
+
+  vector<ghobject_t> objects;
+  r = store->collection_list(cid, ghobject_t(), ghobject_t::get_max(), true,
+			     INT_MAX, &objects, 0);
+  ASSERT_EQ(r, 0);
+  ASSERT_EQ(num_objs, objects.size());
+  for (unsigned i = 0; i < num_objs; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    bufferlist bl;
+    r = store->read(cid, hoid, 0, 100, bl);
+    ASSERT_EQ((int)stringify(i).length(), r);
+    ASSERT_EQ(stringify(i), bl.to_str());
+  }
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < num_objs; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  if (merge_threshold > 0) {
+    g_ceph_context->_conf->set_val("filestore_merge_threshold",
+				   stringify(merge_threshold).c_str());
+  }
+}
+
+// hashed subdirectories directly under a filestore collection
+static unsigned count_hash_subdirs(const coll_t& cid)
+{
+  string path = string("store_test_temp_dir/current/") + cid.to_str();
+  DIR *dir = ::opendir(path.c_str());
+  if (!dir)
+    return 0;
+  unsigned n = 0;
+  struct dirent *de;
+  while ((de = ::readdir(dir)) != NULL) {
+    if (strncmp(de->d_name, "DIR_", 4) == 0)
+      ++n;
+  }
+  ::closedir(dir);
+  return n;
+}
+
+TEST_P(StoreTest, FilestoreSplitAhead) {
+  if (GetParam() != string("filestore"))
+    return;
+  ObjectStore::Sequencer osr("test");
+  FileStore *fs = static_cast<FileStore*>(store.get());
+  // the split thread only runs if split_ahead_ratio is set at mount
+  g_conf->set_val("filestore_split_ahead_ratio", "0.5");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  const PerfCounters *logger = store->get_perf_counters();
+  ASSERT_TRUE(logger);
+  uint64_t split_ahead = logger->get(l_os_split_ahead);
+  coll_t cid(spg_t(pg_t(3, 22), shard_id_t::NO_SHARD));
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // past the split-ahead ratio but below the threshold, so created()
+  // never splits in the foreground
+  unsigned objs_per_folder = abs(g_conf->filestore_merge_threshold) * 16 *
+    g_conf->filestore_split_multiple;
+  const unsigned num_objs = objs_per_folder * 3 / 4;
+  ASSERT_LT(num_objs, objs_per_folder);
+  for (unsigned i = 0; i < num_objs; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(stringify(i));
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  for (unsigned i = 0;
+       i < 3000 && (fs->has_queued_splits() ||
+		    logger->get(l_os_split_ahead) == split_ahead);
+       ++i)
+    usleep(10000);
+  ASSERT_FALSE(fs->has_queued_splits());
+  ASSERT_EQ(split_ahead + 1, logger->get(l_os_split_ahead));
+  ASSERT_GT(count_hash_subdirs(cid), 0u);
+
+  vector<ghobject_t> objects;
+  r = store->collection_list(cid, ghobject_t(), ghobject_t::get_max(), true,
+			     INT_MAX, &objects, 0);
+  ASSERT_EQ(r, 0);
+  ASSERT_EQ(num_objs, objects.size());
+  for (unsigned i = 0; i < num_objs; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    bufferlist bl;
+    r = store->read(cid, hoid, 0, 100, bl);
+    ASSERT_EQ((int)stringify(i).length(), r);
+    ASSERT_EQ(stringify(i), bl.to_str());
+  }
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < num_objs; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("filestore_split_ahead_ratio", "0");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+}
+
+TEST_P(StoreTest, FilestoreSplitAheadSkipped) {
+  if (GetParam() != string("filestore"))
+    return;
+  ObjectStore::Sequencer osr("test");
+  FileStore *fs = static_cast<FileStore*>(store.get());
+  // hold the split thread off until the queued directory has emptied
+  g_conf->set_val("filestore_split_ahead_ratio", "0.5");
+  g_conf->set_val("filestore_split_ahead_rate", "0.0001");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  const PerfCounters *logger = store->get_perf_counters();
+  ASSERT_TRUE(logger);
+  uint64_t split_ahead = logger->get(l_os_split_ahead);
+  uint64_t skipped = logger->get(l_os_split_ahead_skipped);
+  coll_t cid(spg_t(pg_t(3, 23), shard_id_t::NO_SHARD));
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  unsigned objs_per_folder = abs(g_conf->filestore_merge_threshold) * 16 *
+    g_conf->filestore_split_multiple;
+  const unsigned num_objs = objs_per_folder * 3 / 4;
+  for (unsigned i = 0; i < num_objs; ++i) {
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					CEPH_NOSNAP)));
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(stringify(i));
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_TRUE(fs->has_queued_splits());
+  // drop back under the ratio before the thread gets to it
+  const unsigned keep = objs_per_folder / 4;
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = keep; i < num_objs; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("filestore_split_ahead_rate", "10");
+  g_conf->apply_changes(NULL);
+  for (unsigned i = 0;
+       i < 3000 && logger->get(l_os_split_ahead_skipped) == skipped;
+       ++i)
+    usleep(10000);
+  ASSERT_FALSE(fs->has_queued_splits());
+  ASSERT_EQ(skipped + 1, logger->get(l_os_split_ahead_skipped));
+  ASSERT_EQ(split_ahead, logger->get(l_os_split_ahead));
+  ASSERT_EQ(0u, count_hash_subdirs(cid));
+
+  vector<ghobject_t> objects;
+  r = store->collection_list(cid, ghobject_t(), ghobject_t::get_max(), true,
+			     INT_MAX, &objects, 0);
+  ASSERT_EQ(r, 0);
+  ASSERT_EQ(keep, objects.size());
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < keep; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(i),
+					  CEPH_NOSNAP)));
+      t.remove(cid, hoid);
+    }
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("filestore_split_ahead_ratio", "0");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+}
+
+TEST_P(StoreTest, KStoreStripeCache) {
+  if (GetParam() != string("kstore"))
+    return;
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  const unsigned stripe = g_conf->kstore_default_stripe_size;
+  const unsigned size = stripe * 4;
+  bufferlist expected;
+  for (unsigned i = 0; i < 4; ++i)
+    expected.append(string(stripe, 'a' + i));
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, expected.length(), expected);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // start with a cold cache
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  const PerfCounters *logger = store->get_perf_counters();
+  ASSERT_TRUE(logger);
+  uint64_t hit = logger->get(l_kstore_stripe_cache_hit);
+  uint64_t miss = logger->get(l_kstore_stripe_cache_miss);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  ASSERT_EQ(hit, logger->get(l_kstore_stripe_cache_hit));
+  ASSERT_EQ(miss + 4, logger->get(l_kstore_stripe_cache_miss));
+  ASSERT_EQ(size, logger->get(l_kstore_stripe_cache_bytes));
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  ASSERT_EQ(hit + 4, logger->get(l_kstore_stripe_cache_hit));
+  ASSERT_EQ(miss + 4, logger->get(l_kstore_stripe_cache_miss));
+
+  // a cache of two stripes keeps the two most recently read
+  g_conf->set_val("kstore_stripe_cache_size", stringify(stripe * 2).c_str());
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  hit = logger->get(l_kstore_stripe_cache_hit);
+  miss = logger->get(l_kstore_stripe_cache_miss);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  ASSERT_EQ(miss + 4, logger->get(l_kstore_stripe_cache_miss));
+  ASSERT_EQ(stripe * 2, logger->get(l_kstore_stripe_cache_bytes));
+  {
+    bufferlist in, exp;
+    r = store->read(cid, hoid, stripe * 2, stripe * 2, in);
+    ASSERT_EQ((int)stripe * 2, r);
+    exp.substr_of(expected, stripe * 2, stripe * 2);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  ASSERT_EQ(hit + 2, logger->get(l_kstore_stripe_cache_hit));
+  ASSERT_EQ(miss + 4, logger->get(l_kstore_stripe_cache_miss));
+  {
+    bufferlist in, exp;
+    r = store->read(cid, hoid, 0, stripe, in);
+    ASSERT_EQ((int)stripe, r);
+    exp.substr_of(expected, 0, stripe);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  ASSERT_EQ(hit + 2, logger->get(l_kstore_stripe_cache_hit));
+  ASSERT_EQ(miss + 5, logger->get(l_kstore_stripe_cache_miss));
+
+  g_conf->set_val("kstore_stripe_cache_size", "67108864");
+  g_conf->apply_changes(NULL);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, KStoreStripeCacheRemove) {
+  if (GetParam() != string("kstore"))
+    return;
+  // removing stripes must drop them from the cache, not serve the old data
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  const unsigned stripe = g_conf->kstore_default_stripe_size;
+  const unsigned size = stripe * 4;
+  bufferlist data, zeros;
+  data.append(string(size, 'a'));
+  zeros.append_zero(size);
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, data.length(), data);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const PerfCounters *logger = store->get_perf_counters();
+  ASSERT_TRUE(logger);
+  uint64_t hit = logger->get(l_kstore_stripe_cache_hit);
+  uint64_t miss = logger->get(l_kstore_stripe_cache_miss);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(data));
+  }
+  // the committed write populated the cache
+  ASSERT_EQ(hit + 4, logger->get(l_kstore_stripe_cache_hit));
+  ASSERT_EQ(miss, logger->get(l_kstore_stripe_cache_miss));
+  {
+    ObjectStore::Transaction t;
+    t.truncate(cid, hoid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.truncate(cid, hoid, size);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  hit = logger->get(l_kstore_stripe_cache_hit);
+  miss = logger->get(l_kstore_stripe_cache_miss);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(zeros));
+  }
+  ASSERT_EQ(hit, logger->get(l_kstore_stripe_cache_hit));
+  ASSERT_EQ(miss + 4, logger->get(l_kstore_stripe_cache_miss));
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(zeros));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, KStoreStripeCoalesce) {
+  if (GetParam() != string("kstore"))
+    return;
+  // small writes to the same stripes in one transaction become one kv
+  // update per stripe
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  const unsigned stripe = g_conf->kstore_default_stripe_size;
+  const unsigned size = stripe * 2;
+  string expected(size, 0);
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  const PerfCounters *logger = store->get_perf_counters();
+  ASSERT_TRUE(logger);
+  uint64_t coalesced = logger->get(l_kstore_stripe_coalesced);
+  {
+    ObjectStore::Transaction t;
+    // 4 writes into stripe 0, 2 into stripe 1
+    unsigned offs[] = { 0, 8192, 4096, 20000, stripe + 100, stripe + 9000 };
+    for (unsigned i = 0; i < 6; ++i) {
+      string s(4096, 'a' + i);
+      bufferlist bl;
+      bl.append(s);
+      t.write(cid, hoid, offs[i], bl.length(), bl);
+      expected.replace(offs[i], s.length(), s);
+    }
+    t.truncate(cid, hoid, size);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_EQ(coalesced + 4, logger->get(l_kstore_stripe_coalesced));
+  bufferlist exp;
+  exp.append(expected);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, size, in);
+    ASSERT_EQ((int)size, r);
+    ASSERT_TRUE(in.contents_equal(exp));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
     t.remove_collection(cid);
     r = store->apply_transaction(&osr, std::move(t));
     ASSERT_EQ(r, 0);
@@ -3477,6 +4794,7 @@ int main(int argc, char **argv) {
   g_ceph_context->_conf->set_val("filestore_fiemap", "true");
   g_ceph_context->_conf->set_val("bluestore_fsck_on_mount", "true");
   g_ceph_context->_conf->set_val("bluestore_fsck_on_umount", "true");
+  g_ceph_context->_conf->set_val("bluestore_fsck_on_umount_deep", "true");
   g_ceph_context->_conf->set_val("bluestore_debug_misc", "true");
   g_ceph_context->_conf->set_val("bluestore_debug_small_allocations", "4");
   g_ceph_context->_conf->set_val("bluestore_debug_freelist", "true");
@@ -7,10 +7,13 @@
 #include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <atomic>
+#include <thread>
 #include "global/global_init.h"
 #include "common/ceph_argparse.h"
 #include "include/stringify.h"
 #include "common/errno.h"
+#include "common/perf_counters.h"
 #include <gtest/gtest.h>
 
 #include "os/bluestore/BlueFS.h"
@@ -131,6 +134,132 @@ TEST(BlueFS, small_appends) {
   rm_temp_bdev(fn);
 }
 
+TEST(BlueFS, sequential_read_random) {
+  uint64_t size = 1048476 * 128;
+  string fn = get_temp_bdev(size);
+  BlueFS fs;
+  ASSERT_EQ(0, fs.add_block_device(0, fn));
+  fs.add_block_extent(0, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid));
+  ASSERT_EQ(0, fs.mount());
+  const unsigned file_size = 8 * 1048576;
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.mkdir("dir"));
+    ASSERT_EQ(0, fs.open_for_write("dir", "file", &h, false));
+    for (unsigned i = 0; i < file_size / 4096; ++i) {
+      bufferlist bl;
+      bl.append(string(4096, 'a' + i % 26));
+      h->append(bl);
+    }
+    fs.fsync(h);
+    fs.close_writer(h);
+  }
+  const PerfCounters *logger = fs.get_perf_counters();
+  uint64_t ra_bytes = logger->get(l_bluefs_readahead_bytes);
+  uint64_t ra_hit_bytes = logger->get(l_bluefs_readahead_hit_bytes);
+  {
+    // a sequential scan through a random reader, as compaction does,
+    // should trigger readahead and still return the right data
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "file", &h, true));
+    char buf[65536];
+    for (unsigned off = 0; off < file_size; off += sizeof(buf)) {
+      ASSERT_EQ((int)sizeof(buf), fs.read_random(h, off, sizeof(buf), buf));
+      for (unsigned i = 0; i < sizeof(buf); i += 4096) {
+	ASSERT_EQ('a' + (int)((off + i) / 4096 % 26), buf[i]);
+      }
+    }
+    delete h;
+  }
+  ASSERT_GT(logger->get(l_bluefs_readahead_bytes), ra_bytes);
+  ASSERT_GT(logger->get(l_bluefs_readahead_hit_bytes), ra_hit_bytes);
+  {
+    // scattered reads through a random reader should not prefetch
+    ra_bytes = logger->get(l_bluefs_readahead_bytes);
+    ra_hit_bytes = logger->get(l_bluefs_readahead_hit_bytes);
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "file", &h, true));
+    char buf[65536];
+    const unsigned chunks = file_size / sizeof(buf);
+    for (unsigned i = 0; i < chunks; ++i) {
+      unsigned off = (i * 7919) % chunks * sizeof(buf);
+      ASSERT_EQ((int)sizeof(buf), fs.read_random(h, off, sizeof(buf), buf));
+      ASSERT_EQ('a' + (int)(off / 4096 % 26), buf[0]);
+    }
+    delete h;
+    ASSERT_EQ(ra_bytes, logger->get(l_bluefs_readahead_bytes));
+    ASSERT_EQ(ra_hit_bytes, logger->get(l_bluefs_readahead_hit_bytes));
+  }
+  {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "file", &h));
+    for (unsigned off = 0; off < file_size; off += 65536) {
+      bufferlist bl;
+      ASSERT_EQ(65536, fs.read(h, &h->buf, off, 65536, &bl, NULL));
+      ASSERT_EQ('a' + (int)(off / 4096 % 26), bl[0]);
+    }
+    delete h;
+  }
+  fs.umount();
+  rm_temp_bdev(fn);
+}
+
+TEST(BlueFS, compact_log_async) {
+  uint64_t size = 1048476 * 128;
+  string fn = get_temp_bdev(size);
+  g_ceph_context->_conf->set_val("bluefs_log_compact_min_size", "1048576");
+  g_ceph_context->_conf->set_val("bluefs_log_compact_min_ratio", "1");
+  g_ceph_context->_conf->apply_changes(NULL);
+  BlueFS fs;
+  ASSERT_EQ(0, fs.add_block_device(0, fn));
+  fs.add_block_extent(0, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("dir"));
+  const unsigned num_files = 2000;
+  std::atomic_bool done(false);
+  // keep compacting while another thread grows the log
+  std::thread compactor([&] {
+      while (!done) {
+	fs.sync_metadata();
+      }
+    });
+  for (unsigned i = 0; i < num_files; ++i) {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "file." + stringify(i), &h, false));
+    bufferlist bl;
+    bl.append(stringify(i));
+    h->append(bl);
+    fs.fsync(h);
+    fs.close_writer(h);
+  }
+  done = true;
+  compactor.join();
+  fs.umount();
+  ASSERT_EQ(0, fs.mount());
+  vector<string> ls;
+  ASSERT_EQ(0, fs.readdir("dir", &ls));
+  ASSERT_EQ(num_files + 2, ls.size());  // . and ..
+  for (unsigned i = 0; i < num_files; i += 97) {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "file." + stringify(i), &h));
+    bufferlist bl;
+    string expected = stringify(i);
+    ASSERT_EQ((int)expected.length(),
+	      fs.read(h, &h->buf, 0, 1024, &bl, NULL));
+    ASSERT_EQ(expected, string(bl.c_str(), bl.length()));
+    delete h;
+  }
+  fs.umount();
+  rm_temp_bdev(fn);
+  g_ceph_context->_conf->set_val("bluefs_log_compact_min_size", "16777216");
+  g_ceph_context->_conf->set_val("bluefs_log_compact_min_ratio", "5");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
@@ -0,0 +1,163 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <iostream>
+#include "global/global_init.h"
+#include "global/global_context.h"
+#include "common/config.h"
+#include "common/ceph_argparse.h"
+#include "include/stringify.h"
+#include "include/memory.h"
+#include <gtest/gtest.h>
+
+#include "os/bluestore/Allocator.h"
+
+#if GTEST_HAS_PARAM_TEST
+
+class AllocTest : public ::testing::TestWithParam<const char*> {
+public:
+  static const uint64_t block_size = 65536;
+  static const uint64_t dev_size = 1024 * block_size;
+
+  ceph::shared_ptr<Allocator> alloc;
+
+  void SetUp() override {
+    alloc.reset(Allocator::create(GetParam(), dev_size, block_size));
+    ASSERT_TRUE(alloc);
+  }
+  void TearDown() override {
+    alloc->shutdown();
+    alloc.reset();
+  }
+};
+
+const uint64_t AllocTest::block_size;
+const uint64_t AllocTest::dev_size;
+
+TEST_P(AllocTest, empty)
+{
+  ASSERT_EQ(0u, alloc->get_free());
+  ASSERT_EQ(-ENOSPC, alloc->reserve(block_size));
+}
+
+TEST_P(AllocTest, simple)
+{
+  alloc->init_add_free(0, dev_size);
+  ASSERT_EQ(dev_size, alloc->get_free());
+
+  ASSERT_EQ(0, alloc->reserve(16 * block_size));
+  uint64_t offset;
+  uint32_t length;
+  ASSERT_EQ(0, alloc->allocate(16 * block_size, block_size, 0,
+			       &offset, &length));
+  ASSERT_EQ(0u, offset % block_size);
+  ASSERT_EQ(16 * block_size, length);
+  ASSERT_EQ(dev_size - length, alloc->get_free());
+
+  alloc->release(offset, length);
+  ASSERT_EQ(dev_size - length, alloc->get_free());
+  alloc->commit_start();
+  ASSERT_EQ(dev_size - length, alloc->get_free());
+  alloc->commit_finish();
+  ASSERT_EQ(dev_size, alloc->get_free());
+}
+
+TEST_P(AllocTest, reserve)
+{
+  alloc->init_add_free(0, dev_size);
+  ASSERT_EQ(0, alloc->reserve(dev_size));
+  ASSERT_EQ(-ENOSPC, alloc->reserve(block_size));
+  alloc->unreserve(block_size);
+  ASSERT_EQ(0, alloc->reserve(block_size));
+  alloc->unreserve(dev_size);
+}
+
+TEST_P(AllocTest, alloc_unit_alignment)
+{
+  alloc->init_add_free(block_size, dev_size - block_size);
+  ASSERT_EQ(0, alloc->reserve(4 * block_size));
+  uint64_t offset;
+  uint32_t length;
+  ASSERT_EQ(0, alloc->allocate(4 * block_size, 4 * block_size, 0,
+			       &offset, &length));
+  ASSERT_EQ(0u, offset % (4 * block_size));
+  ASSERT_EQ(4 * block_size, length);
+}
+
+TEST_P(AllocTest, fragmented)
+{
+  alloc->init_add_free(0, dev_size);
+  uint64_t num = dev_size / block_size;
+  ASSERT_EQ(0, alloc->reserve(dev_size));
+  vector<pair<uint64_t,uint32_t> > extents;
+  for (uint64_t i = 0; i < num; ++i) {
+    uint64_t offset;
+    uint32_t length;
+    ASSERT_EQ(0, alloc->allocate(block_size, block_size, 0,
+				 &offset, &length));
+    ASSERT_EQ(block_size, length);
+    extents.push_back(make_pair(offset, length));
+  }
+  ASSERT_EQ(0u, alloc->get_free());
+
+  // free every other block
+  for (uint64_t i = 0; i < num; i += 2) {
+    alloc->release(extents[i].first, extents[i].second);
+  }
+  alloc->commit_start();
+  alloc->commit_finish();
+  ASSERT_EQ(dev_size / 2, alloc->get_free());
+
+  // a large request can only be satisfied one block at a time
+  ASSERT_EQ(0, alloc->reserve(4 * block_size));
+  uint64_t got = 0;
+  while (got < 4 * block_size) {
+    uint64_t offset;
+    uint32_t length;
+    ASSERT_EQ(0, alloc->allocate(4 * block_size - got, block_size, 0,
+				 &offset, &length));
+    ASSERT_EQ(block_size, length);
+    got += length;
+  }
+  ASSERT_EQ(dev_size / 2 - 4 * block_size, alloc->get_free());
+}
+
+TEST_P(AllocTest, init_rm_free)
+{
+  alloc->init_add_free(0, dev_size);
+  alloc->init_rm_free(0, dev_size / 2);
+  ASSERT_EQ(dev_size / 2, alloc->get_free());
+  ASSERT_EQ(0, alloc->reserve(block_size));
+  uint64_t offset;
+  uint32_t length;
+  ASSERT_EQ(0, alloc->allocate(block_size, block_size, 0, &offset, &length));
+  ASSERT_GE(offset, dev_size / 2);
+}
+
+INSTANTIATE_TEST_CASE_P(
+  Allocator,
+  AllocTest,
+  ::testing::Values(
+    "stupid",
+    "bitmap"));
+
+#else
+
+TEST(DummyTest, ValueParameterizedTestsAreNotSupportedOnThisPlatform) {}
+
+#endif
+
+int main(int argc, char **argv) {
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+  env_to_vec(args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+  g_ceph_context->_conf->set_val(
+    "bluestore_min_alloc_size", "65536");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -3,6 +3,9 @@
 
 #include "include/types.h"
 #include "os/bluestore/bluestore_types.h"
+#include "os/bluestore/BlueStore.h"
+#include "common/perf_counters.h"
+#include "global/global_context.h"
 #include "gtest/gtest.h"
 #include "include/stringify.h"
 
@@ -155,3 +158,394 @@ TEST(bluestore_extent_ref_map_t, contains)
   ASSERT_FALSE(m.contains(40, 3000));
   ASSERT_FALSE(m.contains(4000, 30));
 }
+
+TEST(bluestore_onode_t, csum)
+{
+  bluestore_onode_t on;
+  on.set_csum(bluestore_onode_t::CSUM_CRC32C, 12);
+  ASSERT_EQ(4096u, on.get_csum_chunk_size());
+
+  bufferlist bl;
+  for (unsigned i = 0; i < 10000; ++i)
+    bl.append((char)(i * 7));
+  on.csum_write(0, 10000, &bl);
+  on.size = 10000;
+  ASSERT_EQ(3u, on.get_csum_count());
+  ASSERT_TRUE(on.csum_unknown.empty());
+  uint64_t bad = 0;
+  ASSERT_EQ(0, on.csum_verify(0, bl, &bad));
+  bufferlist tail;
+  tail.substr_of(bl, 8192, 10000 - 8192);
+  ASSERT_EQ(0, on.csum_verify(8192, tail, &bad));
+
+  bufferlist corrupt;
+  corrupt.append(bl.c_str(), bl.length());
+  corrupt.c_str()[5000] ^= 1;
+  ASSERT_EQ(-EIO, on.csum_verify(0, corrupt, &bad));
+  ASSERT_EQ(4096u, bad);
+
+  // a partial overwrite drops that chunk's csum
+  bufferlist x;
+  x.append("xyz");
+  on.csum_write(100, 3, &x);
+  ASSERT_FALSE(on.has_csum_value(0));
+  ASSERT_TRUE(on.has_csum_value(1));
+
+  // writing past a partial eof chunk invalidates it; the hole is unknown
+  bufferlist y;
+  y.append(string(4096, 'y'));
+  on.csum_write(16384, 4096, &y);
+  on.size = 20480;
+  ASSERT_EQ(5u, on.get_csum_count());
+  ASSERT_FALSE(on.has_csum_value(2));
+  ASSERT_FALSE(on.has_csum_value(3));
+  ASSERT_TRUE(on.has_csum_value(4));
+  ASSERT_EQ(0, on.csum_verify(16384, y, &bad));
+
+  // zeroing whole chunks gives them a csum again
+  on.csum_write(8192, 8192, NULL);
+  ASSERT_TRUE(on.has_csum_value(2));
+  ASSERT_TRUE(on.has_csum_value(3));
+  bufferlist z;
+  z.append_zero(8192);
+  ASSERT_EQ(0, on.csum_verify(8192, z, &bad));
+
+  bufferlist enc;
+  ::encode(on, enc);
+  bluestore_onode_t on2;
+  bufferlist::iterator p = enc.begin();
+  ::decode(on2, p);
+  ASSERT_EQ(on.csum_data, on2.csum_data);
+  ASSERT_EQ(on.csum_unknown, on2.csum_unknown);
+
+  // truncate down into a chunk
+  on.size = 6000;
+  on.csum_truncate(20480);
+  ASSERT_EQ(2u, on.get_csum_count());
+  ASSERT_FALSE(on.has_csum_value(1));
+
+  // and back up; the grown range has no csum
+  on.size = 12000;
+  on.csum_truncate(6000);
+  ASSERT_EQ(2u, on.get_csum_count());
+  ASSERT_FALSE(on.has_csum_value(2));
+}
+
+TEST(bluestore_onode_t, csum_types)
+{
+  const char *names[] = { "crc32c", "crc32c_16", "crc32c_8",
+			  "xxhash32", "xxhash64" };
+  const unsigned sizes[] = { 4, 2, 1, 4, 8 };
+  for (unsigned n = 0; n < sizeof(names) / sizeof(names[0]); ++n) {
+    int type = bluestore_onode_t::get_csum_string_type(names[n]);
+    ASSERT_GT(type, 0);
+    ASSERT_EQ(string(names[n]), bluestore_onode_t::get_csum_type_string(type));
+    ASSERT_EQ(sizes[n], bluestore_onode_t::get_csum_value_size(type));
+
+    bluestore_onode_t on;
+    on.set_csum(type, 12);
+    // build the data from pieces that don't line up with the chunks
+    bufferlist bl;
+    for (unsigned i = 0; i < 12288; i += 1000) {
+      string piece;
+      for (unsigned j = i; j < MIN(i + 1000, 12288u); ++j)
+	piece.push_back((char)(j * 7));
+      bl.append(buffer::copy(piece.data(), piece.length()));
+    }
+    on.csum_write(0, bl.length(), &bl);
+    on.size = bl.length();
+    ASSERT_EQ(3u, on.get_csum_count());
+    ASSERT_EQ(3u * sizes[n], on.csum_data.size());
+
+    // the value doesn't depend on how the data is fragmented
+    bufferlist flat;
+    flat.append(bl.c_str(), bl.length());
+    uint64_t bad = 0;
+    ASSERT_EQ(0, on.csum_verify(0, flat, &bad));
+    ASSERT_EQ(0, on.csum_verify(0, bl, &bad));
+
+    flat.c_str()[9000] ^= 0x10;
+    ASSERT_EQ(-EIO, on.csum_verify(0, flat, &bad));
+    ASSERT_EQ(8192u, bad);
+
+    bufferlist enc;
+    ::encode(on, enc);
+    bluestore_onode_t on2;
+    bufferlist::iterator p = enc.begin();
+    ::decode(on2, p);
+    ASSERT_EQ(type, (int)on2.csum_type);
+    ASSERT_EQ(0, on2.csum_verify(0, bl, &bad));
+  }
+  ASSERT_EQ(-EINVAL, bluestore_onode_t::get_csum_string_type("xxhash128"));
+}
+
+TEST(bluestore_onode_t, extent_shards)
+{
+  bluestore_onode_t on;
+  on.extent_map_shard_size = 65536;
+  on.block_map[0] = bluestore_extent_t(1048576, 4096);
+  on.block_map[4096] = bluestore_extent_t(1052672, 8192);
+  on.block_map[61440] = bluestore_extent_t(8192, 8192,
+					   bluestore_extent_t::FLAG_SHARED);
+  on.block_map[131072] = bluestore_extent_t(0x123456789000ull, 4096,
+					    bluestore_extent_t::FLAG_UNWRITTEN);
+
+  bufferlist s0, s1, s2;
+  ASSERT_EQ(3u, on.encode_extent_shard(0, s0));
+  ASSERT_EQ(0u, on.encode_extent_shard(65536, s1));
+  ASSERT_EQ(0u, s1.length());
+  ASSERT_EQ(1u, on.encode_extent_shard(131072, s2));
+  // varints and deltas; far smaller than 16 bytes per extent
+  ASSERT_LT(s0.length(), 3u * 16);
+
+  // the sharded onode carries no extents itself
+  bufferlist enc;
+  ::encode(on, enc);
+  bluestore_onode_t on2;
+  bufferlist::iterator p = enc.begin();
+  ::decode(on2, p);
+  ASSERT_EQ(65536u, on2.extent_map_shard_size);
+  ASSERT_TRUE(on2.block_map.empty());
+
+  p = s0.begin();
+  on2.decode_extent_shard(0, p);
+  p = s2.begin();
+  on2.decode_extent_shard(131072, p);
+  ASSERT_EQ(on.block_map.size(), on2.block_map.size());
+  for (auto& e : on.block_map) {
+    ASSERT_EQ(1u, on2.block_map.count(e.first));
+    ASSERT_EQ(e.second.offset, on2.block_map[e.first].offset);
+    ASSERT_EQ(e.second.length, on2.block_map[e.first].length);
+    ASSERT_EQ(e.second.flags, on2.block_map[e.first].flags);
+  }
+}
+
+TEST(bluestore_onode_t, csum_shards)
+{
+  bluestore_onode_t on;
+  on.extent_map_shard_size = 65536;
+  on.set_csum(bluestore_onode_t::CSUM_CRC32C, 12);
+  bufferlist bl;
+  for (unsigned i = 0; i < 64; ++i)
+    bl.append(string(4096, 'a' + i % 26));
+  on.csum_write(0, bl.length(), &bl);
+  on.size = bl.length();
+  bufferlist x;
+  x.append("foo");
+  on.csum_write(65536 + 100, x.length(), &x);
+  ASSERT_EQ(64u, on.get_csum_count());
+  ASSERT_FALSE(on.has_csum_value(16));
+
+  // each shard carries the csums of the chunks that start in it, and
+  // the onode none of them
+  bufferlist s[4];
+  for (unsigned i = 0; i < 4; ++i)
+    ASSERT_EQ(16u, on.encode_extent_shard(i * 65536, s[i]));
+  bufferlist enc;
+  ::encode(on, enc);
+  bluestore_onode_t on2;
+  bufferlist::iterator p = enc.begin();
+  ::decode(on2, p);
+  ASSERT_EQ(0u, on2.get_csum_count());
+  for (unsigned i = 0; i < 4; ++i) {
+    p = s[i].begin();
+    on2.decode_extent_shard(i * 65536, p);
+  }
+  ASSERT_EQ(on.csum_data, on2.csum_data);
+  ASSERT_EQ(on.csum_unknown, on2.csum_unknown);
+  uint64_t bad, verified = 0;
+  ASSERT_EQ(0, on2.csum_verify(0, bl, &bad, &verified));
+  ASSERT_EQ(bl.length() - 4096u, verified);
+
+  // chunks larger than a shard belong to the shard they start in
+  bluestore_onode_t big;
+  big.extent_map_shard_size = 65536;
+  big.set_csum(bluestore_onode_t::CSUM_CRC32C, 17);
+  big.csum_write(0, bl.length(), &bl);
+  bufferlist b0, b1;
+  ASSERT_EQ(1u, big.encode_extent_shard(0, b0));
+  ASSERT_EQ(0u, big.encode_extent_shard(65536, b1));
+  ASSERT_EQ(0u, b1.length());
+}
+
+static PerfCounters *create_cache_logger()
+{
+  PerfCountersBuilder b(g_ceph_context, "bluestore_cache_test",
+			l_bluestore_first, l_bluestore_last);
+  b.add_u64(l_bluestore_onodes, "onodes");
+  b.add_u64_counter(l_bluestore_onode_hits, "onode_hits");
+  b.add_u64_counter(l_bluestore_onode_misses, "onode_misses");
+  b.add_u64(l_bluestore_buffers, "buffers");
+  b.add_u64(l_bluestore_buffer_bytes, "buffer_bytes");
+  b.add_u64_counter(l_bluestore_buffer_evicted_bytes, "buffer_evicted_bytes");
+  return b.create_perf_counters();
+}
+
+static bufferlist make_bl(unsigned len, char c)
+{
+  bufferlist bl;
+  bl.append(string(len, c));
+  return bl;
+}
+
+TEST(BlueStoreCache, two_q)
+{
+  g_ceph_context->_conf->set_val("bluestore_2q_cache_kin_ratio", ".5");
+  g_ceph_context->_conf->set_val("bluestore_2q_cache_kout_ratio", "1");
+  PerfCounters *logger = create_cache_logger();
+  {
+    BlueStore::Cache c(logger);
+    BlueStore::BufferSpace bs(&c);
+    bufferlist a = make_bl(4096, 'a'), b = make_bl(4096, 'b');
+    map<uint64_t,bufferlist> res;
+
+    // new data goes to warm_in (A1in)
+    bs.write(0, a);
+    bs.write(8192, b);
+    ASSERT_EQ(2u, c.buffer_warm_in.size());
+    ASSERT_EQ(8192u, c.buffer_bytes);
+    ASSERT_EQ(2u, logger->get(l_bluestore_buffers));
+    ASSERT_EQ(8192u, logger->get(l_bluestore_buffer_bytes));
+
+    // warm_in is a fifo: a hit doesn't save a from being evicted first
+    bs.read(0, 4096, res);
+    ASSERT_EQ(1u, res.size());
+    ASSERT_TRUE(res[0].contents_equal(a));
+    c.trim(4096, 0);
+    ASSERT_EQ(1u, c.buffer_warm_in.size());
+    ASSERT_EQ(1u, c.buffer_warm_out.size());
+    ASSERT_EQ(4096u, c.buffer_bytes);
+    ASSERT_EQ(4096u, c.buffer_warm_out_bytes);
+    ASSERT_EQ(4096u, logger->get(l_bluestore_buffer_evicted_bytes));
+
+    // the ghost (A1out) remembers the range but holds no data
+    res.clear();
+    bs.read(0, 12288, res);
+    ASSERT_EQ(1u, res.size());
+    ASSERT_TRUE(res[8192].contents_equal(b));
+
+    // reading a ghost range again makes it hot (Am)
+    bs.did_read(0, a);
+    ASSERT_EQ(1u, c.buffer_hot.size());
+    ASSERT_EQ(0u, c.buffer_warm_out.size());
+    ASSERT_EQ(8192u, c.buffer_bytes);
+
+    // warm_in is over its share, so it gives way before hot
+    c.trim(4096, 0);
+    ASSERT_EQ(1u, c.buffer_hot.size());
+    ASSERT_EQ(0u, c.buffer_warm_in.size());
+    ASSERT_EQ(1u, c.buffer_warm_out.size());
+    res.clear();
+    bs.read(0, 12288, res);
+    ASSERT_EQ(1u, res.size());
+    ASSERT_TRUE(res[0].contents_equal(a));
+
+    // so does a write over a ghost
+    bs.write(8192, b);
+    ASSERT_EQ(2u, c.buffer_hot.size());
+    ASSERT_EQ(0u, c.buffer_warm_out.size());
+
+    // with no budget everything goes, ghosts included
+    c.trim(0, 0);
+    ASSERT_TRUE(c.buffer_hot.empty());
+    ASSERT_TRUE(c.buffer_warm_in.empty());
+    ASSERT_TRUE(c.buffer_warm_out.empty());
+    ASSERT_EQ(0u, c.buffer_bytes);
+    ASSERT_EQ(0u, logger->get(l_bluestore_buffers));
+    ASSERT_EQ(0u, logger->get(l_bluestore_buffer_bytes));
+  }
+  delete logger;
+  g_ceph_context->_conf->set_val("bluestore_2q_cache_kin_ratio", ".5");
+  g_ceph_context->_conf->set_val("bluestore_2q_cache_kout_ratio", ".5");
+}
+
+TEST(BlueStoreCache, shared_budget)
+{
+  PerfCounters *logger = create_cache_logger();
+  {
+    BlueStore::Cache c(logger);
+    // two collections sharing one cache shard
+    BlueStore::OnodeSpace s1(&c), s2(&c);
+    const uint64_t onode_size = sizeof(BlueStore::Onode);
+    for (unsigned i = 0; i < 4; ++i) {
+      for (auto s : { &s1, &s2 }) {
+	ghobject_t oid(hobject_t(sobject_t(
+	  string(s == &s1 ? "a" : "b") + stringify(i), CEPH_NOSNAP)));
+	BlueStore::OnodeRef o(new BlueStore::Onode(s, oid, "key"));
+	ASSERT_EQ(o, s->add(oid, o));
+	o->bc.write(0, make_bl(4096, 'a' + i));
+      }
+    }
+    ASSERT_EQ(8u, logger->get(l_bluestore_onodes));
+    ASSERT_EQ(8 * onode_size, c.onode_bytes);
+    ASSERT_EQ(8 * 4096u, c.buffer_bytes);
+
+    ghobject_t a0(hobject_t(sobject_t("a0", CEPH_NOSNAP)));
+    ghobject_t a3(hobject_t(sobject_t("a3", CEPH_NOSNAP)));
+    ghobject_t b3(hobject_t(sobject_t("b3", CEPH_NOSNAP)));
+    ghobject_t missing(hobject_t(sobject_t("c0", CEPH_NOSNAP)));
+
+    // onodes fit, so buffers get the rest of the budget: only the two
+    // newest buffers, one from each collection, stay resident
+    c.trim(8 * onode_size + 8192, 1.0);
+    ASSERT_EQ(8u, logger->get(l_bluestore_onodes));
+    ASSERT_EQ(8192u, c.buffer_bytes);
+    map<uint64_t,bufferlist> res;
+    s1.lookup(a3)->bc.read(0, 4096, res);
+    ASSERT_EQ(1u, res.size());
+    res.clear();
+    s2.lookup(b3)->bc.read(0, 4096, res);
+    ASSERT_EQ(1u, res.size());
+    res.clear();
+    s1.lookup(a0)->bc.read(0, 4096, res);
+    ASSERT_EQ(0u, res.size());
+    ASSERT_EQ(3u, logger->get(l_bluestore_onode_hits));
+    ASSERT_FALSE(s1.lookup(missing));
+    ASSERT_EQ(1u, logger->get(l_bluestore_onode_misses));
+
+    // shrink to three onodes: the least recently used go, whichever
+    // collection they are in, and the buffers give up their space
+    c.trim(3 * onode_size, 1.0);
+    ASSERT_EQ(3u, logger->get(l_bluestore_onodes));
+    ASSERT_EQ(3 * onode_size, c.onode_bytes);
+    ASSERT_EQ(0u, c.buffer_bytes);
+    ASSERT_EQ(2u, s1.onode_map.size());
+    ASSERT_EQ(1u, s2.onode_map.size());
+    ASSERT_TRUE(s1.onode_map.count(a0));
+    ASSERT_TRUE(s1.onode_map.count(a3));
+    ASSERT_TRUE(s2.onode_map.count(b3));
+  }
+  delete logger;
+}
+
+TEST(BlueStoreTxcStateHistogram, bins)
+{
+  typedef BlueStore::TxcStateHistogram H;
+  // bin b holds [2^(b-1), 2^b); 0 has a bin of its own
+  ASSERT_EQ(0u, H::get_bin(0, 32));
+  ASSERT_EQ(1u, H::get_bin(1, 32));
+  ASSERT_EQ(2u, H::get_bin(2, 32));
+  ASSERT_EQ(2u, H::get_bin(3, 32));
+  ASSERT_EQ(3u, H::get_bin(4, 32));
+  ASSERT_EQ(10u, H::get_bin(1023, 32));
+  ASSERT_EQ(11u, H::get_bin(1024, 32));
+  // the last bin takes everything larger
+  ASSERT_EQ(31u, H::get_bin(1ull << 30, 32));
+  ASSERT_EQ(31u, H::get_bin(1ull << 40, 32));
+  ASSERT_EQ(7u, H::get_bin(1ull << 40, 8));
+
+  H *h = new H;
+  utime_t l;
+  l.set_from_double(.0015);  // 1500 usec
+  h->add(0, l, 4096, false);
+  h->add(0, l, 4096, true);
+  h->add(1, utime_t(), 0, true);
+  ASSERT_EQ(2u, h->lat[0][11].load());
+  ASSERT_EQ(1u, h->lat_size[0][11][13].load());
+  ASSERT_EQ(1u, h->lat[1][0].load());
+  ASSERT_EQ(1u, h->lat_size[1][0][0].load());
+  h->reset();
+  ASSERT_EQ(0u, h->lat[0][11].load());
+  ASSERT_EQ(0u, h->lat_size[0][11][13].load());
+  delete h;
+}
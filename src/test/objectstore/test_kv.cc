@@ -43,6 +43,15 @@ public:
     db.reset(NULL);
   }
 
+  void rm_r(string path) {
+    string cmd = string("rm -r ") + path;
+    int r = ::system(cmd.c_str());
+    if (r) {
+      cerr << "failed with exit code " << r
+	   << ", continuing anyway" << std::endl;
+    }
+  }
+
   virtual void SetUp() {
     int r = ::mkdir("kv_test_temp_dir", 0777);
     if (r < 0 && errno != EEXIST) {
@@ -55,6 +64,7 @@ public:
   }
   virtual void TearDown() {
     fini();
+    rm_r("kv_test_temp_dir");
   }
 };
 
@@ -113,6 +123,229 @@ TEST_P(KVTest, PutReopen) {
   fini();
 }
 
+string tostr(bufferlist& b) {
+  return string(b.c_str(),b.length());
+}
+
+TEST_P(KVTest, GetMultiple) {
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = 0; i < 100; i += 3) {
+      bufferlist v;
+      v.append(stringify(i));
+      t->set("multi", stringify(1000 + i), v);
+    }
+    bufferlist v;
+    v.append("other");
+    t->set("multi0", "1003", v);
+    db->submit_transaction_sync(t);
+  }
+  set<string> keys;
+  for (int i = 0; i < 110; ++i)
+    keys.insert(stringify(1000 + i));
+  map<string,bufferlist> out;
+  ASSERT_EQ(0, db->get("multi", keys, &out));
+  ASSERT_EQ(34u, out.size());
+  for (auto& p : out) {
+    int i = atoi(p.first.c_str()) - 1000;
+    ASSERT_EQ(0, i % 3);
+    ASSERT_EQ(stringify(i), tostr(p.second));
+  }
+  fini();
+}
+
+struct AppendMOP : public KeyValueDB::MergeOperator {
+  virtual void merge_nonexistent(
+    const char *rdata, size_t rlen, std::string *new_value) {
+    *new_value = "?" + std::string(rdata, rlen);
+  }
+  virtual void merge(
+    const char *ldata, size_t llen,
+    const char *rdata, size_t rlen,
+    std::string *new_value) {
+    *new_value = std::string(ldata, llen) + std::string(rdata, rlen);
+  }
+  // We use each operator name and each prefix to construct the
+  // overall RocksDB operator name for consistency check at open time.
+  virtual string name() const {
+    return "Append";
+  }
+};
+
+TEST_P(KVTest, Merge) {
+  shared_ptr<KeyValueDB::MergeOperator> p(new AppendMOP);
+  int r = db->set_merge_operator("A",p);
+  if (r < 0)
+    return; // No merge operators for this database type
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist v1, v2, v3;
+    v1.append(string("1"));
+    v2.append(string("2"));
+    v3.append(string("3"));
+    t->set("P", "K1", v1);
+    t->set("A", "A1", v2);
+    t->rmkey("A", "A2");
+    t->merge("A", "A2", v3);
+    db->submit_transaction_sync(t);
+  }
+  {
+    bufferlist v1, v2, v3;
+    ASSERT_EQ(0, db->get("P", "K1", &v1));
+    ASSERT_EQ(tostr(v1), "1");
+    ASSERT_EQ(0, db->get("A", "A1", &v2));
+    ASSERT_EQ(tostr(v2), "2");
+    ASSERT_EQ(0, db->get("A", "A2", &v3));
+    ASSERT_EQ(tostr(v3), "?3");
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist v1;
+    v1.append(string("1"));
+    t->merge("A", "A2", v1);
+    db->submit_transaction(t);
+  }
+  {
+    bufferlist v;
+    ASSERT_EQ(0, db->get("A", "A2", &v));
+    ASSERT_EQ(tostr(v), "?31");
+  }
+  {
+    // merges in one txn stack on the txn's own writes
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist v1, v2, v3;
+    v1.append(string("x"));
+    v2.append(string("y"));
+    v3.append(string("z"));
+    t->set("A", "A3", v3);
+    t->merge("A", "A3", v1);
+    t->merge("A", "A3", v2);
+    db->submit_transaction_sync(t);
+  }
+  {
+    bufferlist v;
+    ASSERT_EQ(0, db->get("A", "A3", &v));
+    ASSERT_EQ(tostr(v), "zxy");
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist v1, v2;
+    v1.append(string("x"));
+    v2.append(string("y"));
+    t->merge("A", "A1", v1);
+    t->rmkeys_by_prefix("A");
+    t->merge("A", "A2", v2);
+    db->submit_transaction_sync(t);
+  }
+  {
+    bufferlist v1, v2, v3;
+    ASSERT_EQ(-ENOENT, db->get("A", "A1", &v1));
+    ASSERT_EQ(0, db->get("A", "A2", &v2));
+    ASSERT_EQ(tostr(v2), "?y");
+    ASSERT_EQ(-ENOENT, db->get("A", "A3", &v3));
+  }
+  fini();
+
+  init();
+  ASSERT_EQ(0, db->set_merge_operator("A",p));
+  ASSERT_EQ(0, db->open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist v1;
+    v1.append(string("1"));
+    t->merge("A", "A2", v1);
+    db->submit_transaction_sync(t);
+  }
+  {
+    bufferlist v;
+    ASSERT_EQ(0, db->get("A", "A2", &v));
+    ASSERT_EQ(tostr(v), "?y1");
+  }
+  fini();
+}
+
+TEST_P(KVTest, ColumnFamilies) {
+  string spec = "B C(bloom_bits=10,block_cache_share=0.1)";
+  if (db->set_column_families(spec) < 0)
+    return; // No column families for this database type
+  shared_ptr<KeyValueDB::MergeOperator> p(new AppendMOP);
+  ASSERT_EQ(0, db->set_merge_operator("C", p));
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist v, m;
+    v.append(string("v"));
+    m.append(string("+"));
+    t->set("A", "a", v);
+    t->set("B", "b1", v);
+    t->set("B", "b2", v);
+    t->set("BB", "x", v);
+    t->set("C", "c", v);
+    t->merge("C", "c", m);
+    t->set("D", "d", v);
+    db->submit_transaction_sync(t);
+  }
+  vector<pair<string,string> > keys = {
+    {"A", "a"}, {"B", "b1"}, {"B", "b2"}, {"BB", "x"}, {"C", "c"}, {"D", "d"}
+  };
+  {
+    KeyValueDB::WholeSpaceIterator it = db->get_iterator();
+    it->seek_to_first();
+    for (auto& k : keys) {
+      ASSERT_TRUE(it->valid());
+      ASSERT_EQ(k, it->raw_key());
+      it->next();
+    }
+    ASSERT_FALSE(it->valid());
+    it->seek_to_last();
+    for (auto k = keys.rbegin(); k != keys.rend(); ++k) {
+      ASSERT_TRUE(it->valid());
+      ASSERT_EQ(*k, it->raw_key());
+      it->prev();
+    }
+    ASSERT_FALSE(it->valid());
+  }
+  {
+    KeyValueDB::Iterator it = db->get_iterator("B");
+    it->lower_bound("b2");
+    ASSERT_TRUE(it->valid());
+    ASSERT_EQ("b2", it->key());
+    it->next();
+    ASSERT_FALSE(it->valid());
+    bufferlist v;
+    ASSERT_EQ(0, db->get("C", "c", &v));
+    ASSERT_EQ("v+", tostr(v));
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    t->rmkeys_by_prefix("B");
+    db->submit_transaction_sync(t);
+    bufferlist v1, v2;
+    ASSERT_EQ(-ENOENT, db->get("B", "b1", &v1));
+    ASSERT_EQ(0, db->get("BB", "x", &v2));
+  }
+  fini();
+
+  // the set of column families cannot change
+  init();
+  ASSERT_EQ(0, db->set_column_families("B"));
+  ASSERT_NE(0, db->open(cout));
+  fini();
+
+  init();
+  ASSERT_EQ(0, db->set_column_families(spec));
+  ASSERT_EQ(0, db->set_merge_operator("C", p));
+  ASSERT_EQ(0, db->open(cout));
+  {
+    bufferlist v;
+    ASSERT_EQ(0, db->get("C", "c", &v));
+    ASSERT_EQ("v+", tostr(v));
+  }
+  fini();
+}
+
 TEST_P(KVTest, BenchCommit) {
   int n = 1024;
   ASSERT_EQ(0, db->create_and_open(cout));
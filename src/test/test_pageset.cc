@@ -281,3 +281,85 @@ TEST(PageSet, FreeHoles)
   pages.get_range(0, 8, range);
   ASSERT_EQ(0u, range.size());
 }
+
+TEST(PageSet, Partitions)
+{
+  // four partitions of two pages each
+  PageSet pages(1, nullptr, 4, 2);
+  PageSet::page_vector range;
+
+  pages.alloc_range(3, 10, range);
+  ASSERT_EQ(10u, range.size());
+  for (uint64_t i = 0; i < 10; i++)
+    ASSERT_EQ(3 + i, range[i]->offset);
+  range.clear();
+
+  pages.get_range(0, 16, range);
+  ASSERT_EQ(10u, range.size());
+  for (uint64_t i = 0; i < 10; i++)
+    ASSERT_EQ(3 + i, range[i]->offset);
+  range.clear();
+
+  pages.free_pages_after(6);
+  pages.get_range(0, 16, range);
+  ASSERT_EQ(3u, range.size());
+  ASSERT_EQ(5u, range[2]->offset);
+  ASSERT_EQ(3u, pages.size());
+}
+
+TEST(PageSet, Allocator)
+{
+  auto alloc = new PageAllocator(4096, 4 * 4096, false);
+  {
+    PageSet pages(4096, alloc, 2, 1);
+    PageSet::page_vector range;
+
+    // spills into a second slab
+    pages.alloc_range(0, 6 * 4096, range);
+    ASSERT_EQ(6u, range.size());
+    ASSERT_EQ(6u * 4096, alloc->get_page_bytes());
+    ASSERT_EQ(8u * 4096, alloc->get_slab_bytes());
+    for (uint64_t i = 0; i < 6; i++) {
+      ASSERT_EQ(i * 4096, range[i]->offset);
+      ASSERT_EQ(alloc, range[i]->alloc);
+    }
+
+    // freed pages are reused rather than mapping another slab, even if
+    // they went onto another cpu's free list
+    range.clear();
+    pages.free_pages_after(2 * 4096);
+    ASSERT_EQ(2u * 4096, alloc->get_page_bytes());
+    pages.alloc_range(2 * 4096, 6 * 4096, range);
+    ASSERT_EQ(8u * 4096, alloc->get_page_bytes());
+    ASSERT_EQ(8u * 4096, alloc->get_slab_bytes());
+
+    // pages of another size come from the heap
+    PageSet other(1024, alloc);
+    range.clear();
+    other.alloc_range(0, 1024, range);
+    ASSERT_EQ(nullptr, range[0]->alloc);
+  }
+  ASSERT_EQ(0u, alloc->get_page_bytes());
+  alloc->put();
+}
+
+TEST(PageSet, AllocatorRemoteFree)
+{
+  // pages written on one thread and freed on another must not pile up on
+  // the freeing cpu while the writing cpu keeps mapping slabs
+  auto alloc = new PageAllocator(4096, 4 * 4096, false);
+  {
+    PageSet pages(4096, alloc, 2, 1);
+    for (int i = 0; i < 100; i++) {
+      PageSet::page_vector range;
+      pages.alloc_range(0, 8 * 4096, range);
+      ASSERT_EQ(8u, range.size());
+      range.clear();
+      std::thread t([&pages] { pages.free_pages_after(0); });
+      t.join();
+      ASSERT_EQ(0u, alloc->get_page_bytes());
+      ASSERT_EQ(8u * 4096, alloc->get_slab_bytes());
+    }
+  }
+  alloc->put();
+}